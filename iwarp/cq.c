@@ -39,12 +39,14 @@ cq_create(int num)
     cq->num_cqe = num;
     cq->prod = 0;
     cq->cons = 0;
+    lock_init(&cq->lock);
     return cq;
 }
 
 void
 cq_destroy(cq_t *cq)
 {
+    lock_destroy(&cq->lock);
     free(cq->cqe);
     free(cq);
 }
@@ -59,12 +61,20 @@ cq_num_occupied(cq_t *cq)
 	return prod - cq->cons;
 }
 
+/* only a hint unless the caller keeps the producers out */
 int
 cq_isfull(cq_t *cq)
 {
 	return cq_num_occupied(cq) >= cq->num_cqe - 1;
 }
 
+/* entries that can still be produced, a hint the same way */
+int
+cq_space(cq_t *cq)
+{
+	return cq->num_cqe - 1 - cq_num_occupied(cq);
+}
+
 /*
  * Put an entry into cqe[prod].  But if that would cause the
  * prod index to advance so that prod == cons, declare overflow.
@@ -72,23 +82,32 @@ cq_isfull(cq_t *cq)
 int
 cq_produce(cq_t *cq, const cqe_t *cqe)
 {
-    int nextprod = next_index(cq->prod, cq->num_cqe);
+    int nextprod;
 
-    if (unlikely(nextprod == cq->cons))
+    lock_take(&cq->lock);
+    nextprod = next_index(cq->prod, cq->num_cqe);
+    if (unlikely(nextprod == cq->cons)) {
+	lock_drop(&cq->lock);
 	return -ENOSPC;
+    }
 
     cq->cqe[cq->prod] = *cqe;  /* struct copy */
     cq->prod = nextprod;
+    lock_drop(&cq->lock);
     return 0;
 }
 
 int
 cq_consume(cq_t *cq, cqe_t *cqe)
 {
-    if (cq->prod == cq->cons)
+    lock_take(&cq->lock);
+    if (cq->prod == cq->cons) {
+	lock_drop(&cq->lock);
 	return -ENOENT;
+    }
     *cqe = cq->cqe[cq->cons];  /* struct copy */
     cq->cons = next_index(cq->cons, cq->num_cqe);
+    lock_drop(&cq->lock);
     return 0;
 }
 
@@ -11,6 +11,7 @@
 
 #include <stdint.h>
 #include "common.h"
+#include "lock.h"
 
 typedef uint64_t cq_wrid_t;
 
@@ -23,6 +24,9 @@ typedef struct {
     int status;
     cq_wrid_t id;
     uint32_t msg_len;
+    int32_t inv_stag;  /* stag a SEND with Invalidate removed, else 0 */
+    int sk;  /* socket of the connection, tells QPs sharing a CQ apart */
+    uint64_t imm;  /* immediate data of an OP_RECV_IMM, else unset */
 } cqe_t;
 
 /*
@@ -31,18 +35,21 @@ typedef struct {
  * not see this type.
  *
  * A CQ is a circular array with producer and consumer indices that chase
- * each other around the ring.
+ * each other around the ring.  Whoever moves data for a connection
+ * produces, and the thread polling consumes, so the lock covers both.
  */
 typedef struct {
     cqe_t *cqe;   /* array */
     int num_cqe;
     int prod;     /* pointers into array */
     int cons;
+    lock_t lock;
 } cq_t;
 
 cq_t *cq_create(int num);
 void cq_destroy(cq_t *cq);
 int cq_isfull(cq_t *cq);
+int cq_space(cq_t *cq);
 int cq_produce(cq_t *cq, const cqe_t *cqe);
 int cq_consume(cq_t *cq, cqe_t *cqe);
 
@@ -32,10 +32,14 @@
  */
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <sys/uio.h>
 #include <netinet/in.h>
+#include <pthread.h>
 
 #include "crc32c.h"
+#include "util.h"
 
 /*
  * This is the CRC-32C table
@@ -112,36 +116,339 @@ static uint32_t crc32c_table[256] = {
 	0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *data,
+			      size_t len);
+
 /*
  * Steps through buffer one byte at at time, calculates reflected
- * crc using table.
+ * crc using table.  Long buffers in three lanes, see crc32c_update.
  */
 uint32_t
 crc32c(const void *vdata, size_t length)
 {
-    uint32_t crc = ~(uint32_t)0;
-    const unsigned char *data = vdata;
-
-    while (length--)
-	crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
+    uint32_t crc = crc32c_update(~(uint32_t)0, vdata, length);
 
     return htonl(crc ^ ~(uint32_t)0);
 }
 
-/* compute crc of a buffer vectorized into io-vector */
+/*
+ * x^(2^n) mod P for n = 0..31, bit reflected like the table, for
+ * crc32c_combine.  Generated by squaring x^1 = 0x40000000.
+ */
+static const uint32_t crc32c_x2n_table[32] = {
+	0x40000000L, 0x20000000L, 0x08000000L, 0x00800000L,
+	0x00008000L, 0x82F63B78L, 0x6EA2D55CL, 0x18B8EA18L,
+	0x510AC59AL, 0xB82BE955L, 0xB8FDB1E7L, 0x88E56F72L,
+	0x74C360A4L, 0xE4172B16L, 0x0D65762AL, 0x35D73A62L,
+	0x28461564L, 0xBF455269L, 0xE2EA32DCL, 0xFE7740E6L,
+	0xF946610BL, 0x3C204F8FL, 0x538586E3L, 0x59726915L,
+	0x734D5309L, 0xBC1AC763L, 0x7D0722CCL, 0xD289CABEL,
+	0xE94CA9BCL, 0x05B74F3FL, 0xA51E1F42L, 0x40000000L
+};
+
+/* a * b mod P, reflected */
+static uint32_t
+crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0x82F63B78L : b >> 1;
+	}
+	return p;
+}
+
+/* x^(8 len) mod P: what a crc is multiplied by to skip len bytes */
+static uint32_t
+crc32c_shift(size_t len)
+{
+	uint32_t p = (uint32_t)1 << 31;  /* x^0 */
+	int k = 3;
+
+	while (len) {
+		if (len & 1)
+			p = crc32c_multmodp(crc32c_x2n_table[k & 31], p);
+		len >>= 1;
+		k++;
+	}
+	return p;
+}
+
+/* combine on crcs in host order */
+static inline uint32_t
+crc32c_combine_h(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return crc32c_multmodp(crc32c_shift(len2), crc1) ^ crc2;
+}
+
+/*
+ * The crc of A followed by B, from crc(A), crc(B) and the length of B.
+ * The crcs are as crc32c and crc32c_vec return them.
+ */
 uint32_t
-crc32c_vec(const struct iovec *vec, int count)
+crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2)
 {
-	uint32_t crc = ~(uint32_t)0;
-	int i = 0, len = 0;
-	unsigned char *data = 0;
+	return htonl(crc32c_combine_h(ntohl(crc1), ntohl(crc2), len2));
+}
+
+/* below this a lane is not worth the combine */
+#define LANE_MIN 1024
+
+/*
+ * Continue crc, not yet inverted at the end, over a buffer.  Each table
+ * lookup waits for the one before, so a long buffer is done as three
+ * thirds side by side, which the cpu overlaps, and put back together.
+ */
+static uint32_t
+crc32c_update(uint32_t crc, const unsigned char *data, size_t len)
+{
+	uint32_t a, b, c;
+	const unsigned char *db, *dc;
+	size_t n = len / 3, i;
 
-	for (i=0; i < count; i++) {
-		data = vec[i].iov_base;
-		len = vec[i].iov_len;
+	if (n < LANE_MIN) {
 		while (len--)
 			crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
+		return crc;
+	}
+	db = data + n;
+	dc = data + 2*n;
+	a = crc;
+	b = c = ~(uint32_t)0;
+	for (i=0; i<n; i++) {
+		a = crc32c_table[(a ^ data[i]) & 0xFFL] ^ (a >> 8);
+		b = crc32c_table[(b ^ db[i]) & 0xFFL] ^ (b >> 8);
+		c = crc32c_table[(c ^ dc[i]) & 0xFFL] ^ (c >> 8);
+	}
+	for (; i < len - 2*n; i++)
+		c = crc32c_table[(c ^ dc[i]) & 0xFFL] ^ (c >> 8);
+	a = crc32c_combine_h(~a, ~b, n);
+	a = crc32c_combine_h(a, ~c, len - 2*n);
+	return ~a;
+}
+
+/* crc, in host order, of len bytes of the vector starting off bytes in */
+static uint32_t
+crc32c_range(const struct iovec *vec, int count, size_t off, size_t len)
+{
+	uint32_t crc = ~(uint32_t)0;
+	size_t n;
+	int i;
+
+	for (i=0; i < count && len; i++) {
+		if (off >= vec[i].iov_len) {
+			off -= vec[i].iov_len;
+			continue;
+		}
+		n = vec[i].iov_len - off;
+		if (n > len)
+			n = len;
+		crc = crc32c_update(crc,
+				    (const unsigned char *)vec[i].iov_base + off, n);
+		off = 0;
+		len -= n;
+	}
+	return crc ^ ~(uint32_t)0;
+}
+
+/*
+ * Optional helper threads share the crc of a long vector with the
+ * caller, each taking a range; the pieces are combined in order.  A
+ * caller finds the pieces no helper has taken yet and does them itself,
+ * so it never waits behind other callers' work.
+ */
+#define CRC_PAR_MIN (32 * 1024)  /* shortest vector split up */
+#define CRC_MAX_THREADS 16
+
+enum { CRC_JOB_NEW, CRC_JOB_QUEUED, CRC_JOB_TAKEN, CRC_JOB_DONE };
+
+static pthread_mutex_t crc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crc_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t crc_done = PTHREAD_COND_INITIALIZER;
+static crc32c_job_t *crc_jobs = NULL;  /* queued, oldest first */
+static pthread_t crc_threads[CRC_MAX_THREADS];
+static int crc_nthreads = 0;
+static int crc_stopping = 0;
+
+static void *
+crc32c_helper(void *unused ATTR_UNUSED)
+{
+	crc32c_job_t *j;
+
+	pthread_mutex_lock(&crc_lock);
+	for (;;) {
+		while (!crc_jobs && !crc_stopping)
+			pthread_cond_wait(&crc_work, &crc_lock);
+		if (crc_stopping)
+			break;
+		j = crc_jobs;
+		crc_jobs = j->next;
+		j->state = CRC_JOB_TAKEN;
+		pthread_mutex_unlock(&crc_lock);
+		j->crc = crc32c_range(j->vec, j->count, j->off, j->len);
+		pthread_mutex_lock(&crc_lock);
+		j->state = CRC_JOB_DONE;
+		pthread_cond_broadcast(&crc_done);
+	}
+	pthread_mutex_unlock(&crc_lock);
+	return NULL;
+}
+
+/*
+ * Start n helper threads for crc32c_vec.  Not while it is being called.
+ */
+int
+crc32c_threads_start(int n)
+{
+	int i, ret = 0;
+
+	if (n <= 0 || n > CRC_MAX_THREADS || crc_nthreads)
+		return -EINVAL;
+	crc_stopping = 0;
+	for (i=0; i<n; i++) {
+		ret = pthread_create(&crc_threads[i], NULL, crc32c_helper, NULL);
+		if (ret)
+			break;
+	}
+	crc_nthreads = i;
+	if (ret) {
+		crc32c_threads_stop();
+		return -ret;
+	}
+	return 0;
+}
+
+void
+crc32c_threads_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&crc_lock);
+	crc_stopping = 1;
+	pthread_cond_broadcast(&crc_work);
+	pthread_mutex_unlock(&crc_lock);
+	for (i=0; i<crc_nthreads; i++)
+		pthread_join(crc_threads[i], NULL);
+	crc_nthreads = 0;
+}
+
+/* append j to the queue; crc_lock held */
+static void
+crc32c_queue(crc32c_job_t *j)
+{
+	crc32c_job_t **jp;
+
+	for (jp = &crc_jobs; *jp; jp = &(*jp)->next)
+		;
+	j->state = CRC_JOB_QUEUED;
+	j->next = NULL;
+	*jp = j;
+}
+
+/* do j here if no helper has taken it, else wait for the helper */
+static void
+crc32c_finish(crc32c_job_t *j)
+{
+	crc32c_job_t **jp;
+
+	if (j->state == CRC_JOB_NEW) {
+		j->crc = crc32c_range(j->vec, j->count, j->off, j->len);
+		j->state = CRC_JOB_DONE;
+		return;
+	}
+	pthread_mutex_lock(&crc_lock);
+	if (j->state == CRC_JOB_QUEUED) {
+		for (jp = &crc_jobs; *jp != j; jp = &(*jp)->next)
+			;
+		*jp = j->next;
+		pthread_mutex_unlock(&crc_lock);
+		j->crc = crc32c_range(j->vec, j->count, j->off, j->len);
+		j->state = CRC_JOB_DONE;
+	} else {
+		while (j->state != CRC_JOB_DONE)
+			pthread_cond_wait(&crc_done, &crc_lock);
+		pthread_mutex_unlock(&crc_lock);
 	}
+}
+
+static uint32_t
+crc32c_par(const struct iovec *vec, int count, size_t len)
+{
+	crc32c_job_t job[CRC_MAX_THREADS];
+	int n = crc_nthreads, i;
+	size_t part = len / (n + 1), off;
+	uint32_t crc;
+
+	/* pieces 0..n-1 to the helpers, the last, with the odd bytes, here */
+	pthread_mutex_lock(&crc_lock);
+	for (i=0, off=0; i<n; i++, off += part) {
+		job[i].vec = vec;
+		job[i].count = count;
+		job[i].off = off;
+		job[i].len = part;
+		crc32c_queue(&job[i]);
+	}
+	pthread_cond_broadcast(&crc_work);
+	pthread_mutex_unlock(&crc_lock);
+	crc = crc32c_range(vec, count, off, len - off);
+
+	for (i=0; i<n; i++)
+		crc32c_finish(&job[i]);
+
+	/* job[0] ... job[n-1], then this caller's piece */
+	for (i=1; i<n; i++)
+		job[0].crc = crc32c_combine_h(job[0].crc, job[i].crc, part);
+	return crc32c_combine_h(job[0].crc, crc, len - off);
+}
+
+/*
+ * Queue the crc of a vector for the helper threads, if any, and return
+ * without waiting; crc32c_wait gets the result.  Many may be outstanding.
+ */
+void
+crc32c_submit(crc32c_job_t *j, const struct iovec *vec, int count)
+{
+	int i;
+
+	j->vec = vec;
+	j->count = count;
+	j->off = 0;
+	j->len = 0;
+	for (i=0; i < count; i++)
+		j->len += vec[i].iov_len;
+	j->state = CRC_JOB_NEW;
+	if (!crc_nthreads)
+		return;
+	pthread_mutex_lock(&crc_lock);
+	crc32c_queue(j);
+	pthread_cond_signal(&crc_work);
+	pthread_mutex_unlock(&crc_lock);
+}
+
+/* the crc of a submitted vector, as crc32c_vec gives it */
+uint32_t
+crc32c_wait(crc32c_job_t *j)
+{
+	crc32c_finish(j);
+	return htonl(j->crc);
+}
+
+/* compute crc of a buffer vectorized into io-vector */
+uint32_t
+crc32c_vec(const struct iovec *vec, int count)
+{
+	size_t len = 0;
+	int i;
 
-	return htonl(crc ^ ~(uint32_t)0);
+	for (i=0; i < count; i++)
+		len += vec[i].iov_len;
+	if (crc_nthreads && len >= CRC_PAR_MIN)
+		return htonl(crc32c_par(vec, count, len));
+	return htonl(crc32c_range(vec, count, 0, len));
 }
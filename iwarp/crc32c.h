@@ -13,5 +13,25 @@
 
 uint32_t crc32c(const void *data, size_t length);
 uint32_t crc32c_vec(const struct iovec *vec, int count);
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+int crc32c_threads_start(int n);
+void crc32c_threads_stop(void);
+
+/*
+ * A crc left to the helper threads; the vector must stay put until
+ * crc32c_wait.  Fields are private to crc32c.c.
+ */
+typedef struct crc32c_job {
+	const struct iovec *vec;
+	int count;
+	size_t off;
+	size_t len;
+	uint32_t crc;
+	int state;
+	struct crc32c_job *next;
+} crc32c_job_t;
+
+void crc32c_submit(crc32c_job_t *j, const struct iovec *vec, int count);
+uint32_t crc32c_wait(crc32c_job_t *j);
 
 #endif  /* __crc32c_h */
@@ -52,31 +52,26 @@ typedef struct {
 }ddp_untag_msg_t;
 
 
+/*
+ * A socket's headers, serialized when it is registered.  A message takes
+ * a copy and fills in the fields it sets, each segment those it sets; a
+ * full segment's MPA length is in already.
+ */
+struct ddp_tmpl {
+	ddp_untagged_hdr_t ut[NUM_Q];  /* one per queue */
+	ddp_tagged_hdr_t t;
+	ulpdu_len_t ut_payld;  /* payload of a full segment */
+	ulpdu_len_t t_payld;
+};
+
 extern int rdma_write_count;
 
-static ulpdu_len_t UNTAGGED_PAYLD_LEN = 0;
-static ulpdu_len_t TAGGED_PAYLD_LEN = 0;
 static const ulpdu_len_t UNTAGGED_HDR_SZ = sizeof(ddp_untagged_hdr_t);
 static const ulpdu_len_t TAGGED_HDR_SZ = sizeof(ddp_tagged_hdr_t);
 static const ulpdu_len_t max_hdr_sz =
 sizeof(ddp_untagged_hdr_t) > sizeof(ddp_tagged_hdr_t)
 	? sizeof(ddp_untagged_hdr_t) : sizeof(ddp_tagged_hdr_t);
 
-static inline uint64_t swab64(uint64_t x)
-{
-	uint32_t h = x >> 32;
-	uint32_t l = x & ((1ULL<<32)-1);
-	return (((uint64_t) ntohl(l)) << 32) | ((uint64_t) ntohl(h));
-}
-
-#if (__BYTE_ORDER == __LITTLE_ENDIAN)
-#  define ntohq(x) swab64(x)
-#  define htonq(x) swab64(x)
-#else
-#  define ntohq(x) (x)
-#  define htonq(x) (x)
-#endif
-
 inline void
 ddp_init(void)
 {
@@ -89,6 +84,26 @@ ddp_fin(void)
 	mpa_fin();
 }
 
+static void
+ddp_tmpl_init(ddp_sk_ent_t *skent)
+{
+	struct ddp_tmpl *tp;
+	qnum_t qn;
+
+	tp = Malloc(sizeof(*tp));
+	memset(tp, 0, sizeof(*tp));
+	tp->ut_payld = skent->ddp_sgmnt_len - UNTAGGED_HDR_SZ;
+	tp->t_payld = skent->ddp_sgmnt_len - TAGGED_HDR_SZ;
+	for (qn=0; qn<NUM_Q; qn++) {
+		tp->ut[qn].llp_hdr = htons(skent->ddp_sgmnt_len - 2);
+		tp->ut[qn].cf = DDP_CF_DV;
+		tp->ut[qn].qn = htonl(qn);
+	}
+	tp->t.llp_hdr = htons(skent->ddp_sgmnt_len - 2);
+	tp->t.cf = DDP_CF_TAGGED | DDP_CF_DV;
+	skent->tmpl = tp;
+}
+
 int
 ddp_register_sock(iwsk_t *iwsk)
 {
@@ -102,9 +117,7 @@ ddp_register_sock(iwsk_t *iwsk)
 	skent->recv_msn = 1; /* init msn. FIXME: 1 due to Ammasso */
 	skent->send_msn = 1; /* init msn. FIXME: 1 due to Ammasso */
 	skent->ddp_sgmnt_len = mpa_get_mulpdu(iwsk);
-
-	UNTAGGED_PAYLD_LEN = iwsk->ddpsk.ddp_sgmnt_len - UNTAGGED_HDR_SZ;
-	TAGGED_PAYLD_LEN = iwsk->ddpsk.ddp_sgmnt_len - TAGGED_HDR_SZ;
+	ddp_tmpl_init(skent);
 	INIT_LIST_HEAD(&skent->outst_tag);
 	INIT_LIST_HEAD(&skent->outst_untag);
 
@@ -114,110 +127,203 @@ ddp_register_sock(iwsk_t *iwsk)
 void
 ddp_deregister_sock(iwsk_t *iwsk)
 {
+	/* out of the poll set first, so no thread is still receiving on it */
+	mpa_deregister_sock(iwsk);
+	free(iwsk->ddpsk.tmpl);
+	iwsk->ddpsk.tmpl = NULL;
+
 	/* TODO: Surface this error */
 	if (!list_empty(&iwsk->ddpsk.outst_tag))
 		error("%s: outstanding tagged messages exist", __func__);
 	if (!list_empty(&iwsk->ddpsk.outst_untag))
 		error("%s: outstanding untagged messages exist", __func__);
-
-	mpa_deregister_sock(iwsk);
 }
 
 int
 ddp_set_sock_attrs(iwsk_t *iwsk)
 {
-	iwsk = NULL;
-	return 0;
+	return mpa_set_sock_attrs(iwsk);
+}
+
+/*
+ * Find the piece holding byte off of the message in iov.
+ */
+static inline void
+ddp_iov_seek(const struct iovec *iov, int niov, uint32_t off, int *vi,
+	     size_t *vo)
+{
+	*vi = 0;
+	while (off > 0 && *vi < niov && off >= iov[*vi].iov_len) {
+		off -= iov[*vi].iov_len;
+		(*vi)++;
+	}
+	*vo = off;
+}
+
+/*
+ * Describe the len bytes at piece *vi, offset *vo in out and step past
+ * them.  Empty pieces are dropped.  Returns the number of pieces used.
+ */
+static inline int
+ddp_iov_next(const struct iovec *iov, int niov, int *vi, size_t *vo,
+	     uint32_t len, struct iovec *out)
+{
+	int n = 0;
+	size_t l;
+
+	while (len > 0 && *vi < niov) {
+		l = iov[*vi].iov_len - *vo;
+		if (l > len)
+			l = len;
+		if (l) {
+			out[n].iov_base = (uint8_t *) iov[*vi].iov_base + *vo;
+			out[n].iov_len = l;
+			n++;
+		}
+		len -= l;
+		*vo += l;
+		if (*vo == iov[*vi].iov_len) {
+			(*vi)++;
+			*vo = 0;
+		}
+	}
+	return n;
 }
 
 int
-ddp_send_untagged(iwsk_t *iwsk, const void *msg, const uint32_t msg_len,
-				  const qnum_t qn, const uint8_t ulp_ctrl, const uint32_t
-				  ulp_payld)
+ddp_send_untagged_vec(iwsk_t *iwsk, const struct iovec *iov, int niov,
+		      const uint32_t msg_len, const qnum_t qn,
+		      const uint8_t ulp_ctrl, const uint32_t ulp_payld)
 {
+	const struct ddp_tmpl *tp = iwsk->ddpsk.tmpl;
+	const ulpdu_len_t payld = tp->ut_payld;
 	uint32_t i = 0;
 	uint32_t mo = 0; /* ddp rfc Sec. 4.3 */
-	const void *ddp_payld = NULL;
 	ulpdu_len_t ddp_payld_len = 0;
-	int ret;
+	int ret, vi = 0, n;
+	size_t vo = 0;
 	uint32_t num_sgmnts;
 	ddp_untagged_hdr_t ut_hdr;
+	struct iovec pl[DDP_MAX_SGE];
 
-	memset(&ut_hdr, 0, UNTAGGED_HDR_SZ);
-	ut_hdr.cf = DDP_CF_DV;
+	iw_assert(qn < NUM_Q, "%s: bad queue %u", __func__, qn);
+	ut_hdr = tp->ut[qn];
 	ut_hdr.ulp_ctrl = ulp_ctrl;
 	ut_hdr.ulp_payld = htonl(ulp_payld);
-	ut_hdr.qn = htonl(qn);
 	ut_hdr.msn = htonl(iwsk->ddpsk.send_msn);
 
-	num_sgmnts = (msg_len + UNTAGGED_PAYLD_LEN-1) / UNTAGGED_PAYLD_LEN;
+	num_sgmnts = (msg_len + payld-1) / payld;
 	if (unlikely(num_sgmnts == 0))
 	    num_sgmnts = 1;
+	if (num_sgmnts > 1)
+		ddp_pipe_begin(iwsk);
 
 	for (i=0; i<num_sgmnts; i++) {
 
 		ut_hdr.mo = htonl(mo);
-		ddp_payld = (const uint8_t *) msg + mo;
 
 		if (num_sgmnts - 1 == i) {
 			ddp_set_LAST(ut_hdr.cf);
 			ddp_payld_len = msg_len - mo;
+			ut_hdr.llp_hdr = htons(ddp_payld_len
+					       + UNTAGGED_HDR_SZ - 2);
 		} else {
-			ddp_payld_len = UNTAGGED_PAYLD_LEN;
-			mo += UNTAGGED_PAYLD_LEN;
+			ddp_payld_len = payld;
+			mo += payld;
 		}
+		n = ddp_iov_next(iov, niov, &vi, &vo, ddp_payld_len, pl);
 
-		ret = mpa_send(iwsk, &ut_hdr, UNTAGGED_HDR_SZ, ddp_payld,
-					   ddp_payld_len);
-		if (ret < 0)
+		ret = mpa_send(iwsk, &ut_hdr, UNTAGGED_HDR_SZ, pl, n,
+			       ddp_payld_len);
+		if (ret < 0) {
+			ddp_pipe_end(iwsk);
 			return ret;
+		}
 	}
+	ret = ddp_pipe_end(iwsk);
+	if (ret < 0)
+		return ret;
 
 	iwsk->ddpsk.send_msn++; /* update send msn */
 	return 0;
 }
 
 
+/*
+ * Send the tagged segment of the message that starts at *off and advance
+ * *off past it, so a long message can go out a piece at a time.  Returns 1
+ * once the last segment is sent.
+ */
 int
-ddp_send_tagged(iwsk_t *iwsk, const void *msg, const uint32_t msg_len,
-				const uint8_t rsvdulp, const stag_t stag,
-				const tag_offset_t to)
+ddp_send_tagged_sgmnt(iwsk_t *iwsk, const struct iovec *iov, int niov,
+		      const uint32_t msg_len, const uint8_t rsvdulp,
+		      const stag_t stag, const tag_offset_t to, uint32_t *off)
 {
-	uint32_t i = 0;
-	tag_offset_t off = 0;
-	const void *pp = NULL; /* payload pointer */
-	ulpdu_len_t len = 0;
-	int ret;
-	uint32_t num_sgmnts = (msg_len + TAGGED_PAYLD_LEN-1)
-		/ TAGGED_PAYLD_LEN;
+	const struct ddp_tmpl *tp = iwsk->ddpsk.tmpl;
+	ulpdu_len_t len;
+	int last, ret, vi, n;
+	size_t vo;
 	ddp_tagged_hdr_t t_hdr;
+	struct iovec pl[DDP_MAX_SGE];
 
-	memset(&t_hdr, 0, TAGGED_HDR_SZ);
-	t_hdr.cf = DDP_CF_TAGGED | DDP_CF_DV;
+	t_hdr = tp->t;
 	t_hdr.rsvdulp = rsvdulp;
 	t_hdr.stag = htonl(stag);
+	t_hdr.to = htonq(to + *off);
 
-	for (i=0; i<num_sgmnts; i++) {
+	last = (msg_len - *off <= tp->t_payld);
+	if (last) {
+		ddp_set_LAST(t_hdr.cf);
+		len = msg_len - *off;
+		t_hdr.llp_hdr = htons(len + TAGGED_HDR_SZ - 2);
+	} else
+		len = tp->t_payld;
 
-		t_hdr.to = htonq(to + off);
-		pp = (const uint8_t *) msg + off;
+	debug(4, "%s: to %Lx stag %d len %d", __func__,
+	  ntohq(t_hdr.to), stag, len);
 
-		if (num_sgmnts - 1 == i) {
-			ddp_set_LAST(t_hdr.cf);
-			len = msg_len - off;
-		} else {
-			len = TAGGED_PAYLD_LEN;
-			off += TAGGED_PAYLD_LEN;
-		}
+	ddp_iov_seek(iov, niov, *off, &vi, &vo);
+	n = ddp_iov_next(iov, niov, &vi, &vo, len, pl);
+	ret = mpa_send(iwsk, &t_hdr, TAGGED_HDR_SZ, pl, n, len);
+	if (ret < 0)
+		return ret;
+	*off += len;
+	return last;
+}
 
-		debug(4, "%s: to %Lx stag %d len %d", __func__,
-		  ntohq(t_hdr.to), stag, len);
+int
+ddp_send_tagged_vec(iwsk_t *iwsk, const struct iovec *iov, int niov,
+		    const uint32_t msg_len, const uint8_t rsvdulp,
+		    const stag_t stag, const tag_offset_t to)
+{
+	uint32_t off = 0;
+	int ret;
 
-		ret = mpa_send(iwsk, &t_hdr, TAGGED_HDR_SZ, pp, len);
-		if (ret < 0)
+	if (msg_len > iwsk->ddpsk.tmpl->t_payld)
+		ddp_pipe_begin(iwsk);
+	do {
+		ret = ddp_send_tagged_sgmnt(iwsk, iov, niov, msg_len, rsvdulp,
+					    stag, to, &off);
+		if (ret < 0) {
+			ddp_pipe_end(iwsk);
 			return ret;
-	}
-	return 0;
+		}
+	} while (!ret);
+	return ddp_pipe_end(iwsk);
+}
+
+/* writable socket, from mpa's poll */
+int
+ddp_send_ready(iwsk_t *iwsk)
+{
+	return rdmap_send_ready(iwsk);
+}
+
+/* mpa found the stream broken, MPA_ERR_*; the peer is told from above */
+void
+ddp_llp_error(iwsk_t *iwsk, uint8_t ecode)
+{
+	rdmap_terminate(iwsk, rdmap_term_control(RDMAP_TERM_LLP, 0, ecode));
 }
 
 /* TODO */
@@ -244,8 +350,12 @@ ddp_get_hdr_sz(void *b)
 		return UNTAGGED_HDR_SZ;
 }
 
+/*
+ * Where the payload of the segment with header hdr goes: *len bytes in
+ * the *nv pieces of v, at most DDP_MAX_SGE.
+ */
 int
-ddp_get_sink(iwsk_t *sk, void *hdr, buf_t *b)
+ddp_get_sink(iwsk_t *sk, void *hdr, struct iovec *v, int *nv, uint32_t *len)
 {
 	ddp_hdr_start_t *s = (ddp_hdr_start_t *)hdr;
 	if (ddp_get_TAGGED(s->cf)) {
@@ -255,24 +365,30 @@ ddp_get_sink(iwsk_t *sk, void *hdr, buf_t *b)
 		ddp_tagged_hdr_t *h = (ddp_tagged_hdr_t *)hdr;
 
 		/* first 2 bytes makeup  mpa hdr */
-		b->len = ntohs(h->llp_hdr) - (TAGGED_HDR_SZ - 2);
+		*len = ntohs(h->llp_hdr) - (TAGGED_HDR_SZ - 2);
 		to = ntohq(h->to);
 		stag = ntohl(h->stag);
 
-		b->buf = rdmap_get_tag_sink(sk, stag, to, b->len, h->rsvdulp);
+		v[0].iov_base = rdmap_get_tag_sink(sk, stag, to, *len,
+						   h->rsvdulp);
+		v[0].iov_len = *len;
+		*nv = 1;
 		/* TODO: Surface this error */
-		if (!b->buf) {
-			printerr("%s: no sink for stag %d (%x) to 0x%Lx (0x%Lx) len %zu",
-			  __func__, stag, h->stag, Ld(to), Lu(h->to), b->len);
+		if (!v[0].iov_base) {
+			printerr("%s: no sink for stag %d (%x) to 0x%Lx (0x%Lx) len %u",
+			  __func__, stag, h->stag, Ld(to), Lu(h->to), *len);
 			return -EBADMSG;
 		}
 		debug(4, "%s (TAGGED): to %Lx stag %d len %d", __func__, to, stag,
-		  b->len);
+		  *len);
 	}
 	else {
 		qnum_t qn;
 		msg_offset_t mo;
 		msn_t msn;
+		const struct iovec *sink;
+		int nsink, vi;
+		size_t sink_len, vo;
 
 		ddp_untagged_hdr_t *h = (ddp_untagged_hdr_t *)hdr;
 
@@ -280,9 +396,10 @@ ddp_get_sink(iwsk_t *sk, void *hdr, buf_t *b)
 		msn = ntohl(h->msn);
 		mo = ntohl(h->mo);
 
-		buf_t *utbuf = rdmap_get_untag_sink(sk, qn, msn);
+		sink = rdmap_get_untag_sink(sk, qn, msn, h->ulp_ctrl, &nsink,
+					    &sink_len);
 		/* TODO: Surface this error */
-		if (utbuf == NULL) {
+		if (sink == NULL) {
 			printerr("%s utbuf is NULL", __func__);
 			return -EBADMSG;
 		}
@@ -290,14 +407,15 @@ ddp_get_sink(iwsk_t *sk, void *hdr, buf_t *b)
 		/* h->llp_hdr == ddp_payld_len + ddphdr_len. It does not include
 		 * markers, pad and crc len. first 2 bytes makeup mpa hdr.
 		 */
-		b->len = ntohs(h->llp_hdr) - (UNTAGGED_HDR_SZ - 2);
+		*len = ntohs(h->llp_hdr) - (UNTAGGED_HDR_SZ - 2);
 		/* TODO: Surface this error */
-		if ((mo + b->len) > utbuf->len) {
-			printerr("%s:%d (mo + b->len)(%zu) > utbuf->len(%zu)",
-					 __FILE__, __LINE__, mo + b->len,  utbuf->len);
+		if ((mo + *len) > sink_len) {
+			printerr("%s:%d (mo + len)(%u) > sink len(%zu)",
+					 __FILE__, __LINE__, mo + *len, sink_len);
 			return -EBADMSG;
 		}
-		b->buf = (uint8_t *)utbuf->buf + mo;
+		ddp_iov_seek(sink, nsink, mo, &vi, &vo);
+		*nv = ddp_iov_next(sink, nsink, &vi, &vo, *len, v);
 	}
 
 	return 0;
@@ -357,7 +475,7 @@ ddp_process_ulpdu(iwsk_t *iwsk, void *hdr)
 				list_del(&tm->list);
 				free(tm);
 			}
-			rdma_write_count++;
+			__sync_fetch_and_add(&rdma_write_count, 1);
 
 		}
 
@@ -11,6 +11,8 @@
 #define __DDP_H
 
 #include <stdint.h>
+#include <endian.h>
+#include <netinet/in.h>
 #include "mem.h"
 #include "common.h"
 #include "iwsk.h"
@@ -21,6 +23,24 @@ typedef uint8_t ddp_control_field_t;
 typedef uint64_t tag_offset_t;
 typedef uint32_t msg_offset_t;
 
+/* 64-bit network byte order, like ntohl */
+static inline uint64_t swab64(uint64_t x)
+{
+	uint32_t h = x >> 32;
+	uint32_t l = x & ((1ULL<<32)-1);
+	return (((uint64_t) ntohl(l)) << 32) | ((uint64_t) ntohl(h));
+}
+
+#if (__BYTE_ORDER == __LITTLE_ENDIAN)
+#  define ntohq(x) swab64(x)
+#  define htonq(x) swab64(x)
+#else
+#  define ntohq(x) (x)
+#  define htonq(x) (x)
+#endif
+
+#define DDP_MAX_SGE 8  /* pieces of one gather or scatter list */
+
 #define DDP_CF_DV 0x1
 #define DDP_CF_TAGGED 0x80
 
@@ -81,19 +101,103 @@ ddp_init_startup(iwsk_t *iwsk, bool_t is_initiator,
 	return mpa_init_startup(iwsk, is_initiator, pd_in, pd_out, rpd_len);
 }
 
-int ddp_send_untagged(iwsk_t *iwsk, const void *msg, const uint32_t msg_len,
-                      const qnum_t qn, const uint8_t ulp_ctrl,
-		      const uint32_t ulp_payld);
+/*
+ * The messages are gathered from niov pieces, at most DDP_MAX_SGE, that
+ * add up to msg_len.  Each segment goes to mpa as the slice of the
+ * pieces it covers; nothing is copied.
+ */
+int ddp_send_untagged_vec(iwsk_t *iwsk, const struct iovec *iov, int niov,
+                          const uint32_t msg_len, const qnum_t qn,
+			  const uint8_t ulp_ctrl, const uint32_t ulp_payld);
+
+int ddp_send_tagged_vec(iwsk_t *iwsk, const struct iovec *iov, int niov,
+                        const uint32_t msg_len, const uint8_t rsvdulp,
+			const stag_t stag, const tag_offset_t to);
+
+int ddp_send_tagged_sgmnt(iwsk_t *iwsk, const struct iovec *iov, int niov,
+			  const uint32_t msg_len, const uint8_t rsvdulp,
+			  const stag_t stag, const tag_offset_t to,
+			  uint32_t *off);
 
-int ddp_send_tagged(iwsk_t *iwsk, const void *msg, const uint32_t msg_len,
-                    const uint8_t rsvdulp, const stag_t stag,
-		    const tag_offset_t to);
+static inline int
+ddp_send_untagged(iwsk_t *iwsk, const void *msg, const uint32_t msg_len,
+                  const qnum_t qn, const uint8_t ulp_ctrl,
+		  const uint32_t ulp_payld)
+{
+	struct iovec iov = { (void *)(unsigned long) msg, msg_len };
+
+	return ddp_send_untagged_vec(iwsk, &iov, 1, msg_len, qn, ulp_ctrl,
+				     ulp_payld);
+}
+
+/* ask to be called back through ddp_send_ready when iwsk is writable */
+static inline void ddp_want_send(iwsk_t *iwsk, bool_t want)
+{
+	mpa_want_send(iwsk, want);
+}
+
+int ddp_send_ready(iwsk_t *iwsk);
+
+/*
+ * Overlap framing and CRCs with writing for the segments sent on iwsk
+ * until ddp_pipe_end, which returns once all are written.
+ */
+static inline void ddp_pipe_begin(iwsk_t *iwsk)
+{
+	mpa_pipe_begin(iwsk);
+}
+
+static inline int ddp_pipe_end(iwsk_t *iwsk)
+{
+	return mpa_pipe_end(iwsk);
+}
+
+/*
+ * For the POLLOUT path, which must not block: whether the socket has yet
+ * to take the last segment, and an end that keeps what it did not take
+ * to go out first next time.  Both return 1 then.
+ */
+static inline int ddp_pipe_full(iwsk_t *iwsk)
+{
+	return mpa_pipe_full(iwsk);
+}
+
+static inline int ddp_pipe_yield(iwsk_t *iwsk)
+{
+	return mpa_pipe_yield(iwsk);
+}
+
+/* gather sends on iwsk into large writes until uncorked */
+static inline int ddp_cork(iwsk_t *iwsk)
+{
+	return mpa_cork(iwsk);
+}
+
+static inline int ddp_uncork(iwsk_t *iwsk)
+{
+	return mpa_uncork(iwsk);
+}
+
+/* copy a payload that the caller will reuse before uncork */
+static inline int ddp_stage(iwsk_t *iwsk, const struct iovec *iov, int niov,
+			    uint32_t len, struct iovec *copy)
+{
+	return mpa_stage(iwsk, iov, niov, len, copy);
+}
 
 static inline int ddp_poll(void) { return mpa_poll(); }
 uint32_t ddp_get_max_hdr_sz(void);
 uint32_t ddp_get_hdr_sz(void *b);
-int ddp_get_sink(iwsk_t *sk, void *hdr, buf_t *b);
+int ddp_get_sink(iwsk_t *sk, void *hdr, struct iovec *v, int *nv,
+		 uint32_t *len);
 uint32_t ddp_get_ddpseg_len(const iwsk_t *iwsk);
 void ddp_process_ulpdu(iwsk_t *iwsk, void *hdr);
+void ddp_llp_error(iwsk_t *iwsk, uint8_t ecode);
+
+/* the upper layers terminated the stream, read nothing more from it */
+static inline void ddp_stop(iwsk_t *iwsk)
+{
+	mpa_stop_polling(iwsk);
+}
 
 #endif /* __DDP_H */
@@ -18,6 +18,7 @@
 
 
 static inline node_t **ht_lookup_node(ht_t *ht, hkey_t k);
+static void ht_grow(ht_t *ht);
 
 ht_t *ht_create(uint32_t sz, dtor_t vdf)
 {
@@ -71,6 +72,29 @@ ht_lookup_node(ht_t *ht, hkey_t k)
 	return n;
 }
 
+/*
+ * Rehash into twice the buckets, keeping chains short as the table fills.
+ */
+static void
+ht_grow(ht_t *ht)
+{
+	uint32_t i, sz = 2 * ht->sz;
+	node_t **nodes = Malloc(sz * sizeof(*nodes));
+	node_t *c, *next;
+
+	memset(nodes, 0, sz * sizeof(*nodes));
+	for (i = 0; i < ht->sz; i++) {
+		for (c = ht->nodes[i]; c != NULL; c = next) {
+			next = c->next;
+			c->next = nodes[(uint32_t) c->key % sz];
+			nodes[(uint32_t) c->key % sz] = c;
+		}
+	}
+	free(ht->nodes);
+	ht->nodes = nodes;
+	ht->sz = sz;
+}
+
 void
 ht_insert(ht_t *ht, hkey_t k, void *v)
 {
@@ -84,6 +108,8 @@ ht_insert(ht_t *ht, hkey_t k, void *v)
 		(*n)->val = v;
 		(*n)->next = NULL;
 		ht->nnodes++;
+		if (ht->nnodes > ht->sz)
+			ht_grow(ht);
 	} else {
 		error("%s: duplicate key %d exists", __func__, k);
 	}
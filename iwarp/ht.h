@@ -21,6 +21,7 @@ typedef struct node {
 	struct node *next;
 } node_t;
 
+/* the bucket array doubles whenever there are more nodes than buckets */
 typedef struct ht {
 	uint32_t sz;
 	uint32_t nnodes;
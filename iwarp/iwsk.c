@@ -17,17 +17,32 @@
 #include "util.h"
 
 static ht_t *iwht = NULL;
+static rwlock_t iwht_lock;
+static volatile uint32_t iwht_gen = 0;  /* bumped on every delete */
+
+static void
+iwsk_free(void *v)
+{
+	iwsk_t *s = v;
+
+	lock_destroy(&s->send_lock);
+	lock_destroy(&s->recv_lock);
+	free(s);
+}
 
 inline void
 iwsk_init(void)
 {
-	iwht = ht_create(MAX_SOCKETS, free);
+	iwht = ht_create(INIT_SOCKETS, iwsk_free);
+	rwlock_init(&iwht_lock);
 }
 
 inline void
 iwsk_fin(void)
 {
 	ht_destroy(iwht);
+	rwlock_destroy(&iwht_lock);
+	iwht_gen++;
 }
 
 inline void
@@ -36,17 +51,47 @@ iwsk_insert(socket_t sock)
 	iwsk_t *s = Malloc(sizeof(*s));
 	memset(s, 0, sizeof(*s));
 	s->sk = sock;
+	s->prot_domain = -1;
+	lock_init(&s->send_lock);
+	lock_init(&s->recv_lock);
+	rwlock_write(&iwht_lock);
 	ht_insert(iwht, sock, s);
+	rwlock_drop(&iwht_lock);
 }
 
 inline void
 iwsk_delete(socket_t sock)
 {
+	rwlock_write(&iwht_lock);
+	iwht_gen++;
 	ht_delete(iwht, sock);
+	rwlock_drop(&iwht_lock);
 }
 
 inline iwsk_t *
 iwsk_lookup(socket_t sock)
 {
-	return ht_lookup(iwht, sock);
+	iwsk_t *s;
+
+	rwlock_read(&iwht_lock);
+	s = ht_lookup(iwht, sock);
+	rwlock_drop(&iwht_lock);
+	return s;
+}
+
+/*
+ * The generation is read before the lookup, so a delete racing with it
+ * leaves the cache stale rather than pointing at freed memory.
+ */
+iwsk_t *
+iwsk_lookup_cached(iwsk_cache_t *c, socket_t sock)
+{
+	uint32_t gen = iwht_gen;
+
+	if (c->iwsk && c->sk == sock && c->gen == gen)
+		return c->iwsk;
+	c->iwsk = iwsk_lookup(sock);
+	c->sk = sock;
+	c->gen = gen;
+	return c->iwsk;
 }
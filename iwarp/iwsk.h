@@ -16,8 +16,9 @@
 #include "common.h"
 #include "list.h"
 #include "cq.h"
+#include "lock.h"
 
-#define MAX_SOCKETS (128)
+#define INIT_SOCKETS (128)  /* starting size of the socket tables, they grow */
 
 typedef int socket_t;
 typedef uint32_t qnum_t;
@@ -31,7 +32,12 @@ typedef uint32_t stream_pos_t;
  * message sequence numbers etc.
  *
  * TODO: Should buffers be associated with a stream? Or be multiplexed
- * between different streams? What about multithreaded programs?
+ * between different streams?
+ *
+ * In the thread-safe mode (lock.h) each end point has a lock for either
+ * direction, so threads posting to and polling different connections do
+ * not meet.  The receive path takes send_lock too when it touches what
+ * the send side owns: rwrq, resp_q and rd_pending.
  */
 
 /* This struct represents a stream connection end point from rdmap's
@@ -43,18 +49,39 @@ typedef uint32_t stream_pos_t;
  * blocking and calls have sufficient info for generating corresponding cqes.
  */
 typedef struct rdmap_sk_ent {
-	struct list_head buf_qs[3]; /* buffer Qs for send, rdma req, & term messages */
+	struct list_head buf_qs[5]; /* buffer Qs for rdma req, term & atomic messages */
 	struct list_head rwrq; /* q for pending recv work request. For tagged messages */
 	msn_t sink_msn; /* cur msn at sink. only for untagged messages */
+	struct rdmap_recv_wqe *rq; /* posted recvs, slot n & (rq_size - 1) */
+	uint32_t rq_size;  /* power of two, 0 until the first post */
+	uint32_t rq_head;  /* sends received so far */
+	uint32_t rq_tail;  /* recvs posted so far */
+	struct rdmap_srq *srq; /* if set, recvs come from here instead of rq */
+	struct rdmap_recv_wqe *srq_wqe; /* taken from srq for the send being placed */
+	bool_t srq_held; /* srq_wqe is in use */
+	uint32_t rd_issued; /* our rdma read requests on the wire, <= ord */
+	uint32_t rd_pending; /* peer's rdma read requests held, <= ird */
+	uint32_t rd_chunk; /* split our rdma reads bigger than this, 0 never */
+	struct list_head resp_q; /* read and atomic responses still being sent */
+	uint32_t atomic_id; /* request id of our next atomic */
+	uint64_t imm; /* immediate data of the message being received */
+	struct iovec imm_sink; /* placement of imm */
+	bool_t corked; /* send completions wait in held for the uncork */
+	cqe_t *held;
+	uint32_t nheld;
+	uint32_t maxheld;
 } rdmap_sk_ent_t;
 
 /* This struct represents a stream connection end point from ddp's
  * perspective.
  */
+struct ddp_tmpl;
+
 typedef struct ddp_sk_ent {
 	msn_t recv_msn; /* recv msn seq num */
 	msn_t send_msn; /* send msn seq num */
 	uint32_t ddp_sgmnt_len; /* size of ddp segment on this socket */
+	struct ddp_tmpl *tmpl; /* its headers, serialized once */
 	struct list_head outst_tag; /* outst. untagged mesg. placed in-order */
 	struct list_head outst_untag; /* outstanding tagged messages */
 } ddp_sk_ent_t;
@@ -62,8 +89,12 @@ typedef struct ddp_sk_ent {
 /* This struct represents a logical end point of a connection, from mpa's
  * perspective.
  */
+struct mpa_unchecked;
+struct mpa_ops;
+
 typedef struct mpa_sk_ent {
 	bool_t use_crc;	 /* is crc_used ? */
+	bool_t crc_auto; /* startup sets use_crc from the peer's address */
 	bool_t use_mrkr; /* are markers used? */
 	marker_pos_t recv_mp; /* recv marker position */
 	marker_pos_t send_mp; /* send marker position */
@@ -71,22 +102,54 @@ typedef struct mpa_sk_ent {
 	stream_pos_t send_sp; /* send stream position */
 	uint32_t mss;		/* max seg. size on this socket */
 	uint32_t skidx;		/* index of this socket in pollsks array */
+	uint16_t ird;		/* rdma read depths: asked for before startup, */
+	uint16_t ord;		/* negotiated with the peer after */
+	uint16_t ext;		/* rdmap extensions, the same way */
+	bool_t want_out;	/* poll for writability too */
+	bool_t started;		/* startup done, threads may poll it */
+	bool_t eof;		/* peer closed, threads stop polling it */
+	int affinity;		/* progress shard asked for, -1 to hash */
+	int shard;		/* progress shard polling it, -1 none */
+	bool_t defer_crc;	/* place FPDUs before their crcs are checked */
+	bool_t crc_bad;		/* a deferred check failed */
+	struct mpa_unchecked *unchecked;  /* FPDUs placed, not yet checked */
+	struct mpa_unchecked **unchecked_tail;
+	const struct mpa_ops *ops;  /* FPDU writer and reader for the modes */
+	const struct mpa_ops *wrt;  /* writer in use: ops, a cork's or a pipe's */
+	uint8_t *unsent;	/* end of an FPDU the socket did not take yet */
+	uint32_t unsent_off;	/* how much of it is written since */
+	uint32_t unsent_len;
+	int batch_err;		/* first failed write of its cork, for uncork */
 } mpa_sk_ent_t;
 
 /* socket from iwarp protocol perspective */
 typedef struct iwsk {
 	socket_t sk;
+	int prot_domain;  /* stags of this PD are ours too, -1 for none */
 	cq_t *scq;	/* send comp q */
 	cq_t *rcq;	/* recv comp q */
 	rdmap_sk_ent_t rdmapsk;
 	ddp_sk_ent_t ddpsk;
 	mpa_sk_ent_t mpask;
+	lock_t send_lock;
+	lock_t recv_lock;
 } iwsk_t;
 
+/*
+ * A thread's memory of its last lookup, so a run of calls on one socket
+ * skips the table.  It is good until any socket is deleted.
+ */
+typedef struct iwsk_cache {
+	iwsk_t *iwsk;
+	socket_t sk;
+	uint32_t gen;
+} iwsk_cache_t;
+
 inline void iwsk_init(void);
 inline void iwsk_fin(void);
 inline void iwsk_insert(socket_t sock);
 inline void iwsk_delete(socket_t sock);
 inline iwsk_t *iwsk_lookup(socket_t sock);
+iwsk_t *iwsk_lookup_cached(iwsk_cache_t *c, socket_t sock);
 
 #endif /* __IWSK_H */
@@ -0,0 +1,51 @@
+/*
+ * Locks for the thread-safe mode.
+ *
+ * Copyright (C) 2005 OSC iWarp Team
+ * Distributed under the GNU Public License Version 2 or later (See LICENSE)
+ */
+#define _GNU_SOURCE  /* for writer preferring rwlocks */
+#include "lock.h"
+#include "util.h"
+
+bool_t lock_on = FALSE;
+
+void
+lock_enable(void)
+{
+	lock_on = TRUE;
+}
+
+/*
+ * Recursive, so that a socket corked for a batch can still be posted to,
+ * and an srq limit function may post to its srq.
+ */
+void
+lock_init(lock_t *l)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (pthread_mutex_init(l, &attr))
+		error("%s: pthread_mutex_init failed", __func__);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Pollers hold the socket tables' read lock most of the time; with the
+ * default preference for readers a connect could wait on them for good.
+ * That preference rules out a thread read-locking one twice, and none do.
+ */
+void
+rwlock_init(rwlock_t *l)
+{
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	if (pthread_rwlock_init(l, &attr))
+		error("%s: pthread_rwlock_init failed", __func__);
+	pthread_rwlockattr_destroy(&attr);
+}
@@ -0,0 +1,78 @@
+/*
+ * Locks for the thread-safe mode.
+ *
+ * Copyright (C) 2005 OSC iWarp Team
+ * Distributed under the GNU Public License Version 2 or later (See LICENSE)
+ */
+#ifndef __LOCK_H
+#define __LOCK_H
+
+#include <pthread.h>
+#include "common.h"
+
+/*
+ * All of these are no-ops until lock_enable, so a single threaded program
+ * pays for a test and branch only.  Enabling is for good, and must happen
+ * before a second thread calls in or anything is corked.
+ *
+ * Order, outermost first: the verbs RNIC lock, a socket's recv_lock, its
+ * send_lock, then any of the srq, cq and memory locks, which are leaves.
+ * The socket tables are read-locked around the others but never taken
+ * while holding them.
+ */
+extern bool_t lock_on;
+
+typedef pthread_mutex_t lock_t;  /* recursive */
+typedef pthread_rwlock_t rwlock_t;
+
+void lock_enable(void);
+void lock_init(lock_t *l);
+void rwlock_init(rwlock_t *l);
+
+static inline void lock_destroy(lock_t *l)
+{
+	pthread_mutex_destroy(l);
+}
+
+static inline void lock_take(lock_t *l)
+{
+	if (lock_on)
+		pthread_mutex_lock(l);
+}
+
+/* true if l is now held, for pollers that skip what others are busy with */
+static inline int lock_try(lock_t *l)
+{
+	return !lock_on || pthread_mutex_trylock(l) == 0;
+}
+
+static inline void lock_drop(lock_t *l)
+{
+	if (lock_on)
+		pthread_mutex_unlock(l);
+}
+
+static inline void rwlock_destroy(rwlock_t *l)
+{
+	pthread_rwlock_destroy(l);
+}
+
+static inline void rwlock_read(rwlock_t *l)
+{
+	if (lock_on)
+		pthread_rwlock_rdlock(l);
+}
+
+static inline void rwlock_write(rwlock_t *l)
+{
+	if (lock_on)
+		pthread_rwlock_wrlock(l);
+}
+
+static inline void rwlock_drop(rwlock_t *l)
+{
+	if (lock_on)
+		pthread_rwlock_unlock(l);
+}
+
+#endif /* __LOCK_H */
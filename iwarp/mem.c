@@ -11,17 +11,22 @@
 #include "mem.h"
 #include "util.h"
 #include "avl.h"
+#include "list.h"
+#include "lock.h"
 
 /* forward declare these typedefs */
 typedef struct S_mem_region mem_region_t;
 typedef struct S_stag_desc stag_desc_t;
 
 /*
- * STAG descriptor.
+ * STAG descriptor.  A memory window is one of these with window set; it is
+ * allocated unbound (mr NULL) and later bound onto a sub-range of some
+ * region, moving onto that region's stag list.
  */
 struct S_stag_desc {
     stag_desc_t *next;  /* singly linked list hanging off mr */
     mem_region_t *mr;
+    int window;
     size_t start, end;
     stag_t stag;  /* unique index */
     socket_t sk;
@@ -30,24 +35,56 @@ struct S_stag_desc {
 };
 
 /* not bothering with unique bitmask, just hoping no one ever has 4e9 in play */
-static stag_t stag_next_counter = 1;
+static uint32_t stag_next_counter = 1;
 
 /*
- * Memory region descriptor.
+ * Registration cache entry.  Covers the address range [start, end) and is
+ * shared by every registration that falls inside it.  Entries findable in
+ * cache_avl never overlap, so a floor search on start is an interval lookup.
+ * An entry with no registrations left is kept on cache_lru (lazy
+ * deregistration) until it is evicted to stay under cache_limit, or until
+ * mem_invalidate() says the memory underneath went away.
+ */
+typedef struct S_mem_cache_ent mem_cache_ent_t;
+struct S_mem_cache_ent {
+    size_t start, end;
+    int refcnt;
+    int cached;  /* in cache_avl, so new registrations can find it */
+    struct list_head lru;  /* on cache_lru while refcnt == 0 */
+};
+
+static struct avl_table *cache_avl = 0;
+static LIST_HEAD(cache_lru);
+static size_t cache_idle_bytes = 0;
+static size_t cache_limit = 0;
+
+/*
+ * Memory region descriptor.  These are allocated one at a time and never
+ * move, as stag descriptors point at them.  The descriptor handed out is
+ * the slot index plus one.  Unused slots are chained through next_free.
  */
 struct S_mem_region {
     void *addr;
     size_t len;
     int valid;
+    int next_free;
     stag_desc_t *stag_list;
+    mem_cache_ent_t *ent;
 };
-static mem_region_t *mem_region = 0;
+static mem_region_t **mem_region = 0;
 static int num_mem_region = 0;
+static int mem_region_free = -1;
 
 /*
  * AVL tree for quick stag manipulation.
  */
-struct avl_table *stag_avl = 0;
+static struct avl_table *stag_avl = 0;
+
+/*
+ * Placement only looks stags up, and may do so from many threads at once.
+ * Everything else here changes the tables and holds mem_lock for writing.
+ */
+static rwlock_t mem_lock;
 
 static void *mem_avl_malloc(struct libavl_allocator *x ATTR_UNUSED, size_t len)
 {
@@ -72,12 +109,151 @@ static int mem_avl_stag_comp(const void *a, const void *b, void *x ATTR_UNUSED)
     return sa->stag - sb->stag;
 }
 
+static int mem_avl_cache_comp(const void *a, const void *b,
+                              void *x ATTR_UNUSED)
+{
+    const mem_cache_ent_t *ea = a;
+    const mem_cache_ent_t *eb = b;
+
+    return (ea->start > eb->start) - (ea->start < eb->start);
+}
+
+/*
+ * Last cached entry starting at or below addr, or the first one starting
+ * at or above it.  Cached entries are disjoint, so these two are all that
+ * is needed to find every entry overlapping a range.
+ */
+static mem_cache_ent_t *mem_cache_floor(size_t addr)
+{
+    struct avl_node *n = cache_avl->avl_root;
+    mem_cache_ent_t *e, *best = NULL;
+
+    while (n) {
+	e = n->avl_data;
+	if (e->start <= addr) {
+	    best = e;
+	    n = n->avl_link[1];
+	} else
+	    n = n->avl_link[0];
+    }
+    return best;
+}
+
+static mem_cache_ent_t *mem_cache_ceil(size_t addr)
+{
+    struct avl_node *n = cache_avl->avl_root;
+    mem_cache_ent_t *e, *best = NULL;
+
+    while (n) {
+	e = n->avl_data;
+	if (e->start >= addr) {
+	    best = e;
+	    n = n->avl_link[0];
+	} else
+	    n = n->avl_link[1];
+    }
+    return best;
+}
+
+/*
+ * Take an entry out of the tree.  Idle ones are freed now, busy ones when
+ * their last registration goes away.
+ */
+static void mem_cache_remove(mem_cache_ent_t *e)
+{
+    avl_delete(cache_avl, e);
+    e->cached = 0;
+    if (e->refcnt == 0) {
+	list_del(&e->lru);
+	cache_idle_bytes -= e->end - e->start;
+	free(e);
+    }
+}
+
+/*
+ * Evict least recently used idle entries until under the limit.
+ */
+static void mem_cache_trim(void)
+{
+    mem_cache_ent_t *e;
+
+    while (cache_idle_bytes > cache_limit) {
+	e = list_entry(cache_lru.prev, mem_cache_ent_t, lru);
+	mem_cache_remove(e);
+    }
+}
+
+/*
+ * Find or build the cache entry covering [start, end).  On a miss, every
+ * overlapping entry is folded into the new one to keep the tree disjoint.
+ */
+static mem_cache_ent_t *mem_cache_get(size_t start, size_t end)
+{
+    mem_cache_ent_t *e;
+
+    e = mem_cache_floor(start);
+    if (e && end <= e->end) {
+	if (e->refcnt++ == 0) {
+	    list_del(&e->lru);
+	    cache_idle_bytes -= e->end - e->start;
+	}
+	return e;
+    }
+
+    if (e && e->end > start) {
+	start = e->start;
+	if (e->end > end)
+	    end = e->end;
+	mem_cache_remove(e);
+    }
+    while ((e = mem_cache_ceil(start)) && e->start < end) {
+	if (e->end > end)
+	    end = e->end;
+	mem_cache_remove(e);
+    }
+
+    e = Malloc(sizeof(*e));
+    e->start = start;
+    e->end = end;
+    e->refcnt = 1;
+    e->cached = 1;
+    avl_insert(cache_avl, e);
+    return e;
+}
+
+static void mem_cache_put(mem_cache_ent_t *e)
+{
+    if (--e->refcnt > 0)
+	return;
+    if (e->cached && cache_limit > 0) {
+	list_add(&e->lru, &cache_lru);
+	cache_idle_bytes += e->end - e->start;
+	mem_cache_trim();
+    } else {
+	if (e->cached)
+	    avl_delete(cache_avl, e);
+	free(e);
+    }
+}
+
+static void mem_cache_free(void *item, void *x ATTR_UNUSED)
+{
+    free(item);
+}
+
 /*
  * Subsystem startup and shutdown functions.
  */
+static void mem_stag_free(void *item, void *x ATTR_UNUSED)
+{
+    free(item);
+}
+
 void mem_init(void)
 {
     stag_avl = avl_create(mem_avl_stag_comp, 0, &mem_avl_allocator);
+    cache_avl = avl_create(mem_avl_cache_comp, 0, &mem_avl_allocator);
+    rwlock_init(&mem_lock);
 }
 
 void mem_fini(void)
@@ -87,80 +263,218 @@ void mem_fini(void)
     /* walk the mrs, destroying stags as we go */
     for (i=0; i<num_mem_region; i++) {
 	stag_desc_t *sd, *sdnext;
-	mem_region_t *mr = &mem_region[i];
-	if (!mr->valid)
-	    continue;
-	sd = mr->stag_list;
-	while (sd) {
-	    sdnext = sd->next;
-	    mem_stag_destroy(sd->stag);
-	    sd = sdnext;
+	mem_region_t *mr = mem_region[i];
+	if (mr->valid) {
+	    sd = mr->stag_list;
+	    while (sd) {
+		sdnext = sd->next;
+		mem_stag_destroy(sd->stag);
+		sd = sdnext;
+	    }
+	    mem_cache_put(mr->ent);
 	}
-	mr->valid = 0;
+	free(mr);
     }
 
-    /* detsroy avl tree and mr array */
-    avl_destroy(stag_avl, 0);
+    /* detsroy avl trees and mr array; only unbound windows and idle cache
+     * entries remain */
+    avl_destroy(stag_avl, mem_stag_free);
+    avl_destroy(cache_avl, mem_cache_free);
+    INIT_LIST_HEAD(&cache_lru);
+    cache_idle_bytes = 0;
     free(mem_region);
     mem_region = 0;
     num_mem_region = 0;
+    mem_region_free = -1;
+    rwlock_destroy(&mem_lock);
 }
 
-mem_desc_t mem_register(void *addr, size_t len)
+/*
+ * Make sure at least want free region slots exist.
+ */
+static void mem_region_reserve(int want)
 {
-    int i;
-
-    /* find a free slot */
-    for (i=0; i<num_mem_region; i++)
-	if (!mem_region[i].valid)
-	    break;
+    int i, nfree = 0;
 
-    /* enlarge */
-    if (i == num_mem_region) {
-	int j;
+    for (i=mem_region_free; i >= 0 && nfree < want; i=mem_region[i]->next_free)
+	++nfree;
+    if (nfree < want) {
+	int j, n = num_mem_region ? 2 * num_mem_region : 16;
 	void *x = mem_region;
-	num_mem_region += 10;
-	mem_region = Malloc(num_mem_region * sizeof(*mem_region));
-	if (i > 0) {
-	    memcpy(mem_region, x, i * sizeof(*mem_region));
+
+	while (n - num_mem_region + nfree < want)
+	    n *= 2;
+	mem_region = Malloc(n * sizeof(*mem_region));
+	if (num_mem_region > 0) {
+	    memcpy(mem_region, x, num_mem_region * sizeof(*mem_region));
 	    free(x);
 	}
-	for (j=i; j<num_mem_region; j++)
-	    mem_region[j].valid = 0;
+	for (j=n-1; j>=num_mem_region; j--) {
+	    mem_region[j] = Malloc(sizeof(**mem_region));
+	    mem_region[j]->valid = 0;
+	    mem_region[j]->next_free = mem_region_free;
+	    mem_region_free = j;
+	}
+	num_mem_region = n;
     }
+}
+
+/*
+ * Registration is a cache lookup; the region only remembers what the
+ * caller asked for so that stag offsets stay relative to addr.
+ */
+mem_desc_t mem_register(void *addr, size_t len)
+{
+    int i;
+    mem_region_t *mr;
+
+    rwlock_write(&mem_lock);
+    mem_region_reserve(1);
+    i = mem_region_free;
+    mr = mem_region[i];
+    mem_region_free = mr->next_free;
 
     /* build new entry */
-    mem_region[i].addr = addr;
-    mem_region[i].len  = len;
-    mem_region[i].valid = 1;
-    mem_region[i].stag_list = NULL;
-    return (mem_desc_t) &mem_region[i];
+    mr->addr = addr;
+    mr->len  = len;
+    mr->valid = 1;
+    mr->stag_list = NULL;
+    mr->ent = mem_cache_get((size_t) addr, (size_t) addr + len);
+    rwlock_drop(&mem_lock);
+    return (mem_desc_t) i + 1;
 }
 
 static mem_region_t *mr_from_md(mem_desc_t md)
 {
-    mem_region_t *mr = (mem_region_t *) md;
-
-    if (mr < &mem_region[0] || mr >= &mem_region[num_mem_region])
+    if (md == 0 || md > (mem_desc_t) num_mem_region)
+	return 0;
+    if (!mem_region[md - 1]->valid)
 	return 0;
-    return mr;
+    return mem_region[md - 1];
 }
 
 int mem_deregister(mem_desc_t md)
 {
-    mem_region_t *mr = mr_from_md(md);
+    mem_region_t *mr;
+    int ret = 0;
 
+    rwlock_write(&mem_lock);
+    mr = mr_from_md(md);
     if (!mr)
-	return -EINVAL;
-
-    /* cannot deregister until all stags have been invalidated */
-    if (mr->stag_list)
-	return -EBUSY;
+	ret = -EINVAL;
+    else if (mr->stag_list)
+	ret = -EBUSY;  /* cannot deregister until all stags are invalidated */
+    else {
+	mem_cache_put(mr->ent);
+	mr->valid = 0;
+	mr->next_free = mem_region_free;
+	mem_region_free = md - 1;
+    }
+    rwlock_drop(&mem_lock);
+    return ret;
+}
 
-    mr->valid = 0;
+/*
+ * Register and create a whole-region stag for each of n buffers.  The
+ * region table grows once for the batch.  All or nothing: on error every
+ * entry done so far is undone and the error returned.
+ */
+int mem_register_vec(socket_t sk, mem_reg_t *v, int n, int prot_domain)
+{
+    int i;
+    stag_t stag;
+
+    rwlock_write(&mem_lock);
+    mem_region_reserve(n);
+    rwlock_drop(&mem_lock);
+    for (i=0; i<n; i++) {
+	v[i].md = mem_register(v[i].addr, v[i].len);
+	stag = mem_stag_create(sk, v[i].md, 0, v[i].len, v[i].rw,
+			       prot_domain);
+	if (stag < 0) {
+	    mem_deregister(v[i].md);
+	    mem_deregister_vec(v, i);
+	    return stag;
+	}
+	v[i].stag = stag;
+    }
     return 0;
 }
 
+/*
+ * Destroy the stags and deregister the regions of a mem_register_vec
+ * batch.  Keeps going past failures, returning the first.
+ */
+int mem_deregister_vec(mem_reg_t *v, int n)
+{
+    int i, ret, err = 0;
+
+    for (i=0; i<n; i++) {
+	ret = mem_stag_destroy(v[i].stag);
+	if (ret == 0)
+	    ret = mem_deregister(v[i].md);
+	if (ret < 0 && err == 0)
+	    err = ret;
+    }
+    return err;
+}
+
+/*
+ * Bound the bytes kept registered after their last user deregistered.
+ * Zero, the default, turns lazy deregistration off.
+ */
+void mem_cache_set_limit(size_t bytes)
+{
+    rwlock_write(&mem_lock);
+    cache_limit = bytes;
+    mem_cache_trim();
+    rwlock_drop(&mem_lock);
+}
+
+/*
+ * The ULP must call this before unmapping or returning to the OS memory
+ * that may still be cached.  Live registrations inside the range stay
+ * valid until deregistered, but will not be handed out again.
+ */
+void mem_invalidate(void *addr, size_t len)
+{
+    size_t start = (size_t) addr, end = start + len;
+    mem_cache_ent_t *e;
+
+    rwlock_write(&mem_lock);
+    e = mem_cache_floor(start);
+    if (e && e->end > start)
+	mem_cache_remove(e);
+    while ((e = mem_cache_ceil(start)) && e->start < end)
+	mem_cache_remove(e);
+    rwlock_drop(&mem_lock);
+}
+
+/*
+ * Next stag with its low shift bits clear.  Negative stags are errors and
+ * zero is the null stag, so the counter wraps within what is left.
+ */
+static stag_t mem_stag_next(int shift)
+{
+    stag_t stag;
+
+    do
+	stag = (stag_t) ((stag_next_counter++ & (0x7fffffffU >> shift))
+			 << shift);
+    while (stag == 0);
+    return stag;
+}
+
+/*
+ * Whether a peer on sk may use the stag: it was made for that stream, or
+ * for the protection domain sk is in.
+ */
+static int mem_stag_owned(const stag_desc_t *sd, const iwsk_t *sk)
+{
+    return sd->sk == sk->sk
+	|| (sk->prot_domain >= 0 && sd->protection_domain == sk->prot_domain);
+}
+
 /*
  * Start and End are locations WITHIN the memory region that we
  * have already registered
@@ -170,47 +484,50 @@ mem_stag_create(int sk, mem_desc_t md, size_t start, size_t end, stag_acc_t rw,
 		int prot_domain)
 {
     stag_desc_t *sd;
-    mem_region_t *mr = mr_from_md(md);
+    mem_region_t *mr;
     size_t buffer_start;
 
-    if (!mr)
-	return -EINVAL;
-
     if (start >= end)
 	return -EINVAL;
 
-    if (end > mr->len)
+    rwlock_write(&mem_lock);
+    mr = mr_from_md(md);
+    if (!mr || end > mr->len) {
+	rwlock_drop(&mem_lock);
 	return -EINVAL;
+    }
 
     sd = Malloc(sizeof(*sd));
     sd->next = mr->stag_list;
     mr->stag_list = sd;
     sd->mr = mr;
+    sd->window = 0;
 
     buffer_start = (size_t)mr->addr;
 
     sd->start = buffer_start + start;
     sd->end = buffer_start + end;
 
-    sd->stag = stag_next_counter++;
+    sd->stag = mem_stag_next(0);
     sd->sk = sk;
     sd->rw = rw;
     sd->protection_domain = prot_domain;
     /* if collision, just get next tag */
     while (avl_insert(stag_avl, sd))
-	sd->stag = stag_next_counter++;
+	sd->stag = mem_stag_next(0);
+    rwlock_drop(&mem_lock);
     return sd->stag;
 }
 
-int mem_stag_destroy(stag_t stag)
+/*
+ * Take a stag off the stag list of the region it covers.
+ */
+static void mem_stag_unlink(stag_desc_t *sd)
 {
-    stag_desc_t *sd, *si, **siprev;
-    stag_desc_t sdtest = { .stag = stag };
+    stag_desc_t *si, **siprev;
 
-    sd = avl_delete(stag_avl, &sdtest);
-    if (!sd)
-	return -EINVAL;
-    /* remove from mr list */
+    if (!sd->mr)
+	return;
     si = sd->mr->stag_list;
     siprev = &sd->mr->stag_list;
     while (si) {
@@ -221,19 +538,154 @@ int mem_stag_destroy(stag_t stag)
 	siprev = &si->next;
 	si = si->next;
     }
+    sd->mr = NULL;
+}
+
+int mem_stag_destroy(stag_t stag)
+{
+    stag_desc_t *sd;
+    stag_desc_t sdtest = { .stag = stag };
+
+    rwlock_write(&mem_lock);
+    sd = avl_delete(stag_avl, &sdtest);
+    if (sd)
+	mem_stag_unlink(sd);
+    rwlock_drop(&mem_lock);
+    if (!sd)
+	return -EINVAL;
     free(sd);
     return 0;
 }
 
+/*
+ * Allocate an unbound memory window.  It names no memory until
+ * mem_mw_bind attaches it to a region.
+ */
+stag_t mem_mw_alloc(socket_t sk, int prot_domain)
+{
+    stag_desc_t *sd;
+    stag_t stag;
+
+    sd = Malloc(sizeof(*sd));
+    sd->next = NULL;
+    sd->mr = NULL;
+    sd->window = 1;
+    sd->start = sd->end = 0;
+    sd->sk = sk;
+    sd->rw = 0;
+    sd->protection_domain = prot_domain;
+    /* keep the low byte free as the key that rotates on each bind */
+    rwlock_write(&mem_lock);
+    sd->stag = mem_stag_next(8);
+    while (avl_insert(stag_avl, sd))
+	sd->stag = mem_stag_next(8);
+    stag = sd->stag;
+    rwlock_drop(&mem_lock);
+    return stag;
+}
+
+/*
+ * Bind (or rebind) a window onto [start, end) of a registered region.  No
+ * pinning or allocation happens here, just list manipulation.  The low byte
+ * of the stag is a key that changes on every bind, so a peer holding the
+ * previous stag loses access.  Returns the new stag.
+ */
+stag_t mem_mw_bind(stag_t mw, mem_desc_t md, size_t start, size_t end,
+		   stag_acc_t rw)
+{
+    stag_desc_t *sd, sdtest = { .stag = mw };
+    mem_region_t *mr;
+    stag_t stag;
+    int i;
+
+    rwlock_write(&mem_lock);
+    mr = mr_from_md(md);
+    sd = avl_find(stag_avl, &sdtest);
+    if (!mr || start >= end || end > mr->len || !sd || !sd->window) {
+	rwlock_drop(&mem_lock);
+	return -EINVAL;
+    }
+
+    mem_stag_unlink(sd);
+    sd->next = mr->stag_list;
+    mr->stag_list = sd;
+    sd->mr = mr;
+    sd->start = (size_t) mr->addr + start;
+    sd->end = (size_t) mr->addr + end;
+    sd->rw = rw;
+
+    /* the old key is free once we delete, so this always terminates */
+    avl_delete(stag_avl, sd);
+    for (i=1; i<=256; i++) {
+	sd->stag = (mw & ~0xff) | ((mw + i) & 0xff);
+	if (!avl_insert(stag_avl, sd))
+	    break;
+    }
+    stag = sd->stag;
+    rwlock_drop(&mem_lock);
+    return stag;
+}
+
+/*
+ * Unbind a window, as done by a SEND with Invalidate from the peer on sk.
+ * The stag stays allocated for a later bind.  Only windows may be
+ * invalidated, stags from mem_stag_create belong to the local ULP, and
+ * only those the peer could use itself.
+ */
+int mem_stag_invalidate(iwsk_t *sk, stag_t stag)
+{
+    stag_desc_t *sd, sdtest = { .stag = stag };
+    int ret = 0;
+
+    rwlock_write(&mem_lock);
+    sd = avl_find(stag_avl, &sdtest);
+    if (!sd)
+	ret = -EINVAL;
+    else if (!mem_stag_owned(sd, sk))
+	ret = -EPERM;
+    else if (!sd->window)
+	ret = -EACCES;
+    else {
+	mem_stag_unlink(sd);
+	sd->start = sd->end = 0;
+	sd->rw = 0;
+    }
+    rwlock_drop(&mem_lock);
+    return ret;
+}
+
 /*
  * Since other side can invalidate stags, may need to know if it still
  * exists or not.
  */
 int mem_stag_is_enabled(stag_t stag)
 {
-	stag_desc_t sdtest = { .stag = stag };
+	stag_desc_t *sd, sdtest = { .stag = stag };
+	int ret;
 
-	return !!avl_find(stag_avl, &sdtest);
+	rwlock_read(&mem_lock);
+	sd = avl_find(stag_avl, &sdtest);
+	ret = sd && sd->mr;
+	rwlock_drop(&mem_lock);
+	return ret;
+}
+
+static int
+mem_stag_allows(const stag_desc_t *sd, size_t off, size_t len, stag_acc_t rw)
+{
+	if (!sd || !sd->mr)
+		return 0;
+	if ((rw & STAG_R) && !(sd->rw & STAG_R))
+		return 0;
+	if ((rw & STAG_W) && !(sd->rw & STAG_W))
+		return 0;
+	/* cannot write byte at end, ranges are start..(end-1) inclusive */
+	if (off < sd->start || off >= sd->end)
+		return 0;
+
+	if (off+len < sd->start || off+len > sd->end)
+		return 0;
+	return 1;
 }
 
 /*
@@ -245,21 +697,40 @@ mem_stag_location(iwsk_t *sk, stag_t stag, size_t off, size_t len,
 		  stag_acc_t rw)
 {
 	stag_desc_t *sd, sdtest = { .stag = stag };
+	int ok;
 
-	sd = avl_find(stag_avl, &sdtest);
-	if (!sd)
-		return NULL;
 	if (!sk)
 		return NULL;
-	if ((rw & STAG_R) && !(sd->rw & STAG_R))
-		return NULL;
-	if ((rw & STAG_W) && !(sd->rw & STAG_W))
-		return NULL;
-	/* cannot write byte at end, ranges are start..(end-1) inclusive */
-	if (off < sd->start || off >= sd->end)
-		return NULL;
+	rwlock_read(&mem_lock);
+	sd = avl_find(stag_avl, &sdtest);
+	ok = sd && mem_stag_owned(sd, sk) && mem_stag_allows(sd, off, len, rw);
+	rwlock_drop(&mem_lock);
+	return ok ? (char*) off : NULL;
+}
 
-	if (off+len < sd->start || off+len > sd->end)
-		return NULL;
-	return (char*) off;
+/*
+ * Why a peer may not use len bytes at off through stag: -ENOENT no such
+ * stag, -EPERM not one of this stream's, -EACCES not for rw, -ERANGE out
+ * of its bounds.  Zero if it may.
+ */
+int
+mem_stag_check(iwsk_t *sk, stag_t stag, size_t off, size_t len,
+	       stag_acc_t rw)
+{
+	stag_desc_t *sd, sdtest = { .stag = stag };
+	int ret = 0;
+
+	rwlock_read(&mem_lock);
+	sd = avl_find(stag_avl, &sdtest);
+	if (!sd || !sd->mr)
+		ret = -ENOENT;
+	else if (!sk || !mem_stag_owned(sd, sk))
+		ret = -EPERM;
+	else if (((rw & STAG_R) && !(sd->rw & STAG_R))
+		 || ((rw & STAG_W) && !(sd->rw & STAG_W)))
+		ret = -EACCES;
+	else if (!mem_stag_allows(sd, off, len, rw))
+		ret = -ERANGE;
+	rwlock_drop(&mem_lock);
+	return ret;
 }
@@ -41,10 +41,20 @@ mem_desc_t mem_register(void *addr, size_t len);
 int mem_deregister(mem_desc_t md);
 
 /*
- * STAGs are tied to a particular stream.  An alternate model would be to use
- * protection domains (PDs) to permit any of a number of streams to use a given
- * STAG.  Both could coexist, but we use only the stream model.  See DDP spec
- * 8.2 and RDMAP spec 5.2.
+ * Registrations go through a cache keyed by address range.  Registering a
+ * buffer inside one already registered is a tree lookup.  With a non-zero
+ * limit, deregistered ranges are kept around up to that many bytes, least
+ * recently used evicted first.  Since the cache cannot see munmap, the ULP
+ * must invalidate a range before giving that memory back to the OS.
+ */
+void mem_cache_set_limit(size_t bytes);
+void mem_invalidate(void *addr, size_t len);
+
+/*
+ * STAGs are tied to a particular stream, or to a protection domain (PD) that
+ * permits any of a number of streams to use a given STAG.  A stream is in
+ * the PD set by rdmap_set_prot_domain, if any.  A peer can only reach the
+ * STAGs of its own stream or PD.  See DDP spec 8.2 and RDMAP spec 5.2.
  */
 typedef int32_t stag_t;  /* wire is 32 bits, reserving 1 bit for error */
 typedef enum {
@@ -68,6 +78,18 @@ stag_t mem_stag_create(socket_t sk, mem_desc_t md, size_t start, size_t end,
 int mem_stag_destroy(stag_t stag);
 int mem_stag_is_enabled(stag_t stag);
 
+/*
+ * Memory windows expose a sub-range of an existing registration without
+ * the cost of a new stag.  Allocate once, then bind and rebind cheaply; each
+ * bind returns a new stag whose low 8 bits (the key) differ from the last,
+ * revoking the old one.  mem_stag_invalidate unbinds a window, and is what
+ * an incoming SEND with Invalidate does.  Free with mem_stag_destroy.
+ */
+stag_t mem_mw_alloc(socket_t sk, int prot_domain);
+stag_t mem_mw_bind(stag_t mw, mem_desc_t md, size_t start, size_t end,
+                   stag_acc_t rw);
+int mem_stag_invalidate(iwsk_t *sk, stag_t stag);
+
 /*
  * Called by DDP to determine if placement is valid for a given tagged
  * message.
@@ -75,6 +97,24 @@ int mem_stag_is_enabled(stag_t stag);
  */
 void *mem_stag_location(iwsk_t *sk, stag_t stag, size_t off, size_t len,
                         stag_acc_t rw);
+int mem_stag_check(iwsk_t *sk, stag_t stag, size_t off, size_t len,
+                   stag_acc_t rw);
+
+/*
+ * Batch setup: each entry is registered and gets a stag over the whole of
+ * it, md and stag filled in on return.  Large jobs register thousands of
+ * buffers at startup, and in the kernel this is one command for all.
+ */
+typedef struct {
+    void *addr;
+    size_t len;
+    stag_acc_t rw;
+    mem_desc_t md;
+    stag_t stag;
+} mem_reg_t;
+
+int mem_register_vec(socket_t sk, mem_reg_t *v, int n, int prot_domain);
+int mem_deregister_vec(mem_reg_t *v, int n);
 
 /*
  * buffer type. Used specifically in untagged buffer model.
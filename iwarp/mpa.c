@@ -12,13 +12,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <linux/socket.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/uio.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 
 /*
  * IP_MTU is defined in linux/in.h, but linux/in.h conflicts with
@@ -36,14 +40,22 @@
 #include "util.h"
 #include "ht.h"
 #include "crc32c.h"
+#include "lock.h"
 
 /* rename struct pollfd */
 typedef struct pollfd pollfd_t;
 
-/* struct maintaining poll sockets */
+/*
+ * struct maintaining poll sockets, grown as more register.  Pollers work
+ * from a copy and read-lock it again to dispatch; gen tells them whether
+ * a socket left in between.
+ */
 typedef struct poll_sk {
-	pollfd_t *sks;
+	iwsk_t **iwsks;
 	size_t numsks;
+	size_t maxsks;
+	uint32_t gen;		/* bumped on every deregister */
+	rwlock_t lock;
 } poll_sk_t;
 
 typedef struct marker {
@@ -69,30 +81,218 @@ static const uint16_t PAYLD_CHNK = 512 - sizeof(marker_t);
 static const uint32_t MAX_IPSEG = 1 << 16;
 static const uint32_t POLL_TIMEOUT = 0;
 
-static struct iovec *blks = NULL;
-static marker_t *mrkr_blk = NULL;
-static void *ddphdr_blk = NULL;
-static crc_t crc_blk;
-static word_t pad_blk;
+/*
+ * Scratch for building and taking apart FPDUs, one set per thread, made
+ * on first use and freed by scratch_key's destructor as the thread exits.
+ */
+static __thread struct iovec *blks = NULL;
+static __thread marker_t *mrkr_blk = NULL;
+static __thread void *ddphdr_blk = NULL;
+static __thread crc_t crc_blk;
+static __thread word_t pad_blk;
+static __thread pollfd_t *pollfds = NULL;  /* the copy polled on */
+static __thread iwsk_t **polliwsks = NULL;
+static __thread size_t pollmax = 0;
+static pthread_key_t scratch_key;
 static poll_sk_t pollsks;
+
+/*
+ * While progress threads run, each owns a shard of the started sockets
+ * and waits on its own epoll set, so no two threads poll one socket and
+ * a wakeup costs only the ready ones.  The ready list of a shard's last
+ * wait is published so that idle threads can take entries its owner has
+ * not got to yet; an owner with more than one wakes an idle thread
+ * through its eventfd, which sits in its epoll set with a NULL ptr.
+ */
+#define SHARD_EVENTS 64
+#define MPA_EPOLL_IN (EPOLLIN | EPOLLERR | EPOLLHUP)  /* errors are found reading */
+typedef struct shard {
+	int epfd;
+	int wake;		/* eventfd, written to have it steal */
+	volatile int idle;	/* waiting with nothing ready */
+	struct epoll_event *ev;	/* ready list of the last wait */
+	volatile int nev;	/* entries in it, 0 while waiting */
+	volatile int next;	/* next entry to take, by owner or thief */
+	uint32_t gen;		/* pollsks.gen from before the wait */
+	lock_t lock;		/* thieves against the owner refilling ev */
+} shard_t;
+static shard_t *shards = NULL;
+static int nshards = 0;
+
 static uint32_t MAX_CHUNKS = 0;
 static uint32_t MAX_BLKS = 0;
 static uint32_t MAX_MRKRS = 0;
 static uint32_t DDP_MAX_HDR_SZ = 0;
 
+/*
+ * While a socket is corked its plain FPDUs gather here and go out in one
+ * writev.  Headers and crcs are copied in; payloads are only referenced,
+ * so they must stay put until mpa_uncork.  Per thread as well: corking
+ * holds the socket's send lock until the uncork.
+ */
+#define BATCH_FPDUS 64
+#define BATCH_IOVS (4 * BATCH_FPDUS)  /* hdr, payload, pad, crc each */
+#define BATCH_STAGE (16 * 1024)  /* bytes of copied payload per batch */
+static __thread struct {
+	iwsk_t *sk;  /* corked socket, or NULL */
+	struct iovec iov[BATCH_IOVS];
+	uint32_t niov;
+	uint32_t nfpdu;
+	size_t len;
+	uint8_t *hdrs;  /* BATCH_FPDUS of DDP_MAX_HDR_SZ */
+	crc_t crc[BATCH_FPDUS];
+	uint8_t *stage;  /* BATCH_STAGE, payloads copied by mpa_stage */
+	uint32_t staged;
+} batch;
+static const word_t zero_pad = 0;
+
+/*
+ * The FPDUs of a long message with CRCs go out in a pipeline: FPDU n is
+ * written as far as the socket takes it without blocking, FPDU n+1 is
+ * framed and its CRC computed while TCP drains that, then the rest of n
+ * is written.  The two take turns in slot[].  Only within one message,
+ * between mpa_pipe_begin and mpa_pipe_end, so payloads stay put;
+ * mpa_pipe_yield ends it by copying out what the socket did not take.
+ */
+static __thread struct {
+	iwsk_t *sk;  /* socket of the message, or NULL */
+	struct {
+		struct iovec *iov;  /* MAX_BLKS */
+		uint8_t *hdr;  /* DDP_MAX_HDR_SZ, copied */
+		crc_t crc;
+	} slot[2];
+	int cur;  /* slot of the FPDU being written */
+	uint32_t niov;
+	uint32_t vi;  /* first iovec not all written */
+	size_t left;  /* bytes of it not written */
+} sendpipe;
+
+/*
+ * With defer_crc an FPDU is placed as soon as it is read and its crc left
+ * to the crc32c helpers, if any.  The checks are waited for at the last
+ * FPDU of the message, before ddp sees it and it can complete.  What a
+ * check needs is kept per FPDU, as the scratch blks are reused.
+ */
+struct mpa_unchecked {
+	struct mpa_unchecked *next;
+	struct iovec v[DDP_MAX_SGE + 2];  /* header, payload, pad */
+	int nv;
+	uint8_t *hdr;  /* DDP_MAX_HDR_SZ, copied */
+	word_t pad;
+	crc_t crc;  /* as received */
+	crc32c_job_t job;
+};
+
+/*
+ * Subnets whose links are trusted to deliver what TCP checksummed, so
+ * that sockets left to decide by policy go without crcs there.  Set up
+ * before connecting.  IPv4 addresses are kept mapped into IPv6.
+ */
+typedef struct {
+	struct in6_addr addr;
+	int prefix;  /* leading bits of addr that count */
+} mpa_subnet_t;
+
+static mpa_subnet_t *crc_trusted = NULL;
+static int ncrc_trusted = 0;
+
 static inline int mpa_get_mtu(socket_t sock, void *mtu);
 static int mpa_wrt_mrkr_fpdu(mpa_sk_t *mpask, void *ddp_hdr,
-                             uint32_t ddp_hdr_len, const void *ddp_payld,
-                             ulpdu_len_t ddp_payld_len);
-static int mpa_wrt_plain_fpdu(mpa_sk_t *mpask, void *ddp_hdr,
-                              uint32_t ddp_hdr_len, const void *ddp_payld,
-			      ulpdu_len_t ddp_payld_len);
+                             uint32_t ddp_hdr_len, const struct iovec *iov,
+                             int niov, ulpdu_len_t ddp_payld_len);
+static int mpa_wrt_plain_crc(mpa_sk_t *mpask, void *ddp_hdr,
+                             uint32_t ddp_hdr_len, const struct iovec *iov,
+                             int niov, ulpdu_len_t ddp_payld_len);
+static int mpa_wrt_plain_nocrc(mpa_sk_t *mpask, void *ddp_hdr,
+                               uint32_t ddp_hdr_len, const struct iovec *iov,
+                               int niov, ulpdu_len_t ddp_payld_len);
 static inline void mpa_read_mrkr(iwsk_t *s, uint32_t *bidx, uint32_t *midx,
                                  uint32_t *cp, uint32_t *mp);
 static inline void mpa_fill_blk(struct iovec *blks, uint32_t *bidx,
                                 const void *p, uint32_t len, uint32_t *cp);
+static inline void mpa_fill_vec(struct iovec *blks, uint32_t *bidx,
+                                const struct iovec *v, int nv, int *vi,
+                                size_t *vo, uint32_t len, uint32_t *cp);
+static inline int mpa_wrt_plain(mpa_sk_t *mpask, void *ddp_hdr,
+                                uint32_t ddp_hdr_len, const struct iovec *iov,
+                                int niov, ulpdu_len_t ddp_payld_len,
+                                const bool_t crc) ATTR_ALWAYS_INLINE;
 static int mpa_rd_mrkr_fpdu(iwsk_t *iwsk, uint32_t *bidx, uint32_t *midx);
-static int mpa_rd_plain_fpdu(iwsk_t *iwsk, uint32_t *bidx);
+static int mpa_rd_mrkr(iwsk_t *iwsk);
+static inline int mpa_rd_plain(iwsk_t *iwsk, const int check)
+                               ATTR_ALWAYS_INLINE;
+static int mpa_rd_plain_nocrc(iwsk_t *iwsk);
+static int mpa_rd_plain_crc(iwsk_t *iwsk);
+static int mpa_rd_plain_defer(iwsk_t *iwsk);
+static void mpa_check_deferred(iwsk_t *iwsk);
+static int mpa_batch_flush(void);
+static inline int mpa_batch_plain(mpa_sk_t *mpask, void *ddp_hdr,
+                                  uint32_t ddp_hdr_len,
+                                  const struct iovec *iov, int niov,
+                                  ulpdu_len_t ddp_payld_len,
+                                  const bool_t crc) ATTR_ALWAYS_INLINE;
+static int mpa_batch_plain_nocrc(mpa_sk_t *mpask, void *ddp_hdr,
+                                 uint32_t ddp_hdr_len,
+                                 const struct iovec *iov, int niov,
+                                 ulpdu_len_t ddp_payld_len);
+static int mpa_batch_plain_crc(mpa_sk_t *mpask, void *ddp_hdr,
+                               uint32_t ddp_hdr_len, const struct iovec *iov,
+                               int niov, ulpdu_len_t ddp_payld_len);
+static int mpa_pipe_plain_fpdu(mpa_sk_t *mpask, void *ddp_hdr,
+                               uint32_t ddp_hdr_len, const struct iovec *iov,
+                               int niov, ulpdu_len_t ddp_payld_len);
+static int mpa_unsent_push(socket_t sk, mpa_sk_ent_t *ent, bool_t all);
+static int mpa_wrt_unsent(mpa_sk_t *mpask, void *ddp_hdr,
+                          uint32_t ddp_hdr_len, const struct iovec *iov,
+                          int niov, ulpdu_len_t ddp_payld_len);
+static void mpa_scratch_alloc(void);
+static void mpa_scratch_free(void *unused);
+
+/*
+ * The FPDU writer and reader for each combination of a socket's modes,
+ * bound by mpa_set_sock_attrs once startup has settled them, so that the
+ * plain ones test none per FPDU.  Markers are rare and keep one pair
+ * that looks at use_crc itself.  Corking or pipelining a socket puts
+ * their own writer over it in wrt for the while; reading stays with ops.
+ */
+struct mpa_ops {
+	int (*send)(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+		    const struct iovec *iov, int niov,
+		    ulpdu_len_t ddp_payld_len);
+	int (*recv)(iwsk_t *iwsk);
+};
+
+static const struct mpa_ops mpa_ops_plain = {
+	mpa_wrt_plain_nocrc, mpa_rd_plain_nocrc
+};
+static const struct mpa_ops mpa_ops_plain_crc = {
+	mpa_wrt_plain_crc, mpa_rd_plain_crc
+};
+static const struct mpa_ops mpa_ops_plain_defer = {
+	mpa_wrt_plain_crc, mpa_rd_plain_defer
+};
+static const struct mpa_ops mpa_ops_mrkr = {
+	mpa_wrt_mrkr_fpdu, mpa_rd_mrkr
+};
+static const struct mpa_ops mpa_ops_batch = {
+	mpa_batch_plain_nocrc, NULL
+};
+static const struct mpa_ops mpa_ops_batch_crc = {
+	mpa_batch_plain_crc, NULL
+};
+static const struct mpa_ops mpa_ops_pipe = {
+	mpa_pipe_plain_fpdu, NULL
+};
+static const struct mpa_ops mpa_ops_unsent = {
+	mpa_wrt_unsent, NULL
+};
+
+static inline void
+mpa_scratch(void)
+{
+	if (unlikely(!blks))
+		mpa_scratch_alloc();
+}
 
 /*
  * rfc-879: relationship between MTU, MSS, IPv4 & TCP headers
@@ -107,10 +307,41 @@ mpa_init(void)
 
 	/*
 	 * MAX_BLKS = 2*MAX_CHUNKS + 1 + pad + crc + two for header + one for
-	 * safety. one blk for marker and another for payload.
+	 * safety. one blk for marker and another for payload.  Each extra
+	 * piece of a gathered payload can split one more.
 	 */
-	MAX_BLKS = (2*MAX_CHUNKS + 1) + (1 + 1) + (1 + 1) + 1;
+	MAX_BLKS = (2*MAX_CHUNKS + 1) + (1 + 1) + (1 + 1) + 1 + DDP_MAX_SGE;
 	MAX_MRKRS = MAX_CHUNKS + 1 + 1;
+	DDP_MAX_HDR_SZ = ddp_get_max_hdr_sz();
+
+	/* struct to store all poll sockets */
+	pollsks.numsks = 0;
+	pollsks.maxsks = INIT_SOCKETS;
+	pollsks.iwsks = Malloc(pollsks.maxsks * sizeof(*pollsks.iwsks));
+	pollsks.gen = 0;
+	rwlock_init(&pollsks.lock);
+
+	if (pthread_key_create(&scratch_key, mpa_scratch_free))
+		error("%s: pthread_key_create failed", __func__);
+	mpa_scratch();
+}
+
+inline void
+mpa_fin(void)
+{
+	mpa_scratch_free(NULL);
+	pthread_key_delete(scratch_key);
+	rwlock_destroy(&pollsks.lock);
+	free(pollsks.iwsks);
+	free(crc_trusted);
+	crc_trusted = NULL;
+	ncrc_trusted = 0;
+}
+
+static void
+mpa_scratch_alloc(void)
+{
+	int i;
 
 	blks = Malloc(MAX_BLKS * sizeof(*blks));
 	memset(blks, 0, MAX_BLKS * sizeof(*blks));
@@ -119,24 +350,46 @@ mpa_init(void)
 	mrkr_blk = Malloc(MARKER_SZ*MAX_MRKRS);
 	memset(mrkr_blk, 0, MARKER_SZ*MAX_MRKRS);
 
-	/* struct to store all poll sockets */
-	pollsks.numsks = 0;
-	pollsks.sks = Malloc(MAX_SOCKETS * sizeof(*pollsks.sks));
-	memset(pollsks.sks, 0, MAX_SOCKETS * sizeof(*pollsks.sks));
-
 	/* ddphdrblk */
-	DDP_MAX_HDR_SZ = ddp_get_max_hdr_sz();
 	ddphdr_blk = Malloc(DDP_MAX_HDR_SZ);
 	memset(ddphdr_blk, 0, DDP_MAX_HDR_SZ);
+
+	batch.sk = NULL;
+	batch.niov = batch.nfpdu = 0;
+	batch.len = 0;
+	batch.hdrs = Malloc(BATCH_FPDUS * DDP_MAX_HDR_SZ);
+	batch.stage = Malloc(BATCH_STAGE);
+	batch.staged = 0;
+
+	sendpipe.sk = NULL;
+	for (i=0; i<2; i++) {
+		sendpipe.slot[i].iov = Malloc(MAX_BLKS
+					      * sizeof(*sendpipe.slot[i].iov));
+		sendpipe.slot[i].hdr = Malloc(DDP_MAX_HDR_SZ);
+	}
+
+	/* a non-NULL value is what gets the destructor called */
+	pthread_setspecific(scratch_key, blks);
 }
 
-inline void
-mpa_fin(void)
+static void
+mpa_scratch_free(void *unused ATTR_UNUSED)
 {
+	free(batch.hdrs);
+	free(batch.stage);
+	free(sendpipe.slot[0].iov);
+	free(sendpipe.slot[0].hdr);
+	free(sendpipe.slot[1].iov);
+	free(sendpipe.slot[1].hdr);
 	free(ddphdr_blk);
-	free(pollsks.sks);
 	free(blks);
 	free(mrkr_blk);
+	free(pollfds);
+	free(polliwsks);
+	blks = NULL;
+	pollfds = NULL;
+	polliwsks = NULL;
+	pollmax = 0;
 }
 
 inline int
@@ -146,21 +399,44 @@ mpa_register_sock(iwsk_t *s)
 	int one;
 
 	s->mpask.use_crc = FALSE;
+	s->mpask.crc_auto = FALSE;
 	s->mpask.use_mrkr = FALSE;
+	s->mpask.want_out = FALSE;
+	s->mpask.started = FALSE;
+	s->mpask.eof = FALSE;
+	s->mpask.affinity = -1;
+	s->mpask.shard = -1;
+	s->mpask.defer_crc = FALSE;
+	s->mpask.crc_bad = FALSE;
+	s->mpask.unchecked = NULL;
+	s->mpask.unchecked_tail = &s->mpask.unchecked;
+	s->mpask.unsent = NULL;
+	s->mpask.unsent_off = s->mpask.unsent_len = 0;
+	s->mpask.batch_err = 0;
+	s->mpask.ird = 1;
+	s->mpask.ord = 1;
+	s->mpask.ext = 0;
 	s->mpask.recv_mp = 0; /* mpa-rfc Sec. 5.1, also Sec. 6.1 pg. 30 pnt. 7 */
 	s->mpask.send_mp = 0; /* mpa-rfc Sec. 5.1 */
 	s->mpask.send_sp = 0; /* mpa-rfc Sec. 5.1, also Sec. 6.1 pg 30 pnt. 7 */
 	s->mpask.recv_sp = 0; /* mpa-rfc Sec. 5.1 */
+	mpa_set_sock_attrs(s);
 	ret = mpa_get_mtu(s->sk, &(s->mpask.mss));
 	if (ret < 0)
 		return ret;
 	s->mpask.mss = s->mpask.mss - 60 - 60 - 8; /* see mpa_init */
 
 	/* add to pollsks */
+	rwlock_write(&pollsks.lock);
+	if (pollsks.numsks == pollsks.maxsks) {
+		pollsks.maxsks *= 2;
+		pollsks.iwsks = Realloc(pollsks.iwsks,
+					pollsks.maxsks * sizeof(*pollsks.iwsks));
+	}
 	s->mpask.skidx = pollsks.numsks;
-	pollsks.sks[pollsks.numsks].fd = s->sk;
-	pollsks.sks[pollsks.numsks].events = POLLIN;
+	pollsks.iwsks[pollsks.numsks] = s;
 	pollsks.numsks++;
+	rwlock_drop(&pollsks.lock);
 
 	/*
 	 * Disable Nagle algorithm.
@@ -173,17 +449,168 @@ mpa_register_sock(iwsk_t *s)
 	return 0;
 }
 
+/*
+ * Once this returns no poller has s in hand, and none will pick it up.
+ */
 inline void
 mpa_deregister_sock(iwsk_t *s)
 {
-	if (s->mpask.skidx < (pollsks.numsks - 1)) /* not last, overwrite tail */
-		memmove(&pollsks.sks[s->mpask.skidx],
-			&pollsks.sks[s->mpask.skidx + 1],
-			sizeof(struct pollfd)
-			* (pollsks.numsks - 1 - s->mpask.skidx));
-	else /* last socket, erase it */
-		memset(&pollsks.sks[s->mpask.skidx], 0, sizeof(pollfd_t));
+	uint32_t last;
+
+	mpa_scratch();
+	if (batch.sk == s) { /* unsent, the connection is going */
+		batch.sk = NULL;
+		batch.niov = batch.nfpdu = 0;
+		batch.len = 0;
+		batch.staged = 0;
+	}
+	if (sendpipe.sk == s)
+		sendpipe.sk = NULL;
+	free(s->mpask.unsent);
+	s->mpask.unsent = NULL;
+	mpa_check_deferred(s);  /* helpers may still be reading its buffers */
+	rwlock_write(&pollsks.lock);
+	if (s->mpask.shard >= 0) {  /* fails if the peer's eof took it out */
+		epoll_ctl(shards[s->mpask.shard].epfd, EPOLL_CTL_DEL, s->sk,
+			  NULL);
+		s->mpask.shard = -1;
+	}
+	last = pollsks.numsks - 1;
+	if (s->mpask.skidx < last) { /* not last, move the tail into the hole */
+		pollsks.iwsks[s->mpask.skidx] = pollsks.iwsks[last];
+		pollsks.iwsks[s->mpask.skidx]->mpask.skidx = s->mpask.skidx;
+	}
 	pollsks.numsks--;
+	pollsks.gen++;
+	rwlock_drop(&pollsks.lock);
+}
+
+/*
+ * Poll for writability too while the upper layers have something queued
+ * to send on this socket.  Called with its send lock held; pollers pick
+ * the flag up the next time round, a shard's epoll set is told now.  The
+ * barriers pair with mpa_shard_add's: either it sees the new flag or this
+ * sees the shard.  A change to a set it is not yet in just fails.
+ */
+void
+mpa_want_send(iwsk_t *s, bool_t want)
+{
+	struct epoll_event ev;
+	int shard;
+
+	if (s->mpask.want_out == want)
+		return;
+	s->mpask.want_out = want;
+	if (!lock_on)
+		return;
+	__sync_synchronize();
+	shard = s->mpask.shard;
+	if (shard < 0)
+		return;
+	ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+	epoll_ctl(shards[shard].epfd, EPOLL_CTL_MOD, s->sk, &ev);
+}
+
+/*
+ * Put a started socket in the shard it asked for, else one hashed on its
+ * descriptor.  Called with the pollsks write lock held.
+ */
+static void
+mpa_shard_add(iwsk_t *s)
+{
+	struct epoll_event ev;
+	int shard;
+
+	if (s->mpask.affinity >= 0)
+		shard = s->mpask.affinity % nshards;
+	else
+		shard = s->sk % nshards;
+	s->mpask.shard = shard;
+	__sync_synchronize();
+	ev.events = EPOLLIN | (s->mpask.want_out ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+	if (epoll_ctl(shards[shard].epfd, EPOLL_CTL_ADD, s->sk, &ev) < 0)
+		error_errno("%s: epoll_ctl add", __func__);
+}
+
+/*
+ * Split the sockets among n shards, for the n progress threads about to
+ * start; thread-safe mode must be on.  Sockets started later join as
+ * they finish startup.
+ */
+int
+mpa_shards_start(int n)
+{
+	uint32_t i;
+	int j, ret = 0;
+
+	if (n <= 0 || shards)
+		return -EINVAL;
+	rwlock_write(&pollsks.lock);
+	shards = Malloc(n * sizeof(*shards));
+	for (j=0; j<n; j++) {
+		struct epoll_event ev;
+
+		shards[j].epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (shards[j].epfd < 0) {
+			ret = -errno;
+			break;
+		}
+		shards[j].wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (shards[j].wake < 0
+		    || epoll_ctl(shards[j].epfd, EPOLL_CTL_ADD, shards[j].wake,
+				 &ev) < 0) {
+			ret = -errno;
+			if (shards[j].wake >= 0)
+				close(shards[j].wake);
+			close(shards[j].epfd);
+			break;
+		}
+		shards[j].idle = 0;
+		shards[j].ev = Malloc(SHARD_EVENTS * sizeof(*shards[j].ev));
+		shards[j].nev = 0;
+		shards[j].next = 0;
+		shards[j].gen = 0;
+		lock_init(&shards[j].lock);
+	}
+	nshards = j;
+	if (ret == 0)
+		for (i=0; i<pollsks.numsks; i++)
+			if (pollsks.iwsks[i]->mpask.started
+			    && !pollsks.iwsks[i]->mpask.eof)
+				mpa_shard_add(pollsks.iwsks[i]);
+	rwlock_drop(&pollsks.lock);
+	if (ret)
+		mpa_shards_stop();
+	return ret;
+}
+
+/*
+ * After the threads are joined, back to polling everything in
+ * mpa_poll_generic.
+ */
+void
+mpa_shards_stop(void)
+{
+	uint32_t i;
+	int j;
+
+	rwlock_write(&pollsks.lock);
+	for (i=0; i<pollsks.numsks; i++)
+		pollsks.iwsks[i]->mpask.shard = -1;
+	for (j=0; j<nshards; j++) {
+		close(shards[j].wake);
+		close(shards[j].epfd);
+		free(shards[j].ev);
+		lock_destroy(&shards[j].lock);
+	}
+	free(shards);
+	shards = NULL;
+	nshards = 0;
+	rwlock_drop(&pollsks.lock);
 }
 
 /*
@@ -197,6 +624,138 @@ mpa_deregister_sock(iwsk_t *s)
  * would be to have a config file, which takes into account each card type's
  * requirements, and pass it on to program as one argument.
  */
+/*
+ * Cap our read depths by the peer's: we may not have more reads out than
+ * it will queue, nor queue more than it will send.  One read at a time is
+ * always allowed.
+ */
+static void
+mpa_set_depths(iwsk_t *iwsk, const mpa_depths_t *peer)
+{
+	uint16_t ird = ntohs(peer->ird) & MPA_DEPTH_MASK;
+	uint16_t ord = ntohs(peer->ord) & MPA_DEPTH_MASK;
+
+	if (iwsk->mpask.ord > ird)
+		iwsk->mpask.ord = ird ? ird : 1;
+	if (iwsk->mpask.ird > ord)
+		iwsk->mpask.ird = ord ? ord : 1;
+}
+
+/* an IPv4 address as ::ffff:a.b.c.d */
+static void
+mpa_map_v4(struct in6_addr *a, const struct in_addr *a4)
+{
+	memset(a, 0, sizeof(*a));
+	a->s6_addr[10] = a->s6_addr[11] = 0xff;
+	memcpy(&a->s6_addr[12], a4, sizeof(*a4));
+}
+
+/*
+ * Trust subnet, "addr/prefix" or a bare address for just that host, IPv4
+ * or IPv6.  Sockets whose crc use is left to policy go without to peers
+ * in it.
+ */
+int
+mpa_crc_trust(const char *subnet)
+{
+	char buf[INET6_ADDRSTRLEN + 5], *slash, *end;
+	struct in_addr a4;
+	mpa_subnet_t n;
+	long prefix;
+	int max;
+
+	if (strlen(subnet) >= sizeof(buf))
+		return -EINVAL;
+	strcpy(buf, subnet);
+	slash = strchr(buf, '/');
+	if (slash)
+		*slash++ = '\0';
+	if (inet_pton(AF_INET, buf, &a4) == 1) {
+		mpa_map_v4(&n.addr, &a4);
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, &n.addr) == 1)
+		max = 128;
+	else
+		return -EINVAL;
+	prefix = max;
+	if (slash) {
+		prefix = strtol(slash, &end, 10);
+		if (end == slash || *end || prefix < 0 || prefix > max)
+			return -EINVAL;
+	}
+	n.prefix = prefix + 128 - max;
+
+	crc_trusted = Realloc(crc_trusted,
+			      (ncrc_trusted + 1) * sizeof(*crc_trusted));
+	crc_trusted[ncrc_trusted++] = n;
+	return 0;
+}
+
+static int
+mpa_addr(const struct sockaddr *sa, struct in6_addr *a)
+{
+	if (sa->sa_family == AF_INET)
+		mpa_map_v4(a, &((const struct sockaddr_in *)sa)->sin_addr);
+	else if (sa->sa_family == AF_INET6)
+		*a = ((const struct sockaddr_in6 *)sa)->sin6_addr;
+	else
+		return -EAFNOSUPPORT;
+	return 0;
+}
+
+static bool_t
+mpa_in_subnet(const struct in6_addr *a, const mpa_subnet_t *n)
+{
+	int whole = n->prefix / 8, bits = n->prefix % 8;
+
+	if (memcmp(a->s6_addr, n->addr.s6_addr, whole))
+		return FALSE;
+	return !bits || !((a->s6_addr[whole] ^ n->addr.s6_addr[whole])
+			  & (0xff00 >> bits));
+}
+
+/*
+ * Whether a peer at sa is over loopback or in a trusted subnet.
+ */
+bool_t
+mpa_addr_trusted(const struct sockaddr *sa)
+{
+	struct in6_addr a;
+	int i;
+
+	if (mpa_addr(sa, &a) < 0)
+		return FALSE;
+	if (IN6_IS_ADDR_LOOPBACK(&a)
+	    || (IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == 127))
+		return TRUE;
+	for (i=0; i<ncrc_trusted; i++)
+		if (mpa_in_subnet(&a, &crc_trusted[i]))
+			return TRUE;
+	return FALSE;
+}
+
+/*
+ * Whether the peer is this host, over loopback or one of its own
+ * addresses, or in a trusted subnet.
+ */
+static bool_t
+mpa_link_trusted(iwsk_t *iwsk)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	struct in6_addr peer, self;
+
+	if (getpeername(iwsk->sk, (struct sockaddr *)&ss, &len) < 0
+	    || mpa_addr((struct sockaddr *)&ss, &peer) < 0)
+		return FALSE;
+	if (mpa_addr_trusted((struct sockaddr *)&ss))
+		return TRUE;
+	len = sizeof(ss);
+	return getsockname(iwsk->sk, (struct sockaddr *)&ss, &len) == 0
+	       && mpa_addr((struct sockaddr *)&ss, &self) == 0
+	       && IN6_ARE_ADDR_EQUAL(&peer, &self);
+}
+
 int
 mpa_init_startup(iwsk_t *iwsk, bool_t is_initiator, const char *pd_in,
                  char *pd_out, pd_len_t rpd_len)
@@ -204,6 +763,10 @@ mpa_init_startup(iwsk_t *iwsk, bool_t is_initiator, const char *pd_in,
 	int ret;
 	int len;
 	pd_len_t pd_in_len;
+	pd_len_t depths_len = 0;
+	pd_len_t ext_len = 0;
+	mpa_depths_t depths;
+	uint32_t ext;
 	struct {
 		char key[16];
 		uint32_t cntl;
@@ -220,7 +783,20 @@ mpa_init_startup(iwsk_t *iwsk, bool_t is_initiator, const char *pd_in,
 	if (!pd_out || !pd_in)
 		return -EINVAL;
 
-	len = pd_in_len;
+	if (iwsk->mpask.crc_auto) {
+		iwsk->mpask.use_crc = !mpa_link_trusted(iwsk);
+		debug(2, "%s: crc %s by policy", __func__,
+		      iwsk->mpask.use_crc ? "wanted" : "not wanted");
+	}
+
+	/* the responder can only answer with depths if asked with them */
+	if (is_initiator && (iwsk->mpask.ird > 1 || iwsk->mpask.ord > 1
+			     || iwsk->mpask.ext))
+		depths_len = sizeof(depths);
+	if (is_initiator && iwsk->mpask.ext)
+		ext_len = sizeof(ext);
+
+	len = pd_in_len + sizeof(depths) + sizeof(ext);
 	len += sizeof(*rrf);
 	rrf = Malloc(len);
 
@@ -233,16 +809,44 @@ mpa_init_startup(iwsk_t *iwsk, bool_t is_initiator, const char *pd_in,
 		    mpa_set_C(rrf->cntl); /* we prefer CRC */
 		mpa_unset_R(rrf->cntl);
 		mpa_set_Res(rrf->cntl);
-		mpa_set_Rev(rrf->cntl, 0); /* ammasso specific revision */
-		mpa_set_PD_Length(rrf->cntl, pd_in_len);
-		strcpy(rrf->init_string, pd_in);
+		if (depths_len) {
+			mpa_set_Rev(rrf->cntl, MPA_REV_ENHANCED);
+			depths.ird = htons(iwsk->mpask.ird);
+			depths.ord = htons(iwsk->mpask.ord);
+			memcpy(rrf->init_string, &depths, depths_len);
+		} else
+			mpa_set_Rev(rrf->cntl, 0); /* ammasso specific revision */
+		if (ext_len) {
+			mpa_set_X(rrf->cntl);
+			ext = htonl(iwsk->mpask.ext);
+			memcpy(rrf->init_string + depths_len, &ext, ext_len);
+		}
+		mpa_set_PD_Length(rrf->cntl, depths_len + ext_len + pd_in_len);
+		strcpy(rrf->init_string + depths_len + ext_len, pd_in);
 
-		ret = write_full(iwsk->sk, rrf, len);
+		ret = write_full(iwsk->sk, rrf, sizeof(*rrf) + depths_len
+				 + ext_len + pd_in_len);
 		if (ret < 0)
 			return ret;
 
 		read_full(iwsk->sk, rrf, sizeof(*rrf));
 		pd_out_len = mpa_get_PD_Length(rrf->cntl);
+		if (depths_len && mpa_get_Rev(rrf->cntl) == MPA_REV_ENHANCED
+		    && pd_out_len >= depths_len) {
+			read_full(iwsk->sk, &depths, depths_len);
+			pd_out_len -= depths_len;
+			mpa_set_depths(iwsk, &depths);
+			if (ext_len && mpa_get_X(rrf->cntl)
+			    && pd_out_len >= ext_len) {
+				read_full(iwsk->sk, &ext, ext_len);
+				pd_out_len -= ext_len;
+				iwsk->mpask.ext &= ntohl(ext);
+			} else
+				iwsk->mpask.ext = 0;
+		} else {
+			iwsk->mpask.ird = iwsk->mpask.ord = 1;
+			iwsk->mpask.ext = 0;
+		}
 
 		/* XXX: We dont test if pd_out_len > pd_in_len and reallocate rrf
 		 * since we read into pd_out instead of copying from
@@ -284,18 +888,28 @@ mpa_init_startup(iwsk_t *iwsk, bool_t is_initiator, const char *pd_in,
 				return -EBADMSG;
 		}
 
-		if (iwsk->mpask.use_crc == 0) {
-		    if (mpa_get_C(rrf->cntl)) {
-			    iwsk->mpask.use_crc = TRUE;
-		    } else {
-			    iwsk->mpask.use_crc = FALSE;
-		    }
-		} else {
-		    if (!mpa_get_C(rrf->cntl))
-				return -EBADMSG;
-		}
+		/* RFC 5044 Sec. 7.1: crcs if either side wants them */
+		if (mpa_get_C(rrf->cntl))
+			iwsk->mpask.use_crc = TRUE;
 
 		pd_out_len = mpa_get_PD_Length(rrf->cntl);
+		if (mpa_get_Rev(rrf->cntl) == MPA_REV_ENHANCED
+		    && pd_out_len >= sizeof(depths)) {
+			depths_len = sizeof(depths);
+			read_full(iwsk->sk, &depths, depths_len);
+			pd_out_len -= depths_len;
+			mpa_set_depths(iwsk, &depths);
+			if (mpa_get_X(rrf->cntl) && pd_out_len >= sizeof(ext)) {
+				ext_len = sizeof(ext);
+				read_full(iwsk->sk, &ext, ext_len);
+				pd_out_len -= ext_len;
+				iwsk->mpask.ext &= ntohl(ext);
+			} else
+				iwsk->mpask.ext = 0;
+		} else {
+			iwsk->mpask.ird = iwsk->mpask.ord = 1;
+			iwsk->mpask.ext = 0;
+		}
 
 		/* XXX: We dont test if pd_out_len > pd_in_len and reallocate rrf
 		 * since we read into pd_out instead of copying from
@@ -321,17 +935,35 @@ mpa_init_startup(iwsk_t *iwsk, bool_t is_initiator, const char *pd_in,
 		}
 		mpa_unset_R(rrf->cntl);
 		mpa_set_Res(rrf->cntl);
-		mpa_set_Rev(rrf->cntl, 1); /* neteffect specific revision */
-		mpa_set_PD_Length(rrf->cntl, pd_in_len);
+		if (depths_len) {
+			mpa_set_Rev(rrf->cntl, MPA_REV_ENHANCED);
+			depths.ird = htons(iwsk->mpask.ird);
+			depths.ord = htons(iwsk->mpask.ord);
+			memcpy(rrf->init_string, &depths, depths_len);
+		} else
+			mpa_set_Rev(rrf->cntl, 1); /* neteffect specific revision */
+		if (ext_len) {
+			mpa_set_X(rrf->cntl);
+			ext = htonl(iwsk->mpask.ext);
+			memcpy(rrf->init_string + depths_len, &ext, ext_len);
+		}
+		mpa_set_PD_Length(rrf->cntl, depths_len + ext_len + pd_in_len);
 		if(pd_in_len != 0)
-			strcpy(rrf->init_string, pd_in);
-		ret = write_full(iwsk->sk, rrf, len);
+			strcpy(rrf->init_string + depths_len + ext_len, pd_in);
+		ret = write_full(iwsk->sk, rrf, sizeof(*rrf) + depths_len
+				 + ext_len + pd_in_len);
 		if (ret < 0)
 			return ret;
 	}
 	free(rrf);
+	mpa_set_sock_attrs(iwsk);
 
-
+	/* until now startup read the socket itself, now threads may poll it */
+	rwlock_write(&pollsks.lock);
+	iwsk->mpask.started = TRUE;
+	if (nshards)
+		mpa_shard_add(iwsk);
+	rwlock_drop(&pollsks.lock);
 
 	return 0;
 }
@@ -380,42 +1012,79 @@ mpa_get_mtu(socket_t sock, void *mtu)
 /*	return 1500;*/
 }
 
+/*
+ * The writer for s: one that first finishes an FPDU the socket did not
+ * take, this thread's cork or pipeline on it, if any, else its modes'
+ * own.  Neither of the second starts with an FPDU unfinished.  Called
+ * with the send lock held, or before start.
+ */
+static void
+mpa_bind_wrt(iwsk_t *s)
+{
+	mpa_sk_ent_t *ent = &s->mpask;
+
+	if (ent->unsent)
+		ent->wrt = &mpa_ops_unsent;
+	else if (batch.sk == s && !ent->use_mrkr)
+		ent->wrt = ent->use_crc ? &mpa_ops_batch_crc : &mpa_ops_batch;
+	else if (sendpipe.sk == s)
+		ent->wrt = &mpa_ops_pipe;
+	else
+		ent->wrt = ent->ops;
+}
+
+/*
+ * Bind the FPDU writer and reader for the socket's current modes; again
+ * whenever they change, last when startup has settled them.
+ */
 int
 mpa_set_sock_attrs(iwsk_t *iwsk)
 {
-	iwsk = NULL;
+	mpa_sk_ent_t *ent = &iwsk->mpask;
+
+	if (ent->use_mrkr)
+		ent->ops = &mpa_ops_mrkr;
+	else if (!ent->use_crc)
+		ent->ops = &mpa_ops_plain;
+	else if (ent->defer_crc)
+		ent->ops = &mpa_ops_plain_defer;
+	else
+		ent->ops = &mpa_ops_plain_crc;
+	mpa_bind_wrt(iwsk);
 	return 0;
 }
 
+/*
+ * Send one FPDU, its payload gathered from the niov pieces of iov.  The
+ * ddp header starts with the MPA length, which ddp fills in.
+ */
 int
 mpa_send(iwsk_t *iwsk, void *ddp_hdr, const uint32_t ddp_hdr_len,
-	 const void *ddp_payld, const ulpdu_len_t ddp_payld_len)
+	 const struct iovec *iov, int niov, const ulpdu_len_t ddp_payld_len)
 {
 	mpa_sk_t mpask;
+
+	mpa_scratch();
 	mpask.sk = iwsk->sk;
 	mpask.ent = &(iwsk->mpask);
-	if (mpask.ent->use_mrkr)
-		return mpa_wrt_mrkr_fpdu(&mpask, ddp_hdr, ddp_hdr_len, ddp_payld,
-								 ddp_payld_len);
-	else
-		return mpa_wrt_plain_fpdu(&mpask, ddp_hdr, ddp_hdr_len, ddp_payld,
-								  ddp_payld_len);
+	return mpask.ent->wrt->send(&mpask, ddp_hdr, ddp_hdr_len, iov, niov,
+				    ddp_payld_len);
 }
 
 /* marker arithmetic is modulo 2^32 */
 static int
 mpa_wrt_mrkr_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
-                  const void *ddp_payld, ulpdu_len_t ddp_payld_len)
+                  const struct iovec *iov, int niov,
+		  ulpdu_len_t ddp_payld_len)
 {
 	mpa_send_cntr++;
 	ulpdu_len_t len = ddp_payld_len + ddp_hdr_len;
-	/* first 2 bytes makeup mpa hdr */
-	*((ulpdu_len_t *)ddp_hdr) = htons(len - 2);
 
 	stream_pos_t sp = mpask->ent->send_sp; /* position in stream */
 	marker_pos_t mp = mpask->ent->send_mp - sp; /* marker position in fpdu */
 	uint32_t cp = 0;
-	const char *pp = ddp_payld; /* payload position */
+	int vi = 0; /* payload position, piece and offset in it */
+	size_t vo = 0;
 	uint32_t i = 0, l = 0, h = 0, f = 0, cm = 0, b = 0;
 	const uint8_t pad = WORD_SZ*((len+WORD_SZ-1)/WORD_SZ) - len; /* 4-len%4 */
 	marker_t mrkr;
@@ -431,7 +1100,9 @@ mpa_wrt_mrkr_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
 	} else {
 		num_mrkrs = 0;
 	}
-	fpdu_len = l + num_mrkrs*MARKER_SZ + CRC_SZ;
+	fpdu_len = l + num_mrkrs*MARKER_SZ;
+	if (mpask->ent->use_crc)
+		fpdu_len += CRC_SZ;
 	mpask->ent->send_mp += num_mrkrs*MARKER_PERIOD;
 
 	debug(2, "mp=%d sp=%d len=%d fpdu_len=%d", mp, sp,
@@ -463,10 +1134,8 @@ mpa_wrt_mrkr_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
 	h = mp - cp;
 	if (h > ddp_payld_len)
 		h = ddp_payld_len;
-	/* discard const to wedge into iovec */
 	if (h) /* if some filler exists, fill with filler */
-		mpa_fill_blk(blks, &b, pp, h, &cp);
-	pp += h;
+		mpa_fill_vec(blks, &b, iov, niov, &vi, &vo, h, &cp);
 
 	/* fill body of payload */
 	l = ddp_payld_len - h;
@@ -479,8 +1148,7 @@ mpa_wrt_mrkr_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
 		f = mp - cp;
 		if (f > l)
 			f = l;
-		mpa_fill_blk(blks, &b, pp, f, &cp);
-		pp += f;
+		mpa_fill_vec(blks, &b, iov, niov, &vi, &vo, f, &cp);
 
 		l -= f;
 		cm++; /* check */
@@ -518,31 +1186,32 @@ mpa_wrt_mrkr_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
 	return ret;
 }
 
-static int
-mpa_wrt_plain_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
-                   const void *ddp_payld, ulpdu_len_t ddp_payld_len)
+/* crc is constant in each caller, which gets a copy without the test */
+static inline int
+mpa_wrt_plain(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+	      const struct iovec *iov, int niov, ulpdu_len_t ddp_payld_len,
+	      const bool_t crc)
 {
 	ulpdu_len_t len = ddp_payld_len + ddp_hdr_len;
-	/* first 2 bytes makeup mpa hdr */
-	*((ulpdu_len_t *)ddp_hdr) = htons(len - 2);
 
 	uint32_t cp = 0, bi = 0, fpdu_len = 0;
 	const uint8_t pad = WORD_SZ*((len+WORD_SZ-1)/WORD_SZ) - len; /* 4-len%4 */
-	int ret;
+	int ret, j;
 
 	fpdu_len = len + pad;
 
 	debug(2, "fpdu_len = %d len = %d and pad = %d\n", fpdu_len, len, pad);
 
 	mpa_fill_blk(blks, &bi, ddp_hdr, ddp_hdr_len, &cp);
-	mpa_fill_blk(blks, &bi, ddp_payld, ddp_payld_len, &cp);
+	for (j=0; j<niov; j++)
+		mpa_fill_blk(blks, &bi, iov[j].iov_base, iov[j].iov_len, &cp);
 
 	if (pad) {
 		pad_blk = 0;
 		mpa_fill_blk(blks, &bi, &pad_blk, pad, &cp);
 	}
 
-	if (mpask->ent->use_crc) {
+	if (crc) {
 		fpdu_len += CRC_SZ;
 		crc_blk = htonl(crc32c_vec(blks, bi));
 		debug(4, "crc = %x b = %u", ntohl(crc_blk), bi);
@@ -555,52 +1224,669 @@ mpa_wrt_plain_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
 	return ret;
 }
 
+static int
+mpa_wrt_plain_crc(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+		  const struct iovec *iov, int niov, ulpdu_len_t ddp_payld_len)
+{
+	return mpa_wrt_plain(mpask, ddp_hdr, ddp_hdr_len, iov, niov,
+			     ddp_payld_len, TRUE);
+}
+
+static int
+mpa_wrt_plain_nocrc(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+		    const struct iovec *iov, int niov,
+		    ulpdu_len_t ddp_payld_len)
+{
+	return mpa_wrt_plain(mpask, ddp_hdr, ddp_hdr_len, iov, niov,
+			     ddp_payld_len, FALSE);
+}
+
+
+/*
+ * Write what is left of the pending FPDU, or as much of it as the socket
+ * takes now unless all.
+ */
+static int
+mpa_pipe_push(bool_t all)
+{
+	struct iovec *v = sendpipe.slot[sendpipe.cur].iov;
+	struct msghdr msg;
+	ssize_t cc;
+
+	memset(&msg, 0, sizeof(msg));
+	while (sendpipe.left) {
+		msg.msg_iov = &v[sendpipe.vi];
+		msg.msg_iovlen = sendpipe.niov - sendpipe.vi;
+		cc = sendmsg(sendpipe.sk->sk, &msg, all ? 0 : MSG_DONTWAIT);
+		if (cc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!all && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			return -errno;
+		}
+		sendpipe.left -= cc;
+		while (cc > 0) {
+			if ((size_t) cc >= v[sendpipe.vi].iov_len) {
+				cc -= v[sendpipe.vi].iov_len;
+				sendpipe.vi++;
+			} else {
+				v[sendpipe.vi].iov_base =
+				    (uint8_t *) v[sendpipe.vi].iov_base + cc;
+				v[sendpipe.vi].iov_len -= cc;
+				cc = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Send the FPDUs of the message about to go out on s through the
+ * pipeline.  It only pays with CRCs on, and plain FPDUs; a corked socket
+ * batches instead.
+ */
+void
+mpa_pipe_begin(iwsk_t *s)
+{
+	mpa_scratch();
+	if (!s->mpask.use_crc || s->mpask.use_mrkr || batch.sk == s
+	    || sendpipe.sk || s->mpask.unsent)
+		return;
+	sendpipe.sk = s;
+	sendpipe.left = 0;
+	mpa_bind_wrt(s);
+}
+
+/*
+ * Finish the last FPDU; after this the message's buffers may be reused.
+ */
+int
+mpa_pipe_end(iwsk_t *s)
+{
+	int ret;
+
+	mpa_scratch();
+	if (sendpipe.sk != s)
+		return 0;
+	ret = mpa_pipe_push(TRUE);
+	sendpipe.sk = NULL;
+	mpa_bind_wrt(s);
+	return ret;
+}
+
+static int
+mpa_pipe_plain_fpdu(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+                    const struct iovec *iov, int niov,
+		    ulpdu_len_t ddp_payld_len)
+{
+	ulpdu_len_t len = ddp_payld_len + ddp_hdr_len;
+	const uint8_t pad = WORD_SZ*((len+WORD_SZ-1)/WORD_SZ) - len;
+	int next = !sendpipe.cur;
+	struct iovec *v = sendpipe.slot[next].iov;
+	uint8_t *hdr = sendpipe.slot[next].hdr;
+	uint32_t cp = 0, bi = 0;
+	int ret, j;
+
+	iw_assert(ddp_hdr_len <= DDP_MAX_HDR_SZ, "ddp_hdr_len(%u) too big",
+		  ddp_hdr_len);
+
+	memcpy(hdr, ddp_hdr, ddp_hdr_len);
+
+	/* let TCP have what it takes of the previous one now */
+	ret = mpa_pipe_push(FALSE);
+	if (ret < 0)
+		return ret;
+
+	mpa_fill_blk(v, &bi, hdr, ddp_hdr_len, &cp);
+	for (j=0; j<niov; j++)
+		mpa_fill_blk(v, &bi, iov[j].iov_base, iov[j].iov_len, &cp);
+	if (pad)
+		mpa_fill_blk(v, &bi, &zero_pad, pad, &cp);
+	sendpipe.slot[next].crc = htonl(crc32c_vec(v, bi));
+	mpa_fill_blk(v, &bi, &sendpipe.slot[next].crc, CRC_SZ, &cp);
+	mpask->ent->send_sp += cp;
+
+	/* then the rest of it, and start on this one */
+	ret = mpa_pipe_push(TRUE);
+	if (ret < 0)
+		return ret;
+	sendpipe.cur = next;
+	sendpipe.niov = bi;
+	sendpipe.vi = 0;
+	sendpipe.left = cp;
+	return mpa_pipe_push(FALSE);
+}
+
+/*
+ * Offer the socket the rest of the FPDU in the pipeline without blocking.
+ * Returns 1 if it did not take it all.
+ */
+int
+mpa_pipe_full(iwsk_t *s)
+{
+	int ret;
+
+	mpa_scratch();
+	if (sendpipe.sk != s)
+		return 0;
+	ret = mpa_pipe_push(FALSE);
+	if (ret < 0)
+		return ret;
+	return sendpipe.left > 0;
+}
+
+/*
+ * Like mpa_pipe_end, but what the socket does not take now is copied out
+ * and kept on s, to go first at the next POLLOUT or before anything else
+ * sent on s.  Returns 1 if some was kept.
+ */
+int
+mpa_pipe_yield(iwsk_t *s)
+{
+	mpa_sk_ent_t *ent = &s->mpask;
+	struct iovec *v;
+	uint8_t *p;
+	uint32_t i;
+	int ret;
+
+	mpa_scratch();
+	if (sendpipe.sk != s)
+		return 0;
+	ret = mpa_pipe_push(FALSE);
+	sendpipe.sk = NULL;
+	if (ret == 0 && sendpipe.left) {
+		v = sendpipe.slot[sendpipe.cur].iov;
+		ent->unsent = p = Malloc(sendpipe.left);
+		for (i=sendpipe.vi; i<sendpipe.niov; i++) {
+			memcpy(p, v[i].iov_base, v[i].iov_len);
+			p += v[i].iov_len;
+		}
+		ent->unsent_off = 0;
+		ent->unsent_len = sendpipe.left;
+		ret = 1;
+	}
+	mpa_bind_wrt(s);
+	return ret;
+}
+
+/*
+ * Write what is left of the unsent FPDU end of the socket, or as much as
+ * it takes now unless all.  Returns 1 if some is still left.
+ */
+static int
+mpa_unsent_push(socket_t sk, mpa_sk_ent_t *ent, bool_t all)
+{
+	ssize_t cc;
+
+	if (!ent->unsent)
+		return 0;
+	while (ent->unsent_off < ent->unsent_len) {
+		cc = send(sk, ent->unsent + ent->unsent_off,
+			  ent->unsent_len - ent->unsent_off,
+			  all ? 0 : MSG_DONTWAIT);
+		if (cc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!all && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 1;
+			return -errno;
+		}
+		ent->unsent_off += cc;
+	}
+	free(ent->unsent);
+	ent->unsent = NULL;
+	ent->wrt = ent->ops;  /* nothing else is put over an unsent end */
+	return 0;
+}
+
+static int
+mpa_wrt_unsent(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+	       const struct iovec *iov, int niov, ulpdu_len_t ddp_payld_len)
+{
+	int ret;
+
+	ret = mpa_unsent_push(mpask->sk, mpask->ent, TRUE);
+	if (ret < 0)
+		return ret;
+	return mpask->ent->wrt->send(mpask, ddp_hdr, ddp_hdr_len, iov, niov,
+				     ddp_payld_len);
+}
+
+/*
+ * Gather the sends on s until mpa_uncork, for fewer, larger writes.  Only
+ * one socket is corked at a time; corking another flushes the first.
+ * mpa_uncork fails if any write of the batch did, flushes included.
+ */
+int
+mpa_cork(iwsk_t *s)
+{
+	iwsk_t *was = batch.sk;
+	int ret = 0;
+
+	mpa_scratch();
+	ret = mpa_unsent_push(s->sk, &s->mpask, TRUE);
+	if (ret < 0)
+		return ret;
+	if (was != s) {
+		mpa_batch_flush();  /* any error is for the uncork of was */
+		batch.sk = s;
+		s->mpask.batch_err = 0;
+		if (was)
+			mpa_bind_wrt(was);
+		mpa_bind_wrt(s);
+	}
+	return ret;
+}
+
+int
+mpa_uncork(iwsk_t *s)
+{
+	int ret;
+
+	mpa_scratch();
+	if (batch.sk == s) {
+		mpa_batch_flush();
+		batch.sk = NULL;
+		mpa_bind_wrt(s);
+	}
+	ret = s->mpask.batch_err;
+	s->mpask.batch_err = 0;
+	return ret;
+}
+
+static int
+mpa_batch_flush(void)
+{
+	int ret;
+
+	if (batch.nfpdu == 0)
+		return 0;
+	debug(2, "%s: %u fpdus %zu bytes", __func__, batch.nfpdu, batch.len);
+	ret = writev_full(batch.sk->sk, batch.iov, batch.niov, batch.len);
+	batch.niov = batch.nfpdu = 0;
+	batch.len = 0;
+	if (ret < 0 && !batch.sk->mpask.batch_err)
+		batch.sk->mpask.batch_err = ret;  /* those posted before fail */
+	return ret;
+}
+
+/*
+ * Gather the len bytes of iov into a copy that lives until the batch on s
+ * is written, so the caller may reuse the originals at once.  Returns 1
+ * with the copy in *copy, or 0 if s is not corked: those sends go out
+ * before returning and need no copy.
+ */
+int
+mpa_stage(iwsk_t *s, const struct iovec *iov, int niov, uint32_t len,
+	  struct iovec *copy)
+{
+	uint8_t *p;
+	int ret, j;
+
+	mpa_scratch();
+	if (batch.sk != s)
+		return 0;
+	if (len > BATCH_STAGE)
+		return -EINVAL;
+	if (batch.staged + len > BATCH_STAGE) {
+		ret = mpa_batch_flush();
+		if (ret < 0)
+			return ret;
+	}
+	/* a flush when the batch fills leaves the copy of the send in flight */
+	if (batch.nfpdu == 0)
+		batch.staged = 0;
+	p = batch.stage + batch.staged;
+	copy->iov_base = p;
+	copy->iov_len = len;
+	for (j=0; j<niov; j++) {
+		memcpy(p, iov[j].iov_base, iov[j].iov_len);
+		p += iov[j].iov_len;
+	}
+	batch.staged += (len + WORD_SZ - 1) & ~(WORD_SZ - 1);
+	return 1;
+}
+
+static inline int
+mpa_batch_plain(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+                const struct iovec *iov, int niov, ulpdu_len_t ddp_payld_len,
+		const bool_t crc)
+{
+	ulpdu_len_t len = ddp_payld_len + ddp_hdr_len;
+	const uint8_t pad = WORD_SZ*((len+WORD_SZ-1)/WORD_SZ) - len;
+	uint8_t *hdr;
+	uint32_t cp = 0, first;
+	int ret, j;
+
+	if (batch.nfpdu == BATCH_FPDUS || batch.niov + niov + 3 > BATCH_IOVS) {
+		ret = mpa_batch_flush();
+		if (ret < 0)
+			return ret;
+	}
+	iw_assert(ddp_hdr_len <= DDP_MAX_HDR_SZ, "ddp_hdr_len(%u) too big",
+		  ddp_hdr_len);
+
+	hdr = batch.hdrs + batch.nfpdu * DDP_MAX_HDR_SZ;
+	memcpy(hdr, ddp_hdr, ddp_hdr_len);
+
+	first = batch.niov;
+	mpa_fill_blk(batch.iov, &batch.niov, hdr, ddp_hdr_len, &cp);
+	for (j=0; j<niov; j++)
+		mpa_fill_blk(batch.iov, &batch.niov, iov[j].iov_base,
+			     iov[j].iov_len, &cp);
+	if (pad)
+		mpa_fill_blk(batch.iov, &batch.niov, &zero_pad, pad, &cp);
+	mpask->ent->send_sp += cp;
+
+	if (crc) {
+		batch.crc[batch.nfpdu] = htonl(crc32c_vec(&batch.iov[first],
+						  batch.niov - first));
+		mpa_fill_blk(batch.iov, &batch.niov, &batch.crc[batch.nfpdu],
+			     CRC_SZ, &cp);
+	}
+	batch.len += cp;
+	batch.nfpdu++;
+	return 0;
+}
+
+static int
+mpa_batch_plain_nocrc(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+		      const struct iovec *iov, int niov,
+		      ulpdu_len_t ddp_payld_len)
+{
+	return mpa_batch_plain(mpask, ddp_hdr, ddp_hdr_len, iov, niov,
+			       ddp_payld_len, FALSE);
+}
+
+static int
+mpa_batch_plain_crc(mpa_sk_t *mpask, void *ddp_hdr, uint32_t ddp_hdr_len,
+		    const struct iovec *iov, int niov,
+		    ulpdu_len_t ddp_payld_len)
+{
+	return mpa_batch_plain(mpask, ddp_hdr, ddp_hdr_len, iov, niov,
+			       ddp_payld_len, TRUE);
+}
+
+/*
+ * Leave the socket out of polling from now on, till it is deregistered.
+ * With the recv lock held.
+ */
+void
+mpa_stop_polling(iwsk_t *iwsk)
+{
+	iwsk->mpask.eof = TRUE;
+	if (iwsk->mpask.shard >= 0)  /* else it stays ready for good */
+		epoll_ctl(shards[iwsk->mpask.shard].epfd, EPOLL_CTL_DEL,
+			  iwsk->sk, NULL);
+}
+
+/*
+ * Another thread may have read what poll saw, and recv would block.  A
+ * peer that closed is left alone instead of being a fatal EOF: other
+ * threads, progress threads among them, poll sockets the application has
+ * not got round to disconnecting yet.  A stream that failed, reset say,
+ * is the same; it would otherwise stay ready and be polled for ever.
+ */
+static int
+mpa_still_readable(iwsk_t *iwsk)
+{
+	char c;
+	ssize_t cc;
+
+	if (!lock_on)
+		return 1;
+	cc = recv(iwsk->sk, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (cc < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+	    && errno != EINTR) {
+		warning("%s: socket %d: %s", __func__, iwsk->sk,
+			strerror(errno));
+		cc = 0;
+	}
+	if (cc == 0)
+		mpa_stop_polling(iwsk);
+	return cc > 0;
+}
 
+/*
+ * A bounded piece of queued output, then input, unless another thread is
+ * busy with that side of the socket.
+ */
+static int
+mpa_dispatch(iwsk_t *iwsk, bool_t out, bool_t in)
+{
+	int ret = 0;
+
+	if (out && lock_try(&iwsk->send_lock)) {
+		ret = mpa_unsent_push(iwsk->sk, &iwsk->mpask, FALSE);
+		if (ret == 0)
+			ret = ddp_send_ready(iwsk);
+		else if (ret > 0)
+			ret = 0;  /* still not all taken, poll on */
+		lock_drop(&iwsk->send_lock);
+		if (ret < 0)
+			return ret;
+	}
+	if (in && lock_try(&iwsk->recv_lock)) {
+		if (mpa_still_readable(iwsk))
+			ret = mpa_recv(iwsk);
+		lock_drop(&iwsk->recv_lock);
+	}
+	return ret;
+}
+
+/*
+ * Copy the poll set under the lock, poll without it, since the wait may
+ * be long, then lock again to dispatch.  If a socket left meanwhile the
+ * copy may name a freed one; skip this round, poll is level triggered.
+ * Threads skip sockets another thread is busy with, and in thread-safe
+ * mode those still in startup or closed by the peer.  Any thread skips
+ * one whose stream failed a deferred crc check.
+ */
 /* FIXME: handle broken connection */
 int
 mpa_poll_generic(int timeout)
 {
-	int pollret;
-	uint32_t i;
+	int pollret, ret = 0;
+	uint32_t i, n, gen;
+
+	mpa_scratch();
+	rwlock_read(&pollsks.lock);
+	n = pollsks.numsks;
+	if (n > pollmax) {
+		pollmax = pollsks.maxsks;
+		pollfds = Realloc(pollfds, pollmax * sizeof(*pollfds));
+		polliwsks = Realloc(polliwsks, pollmax * sizeof(*polliwsks));
+	}
+	for (i=0; i<n; i++) {
+		iwsk_t *iwsk = pollsks.iwsks[i];
+
+		pollfds[i].fd = iwsk->sk;
+		pollfds[i].events = POLLIN;
+		if (iwsk->mpask.want_out)
+			pollfds[i].events |= POLLOUT;
+		if ((lock_on && !iwsk->mpask.started) || iwsk->mpask.eof)
+			pollfds[i].fd = -1;
+		pollfds[i].revents = 0;
+		polliwsks[i] = iwsk;
+	}
+	gen = pollsks.gen;
+	rwlock_drop(&pollsks.lock);
 
 	/* poll till an event */
-	pollret = poll(pollsks.sks, pollsks.numsks, timeout);
+	pollret = poll(pollfds, n, timeout);
 	if (pollret < 0) {
 		if (errno == EINTR)
 			pollret = 0;
 		else
 			return pollret;
 	}
+	if (pollret == 0)
+		return 0;
 
-	for (i=0; pollret && i < pollsks.numsks; i++) {
-		if (pollsks.sks[i].revents & POLLIN) {
-			int ret = 0;
-			iwsk_t *iwsk = iwsk_lookup(pollsks.sks[i].fd);
-			iw_assert(iwsk != NULL, "%s:%d iwsk == NULL", __FILE__, __LINE__);
-			ret = mpa_recv(iwsk);
+	rwlock_read(&pollsks.lock);
+	if (gen != pollsks.gen)
+		pollret = 0;
+	for (i=0; pollret && i < n; i++) {
+		short revents = pollfds[i].revents;
+		if (revents & (POLLIN | POLLOUT | POLLERR | POLLHUP)) {
+			/* an error alone is for the input side to find */
+			ret = mpa_dispatch(polliwsks[i], revents & POLLOUT,
+					   revents & (POLLIN | POLLERR | POLLHUP));
 			if (ret < 0)
-				return ret;
+				break;
 			pollret--;
 		}
 	}
-	iw_assert(pollret == 0, "%s:%d pollret(%d)", __FILE__, __LINE__, pollret);
-	return 0;
+	rwlock_drop(&pollsks.lock);
+	return ret;
+}
+
+/*
+ * Take the entries other shards' owners have not reached yet.  Holding
+ * the pollsks read lock keeps their sockets from going away; a list from
+ * before a deregistration may name a freed one and is left alone.
+ * Returns how many were taken.
+ */
+static int
+mpa_steal(int self)
+{
+	struct epoll_event ev;
+	shard_t *sh;
+	int i, k, ret = 0, stolen = 0;
+	bool_t got;
+
+	for (i=1; i<nshards && ret >= 0; i++) {
+		sh = &shards[(self + i) % nshards];
+		if (sh->next >= sh->nev)  /* unlocked peek, nothing to take */
+			continue;
+		rwlock_read(&pollsks.lock);
+		for (;;) {
+			lock_take(&sh->lock);
+			k = sh->nev;
+			if (sh->gen == pollsks.gen)
+				k = __sync_fetch_and_add(&sh->next, 1);
+			got = k < sh->nev;  /* nev may change once dropped */
+			if (got)
+				ev = sh->ev[k];
+			lock_drop(&sh->lock);
+			if (!got)
+				break;
+			ret = mpa_dispatch(ev.data.ptr, ev.events & EPOLLOUT,
+					   ev.events & MPA_EPOLL_IN);
+			stolen++;
+			if (ret < 0)
+				break;
+		}
+		rwlock_drop(&pollsks.lock);
+	}
+	return ret < 0 ? ret : stolen;
+}
+
+/*
+ * Have one idle thread, if any, come and help shard self.
+ */
+static void
+mpa_shard_wake(int self)
+{
+	uint64_t one = 1;
+	shard_t *sh;
+	int i;
+
+	for (i=1; i<nshards; i++) {
+		sh = &shards[(self + i) % nshards];
+		if (sh->idle && __sync_bool_compare_and_swap(&sh->idle, 1, 0)) {
+			if (write(sh->wake, &one, sizeof(one)) < 0)
+				error_errno("%s: eventfd write", __func__);
+			return;
+		}
+	}
+}
+
+/*
+ * One round of progress thread i: help the other shards if they have a
+ * backlog, else wait up to timeout on its own, then work through what is
+ * ready, sharing the list with thieves.  The gen check is the one in
+ * mpa_poll_generic.
+ */
+int
+mpa_poll_shard(int i, int timeout)
+{
+	shard_t *sh = &shards[i];
+	uint64_t cnt;
+	int n, k, m, ret;
+	uint32_t gen;
+
+	mpa_scratch();
+	ret = mpa_steal(i);
+	if (ret < 0)
+		return ret;
+	if (ret > 0)  /* others are busy, only look at ours */
+		timeout = 0;
+	ret = 0;
+
+	rwlock_read(&pollsks.lock);
+	gen = pollsks.gen;
+	rwlock_drop(&pollsks.lock);
+	sh->idle = timeout != 0;
+	n = epoll_wait(sh->epfd, sh->ev, SHARD_EVENTS, timeout);
+	sh->idle = 0;
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	/* drop the wakeup, its steal is the next round's */
+	for (k=m=0; k<n; k++) {
+		if (sh->ev[k].data.ptr)
+			sh->ev[m++] = sh->ev[k];
+		else if (read(sh->wake, &cnt, sizeof(cnt)) < 0)
+			error_errno("%s: eventfd read", __func__);
+	}
+	n = m;
+	if (n == 0)
+		return 0;
+
+	lock_take(&sh->lock);
+	sh->gen = gen;
+	sh->next = 0;
+	sh->nev = n;
+	lock_drop(&sh->lock);
+	if (n > 1)
+		mpa_shard_wake(i);
+
+	rwlock_read(&pollsks.lock);
+	if (gen == pollsks.gen) {
+		while ((k = __sync_fetch_and_add(&sh->next, 1)) < n) {
+			ret = mpa_dispatch(sh->ev[k].data.ptr,
+					   sh->ev[k].events & EPOLLOUT,
+					   sh->ev[k].events & MPA_EPOLL_IN);
+			if (ret < 0)
+				break;
+		}
+	}
+	rwlock_drop(&pollsks.lock);
+
+	lock_take(&sh->lock);
+	sh->nev = 0;
+	lock_drop(&sh->lock);
+	return ret;
 }
 
 int
 mpa_recv(iwsk_t *iwsk)
 {
-	uint32_t bidx = 0, midx = 0;
 	int ret;
 
-	if (iwsk->mpask.use_mrkr)
-		ret = mpa_rd_mrkr_fpdu(iwsk, &bidx, &midx);
-	else
-		ret = mpa_rd_plain_fpdu(iwsk, &bidx);
+	mpa_scratch();
+	ret = iwsk->mpask.ops->recv(iwsk);
 	if (ret < 0)
-		return ret;
+		return iwsk->mpask.eof ? 0 : ret;  /* stopped, peer told */
 
 	ddp_process_ulpdu(iwsk, ddphdr_blk);
+	if (unlikely(iwsk->mpask.crc_bad) && !iwsk->mpask.eof) {
+		/* the message completed in error, nothing after it is sound */
+		ddp_llp_error(iwsk, MPA_ERR_CRC);
+		mpa_stop_polling(iwsk);
+	}
 	return 0;
 }
 
@@ -630,6 +1916,32 @@ mpa_fill_blk(struct iovec *blks, uint32_t *bidx, const void *p, uint32_t len,
 	*cp += len;
 }
 
+/*
+ * Fill len bytes of a gathered payload, starting at piece *vi offset *vo,
+ * and step past them.  A run that crosses pieces takes a blk for each.
+ */
+static inline void
+mpa_fill_vec(struct iovec *blks, uint32_t *bidx, const struct iovec *v,
+	     int nv, int *vi, size_t *vo, uint32_t len, uint32_t *cp)
+{
+	size_t l;
+
+	while (len > 0 && *vi < nv) {
+		l = v[*vi].iov_len - *vo;
+		if (l > len)
+			l = len;
+		if (l)
+			mpa_fill_blk(blks, bidx, (uint8_t *) v[*vi].iov_base + *vo,
+				     l, cp);
+		len -= l;
+		*vo += l;
+		if (*vo == v[*vi].iov_len) {
+			(*vi)++;
+			*vo = 0;
+		}
+	}
+}
+
 /*
  * read ddp_hdr_start in ddphdr_blk.
  * pass ddp_hdr_start to ddp layer to determine header size
@@ -648,9 +1960,11 @@ mpa_rd_mrkr_fpdu(iwsk_t *iwsk, uint32_t *bidx, uint32_t *midx)
 	marker_pos_t mk = mp;
 	uint32_t hdrsz = 0, cp = 0, pl = 0, ln = 0, hp = 0, lp = 0, crc = 0;
 	uint32_t st_bidx = *bidx; /* starting block index */
-	uint8_t *cur = NULL;
+	struct iovec v[DDP_MAX_SGE];
+	int nv, vi = 0;
+	size_t vo = 0;
 	uint8_t pad = 0;
-	buf_t b;
+	uint32_t len;
 	int ret;
 
 	memset(ddphdr_blk, 0, DDP_MAX_HDR_SZ);
@@ -682,22 +1996,20 @@ mpa_rd_mrkr_fpdu(iwsk_t *iwsk, uint32_t *bidx, uint32_t *midx)
 					 hdrsz - (mp - MARKER_PERIOD), &cp);
 	}
 
-	ret = ddp_get_sink(iwsk, ddphdr_blk, &b);
+	ret = ddp_get_sink(iwsk, ddphdr_blk, v, &nv, &len);
 	if (ret < 0)
 		return ret;
 
-	cur = b.buf;
-	pl = b.len;
+	pl = len;
 	st_bidx = *bidx; /* readv from st_bidx, ignore already read parts */
 	hp = cp; /* hp: position of last byte of header in fpdu */
-	pad = WORD_SZ*((b.len+WORD_SZ-1)/WORD_SZ) - b.len; /* 4 - b.len%4 */
+	pad = WORD_SZ*((len+WORD_SZ-1)/WORD_SZ) - len; /* 4 - len%4 */
 	debug(2, "pl %d", pl);
 	while (pl > 0) {
 		ln = mp - cp;
 		if (ln > pl)
 			ln = pl;
-		mpa_fill_blk(blks, bidx, cur, ln, &cp);
-		cur += ln;
+		mpa_fill_vec(blks, bidx, v, nv, &vi, &vo, ln, &cp);
 		pl -= ln;
 
 		if (pl == 0 && pad) {
@@ -711,9 +2023,7 @@ mpa_rd_mrkr_fpdu(iwsk_t *iwsk, uint32_t *bidx, uint32_t *midx)
 			(*midx)++;
 		}
 	}
-	iw_assert(cur == ((uint8_t *)b.buf + b.len),
-			  "cur(%p) != (b.buf + b.len)(%p)",
-			  cur, ((uint8_t *)b.buf + b.len));
+	iw_assert(vi == nv, "vi(%d) != nv(%d)", vi, nv);
 
 	iwsk->mpask.recv_sp += cp;
 	iwsk->mpask.recv_mp += (*midx)*MARKER_PERIOD;
@@ -741,23 +2051,93 @@ mpa_rd_mrkr_fpdu(iwsk_t *iwsk, uint32_t *bidx, uint32_t *midx)
 		crc_blk = ntohl(crc_blk);
 		debug(4, "%s: crc %x crc_blk %x bidx %u", __func__, crc,
 		      crc_blk, *bidx - 1);
-		if (crc != crc_blk)
+		if (crc != crc_blk) {
 			printerr("crc check failed. exp %x got %x",
 					 crc, crc_blk); /* TODO: Surface this error */
 			return -EBADMSG;
+		}
 	}
 
 	return 0;
 }
 
-
 static int
-mpa_rd_plain_fpdu(iwsk_t *iwsk, uint32_t *bidx)
+mpa_rd_mrkr(iwsk_t *iwsk)
+{
+	uint32_t bidx = 0, midx = 0;
+
+	return mpa_rd_mrkr_fpdu(iwsk, &bidx, &midx);
+}
+
+/*
+ * Wait for the checks of the FPDUs placed so far.  A failure is kept in
+ * crc_bad, for the message's completion and then the connection.
+ */
+static void
+mpa_check_deferred(iwsk_t *iwsk)
+{
+	struct mpa_unchecked *u;
+	uint32_t crc, crc_rx;
+
+	while ((u = iwsk->mpask.unchecked)) {
+		crc = crc32c_wait(&u->job);
+		crc_rx = ntohl(u->crc);
+		if (crc != crc_rx && !iwsk->mpask.crc_bad) {
+			printerr("crc check failed. exp %x got %x", crc, crc_rx);
+			iwsk->mpask.crc_bad = TRUE;
+		}
+		iwsk->mpask.unchecked = u->next;
+		free(u);
+	}
+	iwsk->mpask.unchecked_tail = &iwsk->mpask.unchecked;
+}
+
+/*
+ * The FPDU just read is placed already; start its check and hold on to
+ * what that needs.  At the last of a message, wait for them all.
+ */
+static void
+mpa_defer_crc(iwsk_t *iwsk, uint32_t hdrsz, const struct iovec *v, int nv,
+	      uint8_t pad)
+{
+	struct mpa_unchecked *u;
+	int j;
+
+	u = Malloc(sizeof(*u) + DDP_MAX_HDR_SZ);
+	u->hdr = (uint8_t *)(u + 1);
+	memcpy(u->hdr, ddphdr_blk, hdrsz);
+	u->v[0].iov_base = u->hdr;
+	u->v[0].iov_len = hdrsz;
+	u->nv = 1;
+	for (j=0; j<nv; j++)
+		u->v[u->nv++] = v[j];
+	if (pad) {
+		u->pad = pad_blk;
+		u->v[u->nv].iov_base = &u->pad;
+		u->v[u->nv++].iov_len = pad;
+	}
+	u->crc = crc_blk;
+	u->next = NULL;
+	crc32c_submit(&u->job, u->v, u->nv);
+	*iwsk->mpask.unchecked_tail = u;
+	iwsk->mpask.unchecked_tail = &u->next;
+
+	if (ddp_is_LAST(((ddp_hdr_start_t *)ddphdr_blk)->cf))
+		mpa_check_deferred(iwsk);
+}
+
+enum { CHECK_NONE, CHECK_NOW, CHECK_DEFER };
+
+/* check is constant in each caller, as crc is for mpa_wrt_plain */
+static inline int
+mpa_rd_plain(iwsk_t *iwsk, const int check)
 {
 	uint32_t hdrsz = 0, cp = 0, hp = 0, crc = 0;
-	uint32_t st_bidx = *bidx; /* starting block index */
+	uint32_t bidx = 0, st_bidx; /* starting block index */
 	uint8_t pad = 0;
-	buf_t b;
+	struct iovec v[DDP_MAX_SGE];
+	int nv, j, ret;
+	uint32_t len;
 
 	memset(ddphdr_blk, 0, sizeof(DDP_MAX_HDR_SZ));
 
@@ -766,30 +2146,38 @@ mpa_rd_plain_fpdu(iwsk_t *iwsk, uint32_t *bidx)
 	read_full(iwsk->sk, (uint8_t *)ddphdr_blk + sizeof(ddp_hdr_start_t),
 			  hdrsz - sizeof(ddp_hdr_start_t));
 
-	mpa_fill_blk(blks, bidx, ddphdr_blk, hdrsz, &cp);
+	mpa_fill_blk(blks, &bidx, ddphdr_blk, hdrsz, &cp);
 
-	ddp_get_sink(iwsk, ddphdr_blk, &b);
-	pad = WORD_SZ*((b.len+WORD_SZ-1)/WORD_SZ) - b.len; /* 4 - b.len%4 */
-	st_bidx = *bidx; /* readv from st_bidx, ignore already read parts */
+	ret = ddp_get_sink(iwsk, ddphdr_blk, v, &nv, &len);
+	if (ret < 0)
+		return ret;
+	pad = WORD_SZ*((len+WORD_SZ-1)/WORD_SZ) - len; /* 4 - len%4 */
+	st_bidx = bidx; /* readv from st_bidx, ignore already read parts */
 	hp = cp; /* hp: position of last byte of header in fpdu */
-	mpa_fill_blk(blks, bidx, b.buf, b.len, &cp);
+	for (j=0; j<nv; j++)
+		mpa_fill_blk(blks, &bidx, v[j].iov_base, v[j].iov_len, &cp);
 
 	if (pad) {
 		pad_blk = 0;
-		mpa_fill_blk(blks, bidx, &pad_blk, pad, &cp);
+		mpa_fill_blk(blks, &bidx, &pad_blk, pad, &cp);
 	}
 
-	if (iwsk->mpask.use_crc)
-		mpa_fill_blk(blks, bidx, &crc_blk, CRC_SZ, &cp);
+	if (check != CHECK_NONE)
+		mpa_fill_blk(blks, &bidx, &crc_blk, CRC_SZ, &cp);
 
-	readv_full(iwsk->sk, &blks[st_bidx], *bidx - st_bidx, cp - hp);
+	readv_full(iwsk->sk, &blks[st_bidx], bidx - st_bidx, cp - hp);
 
 	iwsk->mpask.recv_sp += cp;
 
-	if (iwsk->mpask.use_crc) {
-		crc = crc32c_vec(blks, *bidx - 1);
+	if (check == CHECK_DEFER) {
+		mpa_defer_crc(iwsk, hdrsz, v, nv, pad);
+		return 0;
+	}
+
+	if (check == CHECK_NOW) {
+		crc = crc32c_vec(blks, bidx - 1);
 		crc_blk = ntohl(crc_blk);
-		debug(4, "crc %x %x bidx %u", crc, crc_blk, *bidx - 1);
+		debug(4, "crc %x %x bidx %u", crc, crc_blk, bidx - 1);
 		if (crc != crc_blk) {
 			printerr("crc check failed. exp %x got %x",
 					 crc, crc_blk); /* TODO: Surface this error */
@@ -799,3 +2187,21 @@ mpa_rd_plain_fpdu(iwsk_t *iwsk, uint32_t *bidx)
 
 	return 0;
 }
+
+static int
+mpa_rd_plain_nocrc(iwsk_t *iwsk)
+{
+	return mpa_rd_plain(iwsk, CHECK_NONE);
+}
+
+static int
+mpa_rd_plain_crc(iwsk_t *iwsk)
+{
+	return mpa_rd_plain(iwsk, CHECK_NOW);
+}
+
+static int
+mpa_rd_plain_defer(iwsk_t *iwsk)
+{
+	return mpa_rd_plain(iwsk, CHECK_DEFER);
+}
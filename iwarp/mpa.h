@@ -11,6 +11,8 @@
 #define __MPA_H
 
 #include <stdint.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include "common.h"
 #include "iwsk.h"
 
@@ -44,6 +46,34 @@ typedef uint16_t pd_len_t;
 #define mpa_set_Rev(c, v) ((c) = ((c) | ((v) << 8)))
 #define mpa_set_PD_Length(c, v) ((c) = ((c) | (htons(v) << 16)))
 
+/*
+ * RFC 6581 Sec. 9.1: with revision 2 the private data starts with the
+ * sender's read depths, 14 bits each under two flag bits.  Only sent when
+ * more than one outstanding RDMA read is wanted, so older peers see the
+ * same startup as ever.
+ */
+#define MPA_REV_ENHANCED 2
+#define MPA_DEPTH_MASK 0x3fff
+
+typedef struct {
+	uint16_t ird;
+	uint16_t ord;
+} mpa_depths_t;
+
+/*
+ * The RDMAP extensions of RFC 7306 a side supports go in a word after the
+ * depths, which a reserved control bit says is there.  Peers that do not
+ * know the bit clear it in their reply, and nothing is used.  The word
+ * holds RDMAP_EXT_* and each side keeps the bits both set: 0x1 write with
+ * immediate data, 0x2 atomics, and 0x4, not in the RFC, for the length
+ * written to go in the Immediate Data message's reserved ulp field.
+ */
+#define mpa_get_X(c) (((c) & 0x10) >> 4)
+#define mpa_set_X(c) ((c) = ((c) | 0x10))
+
+/* RFC 5044 Sec. 8 error code for a TERMINATE, layer LLP */
+#define MPA_ERR_CRC 0x02
+
 void mpa_init(void);
 
 void mpa_fin(void);
@@ -52,6 +82,10 @@ int mpa_register_sock(iwsk_t *s);
 
 void mpa_deregister_sock(iwsk_t *s);
 
+int mpa_crc_trust(const char *subnet);
+
+bool_t mpa_addr_trusted(const struct sockaddr *sa);
+
 int mpa_init_startup(iwsk_t *iwsk, bool_t is_initiator, const char *pd_in,
                      char *pd_out, pd_len_t rpd_len);
 
@@ -60,10 +94,35 @@ int mpa_get_mulpdu(iwsk_t *iwsk);
 int mpa_set_sock_attrs(iwsk_t *iwsk);
 
 int mpa_send(iwsk_t *iwsk, void *ddp_hdr, uint32_t ddp_hdr_len,
-             const void *ddp_payld, ulpdu_len_t ddp_payld_len);
+             const struct iovec *iov, int niov, ulpdu_len_t ddp_payld_len);
 
 int mpa_recv(iwsk_t *iwsk);
 
+void mpa_stop_polling(iwsk_t *iwsk);
+
+void mpa_want_send(iwsk_t *s, bool_t want);
+
+void mpa_pipe_begin(iwsk_t *s);
+
+int mpa_pipe_end(iwsk_t *s);
+
+int mpa_pipe_full(iwsk_t *s);
+
+int mpa_pipe_yield(iwsk_t *s);
+
+int mpa_cork(iwsk_t *s);
+
+int mpa_uncork(iwsk_t *s);
+
+int mpa_stage(iwsk_t *s, const struct iovec *iov, int niov, uint32_t len,
+              struct iovec *copy);
+
+int mpa_shards_start(int n);
+
+void mpa_shards_stop(void);
+
+int mpa_poll_shard(int i, int timeout);
+
 int mpa_poll_generic(int timeout);
 static inline int mpa_poll(void)  { return mpa_poll_generic(0); }
 static inline int mpa_block(void) { return mpa_poll_generic(-1); }
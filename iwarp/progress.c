@@ -0,0 +1,122 @@
+/*
+ * Progress threads, moving data while the application computes.
+ *
+ * Copyright (C) 2005 OSC iWarp Team
+ * Distributed under the GNU Public License Version 2 or later (See LICENSE)
+ */
+#define _GNU_SOURCE  /* for pthread_attr_setaffinity_np */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+
+#include "progress.h"
+#include "mpa.h"
+#include "lock.h"
+#include "util.h"
+
+/* longest a thread sleeps in epoll, bounds how long stopping takes */
+static const int PROGRESS_WAIT = 10;
+
+static pthread_t *threads = NULL;
+static int nthreads = 0;
+static volatile bool_t stopping = FALSE;
+static volatile int first_err = 0;
+
+/*
+ * Thread i runs shard i of the sockets.
+ */
+static void *
+progress_loop(void *arg)
+{
+	int i = (intptr_t) arg;
+	int ret;
+
+	while (!stopping) {
+		ret = mpa_poll_shard(i, PROGRESS_WAIT);
+		if (ret < 0) {
+			/* keep the first, the application sees it on its next poll */
+			__sync_bool_compare_and_swap(&first_err, 0, ret);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start n threads, thread i pinned to cores[i] if cores is given.
+ */
+int
+progress_start(int n, const int *cores)
+{
+	pthread_attr_t attr;
+	cpu_set_t set;
+	int i, ret = 0;
+
+	if (n <= 0 || threads)
+		return -EINVAL;
+	lock_enable();
+	ret = mpa_shards_start(n);
+	if (ret)
+		return ret;
+	stopping = FALSE;
+	first_err = 0;
+	threads = Malloc(n * sizeof(*threads));
+	for (i=0; i<n; i++) {
+		pthread_attr_init(&attr);
+		if (cores) {
+			CPU_ZERO(&set);
+			CPU_SET(cores[i], &set);
+			ret = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		if (ret == 0)
+			ret = pthread_create(&threads[i], &attr, progress_loop,
+					     (void *) (intptr_t) i);
+		pthread_attr_destroy(&attr);
+		if (ret)
+			break;
+	}
+	nthreads = i;
+	if (ret) {
+		progress_stop();
+		return -ret;
+	}
+	return 0;
+}
+
+/*
+ * Stop and join the threads, returning the first poll error one hit.
+ */
+int
+progress_stop(void)
+{
+	int i;
+
+	if (!threads)
+		return 0;
+	stopping = TRUE;
+	for (i=0; i<nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	threads = NULL;
+	nthreads = 0;
+	mpa_shards_stop();
+	return first_err;
+}
+
+bool_t
+progress_running(void)
+{
+	return threads != NULL;
+}
+
+/*
+ * A thread that failed stops, so this stays set until progress_stop.
+ */
+int
+progress_error(void)
+{
+	return first_err;
+}
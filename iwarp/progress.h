@@ -0,0 +1,30 @@
+/*
+ * Progress threads, moving data while the application computes.
+ *
+ * Copyright (C) 2005 OSC iWarp Team
+ * Distributed under the GNU Public License Version 2 or later (See LICENSE)
+ */
+#ifndef __PROGRESS_H
+#define __PROGRESS_H
+
+#include "common.h"
+
+/*
+ * Without these the stack only moves data inside rdmap_poll.  Started,
+ * they poll every socket in the background, answer RDMA reads and post
+ * completions; the application then only consumes its CQs.  Starting
+ * them turns on the thread-safe mode (lock.h) for good.
+ *
+ * Each thread owns a shard of the connections, its own epoll set and
+ * MPA scratch; a connection goes to the shard rdmap_set_affinity named,
+ * else one hashed on its socket.  A thread with nothing ready takes
+ * ready connections the others have not reached.  Completions go to the
+ * connections' own CQs, so shards share none unless the application
+ * does.
+ */
+int progress_start(int nthreads, const int *cores);
+int progress_stop(void);
+bool_t progress_running(void);
+int progress_error(void);
+
+#endif /* __PROGRESS_H */
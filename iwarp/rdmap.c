@@ -24,54 +24,94 @@
 #include "mem.h"
 #include "cq.h"
 
-typedef enum {
-	RDMAP_WR_PENDING,
-	RDMAP_WR_COMPLETE
-} rdmap_wr_status_t;
-
+/*
+ * A peer's RDMA read request.  Once it arrives it moves to resp_q, and the
+ * response goes out a segment at a time from src, off bytes sent so far.
+ * An atomic request is carried out on arrival and waits on resp_q the same
+ * way, its answer written over it in aw.
+ */
 typedef struct {
 	struct list_head list;
 	rdmap_rdma_rd_req_hdr_t h;
-	buf_t buf;
+	struct iovec buf;
+	void *src;
+	uint32_t off;
+	bool_t atomic;
+	uint8_t aw[RDMAP_AREQ_SZ];  /* as on the wire */
 } rdmap_rdma_read_req_t;
 
 typedef struct {
 	struct list_head list;
-	buf_t buf;
+	struct iovec buf;
 	rdmap_term_msg_t m;
 } rdmap_term_msg_container_t;
 
 typedef struct {
 	struct list_head list;
-	cq_wrid_t id;
-	buf_t buf;
-} rdmap_untag_wrd_t;
+	struct iovec buf;
+	uint8_t r[RDMAP_ARESP_SZ];
+} rdmap_atomic_resp_container_t;
 
-typedef struct {
-	struct list_head list;
+/*
+ * Posted receive.  Sends consume receives in order, so the receive for the
+ * n-th send sits in slot n & (rq_size - 1) of a per-socket ring and
+ * neither posting nor placement allocates or searches.  Our MSNs count
+ * the messages of all untagged queues together, so the ring keeps its own
+ * count, and only the send due next, msn sink_msn, can be placed.  The
+ * ring is allocated on the first post, so a socket that takes its
+ * receives from a shared queue never has one.
+ */
+struct rdmap_recv_wqe {
 	cq_wrid_t id;
-	stag_t stag;
-	rdmap_wr_status_t wr_status;
-	msg_len_t len;
-} rdmap_tag_wrd_t;
+	int nsge;
+	size_t len;  /* of all of sge */
+	struct iovec sge[DDP_MAX_SGE];  /* scattered into in order */
+};
 
-static const uint32_t NULL_STAG = 0;
-static iwsk_t *last_send_sk = NULL;
-static iwsk_t *last_recv_sk = NULL;
-static stag_acc_t rdmap_acc[8];
-static rdmap_op_t rdmap_sink_op[8];
-static rdmap_op_t rdmap_src_op[8];
+/*
+ * Shared receive queue, a ring like the per-socket one that any attached
+ * socket takes from.  A socket takes its entry when the first segment of a
+ * send arrives and keeps a copy in srq_wqe until the send is complete, so
+ * segments of sends on different sockets can interleave.
+ */
+struct rdmap_srq {
+	struct rdmap_recv_wqe *rq;
+	uint32_t size;  /* power of two */
+	uint32_t head;  /* taken so far */
+	uint32_t tail;  /* posted so far */
+	uint32_t limit;  /* call limit_fn once fewer are posted, 0 disarmed */
+	rdmap_srq_limit_fn_t limit_fn;
+	void *limit_arg;
+	int nsk;  /* sockets attached */
+	lock_t lock;  /* posters against the receive paths of all of them */
+};
 
-static void rdmap_reap_rwr(iwsk_t *iwsk, rdmap_control_field_t cf,
-                           stag_t stag, msg_len_t len);
+static const uint32_t NULL_STAG = 0;
+static const uint32_t RQ_INIT_SIZE = 64;  /* doubles when full */
+static const int RESP_BURST = 16;  /* read response segments per poll */
+/* each thread's last socket posted to, per direction */
+static __thread iwsk_cache_t send_cache;
+static __thread iwsk_cache_t recv_cache;
+/* indexed by the opcode off the wire, all 4 bits of it */
+static stag_acc_t rdmap_acc[16];
+static rdmap_op_t rdmap_sink_op[16];
+static rdmap_op_t rdmap_src_op[16];
+
+static int rdmap_reap_rwr(iwsk_t *iwsk, stag_t stag, msg_len_t len);
+static void rdmap_remote_error(iwsk_t *iwsk, int etype, int ecode);
+static int rdmap_reap_atomic(iwsk_t *iwsk, const uint8_t *w);
+static void rdmap_rwr_fail(iwsk_t *iwsk);
 
 int
 rdmap_init(void)
 {
+	int i;
+
 	iwsk_init();
 	ddp_init();
 
-	last_send_sk = last_recv_sk = NULL;
+	for (i=0; i<16; i++)
+		rdmap_sink_op[i] = rdmap_src_op[i] = OP_ERR;
 
 	rdmap_acc[RDMA_WRITE] = STAG_W;
 	rdmap_acc[RDMA_READ_REQ] = STAG_R;
@@ -81,23 +121,27 @@ rdmap_init(void)
 	rdmap_acc[SEND_SE] = STAG_RW;
 	rdmap_acc[SEND_SE_INV] = STAG_RW;
 	rdmap_acc[TERMINATE] = STAG_R; /* terminates dont go above rdmap */
+	rdmap_acc[ATOMIC_REQ] = STAG_RW;
 
 	rdmap_sink_op[RDMA_WRITE] = OP_ERR;
 	rdmap_sink_op[RDMA_READ_REQ] = OP_ERR;
 	rdmap_sink_op[RDMA_READ_RESP] = OP_RDMA_READ;
 	rdmap_sink_op[SEND] = OP_RECV;
-	rdmap_sink_op[SEND_INV] = OP_RECV; /* TODO: change when inv is done */
+	rdmap_sink_op[SEND_INV] = OP_RECV;
 	rdmap_sink_op[SEND_SE] = OP_RECV;  /* TODO: change when se is done */
-	rdmap_sink_op[SEND_SE_INV] = OP_RECV; /* TODO: change when done */
+	rdmap_sink_op[SEND_SE_INV] = OP_RECV; /* TODO: change when se is done */
 	rdmap_sink_op[TERMINATE] = OP_ERR;
+	rdmap_sink_op[IMMEDIATE] = OP_RECV_IMM;
+	rdmap_sink_op[IMMEDIATE_SE] = OP_RECV_IMM;
+	rdmap_sink_op[ATOMIC_RESP] = OP_ATOMIC;
 
 	rdmap_src_op[RDMA_WRITE] = OP_RDMA_WRITE;
 	rdmap_src_op[RDMA_READ_REQ] = OP_ERR;
 	rdmap_src_op[RDMA_READ_RESP] = OP_ERR;
 	rdmap_src_op[SEND] = OP_SEND;
-	rdmap_src_op[SEND_INV] = OP_SEND; /* TODO: change when inv is done */
+	rdmap_src_op[SEND_INV] = OP_SEND;
 	rdmap_src_op[SEND_SE] = OP_SEND;  /* TODO: change when se is done */
-	rdmap_src_op[SEND_SE_INV] = OP_SEND; /* TODO: change when done */
+	rdmap_src_op[SEND_SE_INV] = OP_SEND; /* TODO: change when se is done */
 	rdmap_src_op[TERMINATE] = OP_ERR;
 
 	return 0;
@@ -108,7 +152,6 @@ rdmap_fin(void)
 {
 	ddp_fin();
 	iwsk_fin();
-	last_send_sk = last_recv_sk = NULL;
 
 	return 0;
 }
@@ -136,7 +179,22 @@ rdmap_register_sock(socket_t sock, cq_t *scq, cq_t *rcq)
 	for (i=0; i< NUM_Q; i++)
 		INIT_LIST_HEAD(&s.ent->buf_qs[i]);
 	INIT_LIST_HEAD(&s.ent->rwrq);
+	INIT_LIST_HEAD(&s.ent->resp_q);
+	s.ent->rd_issued = 0;
+	s.ent->rd_pending = 0;
+	s.ent->rd_chunk = 0;
+	s.ent->atomic_id = 0;
 	s.ent->sink_msn = 1; /* init msn. FIXME: 1 due to Ammasso */
+	s.ent->rq_size = 0;
+	s.ent->rq = NULL;
+	s.ent->rq_head = 0;
+	s.ent->rq_tail = 0;
+	s.ent->srq = NULL;
+	s.ent->srq_wqe = NULL;
+	s.ent->srq_held = FALSE;
+	s.ent->corked = FALSE;
+	s.ent->held = NULL;
+	s.ent->nheld = s.ent->maxheld = 0;
 
 	return 0;
 }
@@ -144,17 +202,48 @@ rdmap_register_sock(socket_t sock, cq_t *scq, cq_t *rcq)
 int
 rdmap_deregister_sock(socket_t sock)
 {
+	rdmap_rdma_read_req_t *d, *dp;
 	iwsk_t *iwsk = iwsk_lookup(sock);
 	if (!iwsk)
 		return -EINVAL;
 
+	/*
+	 * Out of the poll set first, so no poller holds or waits for its locks
+	 * once we have them; then wait out anyone still posting.
+	 */
 	ddp_deregister_sock(iwsk);
+	lock_take(&iwsk->recv_lock);
+	lock_take(&iwsk->send_lock);
+
+	/* unsent read responses die with the connection */
+	list_for_each_entry_safe(d, dp, &iwsk->rdmapsk.resp_q, list) {
+		list_del(&d->list);
+		free(d);
+	}
+	free(iwsk->rdmapsk.rq);
+	free(iwsk->rdmapsk.held);
+	if (iwsk->rdmapsk.srq) {
+		/* a receive taken for a send that never finished goes back
+		 * to its owner as failed rather than being lost */
+		if (iwsk->rdmapsk.srq_held && iwsk->rcq) {
+			cqe_t cqe;
 
+			cqe.id = iwsk->rdmapsk.srq_wqe->id;
+			cqe.status = RDMAP_FAILURE;
+			cqe.op = OP_RECV;
+			cqe.msg_len = 0;
+			cqe.inv_stag = NULL_STAG;
+			cqe.sk = sock;
+			cq_produce(iwsk->rcq, &cqe);
+		}
+		lock_take(&iwsk->rdmapsk.srq->lock);
+		iwsk->rdmapsk.srq->nsk--;
+		lock_drop(&iwsk->rdmapsk.srq->lock);
+		free(iwsk->rdmapsk.srq_wqe);
+	}
+	lock_drop(&iwsk->send_lock);
+	lock_drop(&iwsk->recv_lock);
 	iwsk_delete(sock);
-	if (last_send_sk == iwsk)
-		last_send_sk = NULL;
-	if (last_recv_sk == iwsk)
-		last_recv_sk = NULL;
 
 	return 0;
 }
@@ -169,19 +258,144 @@ rdmap_mpa_use_markers(socket_t sock, int use)
 	if (!iwsk)
 		return -EINVAL;
 	iwsk->mpask.use_mrkr = use;
-	return 0;
+	return ddp_set_sock_attrs(iwsk);
 }
 
+/*
+ * Whether to ask the peer for crcs; either side asking gets them.  With
+ * RDMAP_CRC_AUTO, they are asked for unless the peer is on this host or
+ * in a subnet given to rdmap_crc_trust.
+ */
 int
 rdmap_mpa_use_crc(socket_t sock, int use)
 {
 	iwsk_t *iwsk = iwsk_lookup(sock);
 	if (!iwsk)
 		return -EINVAL;
-	iwsk->mpask.use_crc = use;
+	iwsk->mpask.crc_auto = (use == RDMAP_CRC_AUTO);
+	iwsk->mpask.use_crc = !!use;
+	return ddp_set_sock_attrs(iwsk);
+}
+
+/*
+ * A subnet, "addr/prefix", whose links are trusted not to corrupt what
+ * TCP checksummed.  Before connecting; rdmap_fin forgets them.
+ */
+int
+rdmap_crc_trust(const char *subnet)
+{
+	return mpa_crc_trust(subnet);
+}
+
+/*
+ * Place incoming FPDUs before their crcs are checked; the message
+ * completes once they all are, in error if any failed, and then the peer
+ * is sent a TERMINATE.  Only for connections without markers.
+ */
+int
+rdmap_mpa_defer_crc(socket_t sock, int defer)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	if (!iwsk)
+		return -EINVAL;
+	iwsk->mpask.defer_crc = defer;
+	return ddp_set_sock_attrs(iwsk);
+}
+
+/*
+ * Outstanding RDMA reads wanted each way, before rdmap_init_startup.  The
+ * peer may lower them; without its support both stay at one.
+ */
+int
+rdmap_set_read_depths(socket_t sock, uint16_t ird, uint16_t ord)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	if (!iwsk)
+		return -EINVAL;
+	if (ird == 0 || ord == 0 || ird > MPA_DEPTH_MASK || ord > MPA_DEPTH_MASK)
+		return -EINVAL;
+	iwsk->mpask.ird = ird;
+	iwsk->mpask.ord = ord;
+	return 0;
+}
+
+/*
+ * Reads longer than chunk go out as several requests of at most chunk
+ * bytes, so that up to ord of them overlap, but complete as one.  Zero
+ * turns this off.
+ */
+int
+rdmap_set_read_chunk(socket_t sock, uint32_t chunk)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	if (!iwsk)
+		return -EINVAL;
+	iwsk->rdmapsk.rd_chunk = chunk;
+	return 0;
+}
+
+/*
+ * Protection domain of sock.  The peer may then use any stag of that PD
+ * as well as those made for sock itself.
+ */
+int
+rdmap_set_prot_domain(socket_t sock, int prot_domain)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	if (!iwsk)
+		return -EINVAL;
+	iwsk->prot_domain = prot_domain;
+	return 0;
+}
+
+/*
+ * Progress shard to run sock in when progress threads are started, taken
+ * modulo their number; -1, the default, hashes.  Before
+ * rdmap_init_startup.
+ */
+int
+rdmap_set_affinity(socket_t sock, int shard)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	if (!iwsk)
+		return -EINVAL;
+	if (shard < -1)
+		return -EINVAL;
+	iwsk->mpask.affinity = shard;
+	return 0;
+}
+
+/*
+ * RFC 7306 extensions wanted, RDMAP_EXT_*, before rdmap_init_startup.
+ * Afterwards rdmap_get_extensions says which ones the peer agreed to.
+ * Immediate data comes with RDMAP_EXT_IMM_LEN, which only a peer of ours
+ * agrees to.
+ */
+int
+rdmap_set_extensions(socket_t sock, int ext)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	if (!iwsk)
+		return -EINVAL;
+	if (ext & ~(RDMAP_EXT_IMM | RDMAP_EXT_ATOMIC | RDMAP_EXT_IMM_LEN))
+		return -EINVAL;
+	if (ext & RDMAP_EXT_IMM)
+		ext |= RDMAP_EXT_IMM_LEN;
+	else
+		ext &= ~RDMAP_EXT_IMM_LEN;
+	iwsk->mpask.ext = ext;
 	return 0;
 }
 
+int
+rdmap_get_extensions(socket_t sock)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	if (!iwsk)
+		return -EINVAL;
+	return iwsk->mpask.ext;
+}
+
 int
 rdmap_set_sock_attrs(socket_t sock, int use_mrkr, int use_crc)
 {
@@ -190,7 +404,7 @@ rdmap_set_sock_attrs(socket_t sock, int use_mrkr, int use_crc)
 		return -EINVAL;
 	iwsk->mpask.use_crc = use_crc;
 	iwsk->mpask.use_mrkr = use_mrkr;
-	return 0;
+	return ddp_set_sock_attrs(iwsk);
 }
 
 int
@@ -204,353 +418,1579 @@ rdmap_init_startup(socket_t sock, bool_t is_initiator, const char *pd_in,
     return ddp_init_startup(iwsk, is_initiator, pd_in, pd_out, rpd_len);
 }
 
-int
-rdmap_send(socket_t sock, const void *msg, uint32_t msg_len, cq_wrid_t id)
+/*
+ * Before iwsk sends anything of its own, finish the read response that is
+ * partly out, so that its segments and ours do not interleave; the end of
+ * an FPDU the socket did not take goes first by itself, in mpa.  Responses
+ * not started yet stay for POLLOUT.  They are ordered only among
+ * themselves, and a send need not wait behind all of them.
+ */
+static int
+rdmap_resp_flush(iwsk_t *iwsk)
+{
+	rdmap_rdma_read_req_t *d;
+	rdmap_control_field_t cf;
+	struct iovec src;
+	int ret;
+
+	if (list_empty(&iwsk->rdmapsk.resp_q))
+		return 0;
+	d = list_entry(iwsk->rdmapsk.resp_q.next, rdmap_rdma_read_req_t, list);
+	if (d->atomic || d->off == 0)
+		return 0;
+
+	cf = 0;
+	rdmap_set_RV(cf);
+	rdmap_set_RSVD(cf);
+	rdmap_set_OPCODE(cf, RDMA_READ_RESP);
+	src.iov_base = d->src;
+	src.iov_len = d->h.rdma_rd_sz;
+	ddp_pipe_begin(iwsk);
+	do {
+		ret = ddp_send_tagged_sgmnt(iwsk, &src, 1, d->h.rdma_rd_sz, cf,
+					    d->h.sink_stag, d->h.sink_to,
+					    &d->off);
+	} while (ret == 0);
+	if (ret < 0) {
+		ddp_pipe_end(iwsk);
+		return ret;
+	}
+	ret = ddp_pipe_end(iwsk);
+	if (ret < 0)
+		return ret;
+	list_del(&d->list);
+	iwsk->rdmapsk.rd_pending--;
+	free(d);
+	if (list_empty(&iwsk->rdmapsk.resp_q))
+		ddp_want_send(iwsk, FALSE);
+	return 0;
+}
+
+static inline uint32_t
+rdmap_iov_len(const struct iovec *iov, int niov)
+{
+	uint32_t len = 0;
+	int i;
+
+	for (i=0; i<niov; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/* the rest of the send side below runs with iwsk->send_lock held */
+
+/* no room for another completion, counting those held for an uncork */
+static inline bool_t
+rdmap_scq_full(iwsk_t *iwsk, int flags)
+{
+	return !(flags & RDMAP_UNSIGNALED) && iwsk->scq
+	       && cq_space(iwsk->scq) <= (int) iwsk->rdmapsk.nheld;
+}
+
+/*
+ * Complete a send queue request.  On a corked socket nothing is written
+ * yet, so the completion waits for rdmap_uncork to know how that went.
+ */
+static void
+rdmap_send_done(iwsk_t *iwsk, const cqe_t *cqe)
+{
+	rdmap_sk_ent_t *r = &iwsk->rdmapsk;
+
+	if (!r->corked) {
+		cq_produce(iwsk->scq, cqe);
+		return;
+	}
+	if (r->nheld == r->maxheld) {
+		r->maxheld = r->maxheld ? 2 * r->maxheld : 16;
+		r->held = Realloc(r->held, r->maxheld * sizeof(*r->held));
+	}
+	r->held[r->nheld++] = *cqe;
+}
+
+static int
+rdmap_send_locked(iwsk_t *iwsk, const struct iovec *iov, int niov, rdmap_t op,
+                  stag_t inv_stag, cq_wrid_t id, int flags)
 {
 	int ret;
 	rdmap_control_field_t cf = 0;
 	cqe_t cqe;
+	uint32_t msg_len;
+	struct iovec copy;
 
 	rdmap_set_RV(cf);
-	rdmap_set_OPCODE(cf, SEND);
+	rdmap_set_OPCODE(cf, op);
 
-	if (!last_send_sk || last_send_sk->sk != sock)
-		last_send_sk = iwsk_lookup(sock);
-	if (!last_send_sk)
+	if (niov < 0 || niov > DDP_MAX_SGE)
 		return -EINVAL;
-	if (last_send_sk->scq && cq_isfull(last_send_sk->scq))
+	msg_len = rdmap_iov_len(iov, niov);
+
+	if (rdmap_scq_full(iwsk, flags))
 		return -ENOSPC;
 
-	debug(3, "%s: sock %d msg %p len %d cf 0x%x", __func__,
-	  last_send_sk->sk, msg, msg_len, cf);
+	debug(3, "%s: sock %d niov %d len %d cf 0x%x", __func__,
+	  iwsk->sk, niov, msg_len, cf);
 
-	ret = ddp_send_untagged(last_send_sk, msg, msg_len, SEND_Q, cf,
-							NULL_STAG);
+	ret = rdmap_resp_flush(iwsk);
+	if (ret < 0)
+		return ret;
+	if (flags & RDMAP_INLINE) {
+		if (msg_len > RDMAP_MAX_INLINE)
+			return -EINVAL;
+		/* only a corked socket holds on to iov past the send */
+		ret = ddp_stage(iwsk, iov, niov, msg_len, &copy);
+		if (ret < 0)
+			return ret;
+		if (ret) {
+			iov = &copy;
+			niov = 1;
+		}
+	}
+	ret = ddp_send_untagged_vec(iwsk, iov, niov, msg_len, SEND_Q,
+				    cf, inv_stag);
 	if (ret < 0)
 		return ret;
 
 	cqe.id = id;
 	cqe.status = RDMAP_SUCCESS;
-	cqe.op = rdmap_src_op[SEND];
+	cqe.op = rdmap_src_op[op];
 	cqe.msg_len = msg_len;
-	if (last_send_sk->scq)
-		cq_produce(last_send_sk->scq, &cqe);
+	cqe.inv_stag = NULL_STAG;
+	cqe.sk = iwsk->sk;
+	if (!(flags & RDMAP_UNSIGNALED) && iwsk->scq)
+		rdmap_send_done(iwsk, &cqe);
 
 	return 0;
 }
 
-int
-rdmap_post_recv(socket_t sock, void *buf, msg_len_t len, cq_wrid_t id)
+static int
+rdmap_send_op(socket_t sock, const struct iovec *iov, int niov, rdmap_t op,
+              stag_t inv_stag, cq_wrid_t id, int flags)
 {
-	/* d is freed in rdmap_untag_recv */
-	rdmap_untag_wrd_t *d = Malloc(sizeof(*d));
+	iwsk_t *iwsk = iwsk_lookup_cached(&send_cache, sock);
+	int ret;
 
-	if (!last_recv_sk || last_recv_sk->sk != sock)
-		last_recv_sk = iwsk_lookup(sock);
-	if (!last_recv_sk)
+	if (!iwsk)
 		return -EINVAL;
-	if(last_recv_sk->rcq && cq_isfull(last_recv_sk->rcq))
-		return -ENOSPC;
+	lock_take(&iwsk->send_lock);
+	ret = rdmap_send_locked(iwsk, iov, niov, op, inv_stag, id, flags);
+	lock_drop(&iwsk->send_lock);
+	return ret;
+}
 
-	d->id = id;
-	d->buf.buf = buf;
-	d->buf.len = len;
+int
+rdmap_send(socket_t sock, const void *msg, uint32_t msg_len, cq_wrid_t id,
+           int flags)
+{
+	struct iovec iov = { (void *)(unsigned long) msg, msg_len };
 
-	/* recv ==> untagged buffer ==> send_q ==> Q num 0/SEND_Q */
-	list_add_tail(&d->list, &last_recv_sk->rdmapsk.buf_qs[SEND_Q]);
+	return rdmap_send_op(sock, &iov, 1, SEND, NULL_STAG, id, flags);
+}
 
-	return 0;
+/*
+ * Send gathered from the niov pieces of iov, at most DDP_MAX_SGE, without
+ * copying them together first.
+ */
+int
+rdmap_send_vec(socket_t sock, const struct iovec *iov, int niov, cq_wrid_t id,
+               int flags)
+{
+	return rdmap_send_op(sock, iov, niov, SEND, NULL_STAG, id, flags);
 }
 
-inline stag_acc_t
-rdmap_get_acc(rdmap_control_field_t cf)
+/*
+ * Send carrying an stag for the peer to invalidate when it is placed,
+ * RDMAP spec 5.1.  The STag rides in the otherwise unused untagged ulp
+ * payload field.
+ */
+int
+rdmap_send_inv(socket_t sock, const void *msg, uint32_t msg_len,
+               stag_t inv_stag, cq_wrid_t id, int flags)
 {
-	return rdmap_acc[rdmap_get_OPCODE(cf)];
+	struct iovec iov = { (void *)(unsigned long) msg, msg_len };
+
+	return rdmap_send_op(sock, &iov, 1, SEND_INV, inv_stag, id, flags);
 }
 
-void
-rdmap_untag_recv(iwsk_t *iwsk, rdmap_control_field_t cf, stag_t stag,
-                 qnum_t qn, msn_t msn __attribute__((unused)), msg_len_t len)
+int
+rdmap_send_inv_vec(socket_t sock, const struct iovec *iov, int niov,
+                   stag_t inv_stag, cq_wrid_t id, int flags)
 {
-	cqe_t cqe;
-	struct list_head *l;
+	return rdmap_send_op(sock, iov, niov, SEND_INV, inv_stag, id, flags);
+}
 
-	/* TODO: Ignore stag for now. It is to be used in SEND_*INV */
-	stag = 0;
+/*
+ * Bind a memory window.  Nothing goes on the wire, but it is a send queue
+ * operation so it completes on the scq in order with the surrounding sends.
+ * Returns the new stag, or negative error.
+ */
+static stag_t
+rdmap_bind_mw_locked(iwsk_t *iwsk, stag_t mw, mem_desc_t md, size_t start,
+                     size_t end, stag_acc_t rw, cq_wrid_t id, int flags)
+{
+	stag_t stag;
+	cqe_t cqe;
 
-	/* ddp rfc Sec. 5.4 rdmap always receives messages in order */
-	iw_assert(iwsk->rdmapsk.sink_msn == msn, "sink_msn (%d), msn (%d)",
-			  iwsk->rdmapsk.sink_msn, msn);
+	if (rdmap_scq_full(iwsk, flags))
+		return -ENOSPC;
 
-	/* dequeue first entry */
-	iw_assert(!list_empty(&iwsk->rdmapsk.buf_qs[qn]), "%s: empty qs %d",
-			  __func__, qn);
-	l = iwsk->rdmapsk.buf_qs[qn].next;
-	list_del(l);
+	stag = mem_mw_bind(mw, md, start, end, rw);
+	if (stag < 0)
+		return stag;
 
-	if (qn == SEND_Q) {
-		rdmap_untag_wrd_t *d = list_entry(l, rdmap_untag_wrd_t, list);
-		if (iwsk->rcq) {
-			cqe.id = d->id;
-			cqe.status = RDMAP_SUCCESS;
-			cqe.op = rdmap_sink_op[rdmap_get_OPCODE(cf)];
-			cqe.msg_len = len;
-			cq_produce(iwsk->rcq, &cqe);
-		}
-		free(d);
+	cqe.id = id;
+	cqe.status = RDMAP_SUCCESS;
+	cqe.op = OP_BIND_MW;
+	cqe.msg_len = 0;
+	cqe.inv_stag = NULL_STAG;
+	cqe.sk = iwsk->sk;
+	if (!(flags & RDMAP_UNSIGNALED) && iwsk->scq)
+		rdmap_send_done(iwsk, &cqe);
+
+	return stag;
+}
 
-	} else if (qn == RDMAREQ_Q) {
-		rdmap_rdma_read_req_t *d =
-			list_entry(l, rdmap_rdma_read_req_t, list);
-		rdmap_rdma_rd_req_hdr_t *h = &d->h;
-		rdmap_control_field_t new_cf;
+stag_t
+rdmap_bind_mw(socket_t sock, stag_t mw, mem_desc_t md, size_t start,
+              size_t end, stag_acc_t rw, cq_wrid_t id, int flags)
+{
+	iwsk_t *iwsk = iwsk_lookup_cached(&send_cache, sock);
+	stag_t stag;
 
-		void *b = mem_stag_location(iwsk, h->src_stag, h->src_to,
-					    h->rdma_rd_sz,
-					    rdmap_acc[rdmap_get_OPCODE(cf)]);
-		/* TODO: Surface this error */
-		if (!b)
-			error("%s:%d b == NULL for rdma_rd_req, stag(%u),"
-			      " to(%Lx), len(%u)", __FILE__, __LINE__,
-			      h->src_stag, Lu(h->src_to), h->rdma_rd_sz);
+	if (!iwsk)
+		return -EINVAL;
+	lock_take(&iwsk->send_lock);
+	stag = rdmap_bind_mw_locked(iwsk, mw, md, start, end, rw, id, flags);
+	lock_drop(&iwsk->send_lock);
+	return stag;
+}
 
-		new_cf = 0;
-		rdmap_set_RV(new_cf);
-		rdmap_set_RSVD(new_cf);
-		rdmap_set_OPCODE(new_cf, RDMA_READ_RESP);
+/*
+ * Double the receive ring, moving the posted entries to their slots
+ * under the new mask.  Posting is constant time apart from this.
+ */
+static void
+rdmap_rq_grow(rdmap_sk_ent_t *r)
+{
+	struct rdmap_recv_wqe *rq;
+	uint32_t n = r->rq_size ? 2 * r->rq_size : RQ_INIT_SIZE;
+	uint32_t m;
+
+	rq = Malloc(n * sizeof(*rq));
+	for (m = r->rq_head; m != r->rq_tail; m++)
+		rq[m & (n - 1)] = r->rq[m & (r->rq_size - 1)];
+	free(r->rq);
+	r->rq = rq;
+	r->rq_size = n;
+}
 
-		ddp_send_tagged(iwsk, b, h->rdma_rd_sz, new_cf, h->sink_stag,
-						h->sink_to);
+/*
+ * Post a receive that scatters the message across the niov pieces of iov,
+ * filling each before the next.
+ */
+int
+rdmap_post_recv_vec(socket_t sock, const struct iovec *iov, int niov,
+		    cq_wrid_t id)
+{
+	iwsk_t *iwsk;
+	rdmap_sk_ent_t *r;
+	struct rdmap_recv_wqe *w;
+	int i;
 
-		free(d);
-	} else if (qn == TERM_Q) {
-	    rdmap_term_msg_container_t *td;
-	    uint32_t control;
+	if (niov < 0 || niov > DDP_MAX_SGE)
+		return -EINVAL;
+	iwsk = iwsk_lookup_cached(&recv_cache, sock);
+	if (!iwsk)
+		return -EINVAL;
+	if(iwsk->rcq && cq_isfull(iwsk->rcq))
+		return -ENOSPC;
 
-	    td = list_entry(l, typeof(*td), list);
-	    control = ntohl(td->m.term_control);
-	    warning("%s: terminate message: layer %d, etype %d\n"
-	      "  ecode %d %s %s %s",
-	      __func__,
-	      rdmap_term_get_layer(control),
-	      rdmap_term_get_etype(control),
-	      rdmap_term_get_ecode(control),
-	      rdmap_term_is_hdrct_m(control) ? "msglen-valid" : "",
-	      rdmap_term_is_hdrct_d(control) ? "ddp-hdr-incl" : "",
-	      rdmap_term_is_hdrct_r(control) ? "rdma-hdr-incl" : "");
-	    /* allocated earlier in placement */
-	    free(td);
+	/* recv ==> untagged buffer ==> send_q ==> Q num 0/SEND_Q */
+	r = &iwsk->rdmapsk;
+	if (r->srq)
+		return -EINVAL;  /* post to the shared queue instead */
+	lock_take(&iwsk->recv_lock);
+	if (r->rq_tail - r->rq_head == r->rq_size)
+		rdmap_rq_grow(r);
+	w = &r->rq[r->rq_tail & (r->rq_size - 1)];
+	w->id = id;
+	w->nsge = niov;
+	w->len = 0;
+	for (i=0; i<niov; i++) {
+		w->sge[i] = iov[i];
+		w->len += iov[i].iov_len;
 	}
+	r->rq_tail++;
+	lock_drop(&iwsk->recv_lock);
 
-	iwsk->rdmapsk.sink_msn++;
+	return 0;
 }
 
-inline void *
-rdmap_get_tag_sink(iwsk_t *s, stag_t stag, tag_offset_t to, size_t len,
-		   rdmap_control_field_t cf)
+int
+rdmap_post_recv(socket_t sock, void *buf, msg_len_t len, cq_wrid_t id)
 {
-	return mem_stag_location(s, stag, to, len,
-	                         rdmap_acc[rdmap_get_OPCODE(cf)]);
+	struct iovec iov = { buf, len };
+
+	return rdmap_post_recv_vec(sock, &iov, 1, id);
 }
 
-/* MSN arithmetic is module 2^32, i.e. unsigned int arith. */
-buf_t *
-rdmap_get_untag_sink(iwsk_t *s, qnum_t qn, msn_t msn)
+/*
+ * Create a shared receive queue holding up to size receives.
+ */
+rdmap_srq_t *
+rdmap_srq_create(uint32_t size, rdmap_srq_limit_fn_t fn, void *arg)
 {
-	if (qn == SEND_Q) {
-		rdmap_untag_wrd_t *d;
-		struct list_head *l, *h;
-		uint32_t diff;
-
-		h = &s->rdmapsk.buf_qs[qn];
-		if (list_empty(h))
-			return NULL;
+	rdmap_srq_t *srq;
+	uint32_t n = 1;
+
+	if (size == 0 || size > (1U << 31))
+		return NULL;
+	while (n < size)
+		n <<= 1;
+	srq = Malloc(sizeof(*srq));
+	srq->rq = Malloc(n * sizeof(*srq->rq));
+	srq->size = n;
+	srq->head = 0;
+	srq->tail = 0;
+	srq->limit = 0;
+	srq->limit_fn = fn;
+	srq->limit_arg = arg;
+	srq->nsk = 0;
+	lock_init(&srq->lock);
+	return srq;
+}
 
-		diff = s->rdmapsk.sink_msn - msn;
-		l = h->next;
-		while (diff > 0) {
-			--diff;
-			l = h->next;
-			if (l == h)
-				return NULL;
+int
+rdmap_srq_destroy(rdmap_srq_t *srq)
+{
+	if (srq->nsk)
+		return -EBUSY;
+	lock_destroy(&srq->lock);
+	free(srq->rq);
+	free(srq);
+	return 0;
+}
+
+int
+rdmap_srq_post_recv_vec(rdmap_srq_t *srq, const struct iovec *iov, int niov,
+			cq_wrid_t id)
+{
+	struct rdmap_recv_wqe *w;
+	int i;
+
+	if (niov < 0 || niov > DDP_MAX_SGE)
+		return -EINVAL;
+	lock_take(&srq->lock);
+	if (srq->tail - srq->head == srq->size) {
+		lock_drop(&srq->lock);
+		return -ENOSPC;
+	}
+	w = &srq->rq[srq->tail & (srq->size - 1)];
+	w->id = id;
+	w->nsge = niov;
+	w->len = 0;
+	for (i=0; i<niov; i++) {
+		w->sge[i] = iov[i];
+		w->len += iov[i].iov_len;
+	}
+	srq->tail++;
+	lock_drop(&srq->lock);
+	return 0;
+}
+
+/*
+ * Ask for one call of the limit function when the posted count drops below
+ * limit; 0 disarms.  Like a hardware SRQ limit event it must be re-armed
+ * after it fires.
+ */
+int
+rdmap_srq_arm(rdmap_srq_t *srq, uint32_t limit)
+{
+	if (limit > srq->size)
+		return -EINVAL;
+	lock_take(&srq->lock);
+	srq->limit = limit;
+	lock_drop(&srq->lock);
+	return 0;
+}
+
+uint32_t
+rdmap_srq_posted(const rdmap_srq_t *srq)
+{
+	return srq->tail - srq->head;
+}
+
+/*
+ * Take receives from srq from now on.  The socket must have none of its
+ * own posted; NULL detaches.
+ */
+int
+rdmap_set_srq(socket_t sock, rdmap_srq_t *srq)
+{
+	iwsk_t *iwsk = iwsk_lookup(sock);
+	rdmap_sk_ent_t *r;
+
+	if (!iwsk)
+		return -EINVAL;
+	r = &iwsk->rdmapsk;
+	lock_take(&iwsk->recv_lock);
+	if (r->rq_tail != r->rq_head || r->srq_held) {
+		lock_drop(&iwsk->recv_lock);
+		return -EBUSY;
+	}
+	if (r->srq) {
+		lock_take(&r->srq->lock);
+		r->srq->nsk--;
+		lock_drop(&r->srq->lock);
+		free(r->srq_wqe);
+		r->srq_wqe = NULL;
+	}
+	r->srq = srq;
+	if (srq) {
+		lock_take(&srq->lock);
+		srq->nsk++;
+		lock_drop(&srq->lock);
+		r->srq_wqe = Malloc(sizeof(*r->srq_wqe));
+	}
+	lock_drop(&iwsk->recv_lock);
+	return 0;
+}
+
+/*
+ * Move the next shared receive into the socket's own slot.  The limit
+ * function runs with the srq locked, it may post to it.
+ */
+static int
+rdmap_srq_take(rdmap_sk_ent_t *r)
+{
+	rdmap_srq_t *srq = r->srq;
+
+	lock_take(&srq->lock);
+	if (srq->head == srq->tail) {
+		lock_drop(&srq->lock);
+		return -ENOENT;
+	}
+	*r->srq_wqe = srq->rq[srq->head++ & (srq->size - 1)];
+	r->srq_held = TRUE;
+	if (srq->limit && srq->tail - srq->head < srq->limit) {
+		srq->limit = 0;
+		if (srq->limit_fn)
+			srq->limit_fn(srq, srq->limit_arg);
+	}
+	lock_drop(&srq->lock);
+	return 0;
+}
+
+inline stag_acc_t
+rdmap_get_acc(rdmap_control_field_t cf)
+{
+	return rdmap_acc[rdmap_get_OPCODE(cf)];
+}
+
+/*
+ * RFC 7306 fetch and add: a bit set in mask ends a field, and the carry
+ * out of it is dropped, so one request can add to several packed counters.
+ */
+static uint64_t
+rdmap_masked_add(uint64_t a, uint64_t b, uint64_t mask)
+{
+	uint64_t sum = 0, bit;
+	int i, n, carry = 0;
+
+	if (mask == 0)
+		return a + b;
+	for (i=0; i<64; i++) {
+		bit = 1ULL << i;
+		n = !!(a & bit) + !!(b & bit) + carry;
+		if (n & 1)
+			sum |= bit;
+		carry = (n > 1) && !(mask & bit);
+	}
+	return sum;
+}
+
+static inline void
+rdmap_put32(uint8_t *p, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void
+rdmap_put64(uint8_t *p, uint64_t v)
+{
+	v = htonq(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t
+rdmap_get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
+}
+
+static inline uint64_t
+rdmap_get64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return ntohq(v);
+}
+
+/* atomic headers to and from the RFC 7306 wire layout */
+static void
+rdmap_atomic_req_pack(uint8_t *w, const rdmap_atomic_req_hdr_t *a)
+{
+	rdmap_put32(w + RDMAP_AREQ_AOP, a->aop & 0xf);
+	rdmap_put32(w + RDMAP_AREQ_REQ_ID, a->req_id);
+	rdmap_put32(w + RDMAP_AREQ_STAG, a->stag);
+	rdmap_put64(w + RDMAP_AREQ_TO, a->to);
+	rdmap_put64(w + RDMAP_AREQ_ADD_SWAP, a->add_swap);
+	rdmap_put64(w + RDMAP_AREQ_ADD_SWAP_MASK, a->add_swap_mask);
+	rdmap_put64(w + RDMAP_AREQ_COMPARE, a->compare);
+	rdmap_put64(w + RDMAP_AREQ_COMPARE_MASK, a->compare_mask);
+}
+
+static void
+rdmap_atomic_req_unpack(rdmap_atomic_req_hdr_t *a, const uint8_t *w)
+{
+	a->aop = rdmap_get32(w + RDMAP_AREQ_AOP) & 0xf;
+	a->req_id = rdmap_get32(w + RDMAP_AREQ_REQ_ID);
+	a->stag = rdmap_get32(w + RDMAP_AREQ_STAG);
+	a->to = rdmap_get64(w + RDMAP_AREQ_TO);
+	a->add_swap = rdmap_get64(w + RDMAP_AREQ_ADD_SWAP);
+	a->add_swap_mask = rdmap_get64(w + RDMAP_AREQ_ADD_SWAP_MASK);
+	a->compare = rdmap_get64(w + RDMAP_AREQ_COMPARE);
+	a->compare_mask = rdmap_get64(w + RDMAP_AREQ_COMPARE_MASK);
+}
+
+static void
+rdmap_atomic_resp_pack(uint8_t *w, const rdmap_atomic_resp_hdr_t *r)
+{
+	rdmap_put32(w + RDMAP_ARESP_REQ_ID, r->req_id);
+	rdmap_put64(w + RDMAP_ARESP_ORIG, r->orig);
+}
+
+static void
+rdmap_atomic_resp_unpack(rdmap_atomic_resp_hdr_t *r, const uint8_t *w)
+{
+	r->req_id = rdmap_get32(w + RDMAP_ARESP_REQ_ID);
+	r->orig = rdmap_get64(w + RDMAP_ARESP_ORIG);
+}
+
+/*
+ * Carry out a peer's atomic on our memory, and put what was there in
+ * *orig.  It is atomic against threads of our own using the same memory
+ * too.  Returns -EOPNOTSUPP for an AOpCode we do not know, -EINVAL for a
+ * misaligned target, or why mem_stag_check refuses the target.
+ */
+static int
+rdmap_atomic_exec(iwsk_t *iwsk, const rdmap_atomic_req_hdr_t *a,
+		  uint64_t *orig)
+{
+	volatile uint64_t *p;
+	uint64_t old, val;
+	int ret;
+
+	if (a->aop != RDMAP_ATOMIC_FETCH_ADD && a->aop != RDMAP_ATOMIC_SWAP
+	    && a->aop != RDMAP_ATOMIC_CMP_SWAP)
+		return -EOPNOTSUPP;
+	if (a->to & (sizeof(*p) - 1))
+		return -EINVAL;
+	p = mem_stag_location(iwsk, a->stag, a->to, sizeof(*p),
+			      rdmap_acc[ATOMIC_REQ]);
+	if (!p) {
+		ret = mem_stag_check(iwsk, a->stag, a->to, sizeof(*p),
+				     rdmap_acc[ATOMIC_REQ]);
+		return ret < 0 ? ret : -ENOENT;
+	}
+
+	do {
+		old = *p;
+		if (a->aop == RDMAP_ATOMIC_FETCH_ADD)
+			val = rdmap_masked_add(old, a->add_swap,
+					       a->add_swap_mask);
+		else if (a->aop == RDMAP_ATOMIC_CMP_SWAP
+			 && ((old ^ a->compare) & a->compare_mask) != 0)
+			break;
+		else
+			val = (old & ~a->add_swap_mask)
+			      | (a->add_swap & a->add_swap_mask);
+	} while (!__sync_bool_compare_and_swap(p, old, val));
+	*orig = old;
+	return 0;
+}
+
+/*
+ * Refuse a peer's read or atomic request, err from rdmap_atomic_exec or
+ * mem_stag_check.  RFC 7306 has the target of an atomic checked as the
+ * source of a read is, RFC 5040 Sec. 7.2, and an AOpCode we do not know
+ * is an unexpected opcode.
+ */
+static void
+rdmap_request_error(iwsk_t *iwsk, int err)
+{
+	switch (err) {
+	case -ENOENT:
+		rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_PROT,
+				   RDMAP_ECODE_INVALID_STAG);
+		break;
+	case -EPERM:
+		rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_PROT,
+				   RDMAP_ECODE_STAG_STREAM);
+		break;
+	case -EACCES:
+		rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_PROT,
+				   RDMAP_ECODE_ACCESS);
+		break;
+	case -ERANGE:
+	case -EINVAL:
+		rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_PROT,
+				   RDMAP_ECODE_BASE_BOUNDS);
+		break;
+	default:
+		rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_OP,
+				   RDMAP_ECODE_OPCODE);
+	}
+}
+
+void
+rdmap_untag_recv(iwsk_t *iwsk, rdmap_control_field_t cf, stag_t stag,
+                 qnum_t qn, msn_t msn __attribute__((unused)), msg_len_t len)
+{
+	cqe_t cqe;
+	struct list_head *l;
+	rdmap_t op = rdmap_get_OPCODE(cf);
+
+	/* ddp rfc Sec. 5.4 rdmap always receives messages in order */
+	iw_assert(iwsk->rdmapsk.sink_msn == msn, "sink_msn (%d), msn (%d)",
+			  iwsk->rdmapsk.sink_msn, msn);
+
+	if (qn == SEND_Q) {
+		rdmap_sk_ent_t *r = &iwsk->rdmapsk;
+		struct rdmap_recv_wqe *d;
+
+		if (r->srq) {
+			iw_assert(r->srq_held, "%s: no shared recv taken",
+				  __func__);
+			d = r->srq_wqe;
+			r->srq_held = FALSE;
+		} else {
+			iw_assert(r->rq_tail != r->rq_head,
+				  "%s: empty recv ring", __func__);
+			d = &r->rq[r->rq_head++ & (r->rq_size - 1)];
 		}
 
-		d = list_entry(l, rdmap_untag_wrd_t, list);
-		return &d->buf;
+		cqe.status = RDMAP_SUCCESS;
+		cqe.inv_stag = NULL_STAG;
+		cqe.msg_len = len;
+		if (iwsk->mpask.crc_bad) {
+			/* placed before its crc was checked, which failed */
+			cqe.status = RDMAP_FAILURE;
+		} else if (op == SEND_INV || op == SEND_SE_INV) {
+			/* data is already placed; a bad stag fails the recv */
+			if (mem_stag_invalidate(iwsk, stag) < 0) {
+				printerr("%s: cannot invalidate stag %d", __func__,
+					 stag);
+				cqe.status = RDMAP_FAILURE;
+			} else
+				cqe.inv_stag = stag;
+		} else if (op == IMMEDIATE || op == IMMEDIATE_SE) {
+			/* RFC 7306 reserves the ulp field, unless agreed */
+			cqe.msg_len = iwsk->mpask.ext & RDMAP_EXT_IMM_LEN
+				      ? stag : 0;
+			cqe.imm = r->imm;
+		}
+		if (iwsk->rcq) {
+			cqe.id = d->id;
+			cqe.op = rdmap_sink_op[op];
+			cqe.sk = iwsk->sk;
+			cq_produce(iwsk->rcq, &cqe);
+		}
+		iwsk->rdmapsk.sink_msn++;
+		return;
+	}
+
+	/* dequeue first entry */
+	iw_assert(!list_empty(&iwsk->rdmapsk.buf_qs[qn]), "%s: empty qs %d",
+			  __func__, qn);
+	l = iwsk->rdmapsk.buf_qs[qn].next;
+	list_del(l);
+
+	if (iwsk->mpask.crc_bad && (qn == RDMAREQ_Q || qn == ATOMIC_REQ_Q)) {
+		/* the request failed its deferred crc check, do not act on it */
+		lock_take(&iwsk->send_lock);
+		iwsk->rdmapsk.rd_pending--;
+		lock_drop(&iwsk->send_lock);
+		free(list_entry(l, rdmap_rdma_read_req_t, list));
+	} else if (qn == RDMAREQ_Q) {
+		rdmap_rdma_read_req_t *d =
+			list_entry(l, rdmap_rdma_read_req_t, list);
+		rdmap_rdma_rd_req_hdr_t *h = &d->h;
+		int ret;
+
+		d->src = mem_stag_location(iwsk, h->src_stag, h->src_to,
+					   h->rdma_rd_sz, rdmap_acc[op]);
+		if (!d->src) {
+			ret = mem_stag_check(iwsk, h->src_stag, h->src_to,
+					     h->rdma_rd_sz, rdmap_acc[op]);
+			printerr("%s: bad rdma read source, stag(%u), to(%Lx),"
+				 " len(%u)", __func__, h->src_stag,
+				 Lu(h->src_to), h->rdma_rd_sz);
+			lock_take(&iwsk->send_lock);
+			iwsk->rdmapsk.rd_pending--;
+			lock_drop(&iwsk->send_lock);
+			free(d);
+			rdmap_request_error(iwsk, ret < 0 ? ret : -ENOENT);
+			iwsk->rdmapsk.sink_msn++;
+			return;
+		}
+
+		/*
+		 * Do not answer from inside the receive path, a big response
+		 * would hold up every other connection.  It goes out from
+		 * rdmap_send_ready as the socket takes it, still counted in
+		 * rd_pending until the last byte is sent.
+		 */
+		d->off = 0;
+		lock_take(&iwsk->send_lock);
+		list_add_tail(&d->list, &iwsk->rdmapsk.resp_q);
+		ddp_want_send(iwsk, TRUE);
+		lock_drop(&iwsk->send_lock);
+	} else if (qn == TERM_Q) {
+	    rdmap_term_msg_container_t *td;
+	    uint32_t control;
+
+	    td = list_entry(l, typeof(*td), list);
+	    control = ntohl(td->m.term_control);
+	    warning("%s: terminate message: layer %d, etype %d\n"
+	      "  ecode %d %s %s %s",
+	      __func__,
+	      rdmap_term_get_layer(control),
+	      rdmap_term_get_etype(control),
+	      rdmap_term_get_ecode(control),
+	      rdmap_term_is_hdrct_m(control) ? "msglen-valid" : "",
+	      rdmap_term_is_hdrct_d(control) ? "ddp-hdr-incl" : "",
+	      rdmap_term_is_hdrct_r(control) ? "rdma-hdr-incl" : "");
+	    /* allocated earlier in placement */
+	    free(td);
+	    /* no more answers are coming */
+	    lock_take(&iwsk->send_lock);
+	    rdmap_rwr_fail(iwsk);
+	    lock_drop(&iwsk->send_lock);
+	} else if (qn == ATOMIC_REQ_Q) {
+		rdmap_rdma_read_req_t *d =
+			list_entry(l, rdmap_rdma_read_req_t, list);
+		rdmap_atomic_req_hdr_t a;
+		rdmap_atomic_resp_hdr_t r;
+		int ret;
+
+		/* done now; only the answer waits its turn with the reads */
+		rdmap_atomic_req_unpack(&a, d->aw);
+		ret = rdmap_atomic_exec(iwsk, &a, &r.orig);
+		lock_take(&iwsk->send_lock);
+		if (ret < 0) {
+			iwsk->rdmapsk.rd_pending--;
+			lock_drop(&iwsk->send_lock);
+			printerr("%s: bad atomic request, aop(%u), stag(%u),"
+				 " to(%Lx): %s", __func__, a.aop, a.stag,
+				 Lu(a.to), strerror(-ret));
+			free(d);
+			rdmap_request_error(iwsk, ret);
+		} else {
+			r.req_id = a.req_id;
+			rdmap_atomic_resp_pack(d->aw, &r);
+			d->off = 0;
+			list_add_tail(&d->list, &iwsk->rdmapsk.resp_q);
+			ddp_want_send(iwsk, TRUE);
+			lock_drop(&iwsk->send_lock);
+		}
+	} else if (qn == ATOMIC_RESP_Q) {
+		rdmap_atomic_resp_container_t *ad;
+		int ret;
+
+		ad = list_entry(l, typeof(*ad), list);
+		lock_take(&iwsk->send_lock);
+		ret = rdmap_reap_atomic(iwsk, ad->r);
+		lock_drop(&iwsk->send_lock);
+		free(ad);
+		if (ret < 0)
+			rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_OP,
+					   RDMAP_ECODE_OPCODE);
+	}
+
+	iwsk->rdmapsk.sink_msn++;
+}
+
+inline void *
+rdmap_get_tag_sink(iwsk_t *s, stag_t stag, tag_offset_t to, size_t len,
+		   rdmap_control_field_t cf)
+{
+	return mem_stag_location(s, stag, to, len,
+	                         rdmap_acc[rdmap_get_OPCODE(cf)]);
+}
+
+/*
+ * The buffer for untagged message msn on queue qn, as *niov pieces that
+ * hold *len bytes.  MSN arithmetic is module 2^32, i.e. unsigned int arith.
+ */
+const struct iovec *
+rdmap_get_untag_sink(iwsk_t *s, qnum_t qn, msn_t msn, rdmap_control_field_t cf,
+		     int *niov, size_t *len)
+{
+	rdmap_t op = rdmap_get_OPCODE(cf);
+
+	if (qn == SEND_Q) {
+		rdmap_sk_ent_t *r = &s->rdmapsk;
+		struct rdmap_recv_wqe *w;
+		bool_t imm = (op == IMMEDIATE || op == IMMEDIATE_SE);
+
+		if (msn != r->sink_msn)
+			return NULL;
+		if (imm && !(s->mpask.ext & RDMAP_EXT_IMM)) {
+			printerr("%s: immediate data not agreed on", __func__);
+			return NULL;
+		}
+		if (r->srq) {
+			if (!r->srq_held && rdmap_srq_take(r) < 0)
+				return NULL;
+			w = r->srq_wqe;
+		} else {
+			if (r->rq_head == r->rq_tail)
+				return NULL;
+			w = &r->rq[r->rq_head & (r->rq_size - 1)];
+		}
+		if (imm) {
+			/* the receive is used up, but imm goes in its cqe */
+			r->imm_sink.iov_base = &r->imm;
+			r->imm_sink.iov_len = sizeof(r->imm);
+			*niov = 1;
+			*len = sizeof(r->imm);
+			return &r->imm_sink;
+		}
+		*niov = w->nsge;
+		*len = w->len;
+		return w->sge;
 
 	} else if (qn == RDMAREQ_Q) {
 		rdmap_rdma_read_req_t *d;
-		iw_assert(list_empty(&s->rdmapsk.buf_qs[qn]),
-			  "%s: expected empty list for RDMAREQ_Q", __func__);
+
+		/* the peer agreed to keep no more than ird in flight */
+		lock_take(&s->send_lock);
+		if (s->rdmapsk.rd_pending >= s->mpask.ird) {
+			lock_drop(&s->send_lock);
+			printerr("%s: rdma read request beyond ird %d",
+				 __func__, s->mpask.ird);
+			rdmap_remote_error(s, RDMAP_ETYPE_REMOTE_OP,
+					   RDMAP_ECODE_CATASTROPHIC_STREAM);
+			return NULL;
+		}
+		s->rdmapsk.rd_pending++;
+		lock_drop(&s->send_lock);
 		/*
 		 * Auto-generate an entry to hold the incoming RDMA read
 		 * request; freed in rdmap_untag_recv.
 		 */
 		d = Malloc(sizeof(*d));
-		d->buf.buf = &d->h;
-		d->buf.len = sizeof(d->h);
+		d->atomic = FALSE;
+		d->buf.iov_base = &d->h;
+		d->buf.iov_len = sizeof(d->h);
 		memset(&d->h, 0, sizeof(d->h));
 		list_add_tail(&d->list, &s->rdmapsk.buf_qs[qn]);
+		*niov = 1;
+		*len = d->buf.iov_len;
 		return &d->buf;
 	} else if (qn == TERM_Q) {
 		rdmap_term_msg_container_t *td;
 		td = Malloc(sizeof(*td));
-		td->buf.buf = &td->m;
-		td->buf.len = sizeof(td->m);
+		td->buf.iov_base = &td->m;
+		td->buf.iov_len = sizeof(td->m);
 		list_add_tail(&td->list, &s->rdmapsk.buf_qs[qn]);
+		*niov = 1;
+		*len = td->buf.iov_len;
 		return &td->buf;
+	} else if (qn == ATOMIC_REQ_Q) {
+		rdmap_rdma_read_req_t *d;
+
+		if (!(s->mpask.ext & RDMAP_EXT_ATOMIC)) {
+			printerr("%s: atomics not agreed on", __func__);
+			return NULL;
+		}
+		/* atomics are held against ird along with reads */
+		lock_take(&s->send_lock);
+		if (s->rdmapsk.rd_pending >= s->mpask.ird) {
+			lock_drop(&s->send_lock);
+			printerr("%s: atomic request beyond ird %d",
+				 __func__, s->mpask.ird);
+			rdmap_remote_error(s, RDMAP_ETYPE_REMOTE_OP,
+					   RDMAP_ECODE_CATASTROPHIC_STREAM);
+			return NULL;
+		}
+		s->rdmapsk.rd_pending++;
+		lock_drop(&s->send_lock);
+		d = Malloc(sizeof(*d));
+		d->atomic = TRUE;
+		d->buf.iov_base = d->aw;
+		d->buf.iov_len = sizeof(d->aw);
+		memset(d->aw, 0, sizeof(d->aw));
+		list_add_tail(&d->list, &s->rdmapsk.buf_qs[qn]);
+		*niov = 1;
+		*len = d->buf.iov_len;
+		return &d->buf;
+	} else if (qn == ATOMIC_RESP_Q) {
+		rdmap_atomic_resp_container_t *ad;
+
+		ad = Malloc(sizeof(*ad));
+		ad->buf.iov_base = ad->r;
+		ad->buf.iov_len = sizeof(ad->r);
+		memset(ad->r, 0, sizeof(ad->r));
+		list_add_tail(&ad->list, &s->rdmapsk.buf_qs[qn]);
+		*niov = 1;
+		*len = ad->buf.iov_len;
+		return &ad->buf;
 	}
 	return NULL;
 }
 
-/* rdma write */
-int
-rdmap_rdma_write(socket_t sock, stag_t stag, tag_offset_t to, const void *msg,
-		 uint32_t msg_len, cq_wrid_t id)
+/*
+ * RDMA write, gathered from the niov pieces of iov.  With immediate data,
+ * RFC 7306, an Immediate Data message follows the write on the send queue.
+ * It carries imm, and with RDMAP_EXT_IMM_LEN the length written in the ulp
+ * field where a send puts the stag to invalidate, else 0 as the RFC has
+ * it; it consumes a receive at the peer, which thus completes only after
+ * the data is placed.
+ */
+static int
+rdmap_write_locked(iwsk_t *iwsk, stag_t stag, tag_offset_t to,
+		   const struct iovec *iov, int niov, bool_t with_imm,
+		   uint64_t imm, cq_wrid_t id, int flags)
 {
 	int ret;
 	rdmap_control_field_t cf = 0;
 	cqe_t cqe;
+	uint32_t msg_len;
+	struct iovec immv = { &imm, sizeof(imm) }, copy;
 
 	rdmap_set_RV(cf);
 	rdmap_set_OPCODE(cf, RDMA_WRITE);
 
-	if (!last_send_sk || last_send_sk->sk != sock)
-		last_send_sk = iwsk_lookup(sock);
-	if (!last_send_sk)
+	if (niov < 0 || niov > DDP_MAX_SGE)
 		return -EINVAL;
-	if (last_send_sk->scq && cq_isfull(last_send_sk->scq))
+	msg_len = rdmap_iov_len(iov, niov);
+
+	if (rdmap_scq_full(iwsk, flags))
 		return -ENOSPC;
 
-	debug(3, "%s: sock %d msg %p len %d cf 0x%x", __func__,
-	  last_send_sk->sk, msg, msg_len, cf);
+	if (with_imm && !(iwsk->mpask.ext & RDMAP_EXT_IMM))
+		return -EOPNOTSUPP;
+
+	debug(3, "%s: sock %d niov %d len %d cf 0x%x", __func__,
+	  iwsk->sk, niov, msg_len, cf);
 
-	ret = ddp_send_tagged(last_send_sk, msg, msg_len, cf, stag, to);
+	ret = rdmap_resp_flush(iwsk);
 	if (ret < 0)
 		return ret;
+	if (!with_imm || msg_len) {
+		ret = ddp_send_tagged_vec(iwsk, iov, niov, msg_len, cf,
+					  stag, to);
+		if (ret < 0)
+			return ret;
+	}
+	if (with_imm) {
+		/* imm is on our stack, a corked socket needs a copy */
+		ret = ddp_stage(iwsk, &immv, 1, sizeof(imm), &copy);
+		if (ret < 0)
+			return ret;
+		if (ret)
+			immv = copy;
+		cf = 0;
+		rdmap_set_RV(cf);
+		rdmap_set_OPCODE(cf, IMMEDIATE);
+		ret = ddp_send_untagged_vec(iwsk, &immv, 1, sizeof(imm),
+					    SEND_Q, cf,
+					    iwsk->mpask.ext & RDMAP_EXT_IMM_LEN
+					    ? msg_len : 0);
+		if (ret < 0)
+			return ret;
+	}
 
 	cqe.id = id;
 	cqe.status = RDMAP_SUCCESS;
-	cqe.op = rdmap_src_op[RDMA_WRITE];
+	cqe.op = OP_RDMA_WRITE;
 	cqe.msg_len = msg_len;
-	if (last_send_sk->scq)
-		cq_produce(last_send_sk->scq, &cqe);
+	cqe.inv_stag = NULL_STAG;
+	cqe.sk = iwsk->sk;
+	if (!(flags & RDMAP_UNSIGNALED) && iwsk->scq)
+		rdmap_send_done(iwsk, &cqe);
 
 	return 0;
 }
 
+static int
+rdmap_write_op(socket_t sock, stag_t stag, tag_offset_t to,
+	       const struct iovec *iov, int niov, bool_t with_imm,
+	       uint64_t imm, cq_wrid_t id, int flags)
+{
+	iwsk_t *iwsk = iwsk_lookup_cached(&send_cache, sock);
+	int ret;
+
+	if (!iwsk)
+		return -EINVAL;
+	lock_take(&iwsk->send_lock);
+	ret = rdmap_write_locked(iwsk, stag, to, iov, niov, with_imm, imm, id,
+				 flags);
+	lock_drop(&iwsk->send_lock);
+	return ret;
+}
+
+/* rdma write, gathered from the niov pieces of iov */
+int
+rdmap_rdma_write_vec(socket_t sock, stag_t stag, tag_offset_t to,
+		     const struct iovec *iov, int niov, cq_wrid_t id,
+		     int flags)
+{
+	return rdmap_write_op(sock, stag, to, iov, niov, FALSE, 0, id, flags);
+}
+
+int
+rdmap_rdma_write(socket_t sock, stag_t stag, tag_offset_t to, const void *msg,
+		 uint32_t msg_len, cq_wrid_t id, int flags)
+{
+	struct iovec iov = { (void *)(unsigned long) msg, msg_len };
+
+	return rdmap_write_op(sock, stag, to, &iov, 1, FALSE, 0, id, flags);
+}
+
+int
+rdmap_rdma_write_imm_vec(socket_t sock, stag_t stag, tag_offset_t to,
+			 const struct iovec *iov, int niov, uint64_t imm,
+			 cq_wrid_t id, int flags)
+{
+	return rdmap_write_op(sock, stag, to, iov, niov, TRUE, imm, id, flags);
+}
+
+int
+rdmap_rdma_write_imm(socket_t sock, stag_t stag, tag_offset_t to,
+		     const void *msg, uint32_t msg_len, uint64_t imm,
+		     cq_wrid_t id, int flags)
+{
+	struct iovec iov = { (void *)(unsigned long) msg, msg_len };
+
+	return rdmap_write_op(sock, stag, to, &iov, 1, TRUE, imm, id, flags);
+}
+
+/*
+ * The socket can take more: send a few more segments of the queued read
+ * responses, and atomic responses, in the order the requests came.  A
+ * burst at a time keeps any one connection from monopolizing the poll
+ * loop, and it stops early rather than block once the socket is full.
+ */
+int
+rdmap_send_ready(iwsk_t *iwsk)
+{
+	rdmap_rdma_read_req_t *d;
+	rdmap_control_field_t cf, acf;
+	struct iovec src;
+	int i, ret;
+
+	cf = 0;
+	rdmap_set_RV(cf);
+	rdmap_set_RSVD(cf);
+	rdmap_set_OPCODE(cf, RDMA_READ_RESP);
+	acf = 0;
+	rdmap_set_RV(acf);
+	rdmap_set_RSVD(acf);
+	rdmap_set_OPCODE(acf, ATOMIC_RESP);
+
+	for (i=0; i < RESP_BURST && !list_empty(&iwsk->rdmapsk.resp_q); i++) {
+		ret = ddp_pipe_full(iwsk);
+		if (ret > 0)
+			break;  /* the rest at the next POLLOUT */
+		if (ret < 0) {
+			ddp_pipe_yield(iwsk);
+			return ret;
+		}
+		d = list_entry(iwsk->rdmapsk.resp_q.next, rdmap_rdma_read_req_t,
+			       list);
+		if (d->atomic) {
+			/*
+			 * Written whole, its payload is freed below; not
+			 * while read data before it waits for the socket.
+			 */
+			ret = ddp_pipe_yield(iwsk);
+			if (ret > 0)
+				break;
+			if (ret == 0)
+				ret = ddp_send_untagged(iwsk, d->aw,
+							RDMAP_ARESP_SZ,
+							ATOMIC_RESP_Q, acf,
+							NULL_STAG);
+			if (ret == 0)
+				ret = 1;
+		} else {
+			/* a burst of read data is pipelined, it stays put */
+			ddp_pipe_begin(iwsk);
+			src.iov_base = d->src;
+			src.iov_len = d->h.rdma_rd_sz;
+			ret = ddp_send_tagged_sgmnt(iwsk, &src, 1,
+						    d->h.rdma_rd_sz, cf,
+						    d->h.sink_stag,
+						    d->h.sink_to, &d->off);
+		}
+		if (ret < 0) {
+			ddp_pipe_yield(iwsk);
+			return ret;
+		}
+		if (ret) {
+			list_del(&d->list);
+			iwsk->rdmapsk.rd_pending--;
+			free(d);
+		}
+	}
+	ret = ddp_pipe_yield(iwsk);
+	if (ret < 0)
+		return ret;
+	if (ret == 0 && list_empty(&iwsk->rdmapsk.resp_q))
+		ddp_want_send(iwsk, FALSE);
+	return 0;
+}
+
+/*
+ * Hold the requests posted on sock until rdmap_uncork and send them in as
+ * few writes as possible.  Their completions wait for the uncork too, and
+ * are errors if a write failed; buffers must not be reused before it.  The
+ * calling thread keeps the send side to itself until then, so the batch
+ * goes out whole and in order.
+ */
+int
+rdmap_cork(socket_t sock)
+{
+	iwsk_t *iwsk = iwsk_lookup_cached(&send_cache, sock);
+	int ret;
+
+	if (!iwsk)
+		return -EINVAL;
+	lock_take(&iwsk->send_lock);
+	ret = ddp_cork(iwsk);
+	if (ret < 0)
+		lock_drop(&iwsk->send_lock);
+	else
+		iwsk->rdmapsk.corked = TRUE;
+	return ret;
+}
+
+int
+rdmap_uncork(socket_t sock)
+{
+	iwsk_t *iwsk = iwsk_lookup_cached(&send_cache, sock);
+	rdmap_sk_ent_t *r;
+	uint32_t i;
+	int ret;
+
+	if (!iwsk)
+		return -EINVAL;
+	r = &iwsk->rdmapsk;
+	ret = ddp_uncork(iwsk);
+	for (i=0; i<r->nheld; i++) {
+		if (ret < 0)
+			r->held[i].status = RDMAP_FAILURE;
+		cq_produce(iwsk->scq, &r->held[i]);
+	}
+	r->nheld = 0;
+	r->corked = FALSE;
+	lock_drop(&iwsk->send_lock);
+	return ret;
+}
+
 /* recv for tagged messages */
 void
 rdmap_tag_recv(iwsk_t *iwsk, rdmap_control_field_t cf, stag_t stag,
                msg_len_t len)
 {
+	int ret;
+
 	if (rdmap_get_OPCODE(cf) == RDMA_WRITE) {
 		/* TODO: handle rdma write */
 	}
 	else if (rdmap_get_OPCODE(cf) == RDMA_READ_RESP) {
-		if (list_empty(&iwsk->rdmapsk.rwrq))
-			error("%s:%d rwrq is empty", __FILE__, __LINE__);
-		rdmap_reap_rwr(iwsk, cf, stag, len);
+		lock_take(&iwsk->send_lock);
+		ret = rdmap_reap_rwr(iwsk, stag, len);
+		lock_drop(&iwsk->send_lock);
+		if (ret < 0)
+			rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_OP,
+					   RDMAP_ECODE_OPCODE);
 	} else {
-		/* TODO: Surface this error */
-		error("%s:%d Invalid opcode (%d) for tagged msg",
-			  __FILE__, __LINE__, rdmap_get_OPCODE(cf));
+		printerr("%s: invalid opcode (%d) for tagged msg", __func__,
+			 rdmap_get_OPCODE(cf));
+		rdmap_remote_error(iwsk, RDMAP_ETYPE_REMOTE_OP,
+				   RDMAP_ECODE_OPCODE);
 	}
 }
 
 /*
- * RDMA read requests may be satisfied by the remote peer in any order, but
- * we must "complete" them to the local user in the order they were
- * submitted.  Hence the different behavior depending on if it was the first
- * on the list or not.
+ * Put a read or atomic request on the wire.
  */
-static void
-rdmap_reap_rwr(iwsk_t *iwsk, rdmap_control_field_t cf, stag_t stag,
-               msg_len_t len)
+static int
+rdmap_issue_rwr(iwsk_t *iwsk, rdmap_tag_wrd_t *d)
 {
+	rdmap_control_field_t cf;
 
-	rdmap_tag_wrd_t *d, *dp;
+	cf = 0;
+	rdmap_set_RV(cf);
+	rdmap_set_RSVD(cf);
+	rdmap_set_OPCODE(cf, d->atomic ? ATOMIC_REQ : RDMA_READ_REQ);
+
+	d->issued = TRUE;
+	iwsk->rdmapsk.rd_issued++;
+	if (d->atomic)
+		return ddp_send_untagged(iwsk, d->a, sizeof(d->a),
+					 ATOMIC_REQ_Q, cf, NULL_STAG);
+	return ddp_send_untagged(iwsk, &d->h, sizeof(d->h), RDMAREQ_Q, cf,
+				 NULL_STAG);
+}
+
+static void rdmap_rwr_done(iwsk_t *iwsk);
+
+/*
+ * The peer answers RDMA read requests in the order they went out.  Up to
+ * ord requests are on the wire at once; the rest wait on rwrq behind them
+ * and are issued here as responses free up room.  Completions go to the
+ * local user in submission order either way.
+ */
+static int
+rdmap_reap_rwr(iwsk_t *iwsk, stag_t stag, msg_len_t len)
+{
+	rdmap_tag_wrd_t *d;
 	int found = 0;
 	/* find the just completed entry, mark it complete and update len */
 	list_for_each_entry(d, &iwsk->rdmapsk.rwrq, list) {
-		if (d->stag == stag) {
+		if (!d->atomic && d->issued && d->wr_status == RDMAP_WR_PENDING
+		    && d->stag == stag) {
 			found = 1;
 			d->wr_status = RDMAP_WR_COMPLETE;
-			d->len = len;
+			d->len += len;
+			iwsk->rdmapsk.rd_issued--;
+			break;
+		}
+	}
+
+	if (!found) {
+		printerr("%s: no rdma read outstanding for stag %d",
+			 __func__, stag);
+		rdmap_rwr_fail(iwsk);
+		return -ENOENT;
+	}
+	rdmap_rwr_done(iwsk);
+	return 0;
+}
+
+/*
+ * Atomics share rwrq and ord with reads, and are answered in order too.
+ * The response is w as it came off the wire.
+ */
+static int
+rdmap_reap_atomic(iwsk_t *iwsk, const uint8_t *w)
+{
+	rdmap_atomic_resp_hdr_t r;
+	rdmap_tag_wrd_t *d;
+	int found = 0;
+
+	rdmap_atomic_resp_unpack(&r, w);
+	list_for_each_entry(d, &iwsk->rdmapsk.rwrq, list) {
+		if (d->atomic && d->issued && d->wr_status == RDMAP_WR_PENDING) {
+			found = (rdmap_get32(d->a + RDMAP_AREQ_REQ_ID)
+				 == r.req_id);
+			break;
 		}
 	}
+	if (!found) {
+		printerr("%s: no atomic request %u outstanding", __func__,
+			 r.req_id);
+		rdmap_rwr_fail(iwsk);
+		return -ENOENT;
+	}
+	*d->orig = r.orig;
+	d->len = sizeof(*d->orig);
+	d->wr_status = RDMAP_WR_COMPLETE;
+	iwsk->rdmapsk.rd_issued--;
+	rdmap_rwr_done(iwsk);
+	return 0;
+}
+
+/*
+ * The stream is done for: the reads and atomics still out, or waiting for
+ * ord, complete in error.
+ */
+static void
+rdmap_rwr_fail(iwsk_t *iwsk)
+{
+	rdmap_tag_wrd_t *d;
+
+	list_for_each_entry(d, &iwsk->rdmapsk.rwrq, list) {
+		if (d->wr_status != RDMAP_WR_PENDING)
+			continue;
+		if (d->issued)
+			iwsk->rdmapsk.rd_issued--;
+		d->issued = TRUE;  /* never to go out now */
+		d->wr_status = RDMAP_WR_FAILED;
+	}
+	rdmap_rwr_done(iwsk);
+}
 
-	if (!found)
-		error("%s: no matching recv work request entry for stag %d",
-		      __func__, stag);
+static void
+rdmap_rwr_done(iwsk_t *iwsk)
+{
+	rdmap_tag_wrd_t *d, *dp;
 
 	/*
 	 * Try to generate completion queue entries for any that are
 	 * finished, but they must complete in order.
 	 */
 	list_for_each_entry_safe(d, dp, &iwsk->rdmapsk.rwrq, list) {
-		if (d->wr_status != RDMAP_WR_COMPLETE)
+		if (d->wr_status == RDMAP_WR_PENDING)
 			break;
 
-		if (iwsk->rcq) {
+		if (d->part) {
+			/* the rest of its read follows; carry the length */
+			dp->len += d->len;
+		} else if (!d->unsignaled && iwsk->rcq) {
 			cqe_t cqe;
-			cqe.op = rdmap_sink_op[rdmap_get_OPCODE(cf)];
-			cqe.status = RDMAP_SUCCESS;
+			cqe.op = d->atomic ? OP_ATOMIC : OP_RDMA_READ;
+			cqe.status = (iwsk->mpask.crc_bad
+				      || d->wr_status == RDMAP_WR_FAILED)
+				     ? RDMAP_FAILURE : RDMAP_SUCCESS;
 			cqe.id = d->id;
 			cqe.msg_len = d->len;
+			cqe.inv_stag = NULL_STAG;
+			cqe.sk = iwsk->sk;
 			cq_produce(iwsk->scq, &cqe); /* XXX: RDMA Read CQE on SCQ */
 		}
 		list_del(&d->list);
 		free(d);
 	}
+
+	/* refill the pipeline; if the stream broke, fail what is left */
+	list_for_each_entry(d, &iwsk->rdmapsk.rwrq, list) {
+		if (iwsk->rdmapsk.rd_issued >= iwsk->mpask.ord)
+			break;
+		if (!d->issued && rdmap_issue_rwr(iwsk, d) < 0) {
+			rdmap_rwr_fail(iwsk);
+			return;
+		}
+	}
 }
 
 /*
  * Issue an RDMA read request.  Add an entry to the list of outstanding
- * requests to be completed eventually by rdmap_reap_rwr().
+ * requests to be completed eventually by rdmap_reap_rwr().  With ord
+ * requests already out, it only waits on the list and goes out from there.
+ * A read longer than rd_chunk is queued as one entry per chunk.
  */
+static int
+rdmap_read_locked(iwsk_t *iwsk, stag_t sink_stag, tag_offset_t sink_to,
+		  msg_len_t rdma_rd_sz, stag_t src_stag, tag_offset_t src_to,
+		  cq_wrid_t id, int flags)
+{
+	int ret;
+	rdmap_tag_wrd_t *d, *first = NULL;
+	msg_len_t off = 0, len;
+	uint32_t chunk;
+
+	if (rdmap_scq_full(iwsk, flags))
+		return -ENOSPC;
+
+	chunk = iwsk->rdmapsk.rd_chunk;
+	if (chunk == 0 || chunk > rdma_rd_sz)
+		chunk = rdma_rd_sz;
+
+	do {
+		len = rdma_rd_sz - off < chunk ? rdma_rd_sz - off : chunk;
+		d = Malloc(sizeof(*d));
+		d->id = id;
+		d->stag = sink_stag;
+		d->wr_status = RDMAP_WR_PENDING;
+		d->len = 0;
+		d->issued = FALSE;
+		d->part = (off + len < rdma_rd_sz);
+		d->unsignaled = !!(flags & RDMAP_UNSIGNALED);
+		d->atomic = FALSE;
+		memset(&d->h, 0, sizeof(d->h));
+		d->h.sink_stag = sink_stag;
+		d->h.sink_to = sink_to + off;
+		d->h.rdma_rd_sz = len;
+		d->h.src_stag = src_stag;
+		d->h.src_to = src_to + off;
+		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+		if (!first)
+			first = d;
+		off += len;
+	} while (off < rdma_rd_sz);
+
+	/* issue what ord allows now, the rest as responses come back */
+	for (d = first; &d->list != &iwsk->rdmapsk.rwrq;
+	     d = list_entry(d->list.next, rdmap_tag_wrd_t, list)) {
+		if (iwsk->rdmapsk.rd_issued >= iwsk->mpask.ord)
+			break;
+		ret = rdmap_issue_rwr(iwsk, d);
+		if (ret < 0 && d != first) {
+			/*
+			 * Part of it is out but the stream is broken: it
+			 * completes in error, with whatever else is out.
+			 */
+			rdmap_rwr_fail(iwsk);
+			return 0;
+		}
+		if (ret < 0) {
+			/* nothing of this read is out, take it all back */
+			iwsk->rdmapsk.rd_issued--;
+			while (&first->list != &iwsk->rdmapsk.rwrq) {
+				d = first;
+				first = list_entry(d->list.next,
+						   rdmap_tag_wrd_t, list);
+				list_del(&d->list);
+				free(d);
+			}
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
 int
 rdmap_rdma_read(socket_t sk, stag_t sink_stag, tag_offset_t sink_to,
 		msg_len_t rdma_rd_sz, stag_t src_stag, tag_offset_t src_to,
-		cq_wrid_t id)
+		cq_wrid_t id, int flags)
 {
+	iwsk_t *iwsk = iwsk_lookup_cached(&send_cache, sk);
 	int ret;
-	rdmap_rdma_rd_req_hdr_t h;
-	rdmap_control_field_t cf;
-	rdmap_tag_wrd_t *d;
 
-	memset(&h, 0, sizeof(rdmap_rdma_rd_req_hdr_t));
-	h.sink_stag = sink_stag;
-	h.sink_to = sink_to;
-	h.rdma_rd_sz = rdma_rd_sz;
-	h.src_stag = src_stag;
-	h.src_to = src_to;
+	if (!iwsk)
+		return -EINVAL;
+	lock_take(&iwsk->send_lock);
+	ret = rdmap_read_locked(iwsk, sink_stag, sink_to, rdma_rd_sz, src_stag,
+				src_to, id, flags);
+	lock_drop(&iwsk->send_lock);
+	return ret;
+}
 
-	cf = 0;
-	rdmap_set_RV(cf);
-	rdmap_set_RSVD(cf);
-	rdmap_set_OPCODE(cf, RDMA_READ_REQ);
+/*
+ * Fetch and add, swap, or compare and swap, on the 8 aligned bytes at to
+ * in the peer's memory, RFC 7306.  *orig gets what was there before, and must
+ * stay valid until the completion.  Atomics count against ord with reads,
+ * and complete in order with them.
+ */
+static int
+rdmap_atomic_locked(iwsk_t *iwsk, int aop, stag_t stag, tag_offset_t to,
+		    uint64_t add_swap, uint64_t compare, uint64_t *orig,
+		    cq_wrid_t id, int flags)
+{
+	rdmap_atomic_req_hdr_t a;
+	rdmap_tag_wrd_t *d;
+	int ret;
 
-	if (!last_send_sk || last_send_sk->sk != sk)
-		last_send_sk = iwsk_lookup(sk);
-	if (!last_send_sk)
-		return -EINVAL;
-	if (last_send_sk->scq && cq_isfull(last_send_sk->scq))
+	if (!(iwsk->mpask.ext & RDMAP_EXT_ATOMIC))
+		return -EOPNOTSUPP;
+	if (rdmap_scq_full(iwsk, flags))
 		return -ENOSPC;
 
 	d = Malloc(sizeof(*d));
 	d->id = id;
-	d->stag = sink_stag;
+	d->stag = NULL_STAG;
 	d->wr_status = RDMAP_WR_PENDING;
 	d->len = 0;
-	list_add_tail(&d->list, &last_send_sk->rdmapsk.rwrq);
+	d->issued = FALSE;
+	d->part = FALSE;
+	d->unsignaled = !!(flags & RDMAP_UNSIGNALED);
+	d->atomic = TRUE;
+	d->orig = orig;
+	memset(&a, 0, sizeof(a));
+	a.aop = aop;
+	a.req_id = iwsk->rdmapsk.atomic_id++;
+	a.stag = stag;
+	a.to = to;
+	a.add_swap = add_swap;
+	a.compare = compare;
+	if (aop != RDMAP_ATOMIC_FETCH_ADD)
+		a.add_swap_mask = ~0ULL;
+	if (aop == RDMAP_ATOMIC_CMP_SWAP)
+		a.compare_mask = ~0ULL;
+	rdmap_atomic_req_pack(d->a, &a);
+	list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+
+	if (iwsk->rdmapsk.rd_issued < iwsk->mpask.ord) {
+		ret = rdmap_issue_rwr(iwsk, d);
+		if (ret < 0) {
+			iwsk->rdmapsk.rd_issued--;
+			list_del(&d->list);
+			free(d);
+			return ret;
+		}
+	}
+	return 0;
+}
 
-	ret = ddp_send_untagged(last_send_sk, &h, sizeof(h), RDMAREQ_Q, cf,
-							NULL_STAG);
-	if (ret < 0)
-		return ret;
+int
+rdmap_atomic(socket_t sock, int aop, stag_t stag, tag_offset_t to,
+	     uint64_t add_swap, uint64_t compare, uint64_t *orig,
+	     cq_wrid_t id, int flags)
+{
+	iwsk_t *iwsk;
+	int ret;
 
-	return 0;
+	if (aop != RDMAP_ATOMIC_FETCH_ADD && aop != RDMAP_ATOMIC_SWAP
+	    && aop != RDMAP_ATOMIC_CMP_SWAP)
+		return -EINVAL;
+	if (to & (sizeof(*orig) - 1))
+		return -EINVAL;
+	iwsk = iwsk_lookup_cached(&send_cache, sock);
+	if (!iwsk)
+		return -EINVAL;
+	lock_take(&iwsk->send_lock);
+	ret = rdmap_atomic_locked(iwsk, aop, stag, to, add_swap, compare, orig,
+				  id, flags);
+	lock_drop(&iwsk->send_lock);
+	return ret;
 }
 
+/*
+ * Tell the peer this end is giving up on the stream, RFC 5040 Sec. 7.
+ * Nothing more is read from it; the connection waits for the application
+ * to disconnect it.
+ */
+void
+rdmap_terminate(iwsk_t *iwsk, uint32_t control)
+{
+	rdmap_term_msg_t m;
+	rdmap_control_field_t cf;
+	int ret;
+
+	memset(&m, 0, sizeof(m));
+	m.term_control = htonl(control);
+	cf = 0;
+	rdmap_set_RV(cf);
+	rdmap_set_RSVD(cf);
+	rdmap_set_OPCODE(cf, TERMINATE);
+	lock_take(&iwsk->send_lock);
+	ret = ddp_send_untagged(iwsk, &m, sizeof(m), TERM_Q, cf, NULL_STAG);
+	lock_drop(&iwsk->send_lock);
+	if (ret < 0)
+		printerr("%s: cannot send terminate: %s", __func__,
+			 strerror(-ret));
+}
 
+/*
+ * The peer broke the protocol: terminate, and read nothing more from the
+ * stream.  The segment being received is failed; mpa leaves it at that.
+ * With the recv lock held.
+ */
+static void
+rdmap_remote_error(iwsk_t *iwsk, int etype, int ecode)
+{
+	rdmap_terminate(iwsk, rdmap_term_control(RDMAP_TERM_RDMAP, etype,
+						 ecode));
+	ddp_stop(iwsk);
+}
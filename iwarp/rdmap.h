@@ -16,24 +16,35 @@
 #include "mem.h"
 #include "ddp.h"
 
-/* opcodes accoring to spec */
+/*
+ * opcodes accoring to spec, RFC 5040 Sec. 4.3 and the RFC 7306 extensions
+ * after TERMINATE.  A write with immediate data is an RDMA_WRITE followed
+ * by an IMMEDIATE message, it has no opcode of its own.
+ */
 typedef enum {
 	RDMA_WRITE = 0,
-	RDMA_READ_REQ,
-	RDMA_READ_RESP,
-	SEND,
-	SEND_INV,
-	SEND_SE,
-	SEND_SE_INV,
-	TERMINATE
+	RDMA_READ_REQ = 1,
+	RDMA_READ_RESP = 2,
+	SEND = 3,
+	SEND_INV = 4,
+	SEND_SE = 5,
+	SEND_SE_INV = 6,
+	TERMINATE = 7,
+	IMMEDIATE = 8,
+	IMMEDIATE_SE = 9,
+	ATOMIC_REQ = 10,
+	ATOMIC_RESP = 11
 } rdmap_t;
-#define NUMOPS (TERMINATE + 1)
+#define NUMOPS (ATOMIC_RESP + 1)
 
 typedef enum {
 	OP_RDMA_WRITE = 0,
 	OP_RDMA_READ,
 	OP_SEND,
 	OP_RECV,
+	OP_BIND_MW,
+	OP_RECV_IMM,
+	OP_ATOMIC,
 	OP_ERR
 } rdmap_op_t;
 
@@ -46,8 +57,10 @@ typedef enum {
 	SEND_Q=0,
 	RDMAREQ_Q=1,
 	TERM_Q=2,
+	ATOMIC_REQ_Q=3,
+	ATOMIC_RESP_Q=4,
 } qn_t;
-#define NUM_Q (3)
+#define NUM_Q (5)
 
 /* IWarp spec says messages can be maximum 2^32 */
 typedef uint32_t msg_len_t;
@@ -67,6 +80,78 @@ typedef struct rdmap_rdma_rd_req_hdr {
 	tag_offset_t src_to;
 } rdmap_rdma_rd_req_hdr_t;
 
+/*
+ * RFC 7306 atomics work on the 8 aligned bytes at to.  Masks are applied
+ * as the responder finds them; ours are all ones for swap and compare and
+ * swap, and zero, a plain 64-bit add, for fetch and add.
+ */
+enum {
+	RDMAP_ATOMIC_FETCH_ADD = 0,  /* AOpCodes */
+	RDMAP_ATOMIC_SWAP = 1,
+	RDMAP_ATOMIC_CMP_SWAP = 2
+};
+
+/* atomic request and response in host order */
+typedef struct rdmap_atomic_req_hdr {
+	uint32_t aop;
+	uint32_t req_id;
+	stag_t stag;
+	tag_offset_t to;
+	uint64_t add_swap;
+	uint64_t add_swap_mask;
+	uint64_t compare;
+	uint64_t compare_mask;
+} rdmap_atomic_req_hdr_t;
+
+typedef struct rdmap_atomic_resp_hdr {
+	uint32_t req_id;
+	uint64_t orig;  /* value before the operation */
+} rdmap_atomic_resp_hdr_t;
+
+/* and on the wire, byte offsets of their fields, all in network order */
+enum {
+	RDMAP_AREQ_AOP = 0,  /* low 4 bits of the word, the rest reserved */
+	RDMAP_AREQ_REQ_ID = 4,
+	RDMAP_AREQ_STAG = 8,
+	RDMAP_AREQ_TO = 12,
+	RDMAP_AREQ_ADD_SWAP = 20,
+	RDMAP_AREQ_ADD_SWAP_MASK = 28,
+	RDMAP_AREQ_COMPARE = 36,
+	RDMAP_AREQ_COMPARE_MASK = 44,
+	RDMAP_AREQ_SZ = 52
+};
+
+enum {
+	RDMAP_ARESP_REQ_ID = 0,
+	RDMAP_ARESP_ORIG = 4,
+	RDMAP_ARESP_SZ = 12
+};
+
+typedef enum {
+	RDMAP_WR_PENDING,
+	RDMAP_WR_COMPLETE,
+	RDMAP_WR_FAILED  /* the stream ended before it was answered */
+} rdmap_wr_status_t;
+
+/*
+ * One of our RDMA reads or atomics, on rwrq till it is answered.  Only
+ * rdmap.c uses it, and the tests that queue one by hand.
+ */
+typedef struct {
+	struct list_head list;
+	cq_wrid_t id;
+	stag_t stag;
+	rdmap_wr_status_t wr_status;
+	msg_len_t len;
+	bool_t issued;  /* request sent, else waiting for ord to allow it */
+	bool_t part;  /* chunk of a larger read, only its last one completes */
+	bool_t unsignaled;  /* no completion for the user */
+	rdmap_rdma_rd_req_hdr_t h;
+	bool_t atomic;  /* an atomic, sent as a instead of h */
+	uint8_t a[RDMAP_AREQ_SZ];
+	uint64_t *orig;  /* where its answer goes */
+} rdmap_tag_wrd_t;
+
 typedef struct {
 	uint32_t term_control;
 	uint16_t ddp_segment_len;
@@ -80,6 +165,36 @@ typedef struct {
 #define rdmap_term_is_hdrct_m(c)  ((c) & 0x00008000)
 #define rdmap_term_is_hdrct_d(c)  ((c) & 0x00004000)
 #define rdmap_term_is_hdrct_r(c)  ((c) & 0x00002000)
+#define rdmap_term_control(layer, etype, ecode) \
+	(((layer) << 28) | ((etype) << 24) | ((ecode) << 16))
+
+/* layers in term messages */
+enum {
+	RDMAP_TERM_RDMAP = 0,
+	RDMAP_TERM_DDP = 1,
+	RDMAP_TERM_LLP = 2
+};
+
+/* error types and codes of the RDMAP layer, RFC 5040 Sec. 7.2 */
+enum {
+	RDMAP_ETYPE_CATASTROPHIC = 0,
+	RDMAP_ETYPE_REMOTE_PROT = 1,
+	RDMAP_ETYPE_REMOTE_OP = 2
+};
+
+enum {
+	RDMAP_ECODE_INVALID_STAG = 0x00,
+	RDMAP_ECODE_BASE_BOUNDS = 0x01,
+	RDMAP_ECODE_ACCESS = 0x02,
+	RDMAP_ECODE_STAG_STREAM = 0x03,  /* not associated with the stream */
+	RDMAP_ECODE_TO_WRAP = 0x04,
+	RDMAP_ECODE_VERSION = 0x05,
+	RDMAP_ECODE_OPCODE = 0x06,
+	RDMAP_ECODE_CATASTROPHIC_STREAM = 0x07,
+	RDMAP_ECODE_CATASTROPHIC_GLOBAL = 0x08,
+	RDMAP_ECODE_NO_INVALIDATE = 0x09,
+	RDMAP_ECODE_UNSPECIFIED = 0xff
+};
 
 /* parsing rdmap control field, assuming RV is in least significant bits */
 #define rdmap_get_RV(c) (((c) & 0xc0) >> 6)	/* rdmap version number */
@@ -91,6 +206,21 @@ typedef struct {
 #define rdmap_set_RSVD(c) ((c) = ((c) & 0xcf))  /* reserved = 0 at src */
 #define rdmap_set_OPCODE(c, o) ((c) = (((c) & 0xf0) | ((o) & 0x0f)))
 
+/* flags for send queue requests */
+enum {
+	RDMAP_UNSIGNALED = 0x1,  /* generate no completion */
+	RDMAP_INLINE = 0x2  /* copy the payload now, msg is free on return */
+};
+
+#define RDMAP_MAX_INLINE 256  /* largest RDMAP_INLINE send */
+
+/* RFC 7306 extensions, asked for before startup and used only if agreed */
+enum {
+	RDMAP_EXT_IMM = 0x1,  /* rdma write with immediate data */
+	RDMAP_EXT_ATOMIC = 0x2,  /* fetch and add, swap, compare and swap */
+	RDMAP_EXT_IMM_LEN = 0x4  /* ours: length written, with the immediate */
+};
+
 int rdmap_init(void);
 
 int rdmap_fin(void);
@@ -101,32 +231,112 @@ int rdmap_deregister_sock(socket_t sock);
 
 int rdmap_mpa_use_markers(socket_t sock, int use);
 
+/* for rdmap_mpa_use_crc: leave it to the policy of rdmap_crc_trust */
+#define RDMAP_CRC_AUTO 2
+
 int rdmap_mpa_use_crc(socket_t sock, int use);
 
+int rdmap_crc_trust(const char *subnet);
+
+int rdmap_set_read_depths(socket_t sock, uint16_t ird, uint16_t ord);
+
+int rdmap_set_read_chunk(socket_t sock, uint32_t chunk);
+
+int rdmap_set_prot_domain(socket_t sock, int prot_domain);
+
+int rdmap_set_affinity(socket_t sock, int shard);
+
+int rdmap_mpa_defer_crc(socket_t sock, int defer);
+
+int rdmap_set_extensions(socket_t sock, int ext);
+
+int rdmap_get_extensions(socket_t sock);
+
 int rdmap_set_sock_attrs(socket_t sock, int use_mrkr, int use_crc);
 
 int rdmap_init_startup(socket_t sock, bool_t is_initiator, const char *pd_in,
 		       char *pd_out, pd_len_t rpd_len);
 
-int rdmap_send(socket_t sock, const void *msg, uint32_t msg_len, cq_wrid_t id);
+int rdmap_send(socket_t sock, const void *msg, uint32_t msg_len, cq_wrid_t id,
+	       int flags);
+
+int rdmap_send_inv(socket_t sock, const void *msg, uint32_t msg_len,
+		   stag_t inv_stag, cq_wrid_t id, int flags);
+
+int rdmap_send_vec(socket_t sock, const struct iovec *iov, int niov,
+		   cq_wrid_t id, int flags);
+
+int rdmap_send_inv_vec(socket_t sock, const struct iovec *iov, int niov,
+		       stag_t inv_stag, cq_wrid_t id, int flags);
+
+stag_t rdmap_bind_mw(socket_t sock, stag_t mw, mem_desc_t md, size_t start,
+		     size_t end, stag_acc_t rw, cq_wrid_t id, int flags);
 
 int rdmap_post_recv(socket_t sock, void *buf, msg_len_t len, cq_wrid_t id);
 
+int rdmap_post_recv_vec(socket_t sock, const struct iovec *iov, int niov,
+			cq_wrid_t id);
+
+/*
+ * Shared receive queue.  Sockets attached with rdmap_set_srq take their
+ * receives from it in arrival order instead of posting their own; the
+ * completion's sk says which connection the message came in on.
+ */
+typedef struct rdmap_srq rdmap_srq_t;
+typedef void (*rdmap_srq_limit_fn_t)(rdmap_srq_t *srq, void *arg);
+
+rdmap_srq_t *rdmap_srq_create(uint32_t size, rdmap_srq_limit_fn_t fn,
+			      void *arg);
+
+int rdmap_srq_destroy(rdmap_srq_t *srq);
+
+int rdmap_srq_post_recv_vec(rdmap_srq_t *srq, const struct iovec *iov,
+			    int niov, cq_wrid_t id);
+
+int rdmap_srq_arm(rdmap_srq_t *srq, uint32_t limit);
+
+uint32_t rdmap_srq_posted(const rdmap_srq_t *srq);
+
+int rdmap_set_srq(socket_t sock, rdmap_srq_t *srq);
+
+int rdmap_cork(socket_t sock);
+
+int rdmap_uncork(socket_t sock);
+
 static inline int rdmap_poll(void) { return ddp_poll();}
 
 int rdmap_rdma_read(socket_t sk, stag_t sink_stag, tag_offset_t sink_to,
 		    msg_len_t rdma_rd_sz, stag_t src_stag,
-		    tag_offset_t src_to, cq_wrid_t id);
+		    tag_offset_t src_to, cq_wrid_t id, int flags);
 
 int rdmap_rdma_write(socket_t sock, stag_t stag, tag_offset_t to,
-                     const void *msg, uint32_t msg_len, cq_wrid_t id);
+                     const void *msg, uint32_t msg_len, cq_wrid_t id,
+                     int flags);
+
+int rdmap_rdma_write_vec(socket_t sock, stag_t stag, tag_offset_t to,
+                         const struct iovec *iov, int niov, cq_wrid_t id,
+                         int flags);
+
+int rdmap_rdma_write_imm(socket_t sock, stag_t stag, tag_offset_t to,
+                         const void *msg, uint32_t msg_len, uint64_t imm,
+                         cq_wrid_t id, int flags);
+
+int rdmap_rdma_write_imm_vec(socket_t sock, stag_t stag, tag_offset_t to,
+                             const struct iovec *iov, int niov, uint64_t imm,
+                             cq_wrid_t id, int flags);
+
+int rdmap_atomic(socket_t sock, int aop, stag_t stag, tag_offset_t to,
+		 uint64_t add_swap, uint64_t compare, uint64_t *orig,
+		 cq_wrid_t id, int flags);
 
 void rdmap_process_recv(iwsk_t *s, qnum_t qn, msn_t msn);
 
 inline void *rdmap_get_tag_sink(iwsk_t *s, stag_t stag, tag_offset_t to,
                                 size_t len, rdmap_control_field_t cf);
 
-buf_t *rdmap_get_untag_sink(iwsk_t *s, qnum_t qn, msn_t msn);
+const struct iovec *rdmap_get_untag_sink(iwsk_t *s, qnum_t qn, msn_t msn,
+					 rdmap_control_field_t cf, int *niov,
+					 size_t *len);
 
 inline stag_acc_t rdmap_get_acc(rdmap_control_field_t cf);
 
@@ -136,5 +346,9 @@ void rdmap_untag_recv(iwsk_t *s, rdmap_control_field_t cf, stag_t stag,
 void rdmap_tag_recv(iwsk_t *iwsk, rdmap_control_field_t cf, stag_t stag,
 		    msg_len_t len);
 
+int rdmap_send_ready(iwsk_t *iwsk);
+
+void rdmap_terminate(iwsk_t *iwsk, uint32_t control);
+
 
 #endif /* __RDMAP_H */
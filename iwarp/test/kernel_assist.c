@@ -119,7 +119,7 @@ static void test_rdmap(int fd, int msgsz)
 	while(cq_consume(iwsk->rcq, &cqe) == -ENOENT)
 		rdmap_poll();
 	memset(buf, 0x55, msgsz);
-	rdmap_send(fd, buf, msgsz, 4);
+	rdmap_send(fd, buf, msgsz, 4, 0);
 	while(cq_consume(iwsk->scq, &cqe) == -ENOENT)
 		rdmap_poll();
 
@@ -150,7 +150,7 @@ static void test_rdma_write(int fd, int msgsz)
 		memcpy(buf, &stag, sizeof(stag));
 		memcpy(buf + sizeof(stag), &to, sizeof(to));
 		debug(2, "sending stag %x to %lx", stag, to);
-		rdmap_send(fd, buf, sizeof(stag) + sizeof(to), 0);
+		rdmap_send(fd, buf, sizeof(stag) + sizeof(to), 0, 0);
 		while (cq_consume(iwsk->scq, &cqe) == -ENOENT);
 		while(!buf[msgsz - 1])
 			rdmap_poll();
@@ -191,7 +191,7 @@ static void test_rdma_read(int fd, int msgsz)
 		memcpy(sbuf, &stag, sizeof(stag));
 		memcpy(sbuf + sizeof(stag), &to, sizeof(to));
 		debug(2, "sending stag %x to %lx", stag, to);
-		rdmap_send(fd, sbuf, sizeof(stag) + sizeof(to), 0);
+		rdmap_send(fd, sbuf, sizeof(stag) + sizeof(to), 0, 0);
 		while (cq_consume(iwsk->scq, &cqe) == -ENOENT);
 		rdmap_post_recv(fd, sbuf, 10, 2);
 		while (cq_consume(iwsk->rcq, &cqe) == -ENOENT)
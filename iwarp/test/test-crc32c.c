@@ -8,13 +8,17 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/uio.h>
+#include <netinet/in.h>
 
 #include "util.h"
 #include "crc32c.h"
 
 static void test_crc_vec(void);
+static void test_crc_combine(void);
+static void test_crc_long(void);
 
 static void
 test_crc_vec(void)
@@ -45,6 +49,70 @@ test_crc_vec(void)
 	printf ("crc vec %u %x\n", crc, crc);
 }
 
+static void
+test_crc_combine(void)
+{
+	const char *s = "123456789";
+	uint32_t a, b, crc;
+	int i;
+
+	crc = crc32c(s, 9);
+	if (crc != htonl(0xe3069283))
+		error("crc of check string is wrong: %x", ntohl(crc));
+	for (i=0; i<=9; i++) {
+		a = crc32c(s, i);
+		b = crc32c(s + i, 9 - i);
+		if (crc32c_combine(a, b, 9 - i) != crc)
+			error("combine at %d is wrong: %x want %x", i,
+			      ntohl(crc32c_combine(a, b, 9 - i)), ntohl(crc));
+	}
+}
+
+/*
+ * Long buffers go through lanes and helper threads; small pieces of a
+ * vector do not, and give the answer to check them against.
+ */
+static void
+test_crc_long(void)
+{
+	enum { LEN = 200 * 1024 + 13, PIECE = 1000 };
+	struct iovec small[LEN / PIECE + 1], big[3];
+	unsigned char *buf = Malloc(LEN);
+	uint32_t want, crc;
+	int i, n;
+
+	for (i=0; i<LEN; i++)
+		buf[i] = i * 31 + (i >> 9);
+	for (i=0, n=0; i<LEN; i+=PIECE, n++) {
+		small[n].iov_base = buf + i;
+		small[n].iov_len = LEN - i < PIECE ? LEN - i : PIECE;
+	}
+	want = crc32c_vec(small, n);
+	big[0].iov_base = buf;
+	big[0].iov_len = 18;
+	big[1].iov_base = buf + 18;
+	big[1].iov_len = 100 * 1024;
+	big[2].iov_base = buf + 18 + 100 * 1024;
+	big[2].iov_len = LEN - 18 - 100 * 1024;
+
+	crc = crc32c(buf, LEN);
+	if (crc != want)
+		error("crc of long buffer is wrong: %x want %x", crc, want);
+	crc = crc32c_vec(big, 3);
+	if (crc != want)
+		error("crc of long vector is wrong: %x want %x", crc, want);
+	for (i=1; i<=4; i++) {
+		if (crc32c_threads_start(i) < 0)
+			error("crc32c_threads_start %d failed", i);
+		crc = crc32c_vec(big, 3);
+		crc32c_threads_stop();
+		if (crc != want)
+			error("crc with %d threads is wrong: %x want %x", i,
+			      crc, want);
+	}
+	free(buf);
+}
+
 int main(int argc, char *argv[])
 {
     uint32_t crc, want;
@@ -79,6 +147,8 @@ int main(int argc, char *argv[])
 	error("crc of descending is wrong: %x want %x", crc, want);
 
 	test_crc_vec();
+	test_crc_combine();
+	test_crc_long();
 
     return 0;
 }
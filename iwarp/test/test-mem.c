@@ -69,6 +69,184 @@ int main(int argc, char *argv[])
     free(x);
 #endif
 
+    ret = mem_deregister(md);
+    if (ret != -EINVAL)
+	error_ret(ret, "%s: duplicate mem_deregister", __func__);
+
+    /* registration cache: nested and overlapping ranges, lazy dereg */
+    {
+	mem_desc_t md1, md2, md3;
+	iwsk_t sk;
+	char *y;
+
+	sk.sk = -1;
+	sk.prot_domain = 0;
+
+	len = 4096;
+	y = Malloc(len);
+	mem_cache_set_limit(len);
+
+	md1 = mem_register(y, len / 2);
+	md2 = mem_register(y + 100, 200);
+	md3 = mem_register(y + len / 4, len / 2);
+	if (md1 == md2 || md2 == md3)
+	    error("%s: registrations share a descriptor", __func__);
+
+	/* stag offsets remain relative to each registration */
+	stag = mem_stag_create(0, md2, 0, 200, STAG_W, 0);
+	if (stag < 0)
+	    error_ret(stag, "%s: stag in nested registration", __func__);
+	if (!mem_stag_location(&sk, stag, (size_t) y + 100, 200,
+	                       STAG_W))
+	    error("%s: nested stag does not map its buffer", __func__);
+	stag1 = mem_stag_create(0, md2, 0, 201, STAG_W, 0);
+	if (stag1 != -EINVAL)
+	    error("%s: nested stag exceeded registration", __func__);
+	ret = mem_stag_destroy(stag);
+	if (ret < 0)
+	    error_ret(ret, "%s: mem_stag_destroy %d", __func__, stag);
+
+	ret = mem_deregister(md2);
+	if (ret < 0)
+	    error_ret(ret, "%s: nested mem_deregister", __func__);
+	ret = mem_deregister(md1);
+	if (ret < 0)
+	    error_ret(ret, "%s: mem_deregister", __func__);
+	ret = mem_deregister(md3);
+	if (ret < 0)
+	    error_ret(ret, "%s: overlapping mem_deregister", __func__);
+
+	/* idle now, but cached; a hit must still work after invalidate */
+	md1 = mem_register(y, len);
+	mem_invalidate(y, len);
+	md2 = mem_register(y, len);
+	if (mem_deregister(md1) < 0 || mem_deregister(md2) < 0)
+	    error("%s: mem_deregister after invalidate", __func__);
+
+	mem_cache_set_limit(0);
+	free(y);
+    }
+
+    /* memory windows: bind, rebind revokes old stag, invalidate */
+    {
+	stag_t mw;
+	iwsk_t sk, other;
+	char *y;
+
+	sk.sk = -1;
+	sk.prot_domain = 0;
+	other.sk = -1;
+	other.prot_domain = 1;
+
+	len = 256;
+	y = Malloc(len);
+	md = mem_register(y, len);
+
+	mw = mem_mw_alloc(0, 0);
+	if (mw < 0)
+	    error_ret(mw, "%s: mem_mw_alloc", __func__);
+	if (mem_stag_is_enabled(mw))
+	    error("%s: unbound window %d enabled", __func__, mw);
+
+	stag1 = mem_mw_bind(mw, md, 16, 32, STAG_W);
+	if (stag1 < 0)
+	    error_ret(stag1, "%s: mem_mw_bind", __func__);
+	if (!mem_stag_location(&sk, stag1, (size_t) y + 16, 16, STAG_W))
+	    error("%s: window does not map its range", __func__);
+	if (mem_stag_location(&sk, stag1, (size_t) y, 16, STAG_W))
+	    error("%s: window maps outside its range", __func__);
+	ret = mem_deregister(md);
+	if (ret != -EBUSY)
+	    error_ret(ret, "%s: mem_deregister under bound window", __func__);
+
+	stag2 = mem_mw_bind(stag1, md, 0, len, STAG_R);
+	if (stag2 < 0 || stag2 == stag1)
+	    error("%s: rebind gave stag %d after %d", __func__, stag2, stag1);
+	if (mem_stag_is_enabled(stag1))
+	    error("%s: old window stag %d still enabled", __func__, stag1);
+
+	/* a peer in another protection domain reaches none of it */
+	if (mem_stag_location(&other, stag2, (size_t) y, 1, STAG_R))
+	    error("%s: window maps for another domain", __func__);
+	ret = mem_stag_invalidate(&other, stag2);
+	if (ret != -EPERM)
+	    error_ret(ret, "%s: invalidate from another domain", __func__);
+
+	ret = mem_stag_invalidate(&sk, stag2);
+	if (ret < 0)
+	    error_ret(ret, "%s: mem_stag_invalidate", __func__);
+	if (mem_stag_location(&sk, stag2, (size_t) y, 1, STAG_R))
+	    error("%s: invalidated window still maps", __func__);
+
+	stag = mem_stag_create(0, md, 0, len, STAG_R, 0);
+	ret = mem_stag_invalidate(&sk, stag);
+	if (ret != -EACCES)
+	    error_ret(ret, "%s: invalidate of a region stag", __func__);
+	mem_stag_destroy(stag);
+
+	/* a stag made for a stream is reachable from that stream alone */
+	other.sk = 7;
+	stag = mem_stag_create(7, md, 0, len, STAG_R, 1);
+	if (!mem_stag_location(&other, stag, (size_t) y, 1, STAG_R))
+	    error("%s: stream stag does not map for its stream", __func__);
+	other.sk = 8;
+	other.prot_domain = -1;
+	if (mem_stag_location(&other, stag, (size_t) y, 1, STAG_R))
+	    error("%s: stream stag maps for another stream", __func__);
+	mem_stag_destroy(stag);
+
+	/* leave one window bound; deregister is blocked until dealloc */
+	stag1 = mem_mw_bind(stag2, md, 0, 8, STAG_RW);
+	ret = mem_stag_destroy(stag1);
+	if (ret < 0)
+	    error_ret(ret, "%s: window dealloc", __func__);
+	ret = mem_deregister(md);
+	if (ret < 0)
+	    error_ret(ret, "%s: mem_deregister after windows", __func__);
+	free(y);
+
+	/* an unbound window is cleaned up by mem_fini */
+	mem_mw_alloc(0, 0);
+    }
+
+    /* batch registration, and its all-or-nothing failure */
+    {
+	mem_reg_t v[40];
+	iwsk_t sk;
+	char *y;
+	int i, n = sizeof(v) / sizeof(v[0]);
+
+	sk.sk = -1;
+	sk.prot_domain = 0;
+
+	y = Malloc(n * 100);
+	for (i=0; i<n; i++) {
+	    v[i].addr = y + i * 100;
+	    v[i].len = 100;
+	    v[i].rw = STAG_RW;
+	}
+	ret = mem_register_vec(0, v, n, 0);
+	if (ret < 0)
+	    error_ret(ret, "%s: mem_register_vec", __func__);
+	for (i=0; i<n; i++)
+	    if (!mem_stag_location(&sk, v[i].stag, (size_t) y + i * 100, 100,
+				   STAG_W))
+		error("%s: batch stag %d does not map", __func__, i);
+	ret = mem_deregister_vec(v, n);
+	if (ret < 0)
+	    error_ret(ret, "%s: mem_deregister_vec", __func__);
+	if (mem_stag_is_enabled(v[0].stag))
+	    error("%s: batch stag survived deregister", __func__);
+
+	v[n-1].len = 0;
+	ret = mem_register_vec(0, v, n, 0);
+	if (ret != -EINVAL)
+	    error_ret(ret, "%s: mem_register_vec bad entry", __func__);
+	if (mem_stag_is_enabled(v[0].stag) || mem_deregister(v[0].md) == 0)
+	    error("%s: failed batch left registrations behind", __func__);
+	free(y);
+    }
+
     mem_fini();
     return 0;
 }
@@ -49,8 +49,7 @@ test_conn_reset(socket_t sk)
 	rdmap_register_sock(sk, scq, rcq);
 
 	iwsk_t *iwsk = iwsk_lookup(sk);
-	iwsk->mpask.use_mrkr = TRUE;
-	iwsk->mpask.use_crc = TRUE;
+	rdmap_set_sock_attrs(sk, TRUE, TRUE);
 
 	if (is_server) {
 		rdmap_post_recv(sk, b.buf, b.len, 0);
@@ -61,7 +60,7 @@ test_conn_reset(socket_t sk)
 		uint32_t i = 0;
 		for (i=0; i<NUM; i++)
 			*(((uint32_t *)b.buf) + i) = i;
-		rdmap_send(sk, b.buf, b.len, 0);
+		rdmap_send(sk, b.buf, b.len, 0, 0);
 	}
 
 	cq_destroy(scq);
@@ -22,6 +22,7 @@ void test_chain_insert(void);
 void test_chain_delete(void);
 void test_repeat_lookups(void);
 void test_iwsk_lookups(void);
+void test_grow(void);
 
 void
 test_create_destroy(void)
@@ -141,6 +142,33 @@ test_iwsk_lookups(void)
 	iwsk_fin();
 }
 
+/*
+ * many more keys than buckets: the table must grow and still find them all
+ */
+void
+test_grow(void)
+{
+	ht_t *ht = ht_create(4, free);
+	int k, *v;
+
+	printf("%s\n", __func__);
+	for (k = 0; k < 20000; k++) {
+		v = Malloc(sizeof(int));
+		*v = k;
+		ht_insert(ht, k, v);
+	}
+	if (ht->sz < ht->nnodes)
+		error("%s: %u buckets for %u nodes", __func__, ht->sz, ht->nnodes);
+	for (k = 0; k < 20000; k += 2)
+		ht_delete(ht, k);
+	for (k = 0; k < 20000; k++) {
+		v = ht_lookup(ht, k);
+		if (k % 2 == 0 ? v != NULL : (v == NULL || *v != k))
+			error("%s: lookup of %d after grow", __func__, k);
+	}
+	ht_destroy(ht);
+}
+
 int main()
 {
 	test_create_destroy();
@@ -150,5 +178,6 @@ int main()
 	test_chain_delete();
 	test_repeat_lookups();
 	test_iwsk_lookups();
+	test_grow();
 	return 0;
 }
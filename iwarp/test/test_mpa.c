@@ -20,6 +20,9 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
 #include "ddp.h"
 #include "mpa.h"
 #include "common.h"
@@ -28,13 +31,17 @@
 #include "test_stub.h"
 #include "iwsk.h"
 #include "cq.h"
+#include "crc32c.h"
 
 static bool_t is_server = FALSE;
 
 static void test_mpa_init_startup(socket_t sk);
+static void test_mpa_pipe(iwsk_t *s);
 
 static void print_no(uint32_t d);
 static void test_mpa_hdr(void);
+static void test_mpa_trust(void);
+static void test_mpa_crc_auto(void);
 
 static void
 test_mpa_init_startup(socket_t sk)
@@ -43,15 +50,74 @@ test_mpa_init_startup(socket_t sk)
 	remote = malloc(20);
 	rdmap_init();
 	rdmap_register_sock(sk, NULL, NULL);
+	rdmap_set_sock_attrs(sk, FALSE, TRUE);
 
 	iwsk_t *s = iwsk_lookup(sk);
 
 	mpa_init_startup(s, is_server, "client", remote, 20);
 	printf("remote private data is %s\n", remote);
+	test_mpa_pipe(s);
 	rdmap_deregister_sock(sk);
 	rdmap_fin();
 }
 
+/*
+ * A message of several FPDUs with CRCs, sent through the pipeline and
+ * then again by the plain writer, must put the same bytes on the wire.
+ * Each payload is gathered from two pieces and needs padding.  The
+ * server reads the raw stream and checks the CRCs too.
+ */
+#define PIPE_FPDUS 3
+#define PIPE_HDR 18
+#define PIPE_LEN 1001
+#define PIPE_PAD ((4 - (PIPE_HDR + PIPE_LEN) % 4) % 4)
+#define PIPE_FPDU_SZ (PIPE_HDR + PIPE_LEN + PIPE_PAD + 4)
+
+static void
+test_mpa_pipe(iwsk_t *s)
+{
+	static uint8_t buf[PIPE_FPDUS * PIPE_LEN];
+	static uint8_t wire[2 * PIPE_FPDUS * PIPE_FPDU_SZ];
+	uint8_t hdr[PIPE_HDR];
+	struct iovec iov[2];
+	uint32_t crc;
+	int i, k;
+
+	if (is_server) {
+		read_full(s->sk, wire, sizeof(wire));
+		for (k=0; k<2*PIPE_FPDUS; k++) {
+			uint8_t *f = wire + k * PIPE_FPDU_SZ;
+
+			memcpy(&crc, f + PIPE_FPDU_SZ - 4, 4);
+			if (crc32c(f, PIPE_FPDU_SZ - 4) != ntohl(crc))
+				error("%s: bad crc in fpdu %d", __func__, k);
+		}
+		if (memcmp(wire, wire + sizeof(wire) / 2, sizeof(wire) / 2))
+			error("%s: pipelined and plain fpdus differ", __func__);
+		printf("pipelined fpdus match the plain writer's\n");
+		return;
+	}
+
+	for (i=0; i<(int) sizeof(buf); i++)
+		buf[i] = i * 7 + 1;
+	for (i=0; i<2; i++) {
+		if (i == 0)
+			mpa_pipe_begin(s);
+		for (k=0; k<PIPE_FPDUS; k++) {
+			memset(hdr, k + 1, sizeof(hdr));
+			iov[0].iov_base = buf + k * PIPE_LEN;
+			iov[0].iov_len = 100;
+			iov[1].iov_base = buf + k * PIPE_LEN + 100;
+			iov[1].iov_len = PIPE_LEN - 100;
+			if (mpa_send(s, hdr, sizeof(hdr), iov, 2, PIPE_LEN) < 0)
+				error("%s: mpa_send", __func__);
+		}
+		if (i == 0 && mpa_pipe_end(s) < 0)
+			error("%s: mpa_pipe_end", __func__);
+	}
+	printf("sent %d fpdus pipelined and plain\n", PIPE_FPDUS);
+}
+
 static void
 print_no(uint32_t d)
 {
@@ -116,6 +182,182 @@ test_mpa_hdr(void)
 
 }
 
+/* fills ss from a numeric IPv4 or IPv6 address */
+static int
+test_sockaddr(const char *addr, struct sockaddr_storage *ss)
+{
+	struct sockaddr_in *s4 = (struct sockaddr_in *) ss;
+	struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) ss;
+
+	memset(ss, 0, sizeof(*ss));
+	if (inet_pton(AF_INET, addr, &s4->sin_addr) == 1) {
+		s4->sin_family = AF_INET;
+		return sizeof(*s4);
+	}
+	if (inet_pton(AF_INET6, addr, &s6->sin6_addr) == 1) {
+		s6->sin6_family = AF_INET6;
+		return sizeof(*s6);
+	}
+	return -1;
+}
+
+/*
+ * Trusted subnets as mpa_crc_trust parses them, v4 and v6, against
+ * addresses just inside and outside their prefixes.  IPv4 peers may
+ * also show up as v4-mapped IPv6 addresses.
+ */
+static void
+test_mpa_trust(void)
+{
+	static const struct {
+		const char *subnet, *addr;
+		bool_t in;
+	} t[] = {
+		{ "10.1.0.0/16", "10.1.200.3", TRUE },
+		{ "10.1.0.0/16", "10.2.0.1", FALSE },
+		{ "192.168.4.0/23", "192.168.5.255", TRUE },
+		{ "192.168.4.0/23", "192.168.6.1", FALSE },
+		{ "172.16.0.7", "172.16.0.7", TRUE },
+		{ "172.16.0.7", "172.16.0.6", FALSE },
+		{ "0.0.0.0/0", "8.8.8.8", TRUE },
+		{ "10.0.0.0/8", "::ffff:10.3.3.3", TRUE },
+		{ "10.0.0.0/8", "2001:db8::a00:1", FALSE },
+		{ "fe80::/10", "febf::1", TRUE },
+		{ "fe80::/10", "fec0::1", FALSE },
+		{ "2001:db8::/33", "2001:db8:7fff::1", TRUE },
+		{ "2001:db8::/33", "2001:db8:8000::1", FALSE },
+		{ "2001:db8::5", "2001:db8::5", TRUE },
+		{ "2001:db8::5", "2001:db8::4", FALSE },
+		{ "::/0", "10.9.9.9", TRUE },
+		{ "", "127.0.0.2", TRUE },  /* loopback needs no subnet */
+		{ "", "::1", TRUE },
+		{ "", "10.1.200.3", FALSE },
+	};
+	static const char *const bad[] = {
+		"10.0.0.0/33", "::/129", "10.0.0.0/", "10.0.0.0/-1", "10.0.0.0/8x",
+		"10.0.0/8", "fe80::/1/0", "host/8", "",
+	};
+	struct sockaddr_storage ss;
+	unsigned int i;
+
+	for (i=0; i<sizeof(t)/sizeof(t[0]); i++) {
+		rdmap_init();
+		if (*t[i].subnet && rdmap_crc_trust(t[i].subnet) < 0)
+			error("%s: cannot trust %s", __func__, t[i].subnet);
+		if (test_sockaddr(t[i].addr, &ss) < 0)
+			error("%s: bad address %s", __func__, t[i].addr);
+		if (mpa_addr_trusted((struct sockaddr *) &ss) != t[i].in)
+			error("%s: %s %s in %s", __func__, t[i].addr,
+			      t[i].in ? "not" : "wrongly", t[i].subnet);
+		rdmap_fin();
+	}
+	rdmap_init();
+	for (i=0; i<sizeof(bad)/sizeof(bad[0]); i++)
+		if (rdmap_crc_trust(bad[i]) != -EINVAL)
+			error("%s: took \"%s\"", __func__, bad[i]);
+	rdmap_fin();
+	printf("trusted subnets ok\n");
+}
+
+static void *
+test_crc_auto_respond(void *arg)
+{
+	char remote[20];
+
+	if (mpa_init_startup(arg, FALSE, "", remote, sizeof(remote)) < 0)
+		error("%s: startup", __func__);
+	return NULL;
+}
+
+/*
+ * A connection to addr, on this host, with the crc policy of each end;
+ * both must agree on want.  Returns -1 if addr cannot be listened on.
+ */
+static int
+test_crc_auto_pair(const char *addr, int ipolicy, int rpolicy, bool_t want)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+	socket_t l, sk[2];
+	pthread_t th;
+	char remote[20];
+	int i;
+
+	len = test_sockaddr(addr, &ss);
+	l = socket(ss.ss_family, SOCK_STREAM, 0);
+	if (l < 0 || bind(l, (struct sockaddr *) &ss, len) < 0
+	    || listen(l, 1) < 0
+	    || getsockname(l, (struct sockaddr *) &ss, &len) < 0) {
+		if (l >= 0)
+			close(l);
+		return -1;
+	}
+	sk[0] = socket(ss.ss_family, SOCK_STREAM, 0);
+	if (connect(sk[0], (struct sockaddr *) &ss, len) < 0)
+		error_errno("%s: connect to %s", __func__, addr);
+	sk[1] = accept(l, NULL, NULL);
+	if (sk[1] < 0)
+		error_errno("%s: accept", __func__);
+	close(l);
+
+	for (i=0; i<2; i++) {
+		rdmap_register_sock(sk[i], NULL, NULL);
+		rdmap_mpa_use_crc(sk[i], i ? rpolicy : ipolicy);
+	}
+	pthread_create(&th, NULL, test_crc_auto_respond, iwsk_lookup(sk[1]));
+	if (mpa_init_startup(iwsk_lookup(sk[0]), TRUE, "", remote,
+			     sizeof(remote)) < 0)
+		error("%s: startup", __func__);
+	pthread_join(th, NULL);
+	for (i=0; i<2; i++) {
+		if (iwsk_lookup(sk[i])->mpask.use_crc != want)
+			error("%s: %s crc %d, policies %d %d, via %s", __func__,
+			      i ? "responder" : "initiator",
+			      iwsk_lookup(sk[i])->mpask.use_crc, ipolicy,
+			      rpolicy, addr);
+		rdmap_deregister_sock(sk[i]);
+		close(sk[i]);
+	}
+	return 0;
+}
+
+/*
+ * RDMAP_CRC_AUTO on both ends of a connection to this host, over
+ * loopback or one of its own addresses, goes without crcs; either end
+ * asking for them gets them on both.
+ */
+static void
+test_mpa_crc_auto(void)
+{
+	struct ifaddrs *ifa, *p;
+	char own[INET6_ADDRSTRLEN] = "";
+
+	rdmap_init();
+	test_crc_auto_pair("127.0.0.1", RDMAP_CRC_AUTO, RDMAP_CRC_AUTO, FALSE);
+	test_crc_auto_pair("127.0.0.1", RDMAP_CRC_AUTO, TRUE, TRUE);
+	test_crc_auto_pair("127.0.0.1", TRUE, RDMAP_CRC_AUTO, TRUE);
+	test_crc_auto_pair("127.0.0.1", FALSE, FALSE, FALSE);
+	if (test_crc_auto_pair("::1", RDMAP_CRC_AUTO, RDMAP_CRC_AUTO,
+			       FALSE) < 0)
+		printf("no IPv6 loopback, skipped\n");
+
+	/* same host by address, not by loopback */
+	if (getifaddrs(&ifa) == 0) {
+		for (p=ifa; p && !*own; p=p->ifa_next)
+			if (p->ifa_addr && p->ifa_addr->sa_family == AF_INET
+			    && !mpa_addr_trusted(p->ifa_addr))
+				inet_ntop(AF_INET,
+				   &((struct sockaddr_in *) p->ifa_addr)->sin_addr,
+				   own, sizeof(own));
+		freeifaddrs(ifa);
+	}
+	if (!*own || test_crc_auto_pair(own, RDMAP_CRC_AUTO, RDMAP_CRC_AUTO,
+					FALSE) < 0)
+		printf("no address of our own besides loopback, skipped\n");
+	rdmap_fin();
+	printf("crc policy over loopback ok\n");
+}
+
 int main(int argc, char *argv[])
 {
 	parse_options(argc, argv);
@@ -123,6 +365,8 @@ int main(int argc, char *argv[])
 	socket_t sk = init_connection(is_server);
 	test_mpa_init_startup(sk);
 	test_mpa_hdr();
+	test_mpa_trust();
+	test_mpa_crc_auto();
 	close(sk);
 	return 0;
 }
@@ -121,8 +121,7 @@ test_spray(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 	rdmap_init();
 	rdmap_register_sock(sk, cq, cq);
 	iwsk_t *iwsk = iwsk_lookup(sk);
-	iwsk->mpask.use_mrkr = use_mrkr;
-	iwsk->mpask.use_crc = use_crc;
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
 	debug(2, "iwsk %p %d", iwsk, iwsk->sk);
 
 	if (is_server) {
@@ -145,11 +144,11 @@ test_spray(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 			rdmap_post_recv(sk, local_buf, 0, 4);
 			int j = 0;
 			for (j=0; j < window-1; j++) {
-				rdmap_rdma_write(sk, rem_stag, rem_to, buf, rem_len, 3);
+				rdmap_rdma_write(sk, rem_stag, rem_to, buf, rem_len, 3, 0);
 				while(cq_consume(iwsk->scq, &cqe) == -ENOENT);
 			}
 			buf[rem_len-1] = 'A';
-			rdmap_rdma_write(sk, rem_stag, rem_to, buf, rem_len, 3);
+			rdmap_rdma_write(sk, rem_stag, rem_to, buf, rem_len, 3, 0);
 			while(cq_consume(iwsk->scq, &cqe) == -ENOENT);
 			while(cq_consume(iwsk->rcq, &cqe) == -ENOENT)
 				rdmap_poll();
@@ -167,7 +166,7 @@ test_spray(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 		*(stag_t *)(local_buf + off) = stag; off += sizeof(stag);
 		*(tag_offset_t *)(local_buf + off) = to; off += sizeof(to);
 		*(int32_t *)(local_buf + off) = length; off += sizeof(length);
-		rdmap_send(sk, local_buf, off, 1);
+		rdmap_send(sk, local_buf, off, 1, 0);
 		while(cq_consume(iwsk->scq, &cqe) == -ENOENT);
 
 		debug(2, "sent stag:%d to:%Lx len:%d", stag, to, length);
@@ -180,7 +179,7 @@ test_spray(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 				rdmap_poll();
 			}
 			buf[length-1] = '\0';
-			rdmap_send(sk, local_buf, 0, 2);
+			rdmap_send(sk, local_buf, 0, 2, 0);
 			while(cq_consume(iwsk->scq, &cqe) == -ENOENT);
 
 		}
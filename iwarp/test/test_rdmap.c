@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
 #include "ddp.h"
 #include "mpa.h"
 #include "common.h"
@@ -28,24 +29,11 @@
 #include "mem.h"
 #include "cq.h"
 
-typedef enum{
-	TEST_WR_PENDING,
-	TEST_WR_COMPLETE
-}test_wr_status_t;
-
 typedef struct test_untag_wrd{
 	cq_wrid_t id;
 	buf_t *buf;
 }test_untag_wrd_t;
 
-typedef struct test_tag_wrd{
-	struct list_head list;
-	cq_wrid_t id;
-	stag_t stag;
-	test_wr_status_t wr_status;
-	msg_len_t len;
-}test_tag_wrd_t;
-
 static bool_t is_server = FALSE;
 static int32_t length = -1;
 
@@ -57,6 +45,14 @@ static void test_rdma_write(socket_t sk, bool_t use_mrkr, bool_t use_crc);
 static void test_reap_rwr(socket_t sk);
 static void test_rdma_read(socket_t sk, bool_t use_mrkr, bool_t use_crc);
 static void test_byte_order(socket_t sk, bool_t use_mrkr, bool_t use_crc);
+static void test_sge(socket_t sk, bool_t use_mrkr, bool_t use_crc);
+static void test_cork(socket_t sk, bool_t use_mrkr, bool_t use_crc);
+static void test_read_chunks(socket_t sk, bool_t use_mrkr, bool_t use_crc);
+static void test_unsignaled(socket_t sk, bool_t use_mrkr, bool_t use_crc);
+static void test_ext(socket_t sk, bool_t use_mrkr, bool_t use_crc,
+		     bool_t imm_len);
+static void test_atomic_error(socket_t sk);
+static void test_cork_error(socket_t sk);
 
 static void ATTR_NORETURN
 local_usage(const char *funcname)
@@ -108,10 +104,7 @@ test_send(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 
 	rdmap_init();
 	rdmap_register_sock(sk, NULL, NULL);
-
-	iwsk_t *iwsk = iwsk_lookup(sk);
-	iwsk->mpask.use_mrkr = use_mrkr;
-	iwsk->mpask.use_crc = use_crc;
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
 
 	if (is_server) {
 		uint32_t i =0;
@@ -127,7 +120,7 @@ test_send(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 		uint32_t i = 0;
 		for (i=0; i<NUM; i++)
 			*(((uint32_t *)b.buf) + i) = i;
-		rdmap_send(sk, b.buf, b.len, 0);
+		rdmap_send(sk, b.buf, b.len, 0, 0);
 	}
 	rdmap_deregister_sock(sk);
 	free(b.buf);
@@ -147,10 +140,7 @@ test_rdma_write(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 
 	rdmap_init();
 	rdmap_register_sock(sk, NULL, NULL);
-
-	iwsk_t *iwsk = iwsk_lookup(sk);
-	iwsk->mpask.use_mrkr = use_mrkr;
-	iwsk->mpask.use_crc = use_crc;
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
 
 	if (is_server) {
 		mem_init();
@@ -158,8 +148,8 @@ test_rdma_write(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 		stag_t stag = mem_stag_create(sk, md, 0, b.len, STAG_W, 0);
 		tag_offset_t to = (tag_offset_t)((uintptr_t)b.buf);
 		debug(2, "stag gen (%u)", stag);
-		rdmap_send(sk, &stag, sizeof(stag), 0);
-		rdmap_send(sk, &to, sizeof(to), 0);
+		rdmap_send(sk, &stag, sizeof(stag), 0, 0);
+		rdmap_send(sk, &to, sizeof(to), 0, 0);
 		rdmap_post_recv(sk, b.buf, b.len, 6);
 		while (!*(((uint32_t *)b.buf) + (NUM-1)))
 			rdmap_poll();
@@ -181,19 +171,47 @@ test_rdma_write(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 		debug(2, "stag recved (%u) to %lx", stag, to);
 		for (i=0; i<NUM; i++)
 			*(((uint32_t *)b.buf) + i) = i;
-		rdmap_rdma_write(sk, stag, to, b.buf, b.len, 0);
+		rdmap_rdma_write(sk, stag, to, b.buf, b.len, 0, 0);
 	}
 	rdmap_deregister_sock(sk);
 	free(b.buf);
 	rdmap_fin();
 }
 
+/* a read request for stag, as if already on the wire */
+static void
+test_queue_rwr(iwsk_t *iwsk, stag_t stag)
+{
+	rdmap_tag_wrd_t *d = Malloc(sizeof(rdmap_tag_wrd_t));
+
+	memset(d, 0, sizeof(*d));
+	d->id = 2;
+	d->stag = stag;
+	d->wr_status = RDMAP_WR_PENDING;
+	d->issued = TRUE;
+	list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+	iwsk->rdmapsk.rd_issued++;
+}
+
+/* n requests left on rwrq, pending of them not answered yet */
+static void
+test_expect_rwrq(iwsk_t *iwsk, int n, uint32_t pending)
+{
+	struct list_head *l;
+	int i = 0;
+
+	list_for_each(l, &iwsk->rdmapsk.rwrq)
+		i++;
+	if (i != n || iwsk->rdmapsk.rd_issued != pending)
+		error("%s: %d requests left, %u pending, expected %d and %u",
+		      __func__, i, iwsk->rdmapsk.rd_issued, n, pending);
+}
+
 static void
 test_reap_rwr(socket_t sk)
 {
 	iwsk_t *iwsk;
 	rdmap_control_field_t cf;
-	test_tag_wrd_t *d = NULL;
 
 	rdmap_init();
 	rdmap_register_sock(sk, NULL, NULL);
@@ -206,91 +224,53 @@ test_reap_rwr(socket_t sk)
 		/* test with empty q. tested it caught the error */
 /*		rdmap_tag_recv(iwsk, cf, 3, 4);*/
 
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 3;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+		test_queue_rwr(iwsk, 3);
 
 		/* test with one element */
-		rdmap_tag_recv(iwsk, cf, d->stag, d->len);
-
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 3;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
-
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 4;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+		rdmap_tag_recv(iwsk, cf, 3, 0);
+		test_expect_rwrq(iwsk, 0, 0);
+
+		test_queue_rwr(iwsk, 3);
+
+		test_queue_rwr(iwsk, 4);
 
 		/* test with multiple stags with match at start*/
 		rdmap_tag_recv(iwsk, cf, 3, 2);
+		test_expect_rwrq(iwsk, 1, 1);
 
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 6;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+		test_queue_rwr(iwsk, 6);
 
 		/* test multiple stags no match. currently catches the error */
 		/*rdmap_tag_recv(iwsk, cf, 1, 4); *//* currently 4 6; no 1 */
 
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 3;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+		test_queue_rwr(iwsk, 3);
 
 		/* test with multiple stags match at end or middle */
 		rdmap_tag_recv(iwsk, cf, 6, 8); /* currently 4 6 3 */
 		rdmap_tag_recv(iwsk, cf, 3, 8);
+		test_expect_rwrq(iwsk, 3, 1);  /* complete behind 4 */
 
 		/* test for reap action deq */
 		rdmap_tag_recv(iwsk, cf, 4, 4);
+		test_expect_rwrq(iwsk, 0, 0);
 
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 1;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 2;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+		test_queue_rwr(iwsk, 1);
+		test_queue_rwr(iwsk, 2);
 
 		/* test for reap action blocked */
 		rdmap_tag_recv(iwsk, cf, 1, 4);
+		test_expect_rwrq(iwsk, 1, 1);
 		/* empty the queue */
 		rdmap_tag_recv(iwsk, cf, 2, 4);
+		test_expect_rwrq(iwsk, 0, 0);
 
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 3;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
-		d = Malloc(sizeof(test_tag_wrd_t));
-		d->id = 2;
-		d->stag = 3;
-		d->wr_status = TEST_WR_PENDING;
-		d->len = 0;
-		list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
+		test_queue_rwr(iwsk, 3);
+		test_queue_rwr(iwsk, 3);
 
 		/* test with multiple similar stags & blocked for mis-match */
 		rdmap_tag_recv(iwsk, cf, 3, 4);
-
+		test_expect_rwrq(iwsk, 1, 1);
+		printf("reap rwr ok\n");
 	}
 	rdmap_deregister_sock(sk);
 	rdmap_fin();
@@ -315,8 +295,7 @@ test_rdma_read(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 	rdmap_init();
 	rdmap_register_sock(sk, scq, rcq);
 	iwsk_t *iwsk = iwsk_lookup(sk);
-	iwsk->mpask.use_mrkr = use_mrkr;
-	iwsk->mpask.use_crc = use_crc;
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
 	debug(2, "iwsk %p %d", iwsk, iwsk->sk);
 
 	if (is_server) {
@@ -332,11 +311,11 @@ test_rdma_read(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 		for (i=0; i<NUM; i++)
 			*(((uint32_t *)b.buf) + i) = i;
 
-		rdmap_send(sk, &stag, sizeof(stag_t), 1);
+		rdmap_send(sk, &stag, sizeof(stag_t), 1, 0);
 		while(cq_consume(iwsk->scq, &cqe) == -ENOENT);
 		debug(2, "wrid %u", cqe.id);
 
-		rdmap_send(sk, &to, sizeof(to), 2);
+		rdmap_send(sk, &to, sizeof(to), 2, 0);
 		while(cq_consume(iwsk->scq, &cqe) == -ENOENT);
 		debug(2, "wrid %u", cqe.id);
 
@@ -363,13 +342,13 @@ test_rdma_read(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 			rdmap_poll();
 		debug(2, "stag rcvd (%u)", rem_to);
 
-		rdmap_rdma_read(sk, my_stag, my_to, b.len, rem_stag, rem_to, 2);
+		rdmap_rdma_read(sk, my_stag, my_to, b.len, rem_stag, rem_to, 2, 0);
 		while (cq_consume(iwsk->scq, &cqe))
 			rdmap_poll();
 		debug(2, "cqe %u %u", cqe.id, cqe.msg_len);
 		uint32_t ack = cqe.msg_len;
 
-		rdmap_send(sk, &ack, sizeof(ack), 3);
+		rdmap_send(sk, &ack, sizeof(ack), 3, 0);
 		while(cq_consume(iwsk->scq, &cqe) == -ENOENT)
 			rdmap_poll();
 
@@ -404,8 +383,7 @@ test_byte_order(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 	rdmap_register_sock(sk, scq, rcq);
 
 	iwsk_t *iwsk = iwsk_lookup(sk);
-	iwsk->mpask.use_mrkr = use_mrkr;
-	iwsk->mpask.use_crc = use_crc;
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
 
 	if (is_server) {
 		rdmap_post_recv(sk, b.buf, b.len, 0);
@@ -417,14 +395,527 @@ test_byte_order(socket_t sk, bool_t use_mrkr, bool_t use_crc)
 		*(stag_t *)(cp + off) = 0x01798a00; off += 4;
 		*(tag_offset_t *)(cp + off) = 0x000000000804e008; off += 8;
 		*(msg_len_t *)(cp + off) = 1024; off += 4;
-		rdmap_send(sk, b.buf, b.len, 0);
+		rdmap_send(sk, b.buf, b.len, 0, 0);
+	}
+
+	cq_destroy(scq);
+	cq_destroy(rcq);
+	rdmap_deregister_sock(sk);
+	free(b.buf);
+	rdmap_fin();
+}
+
+/* waits for the next completion on cq, polling */
+static void
+test_wait_cqe(cq_t *cq, cqe_t *cqe)
+{
+	while (cq_consume(cq, cqe) == -ENOENT)
+		rdmap_poll();
+}
+
+/*
+ * A send gathered from three pieces, one empty, scattered over two that
+ * split it elsewhere and leave room over, then an rdma write gathered
+ * from three more.
+ */
+static void
+test_sge(socket_t sk, bool_t use_mrkr, bool_t use_crc)
+{
+	uint32_t len = length, i;
+	uint8_t *a, *b;
+	uint64_t msg[2];
+	cqe_t cqe;
+	cq_t *scq, *rcq;
+
+	if (len < 8)
+		len = 8;
+	a = Malloc(len);
+	b = Malloc(len);
+	scq = cq_create(16);
+	rcq = cq_create(16);
+
+	mem_init();
+	rdmap_init();
+	rdmap_register_sock(sk, scq, rcq);
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
+
+	if (is_server) {
+		uint32_t split = len/2 + 1, ack = 0;
+		struct iovec r[2] = { { a, split }, { b, len } };
+		mem_desc_t md;
+
+		memset(a, 0, len);
+		memset(b, 0, len);
+		rdmap_post_recv_vec(sk, r, 2, 1);
+		test_wait_cqe(rcq, &cqe);
+		if (cqe.id != 1 || cqe.msg_len != len
+		    || cqe.status != RDMAP_SUCCESS)
+			error("%s: recv cqe id %d len %u", __func__,
+			      (int) cqe.id, cqe.msg_len);
+		for (i=0; i<len; i++)
+			if ((i < split ? a[i] : b[i - split]) != (uint8_t)(i*13))
+				error("%s: wrong recv byte %u", __func__, i);
+
+		memset(a, 0, len);
+		md = mem_register(a, len);
+		msg[0] = mem_stag_create(sk, md, 0, len, STAG_W, 0);
+		msg[1] = (uintptr_t) a;
+		rdmap_post_recv(sk, &ack, sizeof(ack), 2);
+		rdmap_send(sk, msg, sizeof(msg), 1, 0);
+		test_wait_cqe(rcq, &cqe);
+		for (i=0; i<len; i++)
+			if (a[i] != (uint8_t)(i*5))
+				error("%s: wrong written byte %u", __func__, i);
+		mem_deregister(md);
+		printf("sge ok\n");
+	} else {
+		struct iovec s[3] = {
+			{ a, len/3 }, { a + len/3, 0 }, { a + len/3, len - len/3 }
+		};
+		uint32_t ack = 1;
+
+		for (i=0; i<len; i++)
+			a[i] = i*13;
+		rdmap_post_recv(sk, msg, sizeof(msg), 1);
+		rdmap_send_vec(sk, s, 3, 1, 0);
+		test_wait_cqe(rcq, &cqe);
+
+		for (i=0; i<len; i++)
+			b[i] = i*5;
+		s[0].iov_base = b;
+		s[0].iov_len = 3;
+		s[1].iov_base = b + 3;
+		s[1].iov_len = len/2 - 3;
+		s[2].iov_base = b + len/2;
+		s[2].iov_len = len - len/2;
+		rdmap_rdma_write_vec(sk, msg[0], msg[1], s, 3, 2, 0);
+		rdmap_send(sk, &ack, sizeof(ack), 3, 0);
+		for (i=0; i<3; i++) {
+			test_wait_cqe(scq, &cqe);
+			if (cqe.id != 1+i || cqe.status != RDMAP_SUCCESS)
+				error("%s: cqe id %d", __func__, (int) cqe.id);
+		}
+	}
+
+	cq_destroy(scq);
+	cq_destroy(rcq);
+	rdmap_deregister_sock(sk);
+	free(a);
+	free(b);
+	rdmap_fin();
+	mem_fini();
+}
+
+/*
+ * Sends posted while corked complete at the uncork, not before, and all
+ * arrive.
+ */
+static void
+test_cork(socket_t sk, bool_t use_mrkr, bool_t use_crc)
+{
+	enum { N = 3 };
+	uint32_t v[N], i;
+	cqe_t cqe;
+	cq_t *scq, *rcq;
+
+	scq = cq_create(16);
+	rcq = cq_create(16);
+
+	mem_init();
+	rdmap_init();
+	rdmap_register_sock(sk, scq, rcq);
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
+
+	if (is_server) {
+		for (i=0; i<N; i++)
+			rdmap_post_recv(sk, &v[i], sizeof(v[i]), i);
+		for (i=0; i<N; i++) {
+			test_wait_cqe(rcq, &cqe);
+			if (cqe.id != i || cqe.status != RDMAP_SUCCESS
+			    || v[i] != 100+i)
+				error("%s: recv cqe id %d value %u", __func__,
+				      (int) cqe.id, v[i]);
+		}
+		printf("cork ok\n");
+	} else {
+		if (rdmap_cork(sk) < 0)
+			error("%s: cork", __func__);
+		for (i=0; i<N; i++) {
+			v[i] = 100+i;
+			rdmap_send(sk, &v[i], sizeof(v[i]), i, 0);
+		}
+		if (cq_consume(scq, &cqe) != -ENOENT)
+			error("%s: cqe before the uncork", __func__);
+		if (rdmap_uncork(sk) < 0)
+			error("%s: uncork", __func__);
+		for (i=0; i<N; i++) {
+			if (cq_consume(scq, &cqe) < 0)
+				error("%s: no cqe %u after the uncork", __func__, i);
+			if (cqe.id != i || cqe.status != RDMAP_SUCCESS)
+				error("%s: cqe id %d status %d", __func__,
+				      (int) cqe.id, cqe.status);
+		}
+	}
+
+	cq_destroy(scq);
+	cq_destroy(rcq);
+	rdmap_deregister_sock(sk);
+	rdmap_fin();
+	mem_fini();
+}
+
+/*
+ * An unsignaled send leaves no completion; the signaled one after it
+ * does, and both arrive.
+ */
+static void
+test_unsignaled(socket_t sk, bool_t use_mrkr, bool_t use_crc)
+{
+	enum { N = 2 };
+	uint32_t v[N], i;
+	cqe_t cqe;
+	cq_t *scq, *rcq;
+
+	scq = cq_create(16);
+	rcq = cq_create(16);
+
+	mem_init();
+	rdmap_init();
+	rdmap_register_sock(sk, scq, rcq);
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
+
+	if (is_server) {
+		for (i=0; i<N; i++)
+			rdmap_post_recv(sk, &v[i], sizeof(v[i]), i);
+		for (i=0; i<N; i++) {
+			test_wait_cqe(rcq, &cqe);
+			if (cqe.id != i || cqe.status != RDMAP_SUCCESS
+			    || v[i] != 200+i)
+				error("%s: recv cqe id %d value %u", __func__,
+				      (int) cqe.id, v[i]);
+		}
+		printf("unsignaled ok\n");
+	} else {
+		for (i=0; i<N; i++)
+			v[i] = 200+i;
+		if (rdmap_send(sk, &v[0], sizeof(v[0]), 0,
+			       RDMAP_UNSIGNALED) < 0)
+			error("%s: unsignaled send", __func__);
+		if (cq_consume(scq, &cqe) != -ENOENT)
+			error("%s: cqe id %d for the unsignaled send", __func__,
+			      (int) cqe.id);
+		if (rdmap_send(sk, &v[1], sizeof(v[1]), 1, 0) < 0)
+			error("%s: signaled send", __func__);
+		test_wait_cqe(scq, &cqe);
+		if (cqe.id != 1 || cqe.status != RDMAP_SUCCESS)
+			error("%s: cqe id %d status %d", __func__,
+			      (int) cqe.id, cqe.status);
+		if (cq_consume(scq, &cqe) != -ENOENT)
+			error("%s: extra cqe id %d", __func__, (int) cqe.id);
+	}
+
+	cq_destroy(scq);
+	cq_destroy(rcq);
+	rdmap_deregister_sock(sk);
+	rdmap_fin();
+	mem_fini();
+}
+
+/*
+ * One read split into several chunks, not dividing it evenly: the data
+ * all lands and it completes once, for the whole length.
+ */
+static void
+test_read_chunks(socket_t sk, bool_t use_mrkr, bool_t use_crc)
+{
+	uint32_t NUM = length/4;
+	uint32_t i, ack = 0;
+	uint32_t *v;
+	msg_len_t len = NUM*sizeof(uint32_t);
+	cqe_t cqe;
+	cq_t *scq, *rcq;
+
+	v = Malloc(len);
+	scq = cq_create(16);
+	rcq = cq_create(16);
+
+	mem_init();
+	rdmap_init();
+	rdmap_register_sock(sk, scq, rcq);
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
+
+	if (is_server) {
+		mem_desc_t md = mem_register(v, len);
+		stag_t stag = mem_stag_create(sk, md, 0, len, STAG_R, 0);
+		tag_offset_t to = (tag_offset_t)((uintptr_t)v);
+
+		for (i=0; i<NUM; i++)
+			v[i] = 7*i + 1;
+		rdmap_send(sk, &stag, sizeof(stag), 1, 0);
+		test_wait_cqe(scq, &cqe);
+		rdmap_send(sk, &to, sizeof(to), 2, 0);
+		test_wait_cqe(scq, &cqe);
+
+		rdmap_post_recv(sk, &ack, sizeof(ack), 3);
+		test_wait_cqe(rcq, &cqe);
+		if (ack != len)
+			error("%s: client read %u of %u", __func__, ack, len);
+		printf("read chunks ok\n");
+		mem_deregister(md);
+	} else {
+		mem_desc_t md = mem_register(v, len);
+		stag_t my_stag = mem_stag_create(sk, md, 0, len, STAG_W, 0);
+		tag_offset_t my_to = (tag_offset_t)((uintptr_t)v);
+		stag_t rem_stag = 0;
+		tag_offset_t rem_to = 0;
+
+		memset(v, 0, len);
+		rdmap_post_recv(sk, &rem_stag, sizeof(rem_stag), 1);
+		test_wait_cqe(rcq, &cqe);
+		rdmap_post_recv(sk, &rem_to, sizeof(rem_to), 2);
+		test_wait_cqe(rcq, &cqe);
+
+		if (rdmap_set_read_chunk(sk, len/4 + 1) < 0)
+			error("%s: set read chunk", __func__);
+		if (rdmap_rdma_read(sk, my_stag, my_to, len, rem_stag, rem_to,
+				    5, 0) < 0)
+			error("%s: rdma read", __func__);
+		test_wait_cqe(scq, &cqe);
+		if (cqe.id != 5 || cqe.status != RDMAP_SUCCESS
+		    || cqe.msg_len != len)
+			error("%s: cqe id %d status %d len %u", __func__,
+			      (int) cqe.id, cqe.status, cqe.msg_len);
+		for (i=0; i<NUM; i++)
+			if (v[i] != 7*i + 1)
+				error("%s: word %u is %u", __func__, i, v[i]);
+
+		ack = cqe.msg_len;
+		rdmap_send(sk, &ack, sizeof(ack), 3, 0);
+		test_wait_cqe(scq, &cqe);
+		if (cqe.id != 3)
+			error("%s: cqe id %d after the read, not the send",
+			      __func__, (int) cqe.id);
+		if (cq_consume(scq, &cqe) != -ENOENT)
+			error("%s: extra cqe id %d", __func__, (int) cqe.id);
+		mem_deregister(md);
+	}
+
+	cq_destroy(scq);
+	cq_destroy(rcq);
+	rdmap_deregister_sock(sk);
+	free(v);
+	rdmap_fin();
+	mem_fini();
+}
+
+/*
+ * RFC 7306: write with immediate data, then fetch and add, compare and
+ * swap that hits and one that misses, and swap, all on one word.  The
+ * immediate's cqe has the length written only if imm_len was agreed.
+ */
+static void
+test_ext(socket_t sk, bool_t use_mrkr, bool_t use_crc, bool_t imm_len)
+{
+	const uint64_t IMM = 0x1122334455667788ULL;
+	uint32_t NUM = length/4;
+	uint32_t i;
+	buf_t b;
+	uint64_t *target, msg[4];
+	cqe_t cqe;
+	cq_t *scq, *rcq;
+
+	b.len = NUM*sizeof(uint32_t);
+	b.buf = Malloc(b.len);
+	memset(b.buf, 0, b.len);
+	target = Malloc(sizeof(*target));
+	scq = cq_create(16);
+	rcq = cq_create(16);
+
+	mem_init();
+	rdmap_init();
+	rdmap_register_sock(sk, scq, rcq);
+	rdmap_set_sock_attrs(sk, use_mrkr, use_crc);
+	/* no startup here to agree on them */
+	iwsk_lookup(sk)->mpask.ext = RDMAP_EXT_IMM | RDMAP_EXT_ATOMIC
+				     | (imm_len ? RDMAP_EXT_IMM_LEN : 0);
+
+	if (is_server) {
+		mem_desc_t md = mem_register(b.buf, b.len);
+		mem_desc_t amd = mem_register(target, sizeof(*target));
+		uint32_t ack = 0;
+
+		*target = 5;
+		msg[0] = mem_stag_create(sk, md, 0, b.len, STAG_W, 0);
+		msg[1] = (uintptr_t) b.buf;
+		msg[2] = mem_stag_create(sk, amd, 0, sizeof(*target),
+					 STAG_RW, 0);
+		msg[3] = (uintptr_t) target;
+		/* the immediate data uses up a receive, the ack the next */
+		rdmap_post_recv(sk, NULL, 0, 7);
+		rdmap_post_recv(sk, &ack, sizeof(ack), 8);
+		rdmap_send(sk, msg, sizeof(msg), 1, 0);
+		test_wait_cqe(rcq, &cqe);
+		if (cqe.id != 7 || cqe.op != OP_RECV_IMM || cqe.imm != IMM
+		    || cqe.msg_len != (imm_len ? b.len : 0)
+		    || cqe.status != RDMAP_SUCCESS)
+			error("%s: immediate cqe id %d op %d len %u",
+			      __func__, (int) cqe.id, cqe.op, cqe.msg_len);
+		for (i=0; i<NUM; i++)
+			if (((uint32_t *)b.buf)[i] != i)
+				error("%s: wrong word %u, got %u", __func__, i,
+				      ((uint32_t *)b.buf)[i]);
+		test_wait_cqe(rcq, &cqe);
+		if (cqe.id != 8 || *target != 42)
+			error("%s: target %Lu after the atomics", __func__,
+			      Lu(*target));
+		mem_deregister(amd);
+		mem_deregister(md);
+	} else {
+		uint64_t orig[4] = { 0, 0, 0, 0 };
+		const uint64_t want[4] = { 5, 15, 100, 100 };
+		uint32_t ack = 1;
+
+		rdmap_post_recv(sk, msg, sizeof(msg), 1);
+		test_wait_cqe(rcq, &cqe);
+		for (i=0; i<NUM; i++)
+			((uint32_t *)b.buf)[i] = i;
+		rdmap_rdma_write_imm(sk, msg[0], msg[1], b.buf, b.len, IMM,
+				     1, 0);
+		test_wait_cqe(scq, &cqe);
+
+		/* ord is 1, the rest wait their turn behind the first */
+		rdmap_atomic(sk, RDMAP_ATOMIC_FETCH_ADD, msg[2], msg[3], 10, 0,
+			     &orig[0], 2, 0);
+		rdmap_atomic(sk, RDMAP_ATOMIC_CMP_SWAP, msg[2], msg[3], 100, 15,
+			     &orig[1], 3, 0);
+		rdmap_atomic(sk, RDMAP_ATOMIC_CMP_SWAP, msg[2], msg[3], 7, 15,
+			     &orig[2], 4, 0);
+		rdmap_atomic(sk, RDMAP_ATOMIC_SWAP, msg[2], msg[3], 42, 0,
+			     &orig[3], 5, 0);
+		for (i=0; i<4; i++) {
+			test_wait_cqe(scq, &cqe);
+			if (cqe.id != 2+i || cqe.op != OP_ATOMIC
+			    || cqe.status != RDMAP_SUCCESS || orig[i] != want[i])
+				error("%s: atomic %u: cqe id %d, orig %Lu",
+				      __func__, i, (int) cqe.id, Lu(orig[i]));
+		}
+		rdmap_send(sk, &ack, sizeof(ack), 6, 0);
+		test_wait_cqe(scq, &cqe);
+		printf("ext ok\n");
 	}
 
 	cq_destroy(scq);
 	cq_destroy(rcq);
 	rdmap_deregister_sock(sk);
+	free(target);
 	free(b.buf);
 	rdmap_fin();
+	mem_fini();
+}
+
+/*
+ * An atomic on memory registered for writes only: the peer terminates,
+ * and the atomic completes in error.  The stream is done with after it.
+ */
+static void
+test_atomic_error(socket_t sk)
+{
+	uint64_t *target, msg[2];
+	cqe_t cqe;
+	cq_t *scq, *rcq;
+
+	target = Malloc(sizeof(*target));
+	*target = 5;
+	scq = cq_create(16);
+	rcq = cq_create(16);
+
+	mem_init();
+	rdmap_init();
+	rdmap_register_sock(sk, scq, rcq);
+	iwsk_t *iwsk = iwsk_lookup(sk);
+	iwsk->mpask.ext = RDMAP_EXT_ATOMIC;
+
+	if (is_server) {
+		mem_desc_t md = mem_register(target, sizeof(*target));
+
+		msg[0] = mem_stag_create(sk, md, 0, sizeof(*target), STAG_W, 0);
+		msg[1] = (uintptr_t) target;
+		rdmap_send(sk, msg, sizeof(msg), 1, 0);
+		while (!iwsk->mpask.eof)
+			rdmap_poll();
+		if (*target != 5)
+			error("%s: target changed to %Lu", __func__,
+			      Lu(*target));
+		mem_deregister(md);
+	} else {
+		uint64_t orig = 0;
+
+		rdmap_post_recv(sk, msg, sizeof(msg), 1);
+		test_wait_cqe(rcq, &cqe);
+		rdmap_atomic(sk, RDMAP_ATOMIC_FETCH_ADD, msg[0], msg[1], 10, 0,
+			     &orig, 2, 0);
+		test_wait_cqe(scq, &cqe);
+		if (cqe.id != 2 || cqe.op != OP_ATOMIC
+		    || cqe.status != RDMAP_FAILURE)
+			error("%s: cqe id %d status %d", __func__,
+			      (int) cqe.id, cqe.status);
+		printf("atomic error ok\n");
+	}
+
+	cq_destroy(scq);
+	cq_destroy(rcq);
+	rdmap_deregister_sock(sk);
+	free(target);
+	rdmap_fin();
+	mem_fini();
+}
+
+/*
+ * A batch whose write fails: the uncork says so and the sends in it
+ * complete in error.  The client shuts down its side to make the write
+ * fail, so this goes after everything else.
+ */
+static void
+test_cork_error(socket_t sk)
+{
+	enum { N = 2 };
+	uint32_t v[N], i;
+	cqe_t cqe;
+	cq_t *scq, *rcq;
+
+	if (is_server)
+		return;
+	scq = cq_create(16);
+	rcq = cq_create(16);
+
+	mem_init();
+	rdmap_init();
+	rdmap_register_sock(sk, scq, rcq);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (rdmap_cork(sk) < 0)
+		error("%s: cork", __func__);
+	for (i=0; i<N; i++) {
+		v[i] = i;
+		rdmap_send(sk, &v[i], sizeof(v[i]), i, 0);
+	}
+	shutdown(sk, SHUT_WR);
+	if (rdmap_uncork(sk) >= 0)
+		error("%s: uncork did not fail", __func__);
+	for (i=0; i<N; i++) {
+		if (cq_consume(scq, &cqe) < 0)
+			error("%s: no cqe %u after the uncork", __func__, i);
+		if (cqe.id != i || cqe.status != RDMAP_FAILURE)
+			error("%s: cqe id %d status %d", __func__,
+			      (int) cqe.id, cqe.status);
+	}
+	printf("cork error ok\n");
+
+	cq_destroy(scq);
+	cq_destroy(rcq);
+	rdmap_deregister_sock(sk);
+	rdmap_fin();
+	mem_fini();
 }
 
 int
@@ -443,6 +934,18 @@ main(int argc, char *argv[])
 	test_rdma_read(sk, FALSE, TRUE);
 	test_byte_order(sk, TRUE, TRUE);
 	test_byte_order(sk, FALSE, TRUE);
+	test_sge(sk, TRUE, TRUE);
+	test_sge(sk, FALSE, TRUE);
+	test_cork(sk, TRUE, TRUE);
+	test_cork(sk, FALSE, TRUE);
+	test_read_chunks(sk, TRUE, TRUE);
+	test_read_chunks(sk, FALSE, TRUE);
+	test_unsignaled(sk, TRUE, TRUE);
+	test_unsignaled(sk, FALSE, TRUE);
+	test_ext(sk, TRUE, TRUE, TRUE);
+	test_ext(sk, FALSE, TRUE, FALSE);
+	test_atomic_error(sk);  /* these two end the stream */
+	test_cork_error(sk);
 	close(sk);
 	return 0;
 }
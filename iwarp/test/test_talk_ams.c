@@ -266,7 +266,7 @@ write_stag_to_len(int s)
 	*(stag_t *)(buf+off) = local_stag; off += 4;
 	*(tag_offset_t *)(buf+off) = local_to; off += 8;
 	*(uint32_t *)(buf+off) = local_len; off += 4;
-	rdmap_send(s, buf, off, 0);
+	rdmap_send(s, buf, off, 0, 0);
 
 	iwsk_t *iwsk = iwsk_lookup(s);
 	cqe_t cqe;
@@ -300,7 +300,7 @@ send_ping(int s, int c, char *b)
 
 	for (i=0; i<bufsize; i++)
 		b[i] = c;
-	rdmap_rdma_write(s, remote_stag, remote_to, b, bufsize, 0);
+	rdmap_rdma_write(s, remote_stag, remote_to, b, bufsize, 0, 0);
 
 	while(cq_consume(iwsk->scq, &cqe) == -ENOENT);
 	/* printf("%s: okay\n", __func__); */
@@ -158,6 +158,19 @@ Malloc(unsigned int n)
     return x;
 }
 
+void *
+Realloc(void *p, unsigned int n)
+{
+    void *x;
+
+    if (n == 0)
+	error("Realloc called on zero bytes");
+    x = realloc(p, n);
+    if (!x)
+	error("%s: couldn't get %d bytes", __func__, n);
+    return x;
+}
+
 /*
  * Gcc >= "2.96" seem to have this nice addition.  2.95.2 does not.
  */
@@ -16,6 +16,7 @@
 #  define ATTR_PRINTF2  __attribute__ ((format(printf, 2, 3)))
 #  define ATTR_NORETURN __attribute__ ((noreturn))
 #  define ATTR_UNUSED   __attribute__ ((unused))
+#  define ATTR_ALWAYS_INLINE __attribute__ ((always_inline))
 #  if __GNUC__ > 2
 #  	 define ATTR_MALLOC   __attribute__ ((malloc))
 #  else
@@ -32,6 +33,7 @@
 #  define ATTR_PRINTF2
 #  define ATTR_NORETURN
 #  define ATTR_UNUSED
+#  define ATTR_ALWAYS_INLINE
 #  define ATTR_MALLOC
 #  ifndef likely
 #  define likely(x)   (x)
@@ -86,6 +88,7 @@ extern void error_errno(const char *fmt, ...) ATTR_PRINTF ATTR_NORETURN;
 extern void error_ret(int ret, const char *fmt, ...) ATTR_PRINTF2 ATTR_NORETURN;
 extern char *strsave(const char *s);
 extern void *Malloc(unsigned int n) ATTR_MALLOC;
+extern void *Realloc(void *p, unsigned int n);
 extern void read_full(int fd, void *buf, size_t count);
 extern int write_full(int fd, const void *buf, size_t count);
 extern void readv_full(int fd, struct iovec *vec, int vec_sz, ssize_t len);
@@ -19,6 +19,7 @@ typedef struct {
     int status;
     u64 id;
     u32 msg_len;
+    s32 inv_stag;  /* stag removed by SEND with Invalidate, else 0 */
 } cqe_t;
 
 /* forward decl */
@@ -93,9 +93,14 @@ inline uint32_t ddp_get_hdr_sz(void *b)
 		return UNTAGGED_HDR_SZ;
 }
 
-int ddp_send_utm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
-                 uint32_t msg_len, qnum_t qn, uint8_t ulp_ctrl,
-		 uint32_t ulp_payld)
+/*
+ * Send an untagged message from user space through the pages of sd, or
+ * from the kernel buffer kmsg when sd is NULL.
+ */
+static int __ddp_send_utm(iwsk_t *iwsk, stag_desc_t *sd,
+			  const void __user *msg, const void *kmsg,
+			  uint32_t msg_len, qnum_t qn, uint8_t ulp_ctrl,
+			  uint32_t ulp_payld)
 {
 	int ret = 0;
 	int i, mo, num_sgmnts;
@@ -117,9 +122,8 @@ int ddp_send_utm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
 	    num_sgmnts = 1;
 
 	/*
-	 * Walk the entries in sd, doing kmap_atomic() on each.  Pass
-	 * to mpa_send.  kunmap.  Can accept kernel data too:  if sd is NULL
-	 * then msg is already in kernel.
+	 * Build an iovec over the mapped pages of sd, or over kmsg, and
+	 * pass it to mpa_send.
 	 */
 	mo = 0;
 	for (i = 0; i < num_sgmnts; i++) {
@@ -136,8 +140,7 @@ int ddp_send_utm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
 
 		numiov = 0;
 		if (sd == NULL) {
-			/* kernel message, not a __user pointer really */
-			iov[numiov].iov_base = (char *) msg + mo;
+			iov[numiov].iov_base = (char *) kmsg + mo;
 			iov[numiov].iov_len = ddp_payld_len;
 			++numiov;
 		} else {
@@ -170,6 +173,22 @@ int ddp_send_utm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
 	return ret;
 }
 
+int ddp_send_utm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
+                 uint32_t msg_len, qnum_t qn, uint8_t ulp_ctrl,
+		 uint32_t ulp_payld)
+{
+	return __ddp_send_utm(iwsk, sd, msg, NULL, msg_len, qn, ulp_ctrl,
+			      ulp_payld);
+}
+
+/* send untagged message from kernel data, such as our own headers */
+int ddp_send_utm_kvec(iwsk_t *iwsk, const struct kvec *kv, qnum_t qn,
+		      uint8_t ulp_ctrl, uint32_t ulp_payld)
+{
+	return __ddp_send_utm(iwsk, NULL, NULL, kv->iov_base, kv->iov_len,
+			      qn, ulp_ctrl, ulp_payld);
+}
+
 /* send tagged message, never from kernel data. */
 int ddp_send_tm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
                 uint32_t msg_len, uint8_t rsvdulp, stag_t sink_stag,
@@ -180,8 +199,6 @@ int ddp_send_tm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
 	msg_len_t mo;
 	ulpdu_len_t ddp_payld_len;
 	ddp_tag_hdr_t th;
-	unsigned long buf = (unsigned long) msg;
-	unsigned long ms = (unsigned long) sd->mr->start >> PAGE_SHIFT;
 
 	memset(&th, 0, sizeof(th));
 	th.cf = DDP_CF_TAGGED | DDP_CF_DV;
@@ -194,16 +211,11 @@ int ddp_send_tm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
 	if (unlikely(num_sgmnts == 0))
 	    num_sgmnts = 1;
 
-	/* premap pages */
-	for (i=0; i<sd->mr->npages; i++)
-		sd->mr->caddr[i] = kmap(sd->mr->page_list[i]);
-
 	mo = 0;
 	for (i=0; i<num_sgmnts; i++) {
 
 		struct kvec iov[5];
 		int numiov;
-		int left;
 
 		numiov = 0;
 		th.to = swab64(sink_to + mo);
@@ -213,39 +225,26 @@ int ddp_send_tm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
 			ddp_payld_len = msg_len - mo;
 		}
 
-		/*
-		 * Fill iov based on send buffer page boundaries.
-		 */
-		left = ddp_payld_len;
-		while (left > 0) {
-			int page_index = ((buf + mo) >> PAGE_SHIFT) - ms;
-			int page_offset = (buf + mo) & ~PAGE_MASK;
-			int page_avail = PAGE_SIZE - page_offset;
-			int numbytes = left;
-			if (numbytes > page_avail)
-				numbytes = page_avail;
-
-			if (numiov == sizeof(iov)/sizeof(iov[0])) {
-				iwarp_info("%s: iov overflow", __func__);
-				return -EOVERFLOW;
-			}
-			iov[numiov].iov_base = sd->mr->caddr[page_index]
-			                       + page_offset;
-			iov[numiov].iov_len = numbytes;
-			++numiov;
-			left -= numbytes;
-			mo += numbytes;
+		/* region pages are mapped already, usually one iov */
+		ret = mem_fill_iovec(msg, ddp_payld_len, mo, sd, iov,
+				     sizeof(iov)/sizeof(iov[0]), &numiov);
+		if (ret < 0) {
+			iwarp_info("%s: mem_fill_iovec error %d", __func__,
+				   ret);
+			return ret;
 		}
 
 		ret = mpa_send(iwsk, &th, sizeof(th), iov, numiov,
 		               ddp_payld_len);
+
+		/* XXX: this should be done after send completion */
+		mem_unmap_iovec(msg, ddp_payld_len, mo, sd);
+
 		if (ret < 0)
 			return ret;
-	}
 
-	/* unmap pages; XXX: do this after send completion */
-	for (i=0; i<sd->mr->npages; i++)
-		kunmap(sd->mr->page_list[i]);
+		mo += ddp_payld_len;
+	}
 
 	return ret;
 }
@@ -313,8 +312,8 @@ int ddp_get_sink(struct user_context *uc, iwsk_t *iwsk, void *hdr,
 		 * linear offset in userspace relative to beginning of
 		 * tagged buffers.
 		 */
-		rbuf = rdmap_get_tag_sink(uc, stag, to, payload_len, h->rsvdulp,
-		                          &offset);
+		rbuf = rdmap_get_tag_sink(uc, iwsk, stag, to, payload_len,
+		                          h->rsvdulp, &offset);
 		if (!rbuf) {
 			iwarp_info("%s: rdmap_get_tag_sink no buf", __func__);
 			return -ENOBUFS;
@@ -130,6 +130,9 @@ int ddp_send_utm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
                  uint32_t msg_len, qnum_t qn, uint8_t ulp_ctrl,
 		 uint32_t ulp_payld);
 
+int ddp_send_utm_kvec(iwsk_t *iwsk, const struct kvec *kv, qnum_t qn,
+		      uint8_t ulp_ctrl, uint32_t ulp_payld);
+
 int ddp_send_tm(iwsk_t *iwsk, stag_desc_t *sd, const void __user *msg,
                 uint32_t msg_len, uint8_t rsvdulp, stag_t sink_stag,
 		tag_offset_t sink_to);
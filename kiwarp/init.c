@@ -9,7 +9,8 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
 #include "util.h"
 #include "user.h"
 #include "rdmap.h"
@@ -171,7 +172,8 @@ static ssize_t iwarp_write(struct file *file, const char __user *ubuf,
 		rcq = cq_lookup(uc, ureg.rcq_handle);
 		if (!rcq)
 			return -EINVAL;
-		ret = rdmap_register_sock(uc, ureg.fd, scq, rcq);
+		ret = rdmap_register_sock(uc, ureg.fd, scq, rcq,
+					  ureg.prot_domain);
 		break;
 	    }
 	    case IWARP_SET_SOCK_ATTRS: {
@@ -287,6 +289,76 @@ static ssize_t iwarp_write(struct file *file, const char __user *ubuf,
 		ret = mem_deregister(umd.md, uc->mm);
 		break;
 	    }
+	    case IWARP_MEM_REG_VEC: {
+		struct user_mem_reg_vec urv;
+		struct user_mem_reg_ent *ents;
+		size_t sz;
+		if (count != sizeof(urv))
+			return -EINVAL;
+		if (copy_from_user(&urv, ubuf, sizeof(urv)))
+			return -EFAULT;
+		if (urv.count == 0 || urv.count > MEM_REG_VEC_MAX)
+			return -EINVAL;
+		sz = urv.count * sizeof(*ents);
+		ents = vmalloc(sz);
+		if (!ents)
+			return -ENOMEM;
+		ret = -EFAULT;
+		if (copy_from_user(ents, urv.ents, sz))
+			goto reg_vec_out;
+		ret = mem_register_vec(ents, urv.count, urv.prot_domain,
+				       uc->mm);
+		if (ret)
+			goto reg_vec_out;
+		if (copy_to_user(urv.ents, ents, sz)) {
+			mem_deregister_vec(ents, urv.count, uc->mm);
+			ret = -EFAULT;
+		}
+	    reg_vec_out:
+		vfree(ents);
+		break;
+	    }
+	    case IWARP_MEM_DEREG_VEC: {
+		struct user_mem_dereg_vec udv;
+		struct user_mem_reg_ent *ents;
+		size_t sz;
+		if (count != sizeof(udv))
+			return -EINVAL;
+		if (copy_from_user(&udv, ubuf, sizeof(udv)))
+			return -EFAULT;
+		if (udv.count == 0 || udv.count > MEM_REG_VEC_MAX)
+			return -EINVAL;
+		sz = udv.count * sizeof(*ents);
+		ents = vmalloc(sz);
+		if (!ents)
+			return -ENOMEM;
+		if (copy_from_user(ents, udv.ents, sz))
+			ret = -EFAULT;
+		else
+			ret = mem_deregister_vec(ents, udv.count, uc->mm);
+		vfree(ents);
+		break;
+	    }
+	    case IWARP_MEM_CACHE_LIMIT: {
+		struct user_mem_cache_limit umcl;
+		if (count != sizeof(umcl))
+			return -EINVAL;
+		if (copy_from_user(&umcl, ubuf, sizeof(umcl)))
+			return -EFAULT;
+		mem_cache_set_limit(umcl.limit, uc->mm);
+		ret = 0;
+		break;
+	    }
+	    case IWARP_MEM_INVALIDATE: {
+		struct user_mem_invalidate umi;
+		if (count != sizeof(umi))
+			return -EINVAL;
+		if (copy_from_user(&umi, ubuf, sizeof(umi)))
+			return -EFAULT;
+		mem_invalidate(umi.address, umi.len, uc->mm);
+		ret = 0;
+		break;
+	    }
 	    case IWARP_STAG_CREATE: {
 		struct user_stag_create usc;
 		stag_t stag;
@@ -316,12 +388,60 @@ static ssize_t iwarp_write(struct file *file, const char __user *ubuf,
 	    }
 	    case IWARP_SEND: {
 		struct user_send us;
-		if (count != sizeof(us))
+		char data[IWARP_MAX_INLINE];
+		struct kvec kv;
+		if (count < sizeof(us))
 			return -EINVAL;
 		if (copy_from_user(&us, ubuf, sizeof(us)))
 			return -EFAULT;
+		if (us.flags & IWARP_WR_INLINE) {
+			/* payload came with the command, send from our copy */
+			if (us.len > IWARP_MAX_INLINE
+			 || count != sizeof(us) + us.len)
+				return -EINVAL;
+			if (copy_from_user(data, ubuf + sizeof(us), us.len))
+				return -EFAULT;
+			kv.iov_base = data;
+			kv.iov_len = us.len;
+			ret = rdmap_send_kvec(uc, us.fd, us.id, &kv,
+					      us.inv_stag, us.flags);
+			break;
+		}
+		if (count != sizeof(us))
+			return -EINVAL;
 		ret = rdmap_send(uc, us.fd, us.id, us.buf, us.len,
-		                 us.local_stag);
+		                 us.local_stag, us.inv_stag, us.flags);
+		break;
+	    }
+	    case IWARP_MW_ALLOC: {
+		struct user_mw_alloc uma;
+		stag_t stag;
+		if (count != sizeof(uma))
+			return -EINVAL;
+		if (copy_from_user(&uma, ubuf, sizeof(uma)))
+			return -EFAULT;
+		stag = mem_mw_alloc(uma.prot_domain, uc->mm);
+		if (stag < 0)
+			return stag;
+		if (copy_to_user(uma.stag, &stag, sizeof(stag)))
+			return -EFAULT;
+		ret = 0;
+		break;
+	    }
+	    case IWARP_MW_BIND: {
+		struct user_mw_bind umb;
+		stag_t stag;
+		if (count != sizeof(umb))
+			return -EINVAL;
+		if (copy_from_user(&umb, ubuf, sizeof(umb)))
+			return -EFAULT;
+		stag = rdmap_bind_mw(uc, umb.fd, umb.id, umb.mw, umb.md,
+		                     umb.offset, umb.len, umb.rw, umb.flags);
+		if (stag < 0)
+			return stag;
+		if (copy_to_user(umb.stag, &stag, sizeof(stag)))
+			return -EFAULT;
+		ret = 0;
 		break;
 	    }
 	    case IWARP_POST_RECV: {
@@ -343,7 +463,7 @@ static ssize_t iwarp_write(struct file *file, const char __user *ubuf,
 			return -EFAULT;
 		ret = rdmap_rdma_write(uc, urw.fd, urw.id, urw.buf, urw.len,
 				       urw.local_stag, urw.sink_stag,
-				       urw.sink_to);
+				       urw.sink_to, urw.flags);
 		break;
 	    }
 	    case IWARP_RDMA_READ: {
@@ -354,13 +474,52 @@ static ssize_t iwarp_write(struct file *file, const char __user *ubuf,
 			return -EFAULT;
 		ret = rdmap_rdma_read(uc, urr.fd, urr.id, urr.sink_stag,
 				      urr.sink_to, urr.len, urr.src_stag,
-				      urr.src_to);
+				      urr.src_to, urr.flags);
 		break;
 	    }
 	    case IWARP_ENCOURAGE: {
 		ret = rdmap_encourage(uc, NULL);
 		break;
 	    }
+	    case IWARP_BATCH: {
+		struct user_batch ub;
+		struct user_batch_hdr bh;
+		const char __user *p;
+		uint32_t i, off = 0;
+		if (count != sizeof(ub))
+			return -EINVAL;
+		if (copy_from_user(&ub, ubuf, sizeof(ub)))
+			return -EFAULT;
+		/* one trip into the kernel for the lot */
+		for (i=0; i<ub.count; i++) {
+			p = (const char __user *) ub.buf + off;
+			if (ub.len - off < sizeof(bh)) {
+				ret = -EINVAL;
+				break;
+			}
+			if (copy_from_user(&bh, p, sizeof(bh))
+			 || copy_from_user(&cmd, p + sizeof(bh), sizeof(cmd))) {
+				ret = -EFAULT;
+				break;
+			}
+			if (bh.len > ub.len - off - sizeof(bh)
+			 || cmd == IWARP_BATCH) {
+				ret = -EINVAL;
+				break;
+			}
+			ret = iwarp_write(file, p + sizeof(bh), bh.len, ppos);
+			if (ret < 0)
+				break;
+			off += user_batch_reclen(bh.len);
+			if (off > ub.len)
+				off = ub.len;
+		}
+		if (put_user(i, ub.done))
+			return -EFAULT;
+		if (ret > 0)
+			ret = 0;
+		break;
+	    }
 	    default:
 		ret = -EINVAL;
 	}
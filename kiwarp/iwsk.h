@@ -72,6 +72,7 @@ typedef struct iwarp_sock {
 	struct socket *sock;
 	cq_t *scq; /* send comp q */
 	cq_t *rcq; /* recv comp q */;
+	int prot_domain; /* PD of the QP, whose stags the peer may use */
 	spinlock_t lock;
 	rdmap_sk_ent_t rdmapsk;
 	ddp_sk_ent_t ddpsk;
@@ -7,23 +7,71 @@
  * Distributed under the GNU Public License Version 2 or later (See
  * LICENSE)
  */
+#include <linux/version.h>
 #include <linux/mm.h>
 #include <linux/highmem.h>
+#include <linux/vmalloc.h>
 #include "mem.h"
+#include "user.h"
 #include "util.h"
 
 static const uint32_t DELTA = 10;
 
 static mem_region_t *mr_from_md(mem_desc_t md, mem_manager_t *mm);
 
+/* descriptors are the table index plus one, so zero is never valid */
 static inline mem_region_t *mr_from_md(mem_desc_t md, mem_manager_t *mm)
 {
-	mem_region_t *mr = (mem_region_t *) md;
+	if (md == 0 || md > (mem_desc_t) mm->num_mem_region)
+		return NULL;
+	return mm->mem_region[md - 1];
+}
 
-	if (mr < &(mm->mem_region[0])
-	    || mr >= &(mm->mem_region[mm->num_mem_region]))
+/*
+ * Make sure at least want free region slots exist.  Slots are allocated
+ * one at a time so a region, and the stags pointing at it, do not move
+ * when the table grows.  Unused slots are chained through next_free.
+ */
+static int mem_region_reserve(int want, mem_manager_t *mm)
+{
+	mem_region_t **x;
+	int i, n, nfree = 0;
+
+	for (i = mm->mem_region_free; i >= 0 && nfree < want;
+	     i = mm->mem_region[i]->next_free)
+		++nfree;
+	if (nfree >= want)
 		return 0;
-	return mr;
+
+	n = mm->num_mem_region ? 2 * mm->num_mem_region : DELTA;
+	while (n - mm->num_mem_region + nfree < want)
+		n *= 2;
+	x = kmalloc(n * sizeof(*x), GFP_KERNEL);
+	if (!x)
+		return -ENOMEM;
+	for (i = mm->num_mem_region; i < n; i++) {
+		x[i] = kmalloc(sizeof(**x), GFP_KERNEL);
+		if (!x[i])
+			goto free_slots;
+		memset(x[i], 0, sizeof(**x));
+		INIT_LIST_HEAD(&x[i]->stag_list);
+	}
+	if (mm->num_mem_region)
+		memcpy(x, mm->mem_region, mm->num_mem_region * sizeof(*x));
+	kfree(mm->mem_region);
+	for (i = n - 1; i >= mm->num_mem_region; i--) {
+		x[i]->next_free = mm->mem_region_free;
+		mm->mem_region_free = i;
+	}
+	mm->mem_region = x;
+	mm->num_mem_region = n;
+	return 0;
+
+free_slots:
+	while (--i >= mm->num_mem_region)
+		kfree(x[i]);
+	kfree(x);
+	return -ENOMEM;
 }
 
 int mem_initialize(mem_manager_t *mm)
@@ -36,16 +84,12 @@ int mem_initialize(mem_manager_t *mm)
 		goto out;
 	}
 
-	mm->num_mem_region = DELTA;
-	mm->mem_region = kmalloc(sizeof(*(mm->mem_region)) * DELTA,
-				 GFP_KERNEL);
-	if(!mm->mem_region) {
-		ret = -ENOMEM;
+	mm->num_mem_region = 0;
+	mm->mem_region = NULL;
+	mm->mem_region_free = -1;
+	ret = mem_region_reserve(DELTA, mm);
+	if (ret)
 		goto out;
-	}
-	memset(mm->mem_region, 0, DELTA * sizeof(*(mm->mem_region)));
-	for (i = 0; i < DELTA; i++)
-		INIT_LIST_HEAD(&(mm->mem_region[i].stag_list));
 
 	mm->stag_ht = kmalloc(sizeof(*(mm->stag_ht)), GFP_KERNEL);
 	if (!mm->stag_ht) {
@@ -57,12 +101,18 @@ int mem_initialize(mem_manager_t *mm)
 		goto free_stag_ht; /* failure */
 
 	mm->stag_next_cntr = 1;
-	spin_lock_init(&mm->lock);
+	mm->cache_root = RB_ROOT;
+	INIT_LIST_HEAD(&mm->cache_lru);
+	mm->cache_idle_bytes = 0;
+	mm->cache_limit = 0;
+	mutex_init(&mm->lock);
 	goto out; /* return success */
 
 free_stag_ht:
 	kfree(mm->stag_ht);
 free_mem_region:
+	for (i = 0; i < mm->num_mem_region; i++)
+		kfree(mm->mem_region[i]);
 	kfree(mm->mem_region);
 out:
 	return ret;
@@ -73,11 +123,296 @@ void mem_stag_free(void *x)
 	kfree(x);
 }
 
+/*
+ * Registrations stay pinned for as long as the cache holds them, so ask for
+ * a long-term pin where the kernel has one: FOLL_LONGTERM migrates pages out
+ * of CMA and movable zones first instead of blocking compaction forever.
+ * Older kernels only have get_user_pages, which does not migrate anything,
+ * and whose arguments changed twice on the way.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+#define mem_pin_pages(start, n, pages) \
+	pin_user_pages(start, n, FOLL_WRITE | FOLL_LONGTERM, pages)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+#define mem_pin_pages(start, n, pages) \
+	pin_user_pages(start, n, FOLL_WRITE | FOLL_LONGTERM, pages, NULL)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0)
+#define mem_pin_pages(start, n, pages) \
+	get_user_pages(start, n, FOLL_WRITE, pages, NULL)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,6,0)
+#define mem_pin_pages(start, n, pages) \
+	get_user_pages(start, n, 1, 0, pages, NULL)
+#else
+#define mem_pin_pages(start, n, pages) \
+	get_user_pages(current, current->mm, start, n, 1, 0, pages, NULL)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,8,0)
+#define mem_pin_lock()   mmap_read_lock(current->mm)
+#define mem_pin_unlock() mmap_read_unlock(current->mm)
+#else
+#define mem_pin_lock()   down_read(&current->mm->mmap_sem)
+#define mem_pin_unlock() up_read(&current->mm->mmap_sem)
+#endif
+
+/* placed data may have been written; dirty pages before letting go */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+#define mem_unpin_pages(pages, n) unpin_user_pages_dirty_lock(pages, n, 1)
+#else
+static void mem_unpin_pages(struct page **pages, int n)
+{
+	int i;
+
+	for (i=0; i<n; i++) {
+		set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+#endif
+
+/*
+ * Last entry starting at or below addr.  Entries in the tree are disjoint,
+ * so this is the only one that can contain addr.
+ */
+static mem_cache_ent_t *mem_cache_floor(unsigned long addr,
+					mem_manager_t *mm)
+{
+	struct rb_node *n = mm->cache_root.rb_node;
+	mem_cache_ent_t *e, *best = NULL;
+
+	while (n) {
+		e = rb_entry(n, mem_cache_ent_t, node);
+		if (e->start <= addr) {
+			best = e;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+	return best;
+}
+
+static void mem_cache_insert(mem_cache_ent_t *e, mem_manager_t *mm)
+{
+	struct rb_node **p = &mm->cache_root.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (e->start < rb_entry(parent, mem_cache_ent_t, node)->start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&e->node, parent, p);
+	rb_insert_color(&e->node, &mm->cache_root);
+	e->cached = 1;
+}
+
+/*
+ * Pin the user pages of a new entry, one chunk at a time, and map each
+ * chunk.  Returns NULL on failure.
+ */
+static mem_cache_ent_t *mem_cache_pin(unsigned long start, unsigned long end)
+{
+	int i, ret, off;
+	mem_cache_ent_t *e;
+	mem_chunk_t *c;
+
+	e = kmalloc(sizeof(*e), GFP_KERNEL);
+	if (!e)
+		return NULL;
+	memset(e, 0, sizeof(*e));
+	e->start = start;
+	e->end = end;
+	e->npages = (end - start) >> PAGE_SHIFT;
+	e->refcnt = 1;
+
+	e->nchunks = (e->npages + MEM_CHUNK_PAGES - 1) / MEM_CHUNK_PAGES;
+	e->chunk = kmalloc(e->nchunks * sizeof(*e->chunk), GFP_KERNEL);
+	if (!e->chunk)
+		goto free_ent;
+	memset(e->chunk, 0, e->nchunks * sizeof(*e->chunk));
+
+	mem_pin_lock();
+	for (i = 0; i < e->nchunks; i++) {
+		c = &e->chunk[i];
+		c->pages = (struct page **) __get_free_page(GFP_KERNEL);
+		if (!c->pages)
+			goto unpin;
+		c->npages = e->npages - i * MEM_CHUNK_PAGES;
+		if (c->npages > MEM_CHUNK_PAGES)
+			c->npages = MEM_CHUNK_PAGES;
+		off = 0;
+		while (off < c->npages) {
+			ret = mem_pin_pages(start + (i * MEM_CHUNK_PAGES + off)
+			                    * PAGE_SIZE, c->npages - off,
+			                    c->pages + off);
+			if (ret <= 0) {
+				if (off)
+					mem_unpin_pages(c->pages, off);
+				free_page((unsigned long) c->pages);
+				c->pages = NULL;
+				goto unpin;
+			}
+			off += ret;
+		}
+	}
+	mem_pin_unlock();
+
+	/* persistent mapping, never kmapped again on the data path */
+	for (i = 0; i < e->nchunks; i++) {
+		c = &e->chunk[i];
+		c->kaddr = vmap(c->pages, c->npages, VM_MAP, PAGE_KERNEL);
+		if (!c->kaddr)
+			iwarp_info("%s: vmap of %d pages failed, using kmap",
+			           __func__, c->npages);
+	}
+	return e;
+
+unpin:
+	mem_pin_unlock();
+	while (--i >= 0) {
+		mem_unpin_pages(e->chunk[i].pages, e->chunk[i].npages);
+		free_page((unsigned long) e->chunk[i].pages);
+	}
+	kfree(e->chunk);
+free_ent:
+	kfree(e);
+	return NULL;
+}
+
+/*
+ * Release pinned pages.  No mmap_sem needed, and current->mm may already
+ * be gone when called from release.
+ */
+static void mem_cache_unpin(mem_cache_ent_t *e)
+{
+	int i;
+	mem_chunk_t *c;
+
+	for (i=0; i<e->nchunks; i++) {
+		c = &e->chunk[i];
+		if (c->kaddr)
+			vunmap(c->kaddr);
+		mem_unpin_pages(c->pages, c->npages);
+		free_page((unsigned long) c->pages);
+	}
+	kfree(e->chunk);
+	kfree(e);
+}
+
+/*
+ * Take an entry out of the tree.  Idle ones are unpinned now, busy ones
+ * when their last region goes away.
+ */
+static void mem_cache_remove(mem_cache_ent_t *e, mem_manager_t *mm)
+{
+	rb_erase(&e->node, &mm->cache_root);
+	e->cached = 0;
+	if (e->refcnt == 0) {
+		list_del(&e->lru);
+		mm->cache_idle_bytes -= e->end - e->start;
+		mem_cache_unpin(e);
+	}
+}
+
+static void mem_cache_trim(mem_manager_t *mm)
+{
+	mem_cache_ent_t *e;
+
+	while (mm->cache_idle_bytes > mm->cache_limit) {
+		e = list_entry(mm->cache_lru.prev, mem_cache_ent_t, lru);
+		mem_cache_remove(e, mm);
+	}
+}
+
+/*
+ * Find or pin the entry covering the page aligned range [start, end).  On
+ * a miss, overlapping entries are folded into the new one so the tree stays
+ * disjoint.
+ */
+static mem_cache_ent_t *mem_cache_get(unsigned long start, unsigned long end,
+				      mem_manager_t *mm)
+{
+	mem_cache_ent_t *e;
+	struct rb_node *n;
+	unsigned long lo = start, hi = end;
+
+	e = mem_cache_floor(start, mm);
+	if (e && end <= e->end) {
+		if (e->refcnt++ == 0) {
+			list_del(&e->lru);
+			mm->cache_idle_bytes -= e->end - e->start;
+		}
+		return e;
+	}
+
+	if (e && e->end > start) {
+		lo = e->start;
+		if (e->end > hi)
+			hi = e->end;
+	}
+	n = e ? rb_next(&e->node) : rb_first(&mm->cache_root);
+	for (; n; n = rb_next(n)) {
+		e = rb_entry(n, mem_cache_ent_t, node);
+		if (e->start >= hi)
+			break;
+		if (e->end > hi)
+			hi = e->end;
+	}
+
+	while ((e = mem_cache_floor(hi - 1, mm)) && e->end > lo)
+		mem_cache_remove(e, mm);
+	e = mem_cache_pin(lo, hi);
+	if (e)
+		mem_cache_insert(e, mm);
+	return e;
+}
+
+static void mem_cache_put(mem_cache_ent_t *e, mem_manager_t *mm)
+{
+	if (--e->refcnt > 0)
+		return;
+	if (e->cached && mm->cache_limit > 0) {
+		list_add(&e->lru, &mm->cache_lru);
+		mm->cache_idle_bytes += e->end - e->start;
+		mem_cache_trim(mm);
+	} else {
+		if (e->cached)
+			rb_erase(&e->node, &mm->cache_root);
+		mem_cache_unpin(e);
+	}
+}
+
+void mem_cache_set_limit(size_t limit, mem_manager_t *mm)
+{
+	mutex_lock(&mm->lock);
+	mm->cache_limit = limit;
+	mem_cache_trim(mm);
+	mutex_unlock(&mm->lock);
+}
+
+/*
+ * Nothing tells us when user memory is unmapped, so the ULP must call this
+ * first.  Regions still registered keep their pages until deregistered.
+ */
+void mem_invalidate(void __user *addr, size_t len, mem_manager_t *mm)
+{
+	unsigned long lo = (unsigned long) addr & PAGE_MASK;
+	unsigned long hi = PAGE_ALIGN((unsigned long) addr + len);
+	mem_cache_ent_t *e;
+
+	mutex_lock(&mm->lock);
+	while ((e = mem_cache_floor(hi - 1, mm)) && e->end > lo)
+		mem_cache_remove(e, mm);
+	mutex_unlock(&mm->lock);
+}
+
 int mem_release(mem_manager_t *mm)
 {
 	int i;
 	int ret = 0;
 	struct hlist_node *cur, *next;
+	struct rb_node *n;
 	ht_node_t *node;
 	stag_desc_t *sd;
 
@@ -86,7 +421,7 @@ int mem_release(mem_manager_t *mm)
 		goto out;
 	}
 
-	spin_lock(&mm->lock);
+	mutex_lock(&mm->lock);
 	/* loop over stag_descs in stag hash; remove them from
 	 * mm->mem_region->stag_list. ht_delete_callback removes them from
 	 * stag_ht and releases their memory.
@@ -101,183 +436,116 @@ int mem_release(mem_manager_t *mm)
 		}
 	}
 
+	/* drop regions, then whatever the cache still holds pinned */
+	for (i = 0; i < mm->num_mem_region; i++) {
+		mem_region_t *mr = mm->mem_region[i];
+		if (mr->valid)
+			mem_cache_put(mr->ent, mm);
+		kfree(mr);
+	}
+	while ((n = rb_first(&mm->cache_root)))
+		mem_cache_remove(rb_entry(n, mem_cache_ent_t, node), mm);
+
 	kfree(mm->stag_ht);
 	kfree(mm->mem_region);
-	spin_unlock(&mm->lock);
+	mutex_unlock(&mm->lock);
 
 out:
 	return ret;
 }
 
-/* alloc 4 pages for these things */
-#define mem_desc_page_order 2
-
 /*
- * Returns the new memory descriptor or NULL if failure.
+ * The unlocked halves below do the work; callers hold mm->lock.
+ * Returns the new memory descriptor or 0 if failure.
  */
-mem_desc_t mem_register(void *addr, size_t len, mem_manager_t *mm)
+static mem_desc_t __mem_register(void *addr, size_t len, mem_manager_t *mm)
 {
-	int i, ret, off;
-	mem_region_t *mr = NULL;
-	struct page *page_list_page;
+	int i;
+	mem_region_t *mr;
+	mem_cache_ent_t *ent;
 	unsigned long npages, cur_base;
 
-	iwarp_debug("%s: addr %p len %zu", __func__, addr, len);
-	spin_lock(&mm->lock);
-
-	/*
-	 * Find an empty slot or allocate a new one.
-	 */
-	for (i = 0; i < mm->num_mem_region; i++) {
-		if (!mm->mem_region[i].valid)
-			break;
-	}
-
-	if (i == mm->num_mem_region) {
-		void *x = mm->mem_region;
-		size_t orig_num = mm->num_mem_region;
-		size_t new_num = orig_num + DELTA;
-		mm->num_mem_region = new_num;
-		mm->mem_region = kmalloc(sizeof(*(mm->mem_region)) * new_num,
-					 GFP_KERNEL);
-		if (!mm->mem_region)
-			goto unlock;
-		memcpy(mm->mem_region, x,
-		       sizeof(*(mm->mem_region)) * orig_num);
-		memset(&(mm->mem_region[orig_num]), 0,
-		       DELTA * sizeof(*(mm->mem_region)));
-		kfree(x);
-	}
-
-	mr = &mm->mem_region[i];
+	if (mem_region_reserve(1, mm))
+		return 0;
 
 	cur_base = (unsigned long) addr & PAGE_MASK;
 	npages = PAGE_ALIGN(len + ((unsigned long) addr & ~PAGE_MASK))
 	         >> PAGE_SHIFT;
 
-	/* if this happens, need to build a list of chunks of pages */
-	if (npages > (1<<mem_desc_page_order) * PAGE_SIZE
-	              / sizeof(struct page *)) {
-		iwarp_info("%s: too many pages %lu > %lu", __func__, npages,
-		           (1<<mem_desc_page_order) * PAGE_SIZE
-			   / sizeof(struct page *));
-		mr = NULL;
-		goto unlock;
-	}
-
 	/*
-	 * Grab the user pages.
+	 * Grab the user pages, or find them already pinned.
 	 */
-	page_list_page = alloc_pages(GFP_KERNEL, mem_desc_page_order);
-	if (!page_list_page) {
-		mr = NULL;
-		goto unlock;
-	}
-	mr->page_list = (struct page **) page_address(page_list_page);
-
-	mr->caddr = kmalloc(npages * sizeof(*mr->caddr), GFP_KERNEL);
-	if (!mr->caddr) {
-		free_pages((unsigned long) mr->page_list, mem_desc_page_order);
-		mr = NULL;
-		goto unlock;
-	}
-
-	down_write(&current->mm->mmap_sem);
-
-	off = 0;
-	while (off < npages) {
-		ret = get_user_pages(current, current->mm,
-		                     cur_base + off * PAGE_SIZE, npages - off,
-				     1, 0, mr->page_list + off, NULL);
-		if (ret < 0) {
-			for (i=0; i<off; i++)
-				put_page(mr->page_list[i]);
-			free_pages((unsigned long) mr->page_list,
-			           mem_desc_page_order);
-			kfree(mr->caddr);
-			mr = NULL;
-			goto out_sem;
-		}
-		off += ret;
-	}
+	ent = mem_cache_get(cur_base, cur_base + npages * PAGE_SIZE, mm);
+	if (!ent)
+		return 0;
 
 	/*
-	 * Finally mark valid the new mem region and return it.
+	 * Finally take a free slot and mark the new mem region valid.
 	 */
+	i = mm->mem_region_free;
+	mr = mm->mem_region[i];
+	mm->mem_region_free = mr->next_free;
 	mr->valid = 1;
 	mr->start = addr;
 	mr->len = len;
 	mr->npages = npages;
+	mr->ent = ent;
 	INIT_LIST_HEAD(&mr->stag_list);
-
-out_sem:
-	up_write(&current->mm->mmap_sem);
-unlock:
-	spin_unlock(&mm->lock);
-	return (mem_desc_t) mr;
+	return i + 1;
 }
 
-int mem_deregister(mem_desc_t md, mem_manager_t *mm)
+static int __mem_deregister(mem_desc_t md, mem_manager_t *mm)
 {
-	int i, ret = 0;
-	mem_region_t *mr = NULL;
+	mem_region_t *mr;
 
-	spin_lock(&mm->lock);
 	mr = mr_from_md(md, mm);
-	if (!mr) {
-		ret = -EINVAL;
-		goto unlock;
-	}
+	if (!mr || !mr->valid)
+		return -EINVAL;
 
-	if (!mr->valid) {
-		ret = -EINVAL;
-		goto unlock;
-	}
-
-	if (!list_empty(&(mr->stag_list))) {
-		ret = -EBUSY;
-		goto unlock;
-	}
+	if (!list_empty(&(mr->stag_list)))
+		return -EBUSY;
 
-	/* release locked pages */
-	down_write(&current->mm->mmap_sem);
-	for (i=0; i<mr->npages; i++) {
-		put_page(mr->page_list[i]);
-	}
-	up_write(&current->mm->mmap_sem);
-	free_pages((unsigned long) mr->page_list, mem_desc_page_order);
-	kfree(mr->caddr);
+	/* pages stay pinned if the cache keeps them */
+	mem_cache_put(mr->ent, mm);
 
-	/* TODO: delete entry by splicing like perl */
 	mr->valid = 0;
+	mr->next_free = mm->mem_region_free;
+	mm->mem_region_free = md - 1;
+	return 0;
+}
 
-unlock:
-	spin_unlock(&mm->lock);
-	return ret;
+/*
+ * Next stag with its low shift bits clear, kept positive and nonzero.
+ * Called with mm->lock held.
+ */
+static stag_t mem_stag_next(mem_manager_t *mm, int shift)
+{
+	stag_t stag;
+
+	do
+		stag = (stag_t) ((mm->stag_next_cntr++ & (0x7fffffffU >> shift))
+		                 << shift);
+	while (stag == 0);
+	return stag;
 }
 
 /* start is absolute address, len is the span */
-stag_t mem_stag_create(mem_desc_t md, void *start, size_t len, stag_acc_t rw,
-		       int prot_domain, mem_manager_t *mm)
+static stag_t __mem_stag_create(mem_desc_t md, void *start, size_t len,
+				stag_acc_t rw, int prot_domain,
+				mem_manager_t *mm)
 {
 	int ret = 0;
 	stag_desc_t *sd = NULL;
 	mem_region_t *mr = NULL;
 
-	iwarp_debug("%s: start %p len %zu", __func__, start, len);
-	spin_lock(&mm->lock);
 	mr = mr_from_md(md, mm);
-	if (!mr || start < mr->start || len > mr->len) {
-		ret = -EINVAL;
-		goto unlock;
-	}
+	if (!mr || !mr->valid || start < mr->start || len > mr->len)
+		return -EINVAL;
 
 	/* sd is freed by either mem_release or mem_stag_destroy */
 	sd = kmalloc(sizeof(*sd), GFP_KERNEL);
-	if (!sd) {
-		ret = -ENOMEM;
-		goto unlock;
-	}
+	if (!sd)
+		return -ENOMEM;
 	memset(sd, 0, sizeof(*sd));
 
 	sd->mr = mr;
@@ -288,35 +556,238 @@ stag_t mem_stag_create(mem_desc_t md, void *start, size_t len, stag_acc_t rw,
 
 	/* insertion also checks for collision */
 	do {
-		sd->stag = mm->stag_next_cntr++;
+		sd->stag = mem_stag_next(mm, 0);
 		ret = ht_insert((void *)(unsigned long)sd->stag, sd, mm->stag_ht);
 	} while (ret);
 
 	list_add(&(sd->list), &(mr->stag_list));
-	ret = sd->stag;
-
-unlock:
-	spin_unlock(&mm->lock);
-	return ret;
+	return sd->stag;
 }
 
-int mem_stag_destroy(stag_t stag, mem_manager_t *mm)
+static int __mem_stag_destroy(stag_t stag, mem_manager_t *mm)
 {
 	int ret = 0;
 	stag_desc_t *sd = NULL;
 
-	spin_lock(&mm->lock);
 	ret = ht_lookup((void *)(unsigned long)stag, (void **)&sd, mm->stag_ht);
 	if (ret)
-		goto unlock;
+		return ret;
 
 	list_del(&(sd->list));
 	ret = ht_delete((void *)(unsigned long)sd->stag, mm->stag_ht);
 
 	kfree(sd);
+	return ret;
+}
+
+mem_desc_t mem_register(void *addr, size_t len, mem_manager_t *mm)
+{
+	mem_desc_t md;
+
+	iwarp_debug("%s: addr %p len %zu", __func__, addr, len);
+	mutex_lock(&mm->lock);
+	md = __mem_register(addr, len, mm);
+	mutex_unlock(&mm->lock);
+	return md;
+}
+
+int mem_deregister(mem_desc_t md, mem_manager_t *mm)
+{
+	int ret;
+
+	mutex_lock(&mm->lock);
+	ret = __mem_deregister(md, mm);
+	mutex_unlock(&mm->lock);
+	return ret;
+}
+
+stag_t mem_stag_create(mem_desc_t md, void *start, size_t len, stag_acc_t rw,
+		       int prot_domain, mem_manager_t *mm)
+{
+	stag_t stag;
+
+	iwarp_debug("%s: start %p len %zu", __func__, start, len);
+	mutex_lock(&mm->lock);
+	stag = __mem_stag_create(md, start, len, rw, prot_domain, mm);
+	mutex_unlock(&mm->lock);
+	return stag;
+}
+
+int mem_stag_destroy(stag_t stag, mem_manager_t *mm)
+{
+	int ret;
+
+	mutex_lock(&mm->lock);
+	ret = __mem_stag_destroy(stag, mm);
+	mutex_unlock(&mm->lock);
+	return ret;
+}
+
+static void __mem_deregister_vec(struct user_mem_reg_ent *v, int n,
+				 mem_manager_t *mm)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		__mem_stag_destroy(v[i].stag, mm);
+		__mem_deregister(v[i].md, mm);
+	}
+}
+
+/*
+ * Register n buffers and give each a stag over all of it, under one lock
+ * and with the region table grown once.  All or nothing: on error the
+ * entries done so far are undone.
+ */
+int mem_register_vec(struct user_mem_reg_ent *v, int n, int prot_domain,
+		     mem_manager_t *mm)
+{
+	int i, ret;
+	stag_t stag;
+
+	mutex_lock(&mm->lock);
+	ret = mem_region_reserve(n, mm);
+	if (ret)
+		goto unlock;
+	for (i = 0; i < n; i++) {
+		v[i].md = __mem_register(v[i].address, v[i].len, mm);
+		if (!v[i].md) {
+			ret = -EINVAL;
+			goto undo;
+		}
+		stag = __mem_stag_create(v[i].md, v[i].address, v[i].len,
+					 v[i].rw, prot_domain, mm);
+		if (stag < 0) {
+			ret = stag;
+			__mem_deregister(v[i].md, mm);
+			goto undo;
+		}
+		v[i].stag = stag;
+	}
+	goto unlock;
+
+undo:
+	__mem_deregister_vec(v, i, mm);
+unlock:
+	mutex_unlock(&mm->lock);
+	return ret;
+}
+
+/*
+ * Destroy the stags and deregister the regions of a mem_register_vec
+ * batch.  Keeps going past failures, returning the first.
+ */
+int mem_deregister_vec(struct user_mem_reg_ent *v, int n, mem_manager_t *mm)
+{
+	int i, ret, err = 0;
+
+	mutex_lock(&mm->lock);
+	for (i = 0; i < n; i++) {
+		ret = __mem_stag_destroy(v[i].stag, mm);
+		if (ret == 0)
+			ret = __mem_deregister(v[i].md, mm);
+		if (ret < 0 && err == 0)
+			err = ret;
+	}
+	mutex_unlock(&mm->lock);
+	return err;
+}
+
+stag_t mem_mw_alloc(int prot_domain, mem_manager_t *mm)
+{
+	int ret = 0;
+	stag_desc_t *sd = NULL;
+
+	/* sd is freed by either mem_release or mem_stag_destroy */
+	sd = kmalloc(sizeof(*sd), GFP_KERNEL);
+	if (!sd)
+		return -ENOMEM;
+	memset(sd, 0, sizeof(*sd));
+	INIT_LIST_HEAD(&sd->list);
+	sd->window = 1;
+	sd->protection_domain = prot_domain;
+
+	/* low byte is the key, rotated on each bind */
+	mutex_lock(&mm->lock);
+	do {
+		sd->stag = mem_stag_next(mm, 8);
+		ret = ht_insert((void *)(unsigned long)sd->stag, sd, mm->stag_ht);
+	} while (ret);
+	ret = sd->stag;
+	mutex_unlock(&mm->lock);
+	return ret;
+}
+
+/* offset is relative to the registered start, len is the span */
+stag_t mem_mw_bind(stag_t mw, mem_desc_t md, size_t offset, size_t len,
+                   stag_acc_t rw, mem_manager_t *mm)
+{
+	int i, ret = 0;
+	stag_desc_t *sd = NULL;
+	mem_region_t *mr = NULL;
+
+	mutex_lock(&mm->lock);
+	mr = mr_from_md(md, mm);
+	if (!mr || !mr->valid || len == 0 || offset + len > mr->len) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+	ret = ht_lookup((void *)(unsigned long)mw, (void **)&sd, mm->stag_ht);
+	if (ret)
+		goto unlock;
+	if (!sd->window) {
+		ret = -EINVAL;
+		goto unlock;
+	}
+
+	list_del(&sd->list);
+	list_add(&sd->list, &mr->stag_list);
+	sd->mr = mr;
+	sd->start = (char *) mr->start + offset;
+	sd->len = len;
+	sd->rw = rw;
+
+	/* the old key is free after the delete, so this always succeeds */
+	ht_delete((void *)(unsigned long)sd->stag, mm->stag_ht);
+	for (i = 1; i <= 256; i++) {
+		sd->stag = (mw & ~0xff) | ((mw + i) & 0xff);
+		if (!ht_insert((void *)(unsigned long)sd->stag, sd,
+			       mm->stag_ht))
+			break;
+	}
+	ret = sd->stag;
+
+unlock:
+	mutex_unlock(&mm->lock);
+	return ret;
+}
+
+/* only windows of the stream's PD may be invalidated by the peer */
+int mem_stag_invalidate(stag_t stag, int prot_domain, mem_manager_t *mm)
+{
+	int ret = 0;
+	stag_desc_t *sd = NULL;
+
+	mutex_lock(&mm->lock);
+	ret = ht_lookup((void *)(unsigned long)stag, (void **)&sd, mm->stag_ht);
+	if (ret)
+		goto unlock;
+	if (sd->protection_domain != prot_domain) {
+		ret = -EPERM;
+		goto unlock;
+	}
+	if (!sd->window) {
+		ret = -EACCES;
+		goto unlock;
+	}
+	list_del_init(&sd->list);
+	sd->mr = NULL;
+	sd->start = NULL;
+	sd->len = 0;
+	sd->rw = 0;
 
 unlock:
-	spin_unlock(&mm->lock);
+	mutex_unlock(&mm->lock);
 	return ret;
 }
 
@@ -325,32 +796,36 @@ inline int mem_stag_is_enabled(stag_t stag, mem_manager_t *mm)
 	int ret = 0;
 	stag_desc_t *sd = NULL;
 
-	spin_lock(&mm->lock);
+	mutex_lock(&mm->lock);
 	ret = ht_lookup((void *)(unsigned long)stag, (void **)&sd, mm->stag_ht);
-	spin_unlock(&mm->lock);
+	if (!ret && !sd->mr)
+		ret = -EINVAL;  /* unbound window */
+	mutex_unlock(&mm->lock);
 
 	return ret;
 }
 
 /*
  * Verify the given stag exists and is compatible with the requested
- * access mode.  Check the memory range too.  Return the full stag
- * descriptor.
+ * access mode and belongs to the stream's PD.  Check the memory range
+ * too.  Return the full stag descriptor.
  */
 stag_desc_t *mem_stag_desc(stag_t stag, void __user *start, size_t len,
-                           stag_acc_t rw, mem_manager_t *mm)
+                           stag_acc_t rw, int prot_domain, mem_manager_t *mm)
 {
 	int ret;
 	stag_desc_t *sd = NULL;
 
-	spin_lock(&mm->lock);
+	mutex_lock(&mm->lock);
 	ret = ht_lookup((void *)(unsigned long)stag, (void **)&sd, mm->stag_ht);
-	spin_unlock(&mm->lock);
+	mutex_unlock(&mm->lock);
 
 	iwarp_debug("%s: stag %d start %p len %zu rw %d returns %d and sd %p",
 	            __func__, stag, start, len, rw, ret, sd);
 	if (ret)
 		return NULL;
+	if (!sd->mr || sd->protection_domain != prot_domain)
+		return NULL;
 	if ((rw & STAG_R) && !(sd->rw & STAG_R))
 		return NULL;
 	if ((rw & STAG_W) && !(sd->rw & STAG_W))
@@ -364,7 +839,8 @@ stag_desc_t *mem_stag_desc(stag_t stag, void __user *start, size_t len,
 }
 
 /*
- * Fill iov based on buffer page boundaries.
+ * Fill iov for the user buffer range.  Mapped chunks are virtually
+ * contiguous, so a payload inside one chunk takes a single iov entry.
  *   *numiov_inout: Pass in the number of entries available in the iov array,
  *                  on return, replaced with number filled.
  *   returns 0 on success
@@ -375,19 +851,28 @@ int mem_fill_iovec(const void __user *bufv, int payload_len, int offset,
 {
 	void *caddr;
 	unsigned long buf = (unsigned long) bufv + offset;
-	const unsigned long ms = (unsigned long) sd->mr->start >> PAGE_SHIFT;
+	mem_cache_ent_t *e = sd->mr->ent;
 
 	iwarp_debug("%s: buf %p len %d offset %d sd %p kvec %p", __func__,
 	            bufv, payload_len, offset, sd, iov);
 	while (payload_len > 0) {
-		int page_index = (buf >> PAGE_SHIFT) - ms;
+		unsigned long page_index = (buf - e->start) >> PAGE_SHIFT;
+		mem_chunk_t *c = &e->chunk[page_index / MEM_CHUNK_PAGES];
+		int chunk_index = page_index % MEM_CHUNK_PAGES;
 		int page_offset = (buf & ~PAGE_MASK);
-		int page_avail = PAGE_SIZE - page_offset;
+		int avail;
 		int numbytes = payload_len;
-		if (numbytes > page_avail)
-			numbytes = page_avail;
 
-		caddr = kmap(sd->mr->page_list[page_index]);
+		if (c->kaddr) {
+			caddr = c->kaddr + chunk_index * PAGE_SIZE;
+			avail = (c->npages - chunk_index) * PAGE_SIZE
+			        - page_offset;
+		} else {
+			caddr = kmap(c->pages[chunk_index]);
+			avail = PAGE_SIZE - page_offset;
+		}
+		if (numbytes > avail)
+			numbytes = avail;
 
 		if (*numiov == num_iov_alloc) {
 			iwarp_info("%s: iov overflow: >%d needed", __func__,
@@ -406,27 +891,34 @@ int mem_fill_iovec(const void __user *bufv, int payload_len, int offset,
 }
 
 /*
- * Unmap kmap after iovec use.  Similar to fill call.
+ * Undo kmaps of unmapped chunks after iovec use.  Similar to fill call.
  */
 int mem_unmap_iovec(const void __user *bufv, int payload_len, int offset,
                     struct stag_desc *sd)
 {
 	unsigned long buf = (unsigned long) bufv + offset;
-	const unsigned long ms = (unsigned long) sd->mr->start >> PAGE_SHIFT;
+	mem_cache_ent_t *e = sd->mr->ent;
 
 	while (payload_len > 0) {
-		int page_index = (buf >> PAGE_SHIFT) - ms;
+		unsigned long page_index = (buf - e->start) >> PAGE_SHIFT;
+		mem_chunk_t *c = &e->chunk[page_index / MEM_CHUNK_PAGES];
+		int chunk_index = page_index % MEM_CHUNK_PAGES;
 		int page_offset = (buf & ~PAGE_MASK);
-		int page_avail = PAGE_SIZE - page_offset;
+		int avail;
 		int numbytes = payload_len;
-		if (numbytes > page_avail)
-			numbytes = page_avail;
 
-		kunmap(sd->mr->page_list[page_index]);
+		if (c->kaddr)
+			avail = (c->npages - chunk_index) * PAGE_SIZE
+			        - page_offset;
+		else {
+			kunmap(c->pages[chunk_index]);
+			avail = PAGE_SIZE - page_offset;
+		}
+		if (numbytes > avail)
+			numbytes = avail;
 
 		payload_len -= numbytes;
 		buf += numbytes;
 	}
 	return 0;
 }
-
@@ -13,7 +13,8 @@
 
 #include <linux/types.h>
 #include <linux/list.h>
-#include <linux/spinlock.h>
+#include <linux/rbtree.h>
+#include <linux/mutex.h>
 #include <linux/uio.h>
 #include "iwsk.h"
 #include "ht.h"
@@ -33,25 +34,61 @@ typedef enum {
 } stag_acc_t;
 
 /*
- * Memory region descriptor.
+ * Pinned pages are held in chunks, each one page worth of page pointers, so
+ * a region is not limited by the size of one page list allocation.  Each
+ * chunk is also mapped contiguously into the kernel when pinned, so the
+ * data path addresses it directly instead of kmapping every page on every
+ * message.  kaddr is NULL if vmap failed (vmalloc space is scarce on
+ * 32-bit); those chunks fall back to kmap per page.
+ */
+#define MEM_CHUNK_PAGES (PAGE_SIZE / sizeof(struct page *))
+
+typedef struct mem_chunk {
+	struct page **pages;
+	void *kaddr;
+	int npages;
+} mem_chunk_t;
+
+/*
+ * Registration cache entry: the pinned pages of [start, end), both page
+ * aligned, shared by every region that falls inside.  Entries in the tree
+ * never overlap.  Idle ones stay pinned on the lru list until evicted or
+ * invalidated.
+ */
+typedef struct mem_cache_ent {
+	struct rb_node node;
+	struct list_head lru;
+	unsigned long start, end;
+	int refcnt;
+	int cached;	/* in the tree, findable by new registrations */
+	mem_chunk_t *chunk;
+	int nchunks;
+	int npages;
+} mem_cache_ent_t;
+
+/*
+ * Memory region descriptor.  The pages are those of the cache entry ent.
+ * Its memory descriptor is the slot index plus one.
  */
 typedef struct mem_region {
     void *start;
     size_t len;
     int valid;
+    int next_free;  /* chain of unused slots */
     struct list_head stag_list;
-    struct page **page_list;
-    void **caddr;  /* temp slots for kmapping of page_list */
     int npages;
+    mem_cache_ent_t *ent;
 } mem_region_t;
 
 
 /*
- * STAG descriptor.
+ * STAG descriptor.  Memory windows have window set and a NULL mr while
+ * unbound; their list head is then empty.
  */
 typedef struct stag_desc {
 	struct list_head list;  /* linked list hanging off mr */
 	mem_region_t *mr;
+	int window;
 	void *start;
 	size_t len;
 	stag_t stag;  /* unique index */
@@ -75,11 +112,16 @@ typedef struct stag_desc {
  */
 
 typedef struct mem_manager {
-	size_t num_mem_region;
-	mem_region_t *mem_region;
-	stag_t stag_next_cntr;
+	int num_mem_region;
+	mem_region_t **mem_region;
+	int mem_region_free;
+	uint32_t stag_next_cntr;
 	ht_t *stag_ht;
-	spinlock_t lock;
+	struct rb_root cache_root;
+	struct list_head cache_lru;
+	size_t cache_idle_bytes;
+	size_t cache_limit;
+	struct mutex lock;  /* held while pinning, which sleeps */
 } mem_manager_t;
 
 /*
@@ -135,6 +177,28 @@ mem_desc_t mem_register(void *addr, size_t len, mem_manager_t *mm);
 
 int mem_deregister(mem_desc_t md, mem_manager_t *mm);
 
+/*
+ * Batch setup: register each entry and create a stag over the whole of it,
+ * filling in md and stag.  One command from user space covers thousands
+ * of buffers.
+ */
+struct user_mem_reg_ent;
+
+#define MEM_REG_VEC_MAX 65536  /* entries per command */
+
+int mem_register_vec(struct user_mem_reg_ent *v, int n, int prot_domain,
+		     mem_manager_t *mm);
+
+int mem_deregister_vec(struct user_mem_reg_ent *v, int n, mem_manager_t *mm);
+
+/*
+ * Registration cache control.  Deregistered pages stay pinned up to limit
+ * bytes; the ULP must invalidate a range before unmapping it.
+ */
+void mem_cache_set_limit(size_t limit, mem_manager_t *mm);
+
+void mem_invalidate(void __user *addr, size_t len, mem_manager_t *mm);
+
 /*
  * Note that the RDMAP spec implies that the ULP creates the stag.  We're
  * not going to do that.  If the remote side invalidates the STAG, the only
@@ -152,13 +216,26 @@ int mem_stag_destroy(stag_t stag, mem_manager_t *mm);
 
 inline int mem_stag_is_enabled(stag_t stag, mem_manager_t *mm);
 
+/*
+ * Memory windows.  Binding moves an allocated window onto a range of a
+ * registered region without touching pages, and rotates the low 8 bits of
+ * the stag so the previous one stops working.  Invalidation, as by an
+ * incoming SEND with Invalidate, unbinds it.  Free with mem_stag_destroy.
+ */
+stag_t mem_mw_alloc(int prot_domain, mem_manager_t *mm);
+
+stag_t mem_mw_bind(stag_t mw, mem_desc_t md, size_t offset, size_t len,
+                   stag_acc_t rw, mem_manager_t *mm);
+
+int mem_stag_invalidate(stag_t stag, int prot_domain, mem_manager_t *mm);
+
 /*
  * Called by DDP to determine if placement is valid for a given tagged
  * message.
  * Returns null if invalid.
  */
 stag_desc_t *mem_stag_desc(stag_t stag, void __user *startv, size_t len,
-                           stag_acc_t rw, mem_manager_t *mm);
+                           stag_acc_t rw, int prot_domain, mem_manager_t *mm);
 
 int mem_fill_iovec(const void __user *buf, int payload_len, int offset,
                    struct stag_desc *sd, struct kvec *iov, int num_iov_alloc,
@@ -15,7 +15,7 @@
 #include <linux/errno.h> 	/* errnos */
 #include <linux/net.h> 		/* for kernel_*msg */
 #include <linux/socket.h>	/* MSG_NOSIGNAL */
-#include <asm/uaccess.h>	/* copy_*_user */
+#include <linux/uaccess.h>	/* copy_*_user */
 #include "iwsk.h"
 #include "mpa.h"
 #include "ddp.h"
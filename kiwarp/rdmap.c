@@ -12,6 +12,7 @@
 #include <linux/file.h>
 #include <linux/errno.h>
 #include <linux/uio.h>
+#include <linux/version.h>
 #include "util.h"
 #include "user.h"
 #include "rdmap.h"
@@ -20,6 +21,11 @@
 #include "ddp.h"
 #include "mem.h"
 
+/* f_dentry went away in 3.19; file_inode has been there since 3.9 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0)
+#define file_inode(f) ((f)->f_dentry->d_inode)
+#endif
+
 typedef enum{
 	RDMAP_WR_PENDING,
 	RDMAP_WR_COMPLETE
@@ -49,6 +55,7 @@ typedef struct {
 	stag_t stag;
 	rdmap_wr_status_t wr_status;
 	msg_len_t len;
+	int unsignaled;  /* no completion for the user */
 } rdmap_tag_wrd_t;
 
 
@@ -73,18 +80,18 @@ int rdmap_open(void)
 	rdmap_sink_op[RDMA_READ_REQ] = OP_ERR;
 	rdmap_sink_op[RDMA_READ_RESP] = OP_RDMA_READ;
 	rdmap_sink_op[SEND] = OP_RECV;
-	rdmap_sink_op[SEND_INV] = OP_RECV; /* TODO: change when inv is done */
+	rdmap_sink_op[SEND_INV] = OP_RECV;
 	rdmap_sink_op[SEND_SE] = OP_RECV;  /* TODO: change when se is done */
-	rdmap_sink_op[SEND_SE_INV] = OP_RECV; /* TODO: change when done */
+	rdmap_sink_op[SEND_SE_INV] = OP_RECV; /* TODO: change when se is done */
 	rdmap_sink_op[TERMINATE] = OP_ERR;
 
 	rdmap_src_op[RDMA_WRITE] = OP_RDMA_WRITE;
 	rdmap_src_op[RDMA_READ_REQ] = OP_ERR;
 	rdmap_src_op[RDMA_READ_RESP] = OP_ERR;
 	rdmap_src_op[SEND] = OP_SEND;
-	rdmap_src_op[SEND_INV] = OP_SEND; /* TODO: change when inv is done */
+	rdmap_src_op[SEND_INV] = OP_SEND;
 	rdmap_src_op[SEND_SE] = OP_SEND;  /* TODO: change when se is done */
-	rdmap_src_op[SEND_SE_INV] = OP_SEND; /* TODO: change when done */
+	rdmap_src_op[SEND_SE_INV] = OP_SEND; /* TODO: change when se is done */
 	rdmap_src_op[TERMINATE] = OP_ERR;
 
 	ret = ddp_open();
@@ -97,7 +104,8 @@ void rdmap_close(void)
 	ddp_close();
 }
 
-int rdmap_register_sock(struct user_context *uc, int fd, cq_t *scq, cq_t *rcq)
+int rdmap_register_sock(struct user_context *uc, int fd, cq_t *scq, cq_t *rcq,
+			int prot_domain)
 {
 	struct file *filp;
 	struct inode *inode;
@@ -111,7 +119,7 @@ int rdmap_register_sock(struct user_context *uc, int fd, cq_t *scq, cq_t *rcq)
 		ret = -EBADF;
 		goto out;
 	}
-	inode = filp->f_dentry->d_inode;
+	inode = file_inode(filp);
 	if (!S_ISSOCK(inode->i_mode)) {
 		ret = -ENOTSOCK;
 		goto out_fput;
@@ -131,6 +139,7 @@ int rdmap_register_sock(struct user_context *uc, int fd, cq_t *scq, cq_t *rcq)
 	iwsk->sock = sock;
 	iwsk->scq = scq;
 	iwsk->rcq = rcq;
+	iwsk->prot_domain = prot_domain;
 	cq_get(scq);
 	cq_get(rcq);
 	INIT_LIST_HEAD(&(iwsk->rdmapsk.buf_qs[SEND_Q]));
@@ -254,8 +263,13 @@ out:
 }
 
 
-int rdmap_send(struct user_context *uc, int fd, uint64_t id,
-	       void __user *ubuf, size_t len, stag_t stag)
+/*
+ * Send len bytes from user space at ubuf under stag, or from the kernel
+ * buffer kv when it is not NULL.
+ */
+static int __rdmap_send(struct user_context *uc, int fd, uint64_t id,
+			void __user *ubuf, const struct kvec *kv, size_t len,
+			stag_t stag, stag_t inv_stag, uint32_t flags)
 {
 	int ret;
 	struct file *filp;
@@ -275,21 +289,34 @@ int rdmap_send(struct user_context *uc, int fd, uint64_t id,
 	if (ret < 0)
 		goto out_fput;
 
-	sd = mem_stag_desc(stag, ubuf, len, STAG_R, uc->mm);
-	if (!sd) {
-		ret = -EINVAL;
-		goto out_fput;
-	}
-
+	/* a non-zero inv_stag asks the peer to invalidate it on placement */
 	rdmap_set_RV(cf);
-	rdmap_set_OPCODE(cf, SEND);
-	ret = ddp_send_utm(iwsk, sd, ubuf, len, SEND_Q, cf, NULL_STAG);
+	rdmap_set_OPCODE(cf, inv_stag ? SEND_INV : SEND);
+	if (kv) {
+		/* already in the kernel, no stag */
+		ret = ddp_send_utm_kvec(iwsk, kv, SEND_Q, cf,
+					inv_stag ? inv_stag : NULL_STAG);
+	} else {
+		sd = mem_stag_desc(stag, ubuf, len, STAG_R,
+				   iwsk->prot_domain, uc->mm);
+		if (!sd) {
+			ret = -EINVAL;
+			goto out_fput;
+		}
+		ret = ddp_send_utm(iwsk, sd, ubuf, len, SEND_Q, cf,
+				   inv_stag ? inv_stag : NULL_STAG);
+	}
 	if (ret < 0)
 		goto out_fput;
+	if (flags & IWARP_WR_UNSIGNALED) {
+		ret = 0;
+		goto out_fput;
+	}
 	cqe.id = id;
 	cqe.status = RDMAP_SUCCESS;
 	cqe.op = rdmap_src_op[SEND];
 	cqe.msg_len = len;
+	cqe.inv_stag = 0;
 	ret = cq_produce(iwsk->scq, &cqe);
 
 out_fput:
@@ -298,6 +325,69 @@ out:
 	return ret;
 }
 
+int rdmap_send(struct user_context *uc, int fd, uint64_t id,
+	       void __user *ubuf, size_t len, stag_t stag, stag_t inv_stag,
+	       uint32_t flags)
+{
+	return __rdmap_send(uc, fd, id, ubuf, NULL, len, stag, inv_stag,
+			    flags);
+}
+
+int rdmap_send_kvec(struct user_context *uc, int fd, uint64_t id,
+		    const struct kvec *kv, stag_t inv_stag, uint32_t flags)
+{
+	return __rdmap_send(uc, fd, id, NULL, kv, kv->iov_len, NULL_STAG,
+			    inv_stag, flags);
+}
+
+/*
+ * Bind a memory window.  Purely local, but ordered on the send queue of
+ * fd and completed on its scq like any other send queue operation.
+ * Returns the new stag.
+ */
+int rdmap_bind_mw(struct user_context *uc, int fd, uint64_t id, stag_t mw,
+		  mem_desc_t md, size_t offset, size_t len, stag_acc_t rw,
+		  uint32_t flags)
+{
+	int ret;
+	stag_t stag;
+	struct file *filp;
+	struct iwarp_sock *iwsk;
+	cqe_t cqe;
+
+	filp = fget(fd);
+	if (!filp) {
+		ret = -EBADF;
+		goto out;
+	}
+	ret = ht_lookup(filp, (void **)&iwsk, uc->fdhash);
+	if (ret < 0)
+		goto out_fput;
+
+	stag = mem_mw_bind(mw, md, offset, len, rw, uc->mm);
+	if (stag < 0) {
+		ret = stag;
+		goto out_fput;
+	}
+	if (flags & IWARP_WR_UNSIGNALED) {
+		ret = stag;
+		goto out_fput;
+	}
+	cqe.id = id;
+	cqe.status = RDMAP_SUCCESS;
+	cqe.op = OP_BIND_MW;
+	cqe.msg_len = 0;
+	cqe.inv_stag = 0;
+	ret = cq_produce(iwsk->scq, &cqe);
+	if (ret == 0)
+		ret = stag;
+
+out_fput:
+	fput(filp);
+out:
+	return ret;
+}
+
 
 int rdmap_post_recv(struct user_context *uc, int fd, uint64_t id,
 		     void __user *ubuf, size_t len, stag_t stag)
@@ -323,7 +413,8 @@ int rdmap_post_recv(struct user_context *uc, int fd, uint64_t id,
 	 * Make sure buffer fits in stag and store stag descriptor
 	 * in structure for use at receive time.
 	 */
-	sd = mem_stag_desc(stag, ubuf, len, STAG_W, uc->mm);
+	sd = mem_stag_desc(stag, ubuf, len, STAG_W, iwsk->prot_domain,
+			   uc->mm);
 	if (!sd) {
 		ret = -EINVAL;
 		goto out_fput;
@@ -352,7 +443,7 @@ out:
 
 int rdmap_rdma_write(struct user_context *uc, int fd, uint64_t id,
 		     void __user *ubuf, size_t len, stag_t local_stag,
-		     stag_t sink_stag, tag_offset_t sink_to)
+		     stag_t sink_stag, tag_offset_t sink_to, uint32_t flags)
 {
 	int ret;
 	struct file *filp;
@@ -370,7 +461,8 @@ int rdmap_rdma_write(struct user_context *uc, int fd, uint64_t id,
 	if (ret < 0)
 		goto out_fput;
 
-	sd = mem_stag_desc(local_stag, ubuf, len, STAG_R, uc->mm);
+	sd = mem_stag_desc(local_stag, ubuf, len, STAG_R, iwsk->prot_domain,
+			   uc->mm);
 	if (!sd) {
 		ret = -EINVAL;
 		goto out_fput;
@@ -382,10 +474,15 @@ int rdmap_rdma_write(struct user_context *uc, int fd, uint64_t id,
 	ret = ddp_send_tm(iwsk, sd, ubuf, len, cf, sink_stag, sink_to);
 	if (ret < 0)
 		goto out_fput;
+	if (flags & IWARP_WR_UNSIGNALED) {
+		ret = 0;
+		goto out_fput;
+	}
 	cqe.id = id;
 	cqe.status = RDMAP_SUCCESS;
 	cqe.op = rdmap_src_op[RDMA_WRITE];
 	cqe.msg_len = len;
+	cqe.inv_stag = 0;
 	ret = cq_produce(iwsk->scq, &cqe);
 
 out_fput:
@@ -401,11 +498,12 @@ out:
  */
 int rdmap_rdma_read(struct user_context *uc, int fd, uint64_t id,
 		    stag_t sink_stag, tag_offset_t sink_to, msg_len_t len,
-		    stag_t src_stag, tag_offset_t src_to)
+		    stag_t src_stag, tag_offset_t src_to, uint32_t flags)
 {
 	int ret = 0;
 	struct file *filp;
 	rdmap_rdma_rd_req_hdr_t h;
+	struct kvec kv;
 	rdmap_cf_t cf;
 	rdmap_tag_wrd_t *d = NULL;
 	iwsk_t *iwsk = NULL;
@@ -441,8 +539,11 @@ int rdmap_rdma_read(struct user_context *uc, int fd, uint64_t id,
 	d->stag = sink_stag;
 	d->wr_status = RDMAP_WR_PENDING;
 	d->len = 0;
+	d->unsignaled = !!(flags & IWARP_WR_UNSIGNALED);
 	list_add_tail(&d->list, &iwsk->rdmapsk.rwrq);
-	ret = ddp_send_utm(iwsk, NULL, &h, sizeof(h), RDMAREQ_Q, cf, NULL_STAG);
+	kv.iov_base = &h;
+	kv.iov_len = sizeof(h);
+	ret = ddp_send_utm_kvec(iwsk, &kv, RDMAREQ_Q, cf, NULL_STAG);
 out_fput:
 	fput(filp);
 out:
@@ -530,7 +631,8 @@ recv_buf_t *rdmap_get_untag_sink(iwsk_t *iwsk, qnum_t qn, msn_t msn)
 	}
 }
 
-recv_buf_t *rdmap_get_tag_sink(struct user_context *uc, stag_t stag,
+recv_buf_t *rdmap_get_tag_sink(struct user_context *uc, iwsk_t *iwsk,
+				stag_t stag,
 				tag_offset_t to, size_t len, rdmap_cf_t cf,
 				uint32_t *offset)
 {
@@ -546,7 +648,7 @@ recv_buf_t *rdmap_get_tag_sink(struct user_context *uc, stag_t stag,
 	}
 
 	sd = mem_stag_desc(stag, (void *)(unsigned long)to, len,
-	                   rdmap_acc[op], uc->mm);
+	                   rdmap_acc[op], iwsk->prot_domain, uc->mm);
 	if (!sd) {
 		iwarp_info("%s: no sd for stag %d to %Lx len %zu op %d",
 		           __func__, stag, to, len, op);
@@ -561,18 +663,30 @@ recv_buf_t *rdmap_get_tag_sink(struct user_context *uc, stag_t stag,
 	return rb;
 }
 
-static int rdmap_recv_send(iwsk_t *iwsk, rdmap_cf_t cf, qnum_t qn, msn_t msn,
+static int rdmap_recv_send(struct user_context *uc, iwsk_t *iwsk,
+			   rdmap_cf_t cf, stag_t stag, qnum_t qn, msn_t msn,
 			   msg_len_t len)
 {
 	int ret = 0;
+	int op = rdmap_get_OPCODE(cf);
 	struct list_head *first = iwsk->rdmapsk.buf_qs[qn].next;
 	recv_buf_t *rb = list_entry(first, recv_buf_t, list);
+	cqe_t cqe;
 
+	cqe.status = RDMAP_SUCCESS;
+	cqe.inv_stag = 0;
+	if (op == SEND_INV || op == SEND_SE_INV) {
+		/* data is placed already; bad stag fails the recv */
+		if (mem_stag_invalidate(stag, iwsk->prot_domain, uc->mm)) {
+			iwarp_info("%s: cannot invalidate stag %d", __func__,
+			           stag);
+			cqe.status = RDMAP_FAILURE;  /* TODO: RDMAP_EOPSTAGDEST */
+		} else
+			cqe.inv_stag = stag;
+	}
 	if (iwsk->rcq) {
-		cqe_t cqe;
 		cqe.id = rb->id;
-		cqe.status = RDMAP_SUCCESS;
-		cqe.op = rdmap_sink_op[rdmap_get_OPCODE(cf)];
+		cqe.op = rdmap_sink_op[op];
 		cqe.msg_len = len;
 		ret = cq_produce(iwsk->rcq, &cqe);
 	}
@@ -600,7 +714,7 @@ static int rdmap_recv_rrr(struct user_context *uc, iwsk_t *iwsk, rdmap_cf_t cf,
 		goto out_free;
 	}
 	sd = mem_stag_desc(r->src_stag, (void *)(unsigned long) r->src_to,
-	                   r->len, rdmap_acc[op], uc->mm);
+	                   r->len, rdmap_acc[op], iwsk->prot_domain, uc->mm);
 	if (!sd) {
 		ret = -EINVAL; /* TODO: surface RDMAP_ECATASGLOBAL */
 		goto out_free;
@@ -640,6 +754,7 @@ static int rdmap_recv_term_msg(struct user_context *uc, iwsk_t *iwsk,
 	cqe.status = RDMAP_TERMINATE;
 	cqe.id = 0;
 	cqe.msg_len = 0;
+	cqe.inv_stag = 0;
 	if (iwsk->rcq)
 		ret = cq_produce(iwsk->rcq, &cqe); /* post on rcq */
 	if (!ret && iwsk->scq && iwsk->scq != iwsk->scq)
@@ -657,11 +772,8 @@ out_free:
 int rdmap_untag_recv(struct user_context *uc, iwsk_t *iwsk, rdmap_cf_t cf,
 		     stag_t stag, qnum_t qn, msn_t msn, msg_len_t len)
 {
-	/* XXX: ignore stag for now; will be used in SEND_*INV */
-	stag = 0;
-
 	if (qn == SEND_Q) {
-		return rdmap_recv_send(iwsk, cf, qn, msn, len);
+		return rdmap_recv_send(uc, iwsk, cf, stag, qn, msn, len);
 	} else if (qn == RDMAREQ_Q) {
 		return rdmap_recv_rrr(uc, iwsk, cf, qn, msn, len);
 	} else if (qn == TERM_Q) {
@@ -707,12 +819,13 @@ static int rdmap_reap_rwr(iwsk_t *iwsk, rdmap_cf_t cf, stag_t stag,
 	list_for_each_entry_safe(d, dp, &iwsk->rdmapsk.rwrq, list) {
 		if (d->wr_status != RDMAP_WR_COMPLETE)
 			break;
-		if (iwsk->rcq) {
+		if (!d->unsignaled && iwsk->rcq) {
 			cqe_t cqe;
 			cqe.op = rdmap_sink_op[op];
 			cqe.status = RDMAP_SUCCESS;
 			cqe.id = d->id;
 			cqe.msg_len = d->len;
+			cqe.inv_stag = 0;
 			ret = cq_produce(iwsk->scq, &cqe);
 			if (ret < 0)
 				goto out;
@@ -753,6 +866,7 @@ static inline int rdmap_check_cq(cq_t *cq, struct work_completion __user *uwc)
 		wc.op = cqe.op;
 		wc.status = cqe.status;
 		wc.msg_len = cqe.msg_len;
+		wc.inv_stag = cqe.inv_stag;
 		if (copy_to_user(uwc, &wc, sizeof(wc)))
 			ret = -EFAULT;
 	}
@@ -835,6 +949,7 @@ static int rdmap_send_term_msg(iwsk_t *iwsk, uint8_t layer, uint8_t etype,
 			       ssize_t ddpsglen, void *rdmahdr)
 {
 	rdmap_term_hdr_t th;
+	struct kvec kv;
 	rdmap_cf_t cf = 0;
 
 	memset(&th, 0, sizeof(th));
@@ -857,7 +972,9 @@ static int rdmap_send_term_msg(iwsk_t *iwsk, uint8_t layer, uint8_t etype,
 	}
 	rdmap_set_RV(cf);
 	rdmap_set_OPCODE(cf, TERMINATE);
-	return ddp_send_utm(iwsk, NULL, &th, sizeof(th), TERM_Q, cf, NULL_STAG);
+	kv.iov_base = &th;
+	kv.iov_len = sizeof(th);
+	return ddp_send_utm_kvec(iwsk, &kv, TERM_Q, cf, NULL_STAG);
 }
 
 /* send a terminate message; invalidate associated iwsk; post cqe */
@@ -875,6 +992,7 @@ int rdmap_surface_ddp_err(iwsk_t *iwsk, uint8_t layer, uint8_t etype,
 	cqe.status = RDMAP_TERMINATE;
 	cqe.id = 0;
 	cqe.msg_len = 0;
+	cqe.inv_stag = 0;
 	if (iwsk->scq)
 		ret = cq_produce(iwsk->scq, &cqe); /* post on scq */
 	if (!ret && iwsk->scq && iwsk->scq != iwsk->rcq)
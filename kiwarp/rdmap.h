@@ -39,6 +39,7 @@ typedef enum {
 	OP_RDMA_READ,
 	OP_SEND,
 	OP_RECV,
+	OP_BIND_MW,
 	OP_TERMINATE,
 	OP_ERR
 } rdmap_op_t;
@@ -138,7 +139,7 @@ int rdmap_open(void);
 void rdmap_close(void);
 
 int rdmap_register_sock(struct user_context *uc, int fd, cq_t *scq,
-			cq_t *rcq);
+			cq_t *rcq, int prot_domain);
 
 int rdmap_set_sock_attrs(struct user_context *uc, int fd, int use_crc,
 			 int use_mrkr);
@@ -158,12 +159,22 @@ int rdmap_poll_block(struct user_context *uc, cq_t *cq,
 
 recv_buf_t *rdmap_get_untag_sink(iwsk_t *iwsk, qnum_t qn, msn_t msn);
 
-recv_buf_t *rdmap_get_tag_sink(struct user_context *uc, stag_t stag,
+recv_buf_t *rdmap_get_tag_sink(struct user_context *uc, iwsk_t *iwsk,
+			       stag_t stag,
 			       tag_offset_t to, size_t len, rdmap_cf_t cf,
 			       uint32_t *offset);
 
 int rdmap_send(struct user_context *uc, int fd, uint64_t id,
-	       void __user *ubuf, size_t len, stag_t stag);
+	       void __user *ubuf, size_t len, stag_t stag, stag_t inv_stag,
+	       uint32_t flags);
+
+/* the same from a kernel buffer, for inline sends */
+int rdmap_send_kvec(struct user_context *uc, int fd, uint64_t id,
+		    const struct kvec *kv, stag_t inv_stag, uint32_t flags);
+
+int rdmap_bind_mw(struct user_context *uc, int fd, uint64_t id, stag_t mw,
+		  mem_desc_t md, size_t offset, size_t len, stag_acc_t rw,
+		  uint32_t flags);
 
 int rdmap_post_recv(struct user_context *uc, int fd, uint64_t id,
 		    void __user *ubuf, size_t len, stag_t stag);
@@ -175,11 +186,11 @@ int rdmap_tag_recv(iwsk_t *iwsk, rdmap_cf_t cf, stag_t stag, msg_len_t len);
 
 int rdmap_rdma_write(struct user_context *uc, int fd, uint64_t id,
 		     void __user *ubuf, size_t len, stag_t local_stag,
-		     stag_t sink_stag, tag_offset_t sink_to);
+		     stag_t sink_stag, tag_offset_t sink_to, uint32_t flags);
 
 int rdmap_rdma_read(struct user_context *uc, int fd, uint64_t id,
 		    stag_t sink_stag, tag_offset_t sink_to, msg_len_t len,
-		    stag_t src_stag, tag_offset_t src_to);
+		    stag_t src_stag, tag_offset_t src_to, uint32_t flags);
 
 static inline int rdmap_encourage(struct user_context *uc,
                                   struct iwarp_sock *iwsk)
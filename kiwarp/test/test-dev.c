@@ -126,6 +126,8 @@ int main(int argc, char *argv[])
     us.buf = bufs.sbuf;
     us.len = strlen(bufs.sbuf)+1;
     us.local_stag = bufs_stag;
+    us.inv_stag = 0;
+    us.flags = 0;
     ret = write(kiwarp_fd, &us, sizeof(us));
     if (ret < 0)
 	error_errno("post send");
@@ -162,6 +162,8 @@ static void test_rdmap_send(int kiwarp_fd, int fd, uint64_t scq, uint64_t rcq,
 	us.buf = sbuf;
 	us.len = msgsz;
 	us.local_stag = send_stag;
+	us.inv_stag = 0;
+	us.flags = 0;
 	ret = write(kiwarp_fd, &us, sizeof(us));
 	if (ret < 0)
 		error_errno("post send");
@@ -288,6 +290,8 @@ static void test_rdmap_rdma_write(int kiwarp_fd, int fd, uint64_t scq,
 	us.buf = sbuf;
 	us.len = sizeof(stag) + sizeof(to);
 	us.local_stag = bufs_stag;
+	us.inv_stag = 0;
+	us.flags = 0;
 	ret = write(kiwarp_fd, &us, sizeof(us));
 	if (ret < 0)
 		error_errno("post send");
@@ -331,6 +335,7 @@ static void test_rdmap_rdma_write(int kiwarp_fd, int fd, uint64_t scq,
 	    urw.local_stag = bufs_stag;
 	    urw.sink_stag = stag;
 	    urw.sink_to = to;
+	    urw.flags = 0;
 	    ret = write(kiwarp_fd, &urw, sizeof(urw));
 	    if (ret < 0)
 		    error_errno("rdma write");
@@ -456,6 +461,8 @@ static void test_rdmap_rdma_read(int kiwarp_fd, int fd, uint64_t scq,
 	us.buf = sbuf;
 	us.len = sizeof(stag) + sizeof(to);
 	us.local_stag = bufs_stag;
+	us.inv_stag = 0;
+	us.flags = 0;
 	ret = write(kiwarp_fd, &us, sizeof(us));
 	if (ret < 0)
 		error_errno("post send");
@@ -497,6 +504,7 @@ static void test_rdmap_rdma_read(int kiwarp_fd, int fd, uint64_t scq,
 	    urr.id = uint64_from_ptr(&urr);
 	    urr.src_stag = stag;
 	    urr.src_to = to;
+	    urr.flags = 0;
 	    urr.len = msgsz;
 	    urr.sink_stag = bufs_stag;
 	    urr.sink_to = uint64_from_ptr(rbuf);
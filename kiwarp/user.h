@@ -30,14 +30,30 @@ enum user_command_type {
 	IWARP_POST_RECV,
 	IWARP_RDMA_WRITE,
 	IWARP_RDMA_READ,
-	IWARP_ENCOURAGE
+	IWARP_ENCOURAGE,
+	IWARP_MEM_CACHE_LIMIT,
+	IWARP_MEM_INVALIDATE,
+	IWARP_MW_ALLOC,
+	IWARP_MW_BIND,
+	IWARP_MEM_REG_VEC,
+	IWARP_MEM_DEREG_VEC,
+	IWARP_BATCH
 };
 
+/* flags for send queue commands */
+enum user_wr_flags {
+	IWARP_WR_UNSIGNALED = 0x1,  /* generate no completion */
+	IWARP_WR_INLINE = 0x2  /* send only: len payload bytes follow the command */
+};
+
+#define IWARP_MAX_INLINE 256  /* largest IWARP_WR_INLINE payload */
+
 struct user_register_sock {
 	uint32_t cmd;  /* IWARP_REGISTER_SOCK */
 	uint32_t fd;
 	uint64_t scq_handle;
 	uint64_t rcq_handle;
+	int32_t prot_domain;  /* the peer reaches only stags of this PD */
 };
 
 struct user_sock_attrs {
@@ -67,6 +83,7 @@ struct work_completion {
 	int32_t op;
 	int32_t status;
 	uint32_t msg_len;
+	int32_t inv_stag;  /* stag invalidated by the peer, 0 if none */
 };
 
 struct user_poll {
@@ -97,7 +114,7 @@ struct user_mem_reg {
 	uint32_t cmd; /*IWARP_MEM_REG*/
 	void *address;
 	size_t len;
-	unsigned long *mem_desc;  /*TODO: make this say mem_desc_t get rid of unsigned long business, and an opaque index rather than a real kernel pointer */
+	unsigned long *mem_desc;  /*TODO: make this say mem_desc_t get rid of unsigned long business */
 };
 
 struct user_mem_dereg {
@@ -105,6 +122,38 @@ struct user_mem_dereg {
 	unsigned long md;
 };
 
+struct user_mem_reg_ent {
+	void *address;
+	size_t len;
+	int rw;
+	unsigned long md;  /* from kernel to user */
+	int32_t stag;      /* from kernel to user */
+};
+
+struct user_mem_reg_vec {
+	uint32_t cmd; /* IWARP_MEM_REG_VEC */
+	uint32_t count;
+	int prot_domain;
+	struct user_mem_reg_ent *ents;  /* md and stag filled in */
+};
+
+struct user_mem_dereg_vec {
+	uint32_t cmd; /* IWARP_MEM_DEREG_VEC */
+	uint32_t count;
+	struct user_mem_reg_ent *ents;
+};
+
+struct user_mem_cache_limit {
+	uint32_t cmd; /* IWARP_MEM_CACHE_LIMIT */
+	size_t limit;
+};
+
+struct user_mem_invalidate {
+	uint32_t cmd; /* IWARP_MEM_INVALIDATE */
+	void *address;
+	size_t len;
+};
+
 struct user_stag_create {
 	uint32_t cmd; /* IWARP_STAG_CREATE */
 	unsigned long md;
@@ -120,6 +169,25 @@ struct user_stag_destroy {
 	int32_t stag;
 };
 
+struct user_mw_alloc {
+	uint32_t cmd; /* IWARP_MW_ALLOC */
+	int prot_domain;
+	int32_t *stag; /* from kernel to user */
+};
+
+struct user_mw_bind {
+	uint32_t cmd; /* IWARP_MW_BIND */
+	uint32_t fd;
+	uint64_t id;   /* opaque user identifier */
+	int32_t mw;
+	unsigned long md;
+	size_t offset;  /* into the registered region */
+	size_t len;
+	int rw;
+	int32_t *stag; /* new stag, from kernel to user */
+	uint32_t flags;
+};
+
 struct user_send {
 	uint32_t cmd; /* IWARP_SEND */
 	uint32_t fd;
@@ -127,6 +195,8 @@ struct user_send {
 	void __user *buf;
 	uint32_t len;
 	int32_t local_stag;
+	int32_t inv_stag;  /* for the peer to invalidate, 0 for none */
+	uint32_t flags;
 };
 
 struct user_post_recv {
@@ -147,6 +217,7 @@ struct user_rdma_write {
 	int32_t local_stag;
 	int32_t sink_stag;
 	uint64_t sink_to;
+	uint32_t flags;
 };
 
 struct user_rdma_read {
@@ -158,11 +229,35 @@ struct user_rdma_read {
 	uint32_t len;
 	int32_t src_stag;
 	int32_t src_to;
+	uint32_t flags;
 };
 
 struct user_encourage {
 	uint32_t cmd; /* IWARP_ENCOURAGE */
 };
 
+/*
+ * Many commands in one write.  buf holds count records, each a
+ * user_batch_hdr then the command itself, padded to USER_BATCH_ALIGN.
+ * Stops at the first failure; done says how many were carried out.
+ */
+#define USER_BATCH_ALIGN 8
+#define user_batch_reclen(len) \
+	(sizeof(struct user_batch_hdr) \
+	 + (((len) + USER_BATCH_ALIGN - 1) & ~(USER_BATCH_ALIGN - 1)))
+
+struct user_batch_hdr {
+	uint32_t len;  /* of the command that follows */
+	uint32_t pad;
+};
+
+struct user_batch {
+	uint32_t cmd; /* IWARP_BATCH */
+	uint32_t count;
+	uint32_t len;  /* bytes in buf */
+	const void __user *buf;
+	uint32_t __user *done;  /* from kernel to user */
+};
+
 #endif  /* __USER_H */
 
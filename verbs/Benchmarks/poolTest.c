@@ -0,0 +1,260 @@
+/*
+ * Buffer Pool Testing Program
+ *
+ *First the pool on its own: size classes, reuse of freed buffers, a new
+ *arena when the first is full, an arena of its own for an oversized
+ *request, and the requests it must refuse.  With a peer the two sides then
+ *take every buffer they send from, receive into and RDMA Write to out of
+ *a pool.  Without one only the first part runs.
+ *
+ *SERVER SHOULD BE STARTED FIRST
+ *
+ * Copyright (C) 2005 OSC iWarp Team
+ * Distributed under the GNU Public License Version 2 or later (See LICENSE)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../verbs.h"
+
+#define BIG (1 << 20)  /*bytes the client writes into the server's pool buffer*/
+
+static int am_server;
+static char *server;
+static iwarp_rnic_handle_t rnic_hndl;
+static iwarp_prot_id prot_id;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: %s u\n", progname);
+    fprintf(stderr, "   or  %s s <port>\n", progname);
+    fprintf(stderr, "   or  %s c <port> <server>\n", progname);
+    exit(1);
+}
+
+static void check(iwarp_status_t ret, const char *what)
+/*give up on any verbs error*/
+{
+    if(ret != IWARP_OK){
+	fprintf(stderr, "%s: %s\n", what, iwarp_string_from_errno(ret));
+	exit(1);
+    }
+}
+
+static void expect(int cond, const char *what)
+{
+    if(!cond){
+	fprintf(stderr, "%s\n", what);
+	exit(1);
+    }
+}
+
+static void unit(void)
+/*the pool alone, nothing is sent*/
+{
+    iwarp_pool_handle_t pool, other;
+    iwarp_pool_buf_t a, b, c, big[2], huge, bogus;
+
+    /*hugepages are asked for, but their absence must not fail the pool*/
+    check(iwarp_pool_create(rnic_hndl, prot_id, 0, REMOTE_READ|REMOTE_WRITE, IWARP_POOL_HUGEPAGE, &pool),
+	  "create pool");
+
+    check(iwarp_pool_alloc(rnic_hndl, pool, 1, &a), "alloc 1");
+    expect(a.length == POOL_MIN_BUF, "1 byte not rounded to the smallest class");
+    check(iwarp_pool_alloc(rnic_hndl, pool, POOL_MIN_BUF + 1, &b), "alloc 65");
+    expect(b.length == 2 * POOL_MIN_BUF, "65 bytes not rounded to the next class");
+    expect(a.stag == b.stag, "two small buffers in different arenas");
+    expect(a.to == (uintptr_t) a.addr && b.to == (uintptr_t) b.addr, "tagged offset is not the address");
+    expect((uintptr_t) a.addr % POOL_MIN_BUF == 0 && (uintptr_t) b.addr % POOL_MIN_BUF == 0,
+	   "buffer not cache line aligned");
+    expect((char *) a.addr + a.length <= (char *) b.addr || (char *) b.addr + b.length <= (char *) a.addr,
+	   "buffers overlap");
+    memset(a.addr, 1, a.length);
+    memset(b.addr, 2, b.length);
+
+    /*a freed buffer comes back to the next request of its class*/
+    check(iwarp_pool_free(rnic_hndl, pool, &a), "free");
+    check(iwarp_pool_alloc(rnic_hndl, pool, 40, &c), "alloc 40");
+    expect(c.addr == a.addr && c.stag == a.stag, "freed buffer not reused");
+    expect(((char *) b.addr)[0] == 2, "reuse touched a neighbour");
+
+    /*the second does not fit in what is left of the first arena*/
+    check(iwarp_pool_alloc(rnic_hndl, pool, HUGEPAGE_SIZE / 2, &big[0]), "alloc half arena");
+    expect(big[0].stag == a.stag, "half arena not carved from the first");
+    check(iwarp_pool_alloc(rnic_hndl, pool, HUGEPAGE_SIZE / 2, &big[1]), "alloc half arena");
+    expect(big[1].stag != a.stag, "full arena not followed by a new one");
+    memset(big[1].addr, 3, big[1].length);
+
+    check(iwarp_pool_alloc(rnic_hndl, pool, 2 * HUGEPAGE_SIZE + 1, &huge), "alloc oversized");
+    expect(huge.length == 4 * HUGEPAGE_SIZE, "oversized request not rounded to its class");
+    expect(huge.stag != a.stag && huge.stag != big[1].stag, "oversized request shares an arena");
+    memset(huge.addr, 4, huge.length);
+
+    expect(iwarp_pool_alloc(rnic_hndl, pool, 0, &bogus) == IWARP_INSUFFICIENT_RESOURCES,
+	   "empty buffer allocated");
+    expect(iwarp_pool_alloc(rnic_hndl, pool, UINT32_MAX, &bogus) == IWARP_INSUFFICIENT_RESOURCES,
+	   "buffer past the largest class allocated");
+
+    /*only what the pool handed out goes back to it*/
+    bogus = b;
+    bogus.addr = (char *) big[0].addr + big[0].length;
+    expect(iwarp_pool_free(rnic_hndl, pool, &bogus) == IWARP_INVALID_MEM_REGION,
+	   "free past the carved part of an arena");
+    check(iwarp_pool_create(rnic_hndl, prot_id, 0, REMOTE_WRITE, 0, &other), "create pool");
+    expect(iwarp_pool_free(rnic_hndl, other, &b) == IWARP_INVALID_MEM_REGION, "free into the wrong pool");
+    check(iwarp_pool_destroy(rnic_hndl, other), "destroy pool");
+
+    check(iwarp_pool_free(rnic_hndl, pool, &huge), "free oversized");
+    check(iwarp_pool_free(rnic_hndl, pool, &big[1]), "free");
+    check(iwarp_pool_free(rnic_hndl, pool, &big[0]), "free");
+    check(iwarp_pool_free(rnic_hndl, pool, &b), "free");
+    check(iwarp_pool_free(rnic_hndl, pool, &c), "free");
+    check(iwarp_pool_destroy(rnic_hndl, pool), "destroy pool");
+}
+
+static void post(iwarp_qp_handle_t qp, iwarp_wr_work_t type, iwarp_pool_buf_t *buf, uint32_t len,
+		 iwarp_pool_buf_t *remote)
+/*one pool buffer, the sink of an RDMA Write given by remote*/
+{
+    iwarp_sgl_t sgl, remote_sgl;
+    iwarp_sge_t sge;
+    iwarp_wr_t wr;
+
+    check(iwarp_create_sgl(rnic_hndl, &sgl), "create sgl");
+    sge.stag = buf->stag;
+    sge.length = len;
+    sge.to = buf->to;
+    check(iwarp_register_sge(rnic_hndl, &sgl, &sge), "register sge");
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_type = type;
+    wr.sgl = &sgl;
+    wr.cq_type = SIGNALED;
+    if(remote != NULL){
+	check(iwarp_create_sgl(rnic_hndl, &remote_sgl), "create sgl");
+	sge.stag = remote->stag;
+	sge.to = remote->to;
+	check(iwarp_register_sge(rnic_hndl, &remote_sgl, &sge), "register sge");
+	wr.remote_sgl = &remote_sgl;
+    }
+    if(type == IWARP_WR_TYPE_RECV)
+	check(iwarp_qp_post_rq(rnic_hndl, qp, &wr), "post recv");
+    else
+	check(iwarp_qp_post_sq(rnic_hndl, qp, &wr), "post send");
+}
+
+static void wait_wc(iwarp_cq_handle_t cq, iwarp_wr_work_t type)
+{
+    iwarp_work_completion_t wc;
+
+    check(iwarp_cq_poll(rnic_hndl, cq, IWARP_INFINITY, 0, &wc), "poll cq");
+    if(wc.wr_type != type || wc.status != IWARP_WR_SUCCESS){
+	fprintf(stderr, "%s: completion type %d status %d, not type %d\n", am_server ? "server" : "client",
+		wc.wr_type, wc.status, type);
+	exit(1);
+    }
+}
+
+static void loopback(int port)
+/*the server hands out a pool buffer, the client writes it from one of its own and says so*/
+{
+    iwarp_pool_handle_t pool;
+    iwarp_pool_buf_t msg, data, sink;
+    iwarp_cq_handle_t cq;
+    iwarp_qp_attrs_t qp_attrs;
+    iwarp_qp_handle_t qp;
+    char priv[64];
+    int i;
+
+    check(iwarp_pool_create(rnic_hndl, prot_id, 0, REMOTE_WRITE, IWARP_POOL_HUGEPAGE, &pool), "create pool");
+    check(iwarp_pool_alloc(rnic_hndl, pool, sizeof(sink), &msg), "alloc");
+    check(iwarp_pool_alloc(rnic_hndl, pool, BIG, &data), "alloc");
+
+    check(iwarp_cq_create(rnic_hndl, NULL, 16, &cq), "create cq");
+    memset(&qp_attrs, 0, sizeof(qp_attrs));
+    qp_attrs.sq_cq = cq;
+    qp_attrs.rq_cq = cq;
+    qp_attrs.sq_depth = 4;
+    qp_attrs.rq_depth = 4;
+    qp_attrs.send_sgl_max = 1;
+    qp_attrs.recv_sgl_max = 1;
+    qp_attrs.rdma_w_sgl_max = 1;
+    qp_attrs.ord = 1;
+    qp_attrs.ird = 1;
+    qp_attrs.prot_d_id = prot_id;
+    qp_attrs.disable_mpa_markers = TRUE;
+    qp_attrs.disable_mpa_crc = TRUE;
+    check(iwarp_qp_create(rnic_hndl, &qp_attrs, &qp), "create qp");
+
+    if(am_server){
+	memset(data.addr, 0, BIG);
+	post(qp, IWARP_WR_TYPE_RECV, &msg, msg.length, NULL);
+	check(iwarp_qp_passive_connect(rnic_hndl, port, qp, "s", priv, sizeof(priv)), "passive connect");
+	/*where to write, the receive for the client's word is already posted*/
+	sink = data;
+	memcpy(msg.addr, &sink, sizeof(sink));
+	post(qp, IWARP_WR_TYPE_SEND, &msg, sizeof(sink), NULL);
+	wait_wc(cq, IWARP_WR_TYPE_SEND);
+	post(qp, IWARP_WR_TYPE_RECV, &msg, msg.length, NULL);
+	wait_wc(cq, IWARP_WR_TYPE_RECV);
+	for(i=0; i<BIG; i++)
+	    if(((uint8_t *) data.addr)[i] != (uint8_t)(i * 7)){
+		fprintf(stderr, "server: byte %d of the write\n", i);
+		exit(1);
+	    }
+    }
+    else{
+	for(i=0; i<BIG; i++)
+	    ((uint8_t *) data.addr)[i] = i * 7;
+	post(qp, IWARP_WR_TYPE_RECV, &msg, msg.length, NULL);
+	check(iwarp_qp_active_connect(rnic_hndl, port, server, 10000, 100, qp, "c", priv, sizeof(priv)),
+	      "active connect");
+	wait_wc(cq, IWARP_WR_TYPE_RECV);
+	memcpy(&sink, msg.addr, sizeof(sink));
+	post(qp, IWARP_WR_TYPE_RDMA_WRITE, &data, BIG, &sink);
+	wait_wc(cq, IWARP_WR_TYPE_RDMA_WRITE);
+	/*sends are ordered behind the write, once the server has this the data is there*/
+	post(qp, IWARP_WR_TYPE_SEND, &msg, 1, NULL);
+	wait_wc(cq, IWARP_WR_TYPE_SEND);
+    }
+
+    check(iwarp_qp_disconnect(rnic_hndl, qp), "disconnect");
+    check(iwarp_qp_destroy(rnic_hndl, qp), "destroy qp");
+    check(iwarp_cq_destroy(rnic_hndl, cq), "destroy cq");
+    check(iwarp_pool_free(rnic_hndl, pool, &data), "free");
+    check(iwarp_pool_free(rnic_hndl, pool, &msg), "free");
+    check(iwarp_pool_destroy(rnic_hndl, pool), "destroy pool");
+}
+
+int main(int argc, char **argv)
+{
+    set_progname(argc, argv);
+    if(argc < 2 || (argv[1][0] != 'u' && argv[1][0] != 's' && argv[1][0] != 'c'))
+	usage();
+    am_server = argv[1][0] == 's';
+    if(argv[1][0] != 'u' && argc < 3)
+	usage();
+    if(argv[1][0] == 'c'){
+	if(argc < 4)
+	    usage();
+	server = argv[3];
+    }
+
+    check(iwarp_rnic_open(0, PAGE_MODE, NULL, &rnic_hndl), "open rnic");
+    check(iwarp_pd_allocate(rnic_hndl, &prot_id), "allocate pd");
+
+    unit();
+    printf("pool ok\n");
+
+    if(argv[1][0] != 'u'){
+	loopback(atoi(argv[2]));
+	printf("pool buffers over loopback ok\n");
+    }
+
+    check(iwarp_pd_deallocate(rnic_hndl, prot_id), "deallocate pd");
+    check(iwarp_rnic_close(rnic_hndl), "close rnic");
+    return 0;
+}
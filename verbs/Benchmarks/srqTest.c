@@ -0,0 +1,308 @@
+/*
+ * Shared Receive Queue Testing Program
+ *
+ *First the queue on its own: the requests it must refuse, and that it
+ *cannot go while a QP uses it.  With a peer, two server QPs then take their
+ *receives from one SRQ while the client sends on each in turn, waiting for
+ *an answer every time so that each message is known to have taken its
+ *receive.  The limit event must fire exactly when the posted count drops
+ *below the armed limit, and not again until the queue is armed anew.
+ *Without a peer only the first part runs.
+ *
+ *SERVER SHOULD BE STARTED FIRST
+ *
+ * Copyright (C) 2005 OSC iWarp Team
+ * Distributed under the GNU Public License Version 2 or later (See LICENSE)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../verbs.h"
+
+#define DEPTH 8  /*receives the SRQ holds*/
+#define SLOT 64  /*bytes of each receive buffer*/
+
+static int am_server;
+static char *server;
+static iwarp_rnic_handle_t rnic_hndl;
+static iwarp_prot_id prot_id;
+static iwarp_srq_handle_t srq;
+static int fired;  /*limit events so far*/
+static int context;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: %s u\n", progname);
+    fprintf(stderr, "   or  %s s <port>\n", progname);
+    fprintf(stderr, "   or  %s c <port> <server>\n", progname);
+    exit(1);
+}
+
+static void check(iwarp_status_t ret, const char *what)
+/*give up on any verbs error*/
+{
+    if(ret != IWARP_OK){
+	fprintf(stderr, "%s %s: %s\n", am_server ? "server" : "client", what, iwarp_string_from_errno(ret));
+	exit(1);
+    }
+}
+
+static void expect(int cond, const char *what)
+{
+    if(!cond){
+	fprintf(stderr, "%s %s\n", am_server ? "server" : "client", what);
+	exit(1);
+    }
+}
+
+static void limit_reached(iwarp_srq_handle_t srq_hndl, void *arg)
+{
+    expect(srq_hndl == srq && arg == &context, "limit event for the wrong queue");
+    fired++;
+}
+
+static void make_wr(iwarp_wr_t *wr, iwarp_sgl_t *sgl, iwarp_wr_work_t type, iwarp_stag_index_t stag, void *buf,
+		    uint32_t len, iwarp_wr_id_t id)
+/*a single buffer work request*/
+{
+    iwarp_sge_t sge;
+
+    check(iwarp_create_sgl(rnic_hndl, sgl), "create sgl");
+    sge.stag = stag;
+    sge.length = len;
+    sge.to = (uintptr_t) buf;
+    check(iwarp_register_sge(rnic_hndl, sgl, &sge), "register sge");
+
+    memset(wr, 0, sizeof(*wr));
+    wr->wr_id = id;
+    wr->wr_type = type;
+    wr->sgl = sgl;
+    wr->cq_type = SIGNALED;
+}
+
+static void post_srq(iwarp_stag_index_t stag, char *slots, iwarp_wr_id_t id)
+/*receive into slot id*/
+{
+    iwarp_sgl_t sgl;
+    iwarp_wr_t wr;
+
+    make_wr(&wr, &sgl, IWARP_WR_TYPE_RECV, stag, slots + id * SLOT, SLOT, id);
+    check(iwarp_srq_post_recv(rnic_hndl, srq, &wr), "post srq recv");
+}
+
+static void post(iwarp_qp_handle_t qp, iwarp_wr_work_t type, iwarp_stag_index_t stag, void *buf, uint32_t len)
+{
+    iwarp_sgl_t sgl;
+    iwarp_wr_t wr;
+
+    make_wr(&wr, &sgl, type, stag, buf, len, 0);
+    if(type == IWARP_WR_TYPE_RECV)
+	check(iwarp_qp_post_rq(rnic_hndl, qp, &wr), "post recv");
+    else
+	check(iwarp_qp_post_sq(rnic_hndl, qp, &wr), "post send");
+}
+
+static void wait_wc(iwarp_cq_handle_t cq, iwarp_wr_work_t type, iwarp_work_completion_t *wc)
+{
+    check(iwarp_cq_poll(rnic_hndl, cq, IWARP_INFINITY, 0, wc), "poll cq");
+    if(wc->wr_type != type || wc->status != IWARP_WR_SUCCESS){
+	fprintf(stderr, "%s: completion type %d status %d, not type %d\n", am_server ? "server" : "client",
+		wc->wr_type, wc->status, type);
+	exit(1);
+    }
+}
+
+static void qp_setup(iwarp_cq_handle_t *cq, iwarp_srq_handle_t srq_hndl, iwarp_qp_handle_t *qp)
+/*cq[0] for sends, cq[1] for receives*/
+{
+    iwarp_qp_attrs_t qp_attrs;
+
+    memset(&qp_attrs, 0, sizeof(qp_attrs));
+    qp_attrs.sq_cq = cq[0];
+    qp_attrs.rq_cq = cq[1];
+    qp_attrs.sq_depth = 4;
+    qp_attrs.rq_depth = 4;
+    qp_attrs.send_sgl_max = 1;
+    qp_attrs.recv_sgl_max = 1;
+    qp_attrs.rdma_w_sgl_max = 1;
+    qp_attrs.max_inline_data = 16;
+    qp_attrs.ord = 1;
+    qp_attrs.ird = 1;
+    qp_attrs.prot_d_id = prot_id;
+    qp_attrs.disable_mpa_markers = TRUE;
+    qp_attrs.disable_mpa_crc = TRUE;
+    qp_attrs.srq = srq_hndl;
+    check(iwarp_qp_create(rnic_hndl, &qp_attrs, qp), "create qp");
+}
+
+static void unit(void)
+/*the queue alone, nothing is sent*/
+{
+    char slots[(DEPTH + 1) * SLOT];
+    iwarp_stag_index_t stag;
+    iwarp_mem_desc_t mr;
+    iwarp_cq_handle_t cq[2];
+    iwarp_qp_handle_t qp;
+    iwarp_sgl_t sgl;
+    iwarp_wr_t wr;
+    int i;
+
+    expect(iwarp_srq_create(rnic_hndl, prot_id, 0, 1, NULL, NULL, &srq) == IWARP_INSUFFICIENT_RESOURCES,
+	   "empty srq created");
+    expect(iwarp_srq_create(rnic_hndl, prot_id, MAX_SRQ_DEPTH + 1, 1, NULL, NULL, &srq)
+	   == IWARP_INSUFFICIENT_RESOURCES, "srq past the largest depth created");
+    check(iwarp_srq_create(rnic_hndl, prot_id, DEPTH, 1, NULL, NULL, &srq), "create srq");
+    expect(iwarp_srq_arm(rnic_hndl, srq, 1) == IWARP_INVALID_MODIFIER, "armed without a handler");
+    check(iwarp_srq_arm(rnic_hndl, srq, 0), "disarm");
+
+    check(iwarp_nsmr_register(rnic_hndl, VA_ADDR_T, slots, sizeof(slots), prot_id, 0, REMOTE_WRITE, &stag, &mr),
+	  "register");
+    for(i=0; i<DEPTH; i++)
+	post_srq(stag, slots, i);
+    make_wr(&wr, &sgl, IWARP_WR_TYPE_RECV, stag, slots + DEPTH * SLOT, SLOT, DEPTH);
+    expect(iwarp_srq_post_recv(rnic_hndl, srq, &wr) == IWARP_RWQ_FULL, "posted past the depth");
+    wr.wr_type = IWARP_WR_TYPE_SEND;
+    expect(iwarp_srq_post_recv(rnic_hndl, srq, &wr) == IWARP_UNKNOWN_WR_TYPE, "send posted to an srq");
+
+    /*a QP on the queue has no receive queue of its own, and holds the queue*/
+    check(iwarp_cq_create(rnic_hndl, NULL, 4, &cq[0]), "create cq");
+    check(iwarp_cq_create(rnic_hndl, NULL, 4, &cq[1]), "create cq");
+    qp_setup(cq, srq, &qp);
+    wr.wr_type = IWARP_WR_TYPE_RECV;
+    expect(iwarp_qp_post_rq(rnic_hndl, qp, &wr) == IWARP_QP_USES_SRQ, "posted to the receive queue of an srq qp");
+    expect(iwarp_srq_destroy(rnic_hndl, srq) == IWARP_SRQ_INUSE, "srq destroyed under a qp");
+    check(iwarp_qp_destroy(rnic_hndl, qp), "destroy qp");
+    /*the posted receives go with it*/
+    check(iwarp_srq_destroy(rnic_hndl, srq), "destroy srq");
+    check(iwarp_cq_destroy(rnic_hndl, cq[0]), "destroy cq");
+    check(iwarp_cq_destroy(rnic_hndl, cq[1]), "destroy cq");
+    check(iwarp_deallocate_stag(rnic_hndl, stag), "deallocate stag");
+    check(iwarp_deregister_mem(rnic_hndl, prot_id, mr), "deregister");
+}
+
+static void loopback(int port)
+/*
+Message i goes out on QP i & 1 and is answered on it.  DEPTH receives are
+posted and the limit armed at half that, so the fifth message sets it off.
+Then half are posted again and the limit armed just under what is posted,
+so the next message sets it off once more.  Each QP is closed after its
+last answer, so neither side ever polls a socket its peer has closed.
+*/
+{
+    char slots[DEPTH * SLOT];
+    uint32_t sbuf, rbuf[2];
+    iwarp_stag_index_t stag;
+    iwarp_mem_desc_t mr;
+    iwarp_cq_handle_t cq[2];
+    iwarp_qp_handle_t qp[2];
+    iwarp_work_completion_t wc;
+    char priv[64];
+    int i, q, want;
+
+    check(iwarp_nsmr_register(rnic_hndl, VA_ADDR_T, am_server ? (void *) slots : (void *) rbuf,
+			      am_server ? sizeof(slots) : sizeof(rbuf), prot_id, 0, REMOTE_WRITE, &stag, &mr),
+	  "register");
+    check(iwarp_cq_create(rnic_hndl, NULL, 2 * DEPTH, &cq[0]), "create cq");
+    check(iwarp_cq_create(rnic_hndl, NULL, 2 * DEPTH, &cq[1]), "create cq");
+
+    if(am_server){
+	check(iwarp_srq_create(rnic_hndl, prot_id, DEPTH, 1, limit_reached, &context, &srq), "create srq");
+	for(i=0; i<DEPTH; i++)
+	    post_srq(stag, slots, i);
+	check(iwarp_srq_arm(rnic_hndl, srq, DEPTH / 2), "arm srq");
+	for(q=0; q<2; q++){
+	    qp_setup(cq, srq, &qp[q]);
+	    check(iwarp_qp_passive_connect(rnic_hndl, port + q, qp[q], "s", priv, sizeof(priv)), "passive connect");
+	}
+
+	for(i=0; i<DEPTH; i++){
+	    wait_wc(cq[1], IWARP_WR_TYPE_RECV, &wc);
+	    expect(wc.qp_hndl == qp[i & 1], "receive completed on the wrong qp");
+	    memcpy(&rbuf[0], slots + wc.wr_id * SLOT, sizeof(rbuf[0]));
+	    if(rbuf[0] != (uint32_t) i){
+		fprintf(stderr, "server: message %u in place of %d\n", rbuf[0], i);
+		exit(1);
+	    }
+	    want = i >= DEPTH / 2 ? (i > DEPTH / 2 + 1 ? 2 : 1) : 0;
+	    if(fired != want){
+		fprintf(stderr, "server: %d limit events after message %d, not %d\n", fired, i, want);
+		exit(1);
+	    }
+	    if(i == DEPTH / 2 + 1){
+		int j;
+
+		for(j=0; j<DEPTH/2; j++)
+		    post_srq(stag, slots, (wc.wr_id + DEPTH - j) % DEPTH);
+		check(iwarp_srq_arm(rnic_hndl, srq, DEPTH - 2), "arm srq");
+	    }
+	    sbuf = i;
+	    post(qp[i & 1], IWARP_WR_TYPE_SEND_INLINE, 0, &sbuf, sizeof(sbuf));
+	    wait_wc(cq[0], IWARP_WR_TYPE_SEND, &wc);
+	    if(i >= DEPTH - 2)
+		check(iwarp_qp_disconnect(rnic_hndl, qp[i & 1]), "disconnect");
+	}
+	expect(iwarp_srq_destroy(rnic_hndl, srq) == IWARP_SRQ_INUSE, "srq destroyed under its qps");
+    }
+    else{
+	for(q=0; q<2; q++){
+	    qp_setup(cq, NULL, &qp[q]);
+	    post(qp[q], IWARP_WR_TYPE_RECV, stag, &rbuf[q], sizeof(rbuf[q]));
+	    check(iwarp_qp_active_connect(rnic_hndl, port + q, server, 10000, 100, qp[q], "c", priv, sizeof(priv)),
+		  "active connect");
+	}
+	for(i=0; i<DEPTH; i++){
+	    q = i & 1;
+	    sbuf = i;
+	    post(qp[q], IWARP_WR_TYPE_SEND_INLINE, 0, &sbuf, sizeof(sbuf));
+	    wait_wc(cq[0], IWARP_WR_TYPE_SEND, &wc);
+	    wait_wc(cq[1], IWARP_WR_TYPE_RECV, &wc);
+	    expect(wc.qp_hndl == qp[q] && rbuf[q] == (uint32_t) i, "wrong answer");
+	    if(i >= DEPTH - 2)
+		check(iwarp_qp_disconnect(rnic_hndl, qp[q]), "disconnect");
+	    else
+		post(qp[q], IWARP_WR_TYPE_RECV, stag, &rbuf[q], sizeof(rbuf[q]));
+	}
+    }
+
+    for(q=0; q<2; q++)
+	check(iwarp_qp_destroy(rnic_hndl, qp[q]), "destroy qp");
+    if(am_server)
+	check(iwarp_srq_destroy(rnic_hndl, srq), "destroy srq");
+    check(iwarp_cq_destroy(rnic_hndl, cq[0]), "destroy cq");
+    check(iwarp_cq_destroy(rnic_hndl, cq[1]), "destroy cq");
+    check(iwarp_deallocate_stag(rnic_hndl, stag), "deallocate stag");
+    check(iwarp_deregister_mem(rnic_hndl, prot_id, mr), "deregister");
+}
+
+int main(int argc, char **argv)
+{
+    set_progname(argc, argv);
+    if(argc < 2 || (argv[1][0] != 'u' && argv[1][0] != 's' && argv[1][0] != 'c'))
+	usage();
+    am_server = argv[1][0] == 's';
+    if(argv[1][0] != 'u' && argc < 3)
+	usage();
+    if(argv[1][0] == 'c'){
+	if(argc < 4)
+	    usage();
+	server = argv[3];
+    }
+
+    check(iwarp_rnic_open(0, PAGE_MODE, NULL, &rnic_hndl), "open rnic");
+    check(iwarp_pd_allocate(rnic_hndl, &prot_id), "allocate pd");
+
+    unit();
+    printf("srq ok\n");
+
+    if(argv[1][0] != 'u'){
+	loopback(atoi(argv[2]));
+	printf("srq over loopback ok\n");
+    }
+
+    check(iwarp_pd_deallocate(rnic_hndl, prot_id), "deallocate pd");
+    check(iwarp_rnic_close(rnic_hndl), "close rnic");
+    return 0;
+}
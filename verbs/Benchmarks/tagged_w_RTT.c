@@ -275,6 +275,14 @@ int main(int argc, char **argv)
     qp_attrs.zero_stag_enable = FALSE;
     qp_attrs.disable_mpa_markers = TRUE;
     qp_attrs.disable_mpa_crc = FALSE;
+    qp_attrs.max_inline_data = 0;
+    qp_attrs.srq = NULL;
+    qp_attrs.imm_data_enable = FALSE;
+    qp_attrs.atomics_enable = FALSE;
+    qp_attrs.progress_affinity = 0;
+    qp_attrs.defer_crc_check = FALSE;
+    qp_attrs.mpa_crc_auto = FALSE;
+    qp_attrs.rdma_read_chunk = 0;
 
 
 
@@ -0,0 +1,395 @@
+/*
+ * Multi-threaded Verbs Testing Program
+ *
+ *Each of several threads runs its own QP and CQ in ping-pong with the
+ *peer, all at once on one RNIC in thread-safe mode, optionally with
+ *background progress threads.  Then one more QP, with deferred CRC checks
+ *at the server, goes through a relay in the client that corrupts a byte of
+ *the second of two large sends.  The server must complete that receive in
+ *error, and the TERMINATE it sends back must fail the RDMA Read the client
+ *posted behind the send.
+ *
+ *SERVER SHOULD BE STARTED FIRST
+ *
+ * Copyright (C) 2005 OSC iWarp Team
+ * Distributed under the GNU Public License Version 2 or later (See LICENSE)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../verbs.h"
+
+#define MAX_THREADS 64
+#define BIG (1 << 20)  /*bytes of each of the two large sends, many FPDUs*/
+#define BAD 0x5a  /*the second large send is all this, the relay corrupts it*/
+#define BAD_RUN 64  /*consecutive BAD bytes the relay sees before it flips one*/
+
+static int am_server;
+static int port;
+static int threads = 4;
+static int progress_threads;
+static int iters = 1000;
+static char *server;
+static iwarp_rnic_handle_t rnic_hndl;
+static iwarp_prot_id prot_id;
+static iwarp_qp_handle_t qps[MAX_THREADS];
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: %s s <port> [threads] [progress threads] [iterations]\n", progname);
+    fprintf(stderr, "   or  %s c <port> <server> [threads] [progress threads] [iterations]\n", progname);
+    exit(1);
+}
+
+static void check(iwarp_status_t ret, const char *what)
+/*give up on any verbs error*/
+{
+    if(ret != IWARP_OK){
+	fprintf(stderr, "%s %s: %s\n", am_server ? "server" : "client", what, iwarp_string_from_errno(ret));
+	exit(1);
+    }
+}
+
+static void post(iwarp_qp_handle_t qp, iwarp_wr_work_t type, iwarp_stag_index_t stag, void *buf, uint32_t len,
+		 iwarp_wr_id_t id)
+/*post a single buffer send or receive*/
+{
+    iwarp_sgl_t sgl;
+    iwarp_sge_t sge;
+    iwarp_wr_t wr;
+
+    check(iwarp_create_sgl(rnic_hndl, &sgl), "create sgl");
+    sge.stag = stag;
+    sge.length = len;
+    sge.to = (uintptr_t) buf;
+    check(iwarp_register_sge(rnic_hndl, &sgl, &sge), "register sge");
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = id;
+    wr.wr_type = type;
+    wr.sgl = &sgl;
+    wr.cq_type = SIGNALED;
+    if(type == IWARP_WR_TYPE_RECV)
+	check(iwarp_qp_post_rq(rnic_hndl, qp, &wr), "post recv");
+    else
+	check(iwarp_qp_post_sq(rnic_hndl, qp, &wr), "post send");
+}
+
+static void wait_wc(iwarp_cq_handle_t cq, iwarp_wr_work_t type, iwarp_wr_id_t id, iwarp_work_completion_t *wc)
+/*the next completion must be this one, its status is left to the caller*/
+{
+    check(iwarp_cq_poll(rnic_hndl, cq, IWARP_INFINITY, 0, wc), "poll cq");
+    if(wc->wr_type != type || wc->wr_id != id){
+	fprintf(stderr, "%s: completion type %d wr %d, not type %d wr %d\n", am_server ? "server" : "client",
+		wc->wr_type, (int) wc->wr_id, type, (int) id);
+	exit(1);
+    }
+}
+
+static void qp_setup(iwarp_cq_handle_t *cq, iwarp_bool_t crc, iwarp_bool_t defer, iwarp_qp_handle_t *qp)
+/*cq[0] for sends, cq[1] for receives, as a receive may complete before the send ahead of it*/
+{
+    iwarp_qp_attrs_t qp_attrs;
+
+    check(iwarp_cq_create(rnic_hndl, NULL, 16, &cq[0]), "create cq");
+    check(iwarp_cq_create(rnic_hndl, NULL, 16, &cq[1]), "create cq");
+    memset(&qp_attrs, 0, sizeof(qp_attrs));
+    qp_attrs.sq_cq = cq[0];
+    qp_attrs.rq_cq = cq[1];
+    qp_attrs.sq_depth = 4;
+    qp_attrs.rq_depth = 4;
+    qp_attrs.send_sgl_max = 1;
+    qp_attrs.recv_sgl_max = 1;
+    qp_attrs.rdma_w_sgl_max = 1;
+    qp_attrs.max_inline_data = 16;
+    qp_attrs.ord = 1;
+    qp_attrs.ird = 1;
+    qp_attrs.prot_d_id = prot_id;
+    qp_attrs.disable_mpa_markers = TRUE;
+    qp_attrs.disable_mpa_crc = !crc;
+    qp_attrs.defer_crc_check = defer;
+    check(iwarp_qp_create(rnic_hndl, &qp_attrs, qp), "create qp");
+}
+
+static void qp_connect(iwarp_qp_handle_t qp, int p)
+{
+    char priv[64];
+
+    if(am_server)
+	check(iwarp_qp_passive_connect(rnic_hndl, p, qp, "s", priv, sizeof(priv)), "passive connect");
+    else
+	check(iwarp_qp_active_connect(rnic_hndl, p, server, 10000, 100, qp, "c", priv, sizeof(priv)),
+	      "active connect");
+}
+
+static void *ping_pong(void *arg)
+/*one thread: its own CQ and QP, every other one with CRC*/
+{
+    long t = (long) arg;
+    int i;
+    uint32_t rbuf, sbuf;
+    iwarp_cq_handle_t cq[2];
+    iwarp_qp_handle_t qp;
+    iwarp_stag_index_t stag;
+    iwarp_mem_desc_t mr;
+    iwarp_work_completion_t wc;
+
+    qp_setup(cq, t & 1, FALSE, &qp);
+    check(iwarp_nsmr_register(rnic_hndl, VA_ADDR_T, &rbuf, sizeof(rbuf), prot_id, 0, REMOTE_WRITE, &stag, &mr),
+	  "register");
+    post(qp, IWARP_WR_TYPE_RECV, stag, &rbuf, sizeof(rbuf), 0);
+    qp_connect(qp, port + t);
+
+    for(i=0; i<iters; i++){
+	if(am_server){
+	    wait_wc(cq[1], IWARP_WR_TYPE_RECV, 0, &wc);
+	    if(wc.status != IWARP_WR_SUCCESS || wc.qp_hndl != qp || rbuf != t * 100000 + i){
+		fprintf(stderr, "server thread %ld: got %u at %d\n", t, rbuf, i);
+		exit(1);
+	    }
+	    sbuf = rbuf + 1;
+	    post(qp, IWARP_WR_TYPE_RECV, stag, &rbuf, sizeof(rbuf), 0);
+	    post(qp, IWARP_WR_TYPE_SEND_INLINE, 0, &sbuf, sizeof(sbuf), 1);
+	    wait_wc(cq[0], IWARP_WR_TYPE_SEND, 1, &wc);
+	}
+	else{
+	    sbuf = t * 100000 + i;
+	    post(qp, IWARP_WR_TYPE_SEND_INLINE, 0, &sbuf, sizeof(sbuf), 1);
+	    wait_wc(cq[0], IWARP_WR_TYPE_SEND, 1, &wc);
+	    wait_wc(cq[1], IWARP_WR_TYPE_RECV, 0, &wc);
+	    if(wc.status != IWARP_WR_SUCCESS || rbuf != t * 100000 + i + 1){
+		fprintf(stderr, "client thread %ld: got %u at %d\n", t, rbuf, i);
+		exit(1);
+	    }
+	    post(qp, IWARP_WR_TYPE_RECV, stag, &rbuf, sizeof(rbuf), 0);
+	}
+    }
+    qps[t] = qp;
+    return NULL;
+}
+
+static void *relay(void *arg)
+/*forward between the client QP and the server, flipping one byte of the first BAD_RUN bytes of BAD going out*/
+{
+    int lfd = (long) arg, fd[2], i, n, run = 0, armed = 1;
+    struct addrinfo hints, *ai;
+    struct pollfd pfd[2];
+    char portstr[16];
+    uint8_t buf[65536];
+
+    fd[0] = accept(lfd, NULL, NULL);
+    close(lfd);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(portstr, sizeof(portstr), "%d", port + threads);
+    if(fd[0] < 0 || getaddrinfo(server, portstr, &hints, &ai)){
+	fprintf(stderr, "relay: no connection\n");
+	exit(1);
+    }
+    fd[1] = socket(ai->ai_family, ai->ai_socktype, 0);
+    if(connect(fd[1], ai->ai_addr, ai->ai_addrlen) < 0){
+	fprintf(stderr, "relay: cannot reach the server\n");
+	exit(1);
+    }
+    freeaddrinfo(ai);
+
+    for(;;){
+	pfd[0].fd = fd[0];
+	pfd[1].fd = fd[1];
+	pfd[0].events = pfd[1].events = POLLIN;
+	if(poll(pfd, 2, -1) < 0)
+	    break;
+	for(i=0; i<2; i++){
+	    if(!pfd[i].revents)
+		continue;
+	    n = read(fd[i], buf, sizeof(buf));
+	    if(n <= 0)
+		goto out;
+	    if(i == 0 && armed){
+		int j;
+
+		for(j=0; j<n && armed; j++){
+		    run = buf[j] == BAD ? run + 1 : 0;
+		    if(run == BAD_RUN){
+			buf[j] ^= 1;
+			armed = 0;
+		    }
+		}
+	    }
+	    if(write(fd[!i], buf, n) != n)
+		goto out;
+	}
+    }
+out:
+    close(fd[0]);
+    close(fd[1]);
+    return NULL;
+}
+
+static void corrupt(void)
+/*two large sends on a QP whose server defers its CRC checks, the second corrupted on the way*/
+{
+    uint8_t *buf;
+    uint64_t addr[2], *rd;
+    int i;
+    iwarp_cq_handle_t cq[2];
+    iwarp_qp_handle_t qp;
+    iwarp_stag_index_t stag;
+    iwarp_mem_desc_t mr;
+    iwarp_work_completion_t wc;
+
+    buf = malloc(2 * BIG + 64);
+    memset(buf, 0, 2 * BIG + 64);
+    rd = (uint64_t *)(buf + 2 * BIG);
+    qp_setup(cq, TRUE, am_server, &qp);
+    check(iwarp_nsmr_register(rnic_hndl, VA_ADDR_T, buf, 2 * BIG + 64, prot_id, 0, REMOTE_READ|REMOTE_WRITE,
+			      &stag, &mr), "register");
+
+    if(am_server){
+	post(qp, IWARP_WR_TYPE_RECV, stag, buf, BIG, 1);
+	post(qp, IWARP_WR_TYPE_RECV, stag, buf + BIG, BIG, 2);
+	qp_connect(qp, port + threads);
+	/*where the client reads from*/
+	addr[0] = stag;
+	addr[1] = (uintptr_t) rd;
+	post(qp, IWARP_WR_TYPE_SEND_INLINE, 0, addr, sizeof(addr), 3);
+	wait_wc(cq[0], IWARP_WR_TYPE_SEND, 3, &wc);
+
+	wait_wc(cq[1], IWARP_WR_TYPE_RECV, 1, &wc);
+	if(wc.status != IWARP_WR_SUCCESS){
+	    fprintf(stderr, "server: first send status %d\n", wc.status);
+	    exit(1);
+	}
+	for(i=0; i<BIG; i++)
+	    if(buf[i] != (uint8_t)(i * 13)){
+		fprintf(stderr, "server: first send byte %d\n", i);
+		exit(1);
+	    }
+	wait_wc(cq[1], IWARP_WR_TYPE_RECV, 2, &wc);
+	if(wc.status != IWARP_WR_FAILURE){
+	    fprintf(stderr, "server: corrupted send status %d\n", wc.status);
+	    exit(1);
+	}
+    }
+    else{
+	struct sockaddr_in sin;
+	pthread_t th;
+	iwarp_sgl_t sgl, remote_sgl;
+	iwarp_sge_t sge;
+	iwarp_wr_t wr;
+	char priv[64];
+	long lfd;
+
+	/*the relay listens on the port after the server's*/
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	i = 1;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port + threads + 1);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(lfd, (struct sockaddr *) &sin, sizeof(sin)) < 0 || listen(lfd, 1) < 0){
+	    fprintf(stderr, "client: relay cannot listen\n");
+	    exit(1);
+	}
+	pthread_create(&th, NULL, relay, (void *) lfd);
+	pthread_detach(th);
+
+	post(qp, IWARP_WR_TYPE_RECV, stag, addr, sizeof(addr), 3);
+	check(iwarp_qp_active_connect(rnic_hndl, port + threads + 1, "localhost", 10000, 100, qp, "c",
+				      priv, sizeof(priv)), "active connect");
+	wait_wc(cq[1], IWARP_WR_TYPE_RECV, 3, &wc);
+
+	for(i=0; i<BIG; i++)
+	    buf[i] = i * 13;
+	memset(buf + BIG, BAD, BIG);
+	post(qp, IWARP_WR_TYPE_SEND, stag, buf, BIG, 1);
+	post(qp, IWARP_WR_TYPE_SEND, stag, buf + BIG, BIG, 2);
+
+	/*behind the sends, never answered: the server stops reading at the bad one*/
+	check(iwarp_create_sgl(rnic_hndl, &sgl), "create sgl");
+	check(iwarp_create_sgl(rnic_hndl, &remote_sgl), "create sgl");
+	sge.stag = stag;
+	sge.length = 8;
+	sge.to = (uintptr_t) rd;
+	check(iwarp_register_sge(rnic_hndl, &sgl, &sge), "register sge");
+	sge.stag = addr[0];
+	sge.to = addr[1];
+	check(iwarp_register_sge(rnic_hndl, &remote_sgl, &sge), "register sge");
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = 4;
+	wr.wr_type = IWARP_WR_TYPE_RDMA_READ;
+	wr.sgl = &sgl;
+	wr.remote_sgl = &remote_sgl;
+	wr.cq_type = SIGNALED;
+	check(iwarp_qp_post_sq(rnic_hndl, qp, &wr), "post read");
+
+	wait_wc(cq[0], IWARP_WR_TYPE_SEND, 1, &wc);
+	wait_wc(cq[0], IWARP_WR_TYPE_SEND, 2, &wc);
+	wait_wc(cq[0], IWARP_WR_TYPE_RDMA_READ, 4, &wc);
+	if(wc.status != IWARP_WR_FAILURE){
+	    fprintf(stderr, "client: read after the corrupted send status %d\n", wc.status);
+	    exit(1);
+	}
+    }
+    qps[threads] = qp;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t th[MAX_THREADS];
+    iwarp_rnic_open_attrs_t open_attrs;
+    long t;
+    int arg = 3;
+
+    set_progname(argc, argv);
+    if(argc < 3 || (argv[1][0] != 's' && argv[1][0] != 'c'))
+	usage();
+    am_server = argv[1][0] == 's';
+    port = atoi(argv[2]);
+    if(!am_server){
+	if(argc < 4)
+	    usage();
+	server = argv[arg++];
+    }
+    if(argc > arg)
+	threads = atoi(argv[arg++]);
+    if(argc > arg)
+	progress_threads = atoi(argv[arg++]);
+    if(argc > arg)
+	iters = atoi(argv[arg++]);
+    if(threads < 1 || threads >= MAX_THREADS || progress_threads < 0 || iters < 1)
+	usage();
+
+    memset(&open_attrs, 0, sizeof(open_attrs));
+    open_attrs.progress_threads = progress_threads;
+    check(iwarp_rnic_open_ext(0, PAGE_MODE, NULL, &open_attrs, &rnic_hndl), "open rnic");
+    check(iwarp_rnic_thread_safe(rnic_hndl), "thread safe");
+    check(iwarp_pd_allocate(rnic_hndl, &prot_id), "allocate pd");
+
+    for(t=0; t<threads; t++)
+	pthread_create(&th[t], NULL, ping_pong, (void *) t);
+    for(t=0; t<threads; t++)
+	pthread_join(th[t], NULL);
+    printf("%d threads of %d ping-pongs ok\n", threads, iters);
+
+    corrupt();
+    printf("corrupted send under deferred crc ok\n");
+
+    for(t=0; t<=threads; t++){
+	check(iwarp_qp_disconnect(rnic_hndl, qps[t]), "disconnect");
+	check(iwarp_qp_destroy(rnic_hndl, qps[t]), "destroy qp");
+    }
+    check(iwarp_rnic_close(rnic_hndl), "close rnic");
+    return 0;
+}
@@ -208,6 +208,14 @@ static void connect_iwarp(void)
     qp_attrs.zero_stag_enable = 0;
     qp_attrs.disable_mpa_markers = 1;
     qp_attrs.disable_mpa_crc = 0;
+    qp_attrs.max_inline_data = 0;
+    qp_attrs.srq = NULL;
+    qp_attrs.imm_data_enable = FALSE;
+    qp_attrs.atomics_enable = FALSE;
+    qp_attrs.progress_affinity = 0;
+    qp_attrs.defer_crc_check = FALSE;
+    qp_attrs.mpa_crc_auto = FALSE;
+    qp_attrs.rdma_read_chunk = 0;
 
     ret = iwarp_qp_create(rnic_hndl, &qp_attrs, &qp_id);
     if (ret)
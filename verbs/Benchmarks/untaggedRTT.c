@@ -271,6 +271,14 @@ int main(int argc, char **argv)
     /* XXX: for speed, turn off mpa crc and markers */
     qp_attrs.disable_mpa_markers = TRUE;
     qp_attrs.disable_mpa_crc = TRUE;
+    qp_attrs.max_inline_data = 0;
+    qp_attrs.srq = NULL;
+    qp_attrs.imm_data_enable = FALSE;
+    qp_attrs.atomics_enable = FALSE;
+    qp_attrs.progress_affinity = 0;
+    qp_attrs.defer_crc_check = FALSE;
+    qp_attrs.mpa_crc_auto = FALSE;
+    qp_attrs.rdma_read_chunk = 0;
 
     ret = iwarp_qp_create(rnic_hndl, &qp_attrs, &qp_id); /*create the QP*/
     if(ret != IWARP_OK)
@@ -58,4 +58,12 @@ ERRNO_ENTRY(IWARP_UNABLE_TO_OPEN_RNIC,)
 ERRNO_ENTRY(IWARP_RNIC_CLOSE_FAILURE,)
 ERRNO_ENTRY(IWARP_UNSUPORTED_COMPL_TYPE,)
 ERRNO_ENTRY(IWARP_STAG_REGISTRATION_FAILURE,)
+ERRNO_ENTRY(IWARP_SRQ_UNSUPPORTED,)
+ERRNO_ENTRY(IWARP_SRQ_INUSE,)
+ERRNO_ENTRY(IWARP_QP_USES_SRQ,)
+ERRNO_ENTRY(IWARP_EXT_NOT_NEGOTIATED,)
+ERRNO_ENTRY(IWARP_PROGRESS_UNSUPPORTED,)
+ERRNO_ENTRY(IWARP_INVALID_SUBNET,)
+ERRNO_ENTRY(IWARP_CRC_THREADS_UNSUPPORTED,)
+ERRNO_ENTRY(IWARP_CRC_TRUST_UNSUPPORTED,)
 
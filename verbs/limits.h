@@ -12,20 +12,32 @@
 
 #define VENDOR_NAME "OSC iwarp"
 #define VERSION 1
-#define MAX_QP 10
+#define MAX_QP 65536
+#define QP_CHUNK 256  /*QP table grows by this many slots at a time*/
 #define MAX_WRQ 250
+#define MAX_SRQ 4  /*user mode only, the kernel has none*/
+#define MAX_SRQ_DEPTH 16384  /*receives one shared queue holds*/
 #define MAX_PROT_DOMAIN 10
 #define HOST_MAX 256
 //~ #define MAX_SQ_DEPTH 256
 //~ #define MAX_RQ_DEPTH 256
-#define MAX_SGE 1
-#define MAX_S_SGL 10
-#define MAX_RDMA_W_SGL 10  /*Ensure this is always at least as big as MAX_*_SGL*/
-#define MAX_R_SGL 10
-#define MAX_IRD 1
+#define MAX_SGE 8  /*no more than DDP_MAX_SGE, the pieces rdmap can gather or scatter*/
+#define MAX_S_SGL MAX_SGE
+#define MAX_RDMA_W_SGL MAX_SGE  /*Ensure this is always at least as big as MAX_*_SGL*/
+#define MAX_R_SGL MAX_SGE
+#define MAX_INLINE 256  /*bytes, same as the kernel IWARP_MAX_INLINE*/
+#ifdef KERNEL_IWARP
+#define MAX_IRD 1  /*the kernel keeps one read outstanding each way*/
 #define MAX_ORD 1
-#define BIND_MEM_WINDOW_ENABLE 0
+#else
+#define MAX_IRD 16  /*more than 1 needs a peer that negotiates it*/
+#define MAX_ORD 16
+#endif
+#define BIND_MEM_WINDOW_ENABLE 1
 #define ENABLE_ZERO_STAG 0
 #define ENABLE_CQE_HANDLER 0
 #define MAX_CQ_DEPTH 1024
+#define HUGEPAGE_SIZE (2*1024*1024)  /*buffer pool arenas are multiples of this*/
+#define POOL_MIN_BUF 64  /*smallest pool buffer, one cache line*/
+#define POOL_CLASSES 26  /*POOL_MIN_BUF << 25 is 2GB*/
 
@@ -26,6 +26,7 @@ forever?  Blocking CQs do not work currently for userspace anyway so ignore this
 
 #define RNIC abi_compat
 #define IGNORE __attribute__ ((unused))
+#define OF_POST_WINDOW 256  /*work requests per list post*/
 
 #include "openfab.h"
 
@@ -430,14 +431,14 @@ int rdma_accept(struct rdma_cm_id *id, IGNORE struct rdma_conn_param *conn_param
     }
     free(attrs.vendor_name);
 
-    rnic_ptr->qp_index[qp_id].socket_fd = accept(myinfo->fd, (struct sockaddr *) &passive_socket, &passive_s_len);
-    if(rnic_ptr->qp_index[qp_id].socket_fd < 0){
+    qp_from_handle(rnic_ptr, qp_id)->socket_fd = accept(myinfo->fd, (struct sockaddr *) &passive_socket, &passive_s_len);
+    if(qp_from_handle(rnic_ptr, qp_id)->socket_fd < 0){
 	debug(0, "Can't accept connection, accept (2) failed", iwarp_string_from_errno(IWARP_CAN_NOT_ACCEPT_CONNECTION));
 	goto GET_OUT;
     }
 
-    debug(5, "the cqs are %p", rnic_ptr->qp_index[qp_id].attributes);
-    debug(5, "just accepted  socket %d from listening socket %d",rnic_ptr->qp_index[qp_id].socket_fd, myinfo->fd);
+    debug(5, "the cqs are %p", qp_from_handle(rnic_ptr, qp_id)->attributes);
+    debug(5, "just accepted  socket %d from listening socket %d",qp_from_handle(rnic_ptr, qp_id)->socket_fd, myinfo->fd);
 
 
     /*register socket with rdmap*/
@@ -448,11 +449,13 @@ int rdma_accept(struct rdma_cm_id *id, IGNORE struct rdma_conn_param *conn_param
 	goto GET_OUT;
     }
 
-     /*mark the QP as connected*/
-    rnic_ptr->qp_index[qp_id].connected = TRUE;
+     /*mark the QP as connected, posts that see that no longer queue*/
+    rwlock_write(&rnic_ptr->lock);
+    qp_from_handle(rnic_ptr, qp_id)->connected = TRUE;
 
     /*dispatch anything that was preposted to the recv workQ*/
-    ret = iwarp_recv_event_dispatcher(rnic_ptr, &rnic_ptr->qp_index[qp_id], &rnic_ptr->recv_q);
+    ret = iwarp_recv_event_dispatcher(rnic_ptr, qp_from_handle(rnic_ptr, qp_id));
+    rwlock_drop(&rnic_ptr->lock);
     if (ret){
 	debug(0, "unable to dispatch recvs", iwarp_string_from_errno(IWARP_RECV_DISPATCHING_FAILURE));
 	goto GET_OUT;
@@ -521,6 +524,22 @@ int rdma_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd,  struct ibv_qp_init
     qp_attrs.zero_stag_enable = 0;
     qp_attrs.disable_mpa_markers = 1;
     qp_attrs.disable_mpa_crc = 1;
+    if(qp_init_attr->cap.max_inline_data > MAX_INLINE){
+	debug(0, "Can't inline %u bytes", qp_init_attr->cap.max_inline_data);
+	return -1;
+    }
+    qp_attrs.max_inline_data = qp_init_attr->cap.max_inline_data;
+    if(qp_init_attr->srq != NULL){
+	debug(0, "No shared receive queues through this interface");
+	return -1;
+    }
+    qp_attrs.srq = NULL;
+    qp_attrs.imm_data_enable = FALSE;
+    qp_attrs.atomics_enable = FALSE;
+    qp_attrs.progress_affinity = 0;
+    qp_attrs.defer_crc_check = FALSE;
+    qp_attrs.mpa_crc_auto = FALSE;
+    qp_attrs.rdma_read_chunk = 0;
 
     cm_qp = malloc(sizeof(struct ibv_qp));
     id->qp = cm_qp;
@@ -717,113 +736,139 @@ struct ibv_mr *ibv_reg_mr(struct ibv_pd *pd, void *addr,  size_t length, enum ib
 
 }
 
-int ibv_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr, IGNORE struct ibv_recv_wr **bad_wr){
+static int of_sgl(struct ibv_qp *qp, struct ibv_sge *sg_list, int num_sge, iwarp_sgl_t *sgl, uint32_t *length){
+    /*build an sgl from the OF sge list, length gets the total*/
     int ret;
-    iwarp_wr_t rq_wr;
+    int i;
     iwarp_sge_t sge;  /*scatter gather entry*/
-    iwarp_sgl_t sgl;  /*the scatter gather list*/
-
-    if(wr->num_sge != 1){
-	debug(0, "Unable to support %d SGEs only support 1", wr->num_sge);
-    }
 
     /*first need to make a SGL*/
-    ret = iwarp_create_sgl(qp->context->swinfo->rnic_hndl, &sgl);
+    ret = iwarp_create_sgl(qp->context->swinfo->rnic_hndl, sgl);
     if(ret){
 	debug(0, "Unable to create SGL: %s", iwarp_string_from_errno(ret));
 	return ret;
     }
 
-    /*set up SGE*/
-    sge.length = wr->sg_list->length;
-    sge.stag = wr->sg_list->lkey; /*assumes STag and lkey are compatible with each oher */
-    sge.to = wr->sg_list->addr;
+    *length = 0;
+    for(i=0; i<num_sge; i++){
+	/*set up SGE*/
+	sge.length = sg_list[i].length;
+	sge.stag = sg_list[i].lkey; /*assumes STag and lkey are compatible with each oher */
+	sge.to = sg_list[i].addr;
+	*length += sge.length;
 
-    /*add SGE to the SGL*/
-    ret = iwarp_register_sge(qp->context->swinfo->rnic_hndl, &sgl, &sge);
-    if(ret){
-	debug(0, "Unable to register SGE with SGL: %s", iwarp_string_from_errno(ret));
-	return ret;
+	/*add SGE to the SGL*/
+	ret = iwarp_register_sge(qp->context->swinfo->rnic_hndl, sgl, &sge);
+	if(ret){
+	    debug(0, "Unable to register SGE %d of %d with SGL: %s", i, num_sge, iwarp_string_from_errno(ret));
+	    return ret;
+	}
     }
 
-    debug(2, "created sgl, sge, and added sge to sgl");
+    debug(2, "created sgl, %d sges added", num_sge);
+    return 0;
+}
 
-    rq_wr.wr_id = wr->wr_id;
-    rq_wr.sgl = &sgl;
-    rq_wr.wr_type = IWARP_WR_TYPE_RECV;
-    rq_wr.cq_type = SIGNALED;
+static int of_recv_wr(struct ibv_qp *qp, struct ibv_recv_wr *wr, iwarp_wr_t *rq_wr, iwarp_sgl_t *sgl){
+    /*translate one receive, the sgl is filled in place*/
+    int ret;
+    uint32_t length;
 
-    ret = iwarp_qp_post_rq(qp->context->swinfo->rnic_hndl, qp->sw_qp,  &rq_wr);
-    if(ret){
-	debug(0, "Unable to post recv to rq: %s", iwarp_string_from_errno(ret));
+    ret = of_sgl(qp, wr->sg_list, wr->num_sge, sgl, &length);
+    if(ret)
 	return ret;
-    }
-    debug(2, "posted rq");
-    debug(2, "after posting RQ SGL count is %d", rq_wr.sgl->sge_count);
+
+    rq_wr->wr_id = wr->wr_id;
+    rq_wr->sgl = sgl;
+    rq_wr->wr_type = IWARP_WR_TYPE_RECV;
+    rq_wr->cq_type = SIGNALED;
     return 0;
 }
 
-int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, IGNORE struct ibv_send_wr **bad_wr){
-
-    int ret;
-    iwarp_wr_t sq_wr;
-    iwarp_sge_t sge, remote_sge;  /*scatter gather entry*/
-    iwarp_sgl_t sgl, remote_sgl;  /*the scatter gather list*/
-
-    if(wr->num_sge != 1){
-	debug(0, "Unable to support %d SGEs only support 1", wr->num_sge);
+int ibv_post_recv(struct ibv_qp *qp, struct ibv_recv_wr *wr, struct ibv_recv_wr **bad_wr){
+    /*the chain goes down in windows, each one a single list post*/
+    int ret = 0;
+    iwarp_wr_t *rq_wr;
+    iwarp_sgl_t *sgl;
+    struct ibv_recv_wr *first;
+    uint32_t n, posted;
+
+    /*the window lives on the heap, sized to the chain up to OF_POST_WINDOW*/
+    for(n=0, first = wr; first != NULL && n < OF_POST_WINDOW; n++, first = first->next);
+    if(n == 0)
+	return 0;
+    rq_wr = malloc(n * sizeof(*rq_wr));
+    sgl = malloc(n * sizeof(*sgl));
+    if(rq_wr == NULL || sgl == NULL){
+	debug(0, "Unable to allocate %u recv wrs", n);
+	*bad_wr = wr;
+	ret = -1;
+	goto out;
     }
 
-    /*first need to make a SGL*/
-    ret = iwarp_create_sgl(qp->context->swinfo->rnic_hndl, &sgl);
-    if(ret){
-	debug(0, "Unable to create SGL: %s", iwarp_string_from_errno(ret));
-	return ret;
+    while(wr != NULL){
+	first = wr;
+	for(n=0; wr != NULL && n < OF_POST_WINDOW; n++, wr = wr->next){
+	    ret = of_recv_wr(qp, wr, &rq_wr[n], &sgl[n]);
+	    if(ret){
+		*bad_wr = first;
+		goto out;
+	    }
+	}
+
+	ret = iwarp_qp_post_rq_list(qp->context->swinfo->rnic_hndl, qp->sw_qp, rq_wr, n, &posted);
+	if(ret){
+	    debug(0, "Unable to post recv to rq: %s", iwarp_string_from_errno(ret));
+	    for(*bad_wr = first; posted > 0; posted--)
+		*bad_wr = (*bad_wr)->next;
+	    goto out;
+	}
+	debug(2, "posted %u to rq", n);
     }
+out:
+    free(rq_wr);
+    free(sgl);
+    return ret;
+}
 
-    /*set up SGE*/
-    sge.length = wr->sg_list->length;
-    sge.stag = wr->sg_list->lkey; /*assumes STag and lkey are compatible with each oher */
-    sge.to = wr->sg_list->addr;
+static int of_send_wr(struct ibv_qp *qp, struct ibv_send_wr *wr, iwarp_wr_t *sq_wr, iwarp_sgl_t *sgl, iwarp_sgl_t *remote_sgl){
+    /*translate one send, the sgls are filled in place*/
+    int ret;
+    uint32_t length;
+    iwarp_sge_t remote_sge;  /*scatter gather entry*/
 
-    /*add SGE to the SGL*/
-    ret = iwarp_register_sge(qp->context->swinfo->rnic_hndl, &sgl, &sge);
-    if(ret){
-	debug(0, "Unable to register SGE with SGL: %s", iwarp_string_from_errno(ret));
+    ret = of_sgl(qp, wr->sg_list, wr->num_sge, sgl, &length);
+    if(ret)
 	return ret;
-    }
-
-    debug(2, "created sgl, sge, and added sge to sgl");
 
-    sq_wr.wr_id = wr->wr_id;
-    sq_wr.sgl = &sgl;
+    sq_wr->wr_id = wr->wr_id;
+    sq_wr->sgl = sgl;
+    sq_wr->remote_sgl = NULL;
 
     /*NEED TO HANDLE RDMA NOW TOO*/
     if(wr->opcode == IBV_WR_SEND){
-	sq_wr.wr_type = IWARP_WR_TYPE_SEND;
+	if(wr->send_flags & IBV_SEND_INLINE)
+	    sq_wr->wr_type = IWARP_WR_TYPE_SEND_INLINE;  /*lkey not needed*/
+	else
+	    sq_wr->wr_type = IWARP_WR_TYPE_SEND;
     }
     else if(wr->opcode == IBV_WR_RDMA_WRITE){
-	sq_wr.wr_type = IWARP_WR_TYPE_RDMA_WRITE;
+	sq_wr->wr_type = IWARP_WR_TYPE_RDMA_WRITE;
 
-	/*now need to create remote SGL*/
-	if(wr->num_sge != 1){
-	    debug(0, "Unable to support %d SGEs only support 1", wr->num_sge);
-	}
-
-	/*first need to make a SGL*/
-	ret = iwarp_create_sgl(qp->context->swinfo->rnic_hndl, &remote_sgl);
+	/*now need to create remote SGL, one buffer taking all the local sges*/
+	ret = iwarp_create_sgl(qp->context->swinfo->rnic_hndl, remote_sgl);
 	if(ret){
 	    debug(0, "Unable to create SGL: %s", iwarp_string_from_errno(ret));
 	    return ret;
 	}
 
 	/*set up SGE*/
-	remote_sge.length = wr->sg_list->length;
+	remote_sge.length = length;
 	remote_sge.stag = wr->wr.rdma.rkey;
 	remote_sge.to = wr->wr.rdma.remote_addr;
 
 	/*add SGE to the SGL*/
-	ret = iwarp_register_sge(qp->context->swinfo->rnic_hndl, &remote_sgl, &remote_sge);
+	ret = iwarp_register_sge(qp->context->swinfo->rnic_hndl, remote_sgl, &remote_sge);
 	if(ret){
 	    debug(0, "Unable to register SGE with SGL: %s", iwarp_string_from_errno(ret));
 	    return ret;
@@ -831,29 +876,66 @@ int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, IGNORE struct ibv_s
 
 	debug(2, "created remote sgl, sge, and added sge to sgl");
 
-	sq_wr.remote_sgl = &remote_sgl;
+	sq_wr->remote_sgl = remote_sgl;
     }
     else{
 	debug(0, "Unsupported operation type");
 	return -1;
     }
 
-    if(wr->send_flags == IBV_SEND_SIGNALED)
-	sq_wr.cq_type = SIGNALED;
+    if(wr->send_flags & IBV_SEND_SIGNALED)
+	sq_wr->cq_type = SIGNALED;
     else
-	sq_wr.cq_type = UNSIGNALED;
+	sq_wr->cq_type = UNSIGNALED;
+    return 0;
+}
 
-    ret = iwarp_qp_post_sq(qp->context->swinfo->rnic_hndl, qp->sw_qp,  &sq_wr);
-    if(ret){
-	debug(0, "Unable to post send to sq: %s", iwarp_string_from_errno(ret));
-	return ret;
+int ibv_post_send(struct ibv_qp *qp, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr){
+    /*the chain goes down in windows, each one checked whole then sent as one batch*/
+    int ret = 0;
+    iwarp_wr_t *sq_wr;
+    iwarp_sgl_t *sgl, *remote_sgl;
+    struct ibv_send_wr *first;
+    uint32_t n, posted;
+
+    /*the window lives on the heap, sized to the chain up to OF_POST_WINDOW*/
+    for(n=0, first = wr; first != NULL && n < OF_POST_WINDOW; n++, first = first->next);
+    if(n == 0)
+	return 0;
+    sq_wr = malloc(n * sizeof(*sq_wr));
+    sgl = malloc(n * sizeof(*sgl));
+    remote_sgl = malloc(n * sizeof(*remote_sgl));
+    if(sq_wr == NULL || sgl == NULL || remote_sgl == NULL){
+	debug(0, "Unable to allocate %u send wrs", n);
+	*bad_wr = wr;
+	ret = -1;
+	goto out;
     }
-    debug(2, "posted sq");
-    debug(2, "after posting SQ SGL count is %d", sq_wr.sgl->sge_count);
-
 
+    while(wr != NULL){
+	first = wr;
+	for(n=0; wr != NULL && n < OF_POST_WINDOW; n++, wr = wr->next){
+	    ret = of_send_wr(qp, wr, &sq_wr[n], &sgl[n], &remote_sgl[n]);
+	    if(ret){
+		*bad_wr = first;
+		goto out;
+	    }
+	}
 
-    return 0;
+	ret = iwarp_qp_post_sq_list(qp->context->swinfo->rnic_hndl, qp->sw_qp, sq_wr, n, &posted);
+	if(ret){
+	    debug(0, "Unable to post send to sq: %s", iwarp_string_from_errno(ret));
+	    for(*bad_wr = first; posted > 0; posted--)
+		*bad_wr = (*bad_wr)->next;
+	    goto out;
+	}
+	debug(2, "posted %u to sq", n);
+    }
+out:
+    free(sq_wr);
+    free(sgl);
+    free(remote_sgl);
+    return ret;
 }
 
 int ibv_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc){
@@ -905,6 +987,10 @@ int ibv_poll_cq(struct ibv_cq *cq, int num_entries, struct ibv_wc *wc){
 	    wc->opcode = IBV_WC_RDMA_READ;
 	break;
 
+	case IWARP_WR_TYPE_BIND_MW:
+	    wc->opcode = IBV_WC_BIND_MW;
+	break;
+
 	default:
 	    debug(0, "Unknown op type");
 	    return -1;
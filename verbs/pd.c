@@ -30,14 +30,17 @@ rnic_hndl
     /*Look through the protection domains and find one that is available*/
     iwarp_rnic_t *rnic_ptr = (iwarp_rnic_t *)ptr_from_int64(rnic_hndl);
 
+    rwlock_write(&rnic_ptr->lock);
     for(i=0; i<MAX_PROT_DOMAIN; i++){
 	if(rnic_ptr->pd_index[i].available == 1){
 	    *prot_id = i;
 	    rnic_ptr->pd_index[i].available = 0;
 	    rnic_ptr->pd_index[i].in_use = 0;
+	    rwlock_drop(&rnic_ptr->lock);
 	    return IWARP_OK;
 	}
     }
+    rwlock_drop(&rnic_ptr->lock);
 
     return IWARP_INSUFFICIENT_RESOURCES;
 }
@@ -52,22 +55,21 @@ Deallocate a protection domain, basically just change its available status
 {
     iwarp_rnic_t *rnic_ptr = (iwarp_rnic_t *)ptr_from_int64(rnic_hndl);
     int index = prot_id;
+    iwarp_status_t ret = IWARP_OK;
 
     if(index < 0 || index > MAX_PROT_DOMAIN)
 	return IWARP_INVALID_PD_ID;
 
-
+    rwlock_write(&rnic_ptr->lock);
     if(rnic_ptr->pd_index[index].in_use > 0)
-	return IWARP_PD_INUSE;
-
-
-    if(rnic_ptr->pd_index[index].available == 1)
-	return IWARP_INVALID_PD_ID;
-
-
-    rnic_ptr->pd_index[index].available = 1;
-
-    return IWARP_OK;
+	ret = IWARP_PD_INUSE;
+    else if(rnic_ptr->pd_index[index].available == 1)
+	ret = IWARP_INVALID_PD_ID;
+    else
+	rnic_ptr->pd_index[index].available = 1;
+    rwlock_drop(&rnic_ptr->lock);
+
+    return ret;
 
 }
 
@@ -0,0 +1,237 @@
+/*
+* Registered buffer pools
+*
+*Communication buffers are carved out of large arenas that are registered
+*once, hugepage backed when the system allows it, so handing out a buffer
+*costs no registration, and placement into it sees few TLB misses.  In
+*kernel mode each arena is a single pinned region.
+*
+*Copyright (C) 2005 OSC iWarp Team
+*Distributed under the GNU Public License Version 2 or later (SEE LICENSE)
+*
+*
+*/
+#include "verbs.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000  /*linux value, older headers lack it*/
+#endif
+
+static int pool_class(uint32_t length)
+/*
+Size class of a request, class c holds POOL_MIN_BUF << c bytes
+*/
+{
+    int c = 0;
+
+    while(((size_t) POOL_MIN_BUF << c) < length)
+	c++;
+    return c;
+}
+
+static iwarp_arena_t *pool_arena_create(iwarp_rnic_t *rnic_ptr, iwarp_pool_t *pool, size_t size)
+/*
+Map and register a new arena of at least size bytes, NULL on failure
+*/
+{
+    iwarp_arena_t *arena;
+    void *base = MAP_FAILED;
+    int huge = 0;
+    int ret;
+
+    size = (size + HUGEPAGE_SIZE - 1) & ~((size_t) HUGEPAGE_SIZE - 1);
+    if(size > UINT32_MAX)  /*registration lengths are 32 bit*/
+	return NULL;
+
+    if(pool->flags & IWARP_POOL_HUGEPAGE){
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	huge = (base != MAP_FAILED);
+    }
+    if(base == MAP_FAILED){
+	/*no reserved hugepages, settle for transparent ones if we can get them*/
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(base == MAP_FAILED)
+	    return NULL;
+#ifdef MADV_HUGEPAGE
+	if(pool->flags & IWARP_POOL_HUGEPAGE)
+	    madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    if(pool->flags & IWARP_POOL_MLOCK){
+	if(mlock(base, size) != 0)
+	    goto unmap;
+    }
+
+    arena = malloc(sizeof(*arena));
+    if(arena == NULL)
+	goto unmap;
+    arena->base = base;
+    arena->size = size;
+    arena->used = 0;
+    arena->huge = huge;
+
+    ret = v_mem_register(rnic_ptr, base, size, &arena->mem_region);
+    if(ret != IWARP_OK)
+	goto free_arena;
+    ret = v_mem_stag_create(rnic_ptr, &arena->mem_region, base, size, pool->access_flags, pool->pd, &arena->stag);
+    if(ret != IWARP_OK){
+	v_mem_deregister(rnic_ptr, arena->mem_region);
+	goto free_arena;
+    }
+    iwarp_pd_hold(rnic_ptr, pool->pd, 1);
+
+    arena->next = pool->arenas;
+    pool->arenas = arena;
+    return arena;
+
+free_arena:
+    free(arena);
+unmap:
+    munmap(base, size);
+    return NULL;
+}
+
+static void pool_arena_destroy(iwarp_rnic_t *rnic_ptr, iwarp_pool_t *pool, iwarp_arena_t *arena)
+/*
+Deregister and unmap an arena, the registration cache must forget it first
+*/
+{
+    v_mem_stag_destroy(rnic_ptr, arena->stag);
+    v_mem_deregister(rnic_ptr, arena->mem_region);
+    v_mem_invalidate(rnic_ptr, arena->base, arena->size);
+    iwarp_pd_hold(rnic_ptr, pool->pd, -1);
+    munmap(arena->base, arena->size);
+    free(arena);
+}
+
+
+iwarp_status_t iwarp_pool_create(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+				 /*IN*/size_t arena_size, iwarp_access_control_t access_flags, int flags,
+				 /*OUT*/iwarp_pool_handle_t *pool_hndl)
+/*
+Create a buffer pool, the first arena is mapped and registered right away so
+that the cost is paid here rather than on the first allocation
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_pool_t *pool;
+    int i;
+
+    pool = malloc(sizeof(*pool));
+    if(pool == NULL)
+	return IWARP_INSUFFICIENT_RESOURCES;
+
+    pool->pd = pd;
+    pool->access_flags = access_flags;
+    pool->flags = flags;
+    pool->arena_size = arena_size ? arena_size : HUGEPAGE_SIZE;
+    pool->arenas = NULL;
+    for(i=0; i<POOL_CLASSES; i++)
+	pool->free_list[i] = NULL;
+
+    if(pool_arena_create(rnic_ptr, pool, pool->arena_size) == NULL){
+	free(pool);
+	return IWARP_MEMORY_REGISTRATION_FAILURE;
+    }
+
+    *pool_hndl = pool;
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_pool_destroy(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_pool_handle_t pool_hndl)
+/*
+Tear down every arena, any buffers still handed out become invalid
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_arena_t *arena;
+
+    while((arena = pool_hndl->arenas) != NULL){
+	pool_hndl->arenas = arena->next;
+	pool_arena_destroy(rnic_ptr, pool_hndl, arena);
+    }
+    free(pool_hndl);
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_pool_alloc(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_pool_handle_t pool_hndl,
+				/*IN*/uint32_t length,
+				/*OUT*/iwarp_pool_buf_t *buf)
+/*
+Get a registered buffer of at least length bytes.  Freed buffers of the same
+size class are reused first, otherwise carve from the newest arena, mapping
+another if it is full.  Buffers are at least cache line aligned.
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_pool_t *pool = pool_hndl;
+    iwarp_pool_free_t *fb;
+    iwarp_arena_t *arena;
+    size_t class_size;
+    int c;
+
+    if(length == 0)
+	return IWARP_INSUFFICIENT_RESOURCES;
+    c = pool_class(length);
+    if(c >= POOL_CLASSES)
+	return IWARP_INSUFFICIENT_RESOURCES;
+    class_size = (size_t) POOL_MIN_BUF << c;
+
+    fb = pool->free_list[c];
+    if(fb != NULL){
+	pool->free_list[c] = fb->next;
+	arena = fb->arena;
+	buf->addr = fb;
+    }
+    else{
+	arena = pool->arenas;
+	if(arena->size - arena->used < class_size){
+	    /*oversized requests get an arena of their own*/
+	    arena = pool_arena_create(rnic_ptr, pool, class_size > pool->arena_size ? class_size : pool->arena_size);
+	    if(arena == NULL)
+		return IWARP_MEMORY_REGISTRATION_FAILURE;
+	}
+	buf->addr = arena->base + arena->used;
+	arena->used += class_size;
+    }
+
+    buf->stag = arena->stag;
+    buf->to = int64_from_ptr(buf->addr);  /*tagged offsets are virtual addresses here*/
+    buf->length = class_size;
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_pool_free(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_pool_handle_t pool_hndl,
+			       /*IN*/iwarp_pool_buf_t *buf)
+/*
+Return a buffer to its size class, it stays registered.  The free list link
+lives in the buffer itself.
+*/
+{
+    iwarp_pool_t *pool = pool_hndl;
+    iwarp_pool_free_t *fb = buf->addr;
+    iwarp_arena_t *arena;
+    int c;
+
+    ignore(rnic_hndl);
+    for(arena = pool->arenas; arena != NULL; arena = arena->next)
+	if(arena->stag == buf->stag)
+	    break;
+    if(arena == NULL || (char *) buf->addr < arena->base
+       || (char *) buf->addr + buf->length > arena->base + arena->used)
+	return IWARP_INVALID_MEM_REGION;
+
+    c = pool_class(buf->length);
+    fb->arena = arena;
+    fb->next = pool->free_list[c];
+    pool->free_list[c] = fb;
+    return IWARP_OK;
+}
@@ -25,9 +25,10 @@ int iwarp_recv_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp,
     iwarp_stag_index_t local_stag;
     
     local_stag = rq_wr->sgl->sge[0].stag;
-    if (unlikely(rq_wr->sgl->sge_count != 1))
-	return IWARP_UNSUPPORTED_WR_COUNT;
-    ret = v_rdmap_post_recv(rnic_ptr, qp->socket_fd, buffer, len, rq_wr->wr_id, local_stag);
+    if (rq_wr->sgl->sge_count != 1)  /*scattered across the sges in order*/
+	ret = v_rdmap_post_recv_vec(rnic_ptr, qp->socket_fd, rq_wr->sgl, rq_wr->wr_id);
+    else
+	ret = v_rdmap_post_recv(rnic_ptr, qp->socket_fd, buffer, len, rq_wr->wr_id, local_stag);
     if (ret != IWARP_OK)
 	return IWARP_RDMAP_POST_RECV_FAILURE;
     //~ ret = rdmap_post_recv(qp->socket_fd, buffer, len, rq_wr->wr_id);
@@ -39,35 +40,163 @@ int iwarp_recv_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp,
 }
 
 /*
- * Dispatch an event off of the queue - enables us to prepost receives before connecting.
- * Returns 0 if successful.
+ * Dispatch the QP's queue of receives posted before it connected, then
+ * free it.  Returns 0 if successful.
 */
-int iwarp_recv_event_dispatcher(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp, iwarp_wr_q_t *work_q)
+int iwarp_recv_event_dispatcher(iwarp_rnic_t *rnic_ptr, iwarp_qp_t *qp)
 {
-    int i, ret;
+    iwarp_wr_q_t *work_q = &qp->recv_q;
+    int i, ret = 0;
     
     //~ printf("...........before loop work q size is %d\n", work_q->size);
 
     for(i = 0; i < work_q->size; i++){  /*for each element in the work queue*/
-	/*normally we would have to pass the scatter gather list but since we are not supporting multiple entries we won't do that*/
 	ret = iwarp_recv_event_dispatch_one(rnic_ptr, qp, &work_q->queue[i]);
 	if (ret)
-	    return ret;
+	    break;
     }
-    /*Reset the work queue*/
-    work_q->size = 0;
-    
     
     /*now we need to free the resources we allocated to save the SGLs*/
-    free(rnic_ptr->recv_q.queue[rnic_ptr->recv_q.size].sgl);
-    
+    iwarp_recv_queue_free(work_q);
     
      //~ printf("...........before returning work q size is %d\n", work_q->size);
-    return 0;
+    return ret;
+}
+
+/*
+ * Free a queue of saved receives and their SGL copies, leaving it empty.
+ */
+void iwarp_recv_queue_free(iwarp_wr_q_t *work_q)
+{
+    int i;
+
+    for(i = 0; i < work_q->size; i++)
+	free(work_q->queue[i].sgl);
+    free(work_q->queue);
+    work_q->queue = NULL;
+    work_q->size = work_q->max = 0;
+}
+
+/*
+ * Count objects made in a protection domain, so it is not deallocated
+ * under them; count is negative as they go.
+ */
+void iwarp_pd_hold(iwarp_rnic_t *rnic_ptr, iwarp_prot_id pd, int count)
+{
+    rwlock_write(&rnic_ptr->lock);
+    rnic_ptr->pd_index[pd].in_use += count;
+    rwlock_drop(&rnic_ptr->lock);
+}
+
+/*
+ * Remember which QP is connected on a socket, -1 for none.  The map is
+ * indexed by fd and grows to the largest one seen.
+ */
+iwarp_status_t iwarp_qp_fd_set(iwarp_rnic_t *rnic_ptr, int fd, iwarp_qp_handle_t qp_hndl)
+{
+    iwarp_qp_handle_t *map;
+    int i, max;
+    iwarp_status_t ret = IWARP_OK;
+
+    if (fd < 0)
+	return IWARP_INVALID_QP_ID;
+    rwlock_write(&rnic_ptr->lock);
+    if (fd >= rnic_ptr->qp_by_fd_max) {
+	if (qp_hndl == -1)
+	    goto out;
+	max = rnic_ptr->qp_by_fd_max ? rnic_ptr->qp_by_fd_max : 64;
+	while (max <= fd)
+	    max *= 2;
+	map = realloc(rnic_ptr->qp_by_fd, max * sizeof(*map));
+	if (map == NULL) {
+	    ret = IWARP_INSUFFICIENT_RESOURCES;
+	    goto out;
+	}
+	for (i = rnic_ptr->qp_by_fd_max; i < max; i++)
+	    map[i] = -1;
+	rnic_ptr->qp_by_fd = map;
+	rnic_ptr->qp_by_fd_max = max;
+    }
+    rnic_ptr->qp_by_fd[fd] = qp_hndl;
+out:
+    rwlock_drop(&rnic_ptr->lock);
+    return ret;
+}
+
+iwarp_qp_handle_t iwarp_qp_from_fd(iwarp_rnic_t *rnic_ptr, int fd)
+{
+    iwarp_qp_handle_t qp_hndl = -1;
+
+    rwlock_read(&rnic_ptr->lock);
+    if (fd >= 0 && fd < rnic_ptr->qp_by_fd_max)
+	qp_hndl = rnic_ptr->qp_by_fd[fd];
+    rwlock_drop(&rnic_ptr->lock);
+    return qp_hndl;
+}
+
+/*
+ * Check that a send request can be carried out on this qp, without doing
+ * anything.  Return 0 if okay or error number.
+ */
+int iwarp_send_wr_check(const iwarp_qp_t *qp, const iwarp_wr_t *sq_wr)
+{
+    uint32_t i, len;
+
+    switch(sq_wr->wr_type){
+	case IWARP_WR_TYPE_BIND_MW:
+	    if (!qp->attributes->bind_mem_window_enable)
+		return IWARP_INVALID_SQ_OPERATION;
+	    return 0;
+
+	case IWARP_WR_TYPE_SEND:
+	case IWARP_WR_TYPE_SEND_INV:
+	    if (unlikely(sq_wr->sgl->sge_count > qp->attributes->send_sgl_max))
+		return IWARP_UNSUPPORTED_WR_COUNT;
+	    return 0;
+
+	case IWARP_WR_TYPE_SEND_INLINE:
+	    if (unlikely(sq_wr->sgl->sge_count > qp->attributes->send_sgl_max))
+		return IWARP_UNSUPPORTED_WR_COUNT;
+	    for (i=0, len=0; i<sq_wr->sgl->sge_count; i++)
+		len += sq_wr->sgl->sge[i].length;
+	    if (unlikely(len > qp->attributes->max_inline_data))
+		return IWARP_INVALID_SQ_OPERATION;
+	    return 0;
+
+	case IWARP_WR_TYPE_RDMA_WRITE:  /*gathered locally into one remote buffer*/
+	    if (unlikely(sq_wr->remote_sgl->sge_count != 1
+	                 || sq_wr->sgl->sge_count > qp->attributes->rdma_w_sgl_max))
+		return IWARP_UNSUPPORTED_WR_COUNT;
+	    return 0;
+
+	case IWARP_WR_TYPE_RDMA_WRITE_IMM:
+	    if (!qp->attributes->imm_data_enable)
+		return IWARP_INVALID_SQ_OPERATION;
+	    if (unlikely(sq_wr->remote_sgl->sge_count != 1
+	                 || sq_wr->sgl->sge_count > qp->attributes->rdma_w_sgl_max))
+		return IWARP_UNSUPPORTED_WR_COUNT;
+	    return 0;
+
+	case IWARP_WR_TYPE_RDMA_READ:  /*the response lands in one tagged buffer*/
+	    if (unlikely(sq_wr->remote_sgl->sge_count != 1 || sq_wr->sgl->sge_count != 1))
+		return IWARP_UNSUPPORTED_WR_COUNT;
+	    return 0;
+
+	case IWARP_WR_TYPE_ATOMIC:  /*8 remote bytes, the old value into 8 local ones*/
+	    if (!qp->attributes->atomics_enable)
+		return IWARP_INVALID_SQ_OPERATION;
+	    if (unlikely(sq_wr->remote_sgl->sge_count != 1 || sq_wr->sgl->sge_count != 1
+	                 || sq_wr->sgl->sge[0].length != sizeof(uint64_t)))
+		return IWARP_UNSUPPORTED_WR_COUNT;
+	    return 0;
+
+	default:
+	    return IWARP_INVALID_SQ_OPERATION;
+    }
 }
 
 /*
- * Dispatch just a single send request.
+ * Dispatch just a single send request, already passed by iwarp_send_wr_check.
  * If we don't want to really initiate a send every time we post a request then we can use this mechanism to process the queue
  * For example we could do a hold on dispatching sends.
  * Return 0 if okay or error number.
@@ -81,20 +210,50 @@ int iwarp_send_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp,
     void *buffer;
     iwarp_stag_index_t local_stag, remote_stag;
     
-    /*if multiple scatter gather entries then we need to do more than just use array index 0*/
-    
-    /*save local stag*/
+    /*window binds carry no data, so no sgl either*/
+    if (sq_wr->wr_type == IWARP_WR_TYPE_BIND_MW) {
+	err = v_rdmap_bind_mw(rnic_ptr, qp->socket_fd, sq_wr->bind, sq_wr->wr_id, sq_wr->cq_type);
+	if (err != IWARP_OK)
+	    return IWARP_INVALID_MEM_REGION;
+	return 0;
+    }
+
+    /*save local stag, a single sge is passed down as a plain buffer, more go as a list*/
     local_stag = sq_wr->sgl->sge[0].stag;
-    
-    if (unlikely(sq_wr->sgl->sge_count != 1))
-	return IWARP_UNSUPPORTED_WR_COUNT;
 
     switch(sq_wr->wr_type){
 	case IWARP_WR_TYPE_SEND:
+	    if (sq_wr->sgl->sge_count != 1) {
+		err = v_rdmap_post_send_vec(rnic_ptr, qp->socket_fd, sq_wr->sgl, sq_wr->wr_id, 0, sq_wr->cq_type);
+		if (err != IWARP_OK)
+		    ret = IWARP_RDMAP_POST_SEND_FAILURE;
+		break;
+	    }
 	    len = sq_wr->sgl->sge[0].length;
 	    buffer = ptr_from_int64(sq_wr->sgl->sge[0].to);
 	    /*untagged send provided to verbs by rdmap layer*/
-	    err = v_rdmap_post_send(rnic_ptr, qp->socket_fd, buffer, len, sq_wr->wr_id, local_stag);
+	    err = v_rdmap_post_send(rnic_ptr, qp->socket_fd, buffer, len, sq_wr->wr_id, local_stag, sq_wr->cq_type);
+	    if (err != IWARP_OK)
+		ret = IWARP_RDMAP_POST_SEND_FAILURE;
+	    break;
+
+	case IWARP_WR_TYPE_SEND_INLINE:
+	    /*copied on the way down, the caller may reuse the buffers at once*/
+	    err = v_rdmap_post_send_inline(rnic_ptr, qp->socket_fd, sq_wr->sgl, sq_wr->wr_id, sq_wr->cq_type);
+	    if (err != IWARP_OK)
+		ret = IWARP_RDMAP_POST_SEND_FAILURE;
+	    break;
+
+	case IWARP_WR_TYPE_SEND_INV:
+	    if (sq_wr->sgl->sge_count != 1) {
+		err = v_rdmap_post_send_vec(rnic_ptr, qp->socket_fd, sq_wr->sgl, sq_wr->wr_id, sq_wr->inv_stag, sq_wr->cq_type);
+		if (err != IWARP_OK)
+		    ret = IWARP_RDMAP_POST_SEND_FAILURE;
+		break;
+	    }
+	    len = sq_wr->sgl->sge[0].length;
+	    buffer = ptr_from_int64(sq_wr->sgl->sge[0].to);
+	    err = v_rdmap_post_send_inv(rnic_ptr, qp->socket_fd, buffer, len, sq_wr->wr_id, local_stag, sq_wr->inv_stag, sq_wr->cq_type);
 	    if (err != IWARP_OK)
 		ret = IWARP_RDMAP_POST_SEND_FAILURE;
 	    break;
@@ -104,11 +263,6 @@ int iwarp_send_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp,
 	    break;
 	
 	case IWARP_WR_TYPE_RDMA_WRITE:
-	    if (unlikely(sq_wr->remote_sgl->sge_count != 1)) {
-		ret = IWARP_UNSUPPORTED_WR_COUNT;
-		break;
-	    }
-
 	    /*Set local info*/
 	    len = sq_wr->sgl->sge[0].length;
 	    buffer = ptr_from_int64(sq_wr->sgl->sge[0].to);
@@ -119,18 +273,16 @@ int iwarp_send_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp,
 	
 	    /*Do the RDMA write*/
 	    //~ err = rdmap_rdma_write(qp->socket_fd, stag, to, buffer, len, sq_wr->wr_id);
-	    err = v_rdmap_rdma_write(rnic_ptr, qp->socket_fd, remote_stag, to, buffer, len, sq_wr->wr_id, local_stag);
+	    if (sq_wr->sgl->sge_count != 1)
+		err = v_rdmap_rdma_write_vec(rnic_ptr, qp->socket_fd, remote_stag, to, sq_wr->sgl, sq_wr->wr_id, sq_wr->cq_type);
+	    else
+		err = v_rdmap_rdma_write(rnic_ptr, qp->socket_fd, remote_stag, to, buffer, len, sq_wr->wr_id, local_stag, sq_wr->cq_type);
 	    if (err != IWARP_OK)
 		ret = IWARP_RDMAP_RDMA_WRITE_FAILURE;  
 	
 	    break;
 	
 	case IWARP_WR_TYPE_RDMA_READ:
-	    if (unlikely(sq_wr->remote_sgl->sge_count != 1)) {
-		ret = IWARP_UNSUPPORTED_WR_COUNT;
-		break;
-	    }
-
 	    /*Local Info -- stag set above*/
 	    to = sq_wr->sgl->sge[0].to;
 	    len = sq_wr->sgl->sge[0].length;
@@ -141,12 +293,25 @@ int iwarp_send_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp,
 
 	    /*Do the RDMA read*/
 	    //~ err = rdmap_rdma_read(qp->socket_fd, stag, to, len, remote_stag, remote_to, sq_wr->wr_id);
-	    err = v_rdmap_rdma_read(rnic_ptr, qp->socket_fd, local_stag, to, len, remote_stag, remote_to, sq_wr->wr_id);
+	    err = v_rdmap_rdma_read(rnic_ptr, qp->socket_fd, local_stag, to, len, remote_stag, remote_to, sq_wr->wr_id, sq_wr->cq_type);
 	    if (err != IWARP_OK)
 		ret = IWARP_RDMAP_RDMA_READ_FAILURE; 
 	
 	    break;
 
+	case IWARP_WR_TYPE_RDMA_WRITE_IMM:
+	    to = sq_wr->remote_sgl->sge[0].to;
+	    remote_stag = sq_wr->remote_sgl->sge[0].stag;
+	    ret = v_rdmap_rdma_write_imm(rnic_ptr, qp->socket_fd, remote_stag, to, sq_wr->sgl, sq_wr->imm_data, sq_wr->wr_id, sq_wr->cq_type);
+	    break;
+
+	case IWARP_WR_TYPE_ATOMIC:
+	    buffer = ptr_from_int64(sq_wr->sgl->sge[0].to);
+	    remote_stag = sq_wr->remote_sgl->sge[0].stag;
+	    remote_to = sq_wr->remote_sgl->sge[0].to;
+	    ret = v_rdmap_atomic(rnic_ptr, qp->socket_fd, sq_wr->atomic, remote_stag, remote_to, buffer, sq_wr->wr_id, sq_wr->cq_type);
+	    break;
+
 	default:
 	    ret = IWARP_INVALID_SQ_OPERATION;
 	    break;
@@ -25,137 +25,190 @@ iwarp_status_t iwarp_qp_create(/*IN*/iwarp_rnic_handle_t rnic_hndl,
 		        /*INOUT*/iwarp_qp_attrs_t *qp_attrs,
 			/*OUT*/ iwarp_qp_handle_t *qp_id)
 /*
-Creat the QP for the user insert it into the QP array of the RNIC insert at qp_id
+Creat the QP for the user insert it into the QP table of the RNIC insert at qp_id
 Attach a new qp_attrs struct to this QP so the user can destroy their data struct
 
+The id of the last destroyed QP is reused first, else the table grows by a chunk
+of QP_CHUNK slots.  Slots never move so a handle stays valid for the QP's life.
+
 We are not accepting out of bounds qp_attributes so qp_attrs is really just an IN
 parameter not an INOUT
 */
 {
-    int i, index;
+    int index;
+    iwarp_qp_t *qp;
+    iwarp_qp_attrs_t *attrs;
 
     /*get a pointer to the RNIC like usual*/
     iwarp_rnic_t *rnic_ptr = (iwarp_rnic_t *)ptr_from_int64(rnic_hndl);
 
-    index = -1;
-    /*find a free QP id*/
-    for(i=0; i<MAX_QP; i++){
-	if(rnic_ptr->qp_index[i].available == TRUE){
-	    *qp_id = i;
+    attrs = malloc(sizeof(iwarp_qp_attrs_t));
 
-	    //~ return IWARP_OK;
-	    index = i;
-	    break;
-	}
-    }
-    if(index == -1)
+    if(attrs == NULL)
 	return IWARP_INSUFFICIENT_RESOURCES;
 
-
-    rnic_ptr->qp_index[index].attributes = malloc(sizeof(iwarp_qp_attrs_t));
-
-    if(rnic_ptr->qp_index[index].attributes == NULL)
-	return IWARP_INSUFFICIENT_RESOURCES;
-
-
     /*check the attributes passed in and save them in the qp's data structure*/
 
-    rnic_ptr->qp_index[index].attributes->sq_cq = qp_attrs->sq_cq;
-    rnic_ptr->qp_index[index].attributes->rq_cq = qp_attrs->rq_cq;
+    attrs->sq_cq = qp_attrs->sq_cq;
+    attrs->rq_cq = qp_attrs->rq_cq;
 
     if(qp_attrs->sq_depth <= MAX_WRQ && qp_attrs->rq_depth <= MAX_WRQ){
-	rnic_ptr->qp_index[index].attributes->sq_depth = qp_attrs->sq_depth;
-	rnic_ptr->qp_index[index].attributes->rq_depth = qp_attrs->rq_depth;
+	attrs->sq_depth = qp_attrs->sq_depth;
+	attrs->rq_depth = qp_attrs->rq_depth;
     }
     else{
 	debug(0, "sq depth > MAX WRQ or rq depth > MAX_WRQ");
-	return IWARP_INVALID_QP_ATTR;
+	goto bad_attr;
     }
 
 
     if(qp_attrs->rdma_r_enable == TRUE || qp_attrs->rdma_r_enable == FALSE)
-	rnic_ptr->qp_index[index].attributes->rdma_r_enable = qp_attrs->rdma_r_enable;
+	attrs->rdma_r_enable = qp_attrs->rdma_r_enable;
     else{
 	debug(0, "rdma_r_enable is true or rdma_r_enable  is false,, what the heck?");
-	return IWARP_INVALID_QP_ATTR;
+	goto bad_attr;
     }
 
     if(qp_attrs->rdma_w_enable == TRUE || qp_attrs->rdma_w_enable == FALSE)
-	rnic_ptr->qp_index[index].attributes->rdma_w_enable = qp_attrs->rdma_w_enable;
+	attrs->rdma_w_enable = qp_attrs->rdma_w_enable;
     else{
 	debug(0, "rdma_w_enable is TRUE or its FALSE, again, what in the world do we make this check for..");
-	return IWARP_INVALID_QP_ATTR;
+	goto bad_attr;
     }
 
     if(!BIND_MEM_WINDOW_ENABLE){ /*if we are not enablilng binding memory windows*/
 	/*make sure the caller is not trying to enable it*/
 	if(qp_attrs->bind_mem_window_enable == TRUE){
 	    debug(0, "Can not bind memory window");
-	    return IWARP_INVALID_QP_ATTR;
+	    goto bad_attr;
 	}
     }
-    rnic_ptr->qp_index[index].attributes->bind_mem_window_enable = qp_attrs->bind_mem_window_enable;
+    attrs->bind_mem_window_enable = qp_attrs->bind_mem_window_enable;
 
     if(qp_attrs->send_sgl_max <= MAX_S_SGL)
-	rnic_ptr->qp_index[index].attributes->send_sgl_max = qp_attrs->send_sgl_max;
+	attrs->send_sgl_max = qp_attrs->send_sgl_max;
     else{
 	debug(0, "Send sgl is > MAX_S_SGL");
-	return IWARP_INVALID_QP_ATTR;
+	goto bad_attr;
     }
 
     if(qp_attrs->rdma_w_sgl_max <= MAX_RDMA_W_SGL)
-	rnic_ptr->qp_index[index].attributes->rdma_w_sgl_max = qp_attrs->rdma_w_sgl_max;
+	attrs->rdma_w_sgl_max = qp_attrs->rdma_w_sgl_max;
     else{
 	debug(0, "rdma_w_sgl_max is smaller than MAX_RDMA_W_SGL");
-	return IWARP_INVALID_QP_ATTR;
+	goto bad_attr;
     }
 
     if(qp_attrs->recv_sgl_max <= MAX_R_SGL)
-	rnic_ptr->qp_index[index].attributes->recv_sgl_max = qp_attrs->recv_sgl_max;
+	attrs->recv_sgl_max = qp_attrs->recv_sgl_max;
     else
-	return IWARP_INVALID_QP_ATTR;
+	goto bad_attr;
 
     if(qp_attrs->ord <= MAX_ORD && qp_attrs->ird <= MAX_IRD){
-	rnic_ptr->qp_index[index].attributes->ord = qp_attrs->ord;
-	rnic_ptr->qp_index[index].attributes->ird = qp_attrs->ird;
+	attrs->ord = qp_attrs->ord;
+	attrs->ird = qp_attrs->ird;
     }
     else{
 	debug(0, "ord smaller than MAX_ORD and ird smaller than MAX_IRD");
-	return IWARP_INVALID_QP_ATTR;
+	goto bad_attr;
     }
 
-    /*check to make sure the PD has been allocated*/
-    if(rnic_ptr->pd_index[qp_attrs->prot_d_id].available == TRUE){
-	debug(0, "Protection Domain was not allocated properly");
-	return IWARP_INVALID_QP_ATTR;
+    if(qp_attrs->max_inline_data <= MAX_INLINE)
+	attrs->max_inline_data = qp_attrs->max_inline_data;
+    else{
+	debug(0, "max_inline_data is larger than MAX_INLINE");
+	goto bad_attr;
     }
 
-    rnic_ptr->qp_index[index].attributes->prot_d_id = qp_attrs->prot_d_id;
+    attrs->prot_d_id = qp_attrs->prot_d_id;
 
     if(!ENABLE_ZERO_STAG){ /*if we are not allowing enable zero stag make sure they are not trying to use it*/
 	if(qp_attrs->zero_stag_enable == TRUE){
 	    debug(0, "Trying to use zero STag which is unsupported");
-	    return IWARP_INVALID_QP_ATTR;
+	    goto bad_attr;
 	}
     }
-    rnic_ptr->qp_index[index].attributes->zero_stag_enable = qp_attrs->zero_stag_enable;
+    attrs->zero_stag_enable = qp_attrs->zero_stag_enable;
 
-    /*Finally makr the QP as not being available*/
-    rnic_ptr->qp_index[index].available = FALSE;
+    if(qp_attrs->srq != NULL && qp_attrs->srq->pd != qp_attrs->prot_d_id){
+	debug(0, "SRQ is in another protection domain");
+	goto bad_attr;
+    }
+    attrs->srq = qp_attrs->srq;
 
-    /*Mark the QP as not being connected*/
-    rnic_ptr->qp_index[index].connected = FALSE;
+    /*RFC 7306 extensions are asked for at connect, the peer may refuse them*/
+    attrs->imm_data_enable = qp_attrs->imm_data_enable;
+    attrs->atomics_enable = qp_attrs->atomics_enable;
 
-    /*Mark Pre-connection posted recvs as being empty*/
-    rnic_ptr->qp_index[index].pre_connection_posts = 0;
+    if(qp_attrs->progress_affinity < 0){
+	debug(0, "Negative progress thread affinity");
+	goto bad_attr;
+    }
+    attrs->progress_affinity = qp_attrs->progress_affinity;
+    attrs->defer_crc_check = qp_attrs->defer_crc_check;
+    attrs->mpa_crc_auto = qp_attrs->mpa_crc_auto;
+    attrs->rdma_read_chunk = qp_attrs->rdma_read_chunk;
 
     /*User HAS to set what attributes the QPs will use for markers and CRC, can not rely on system to fill in 0's
             and can not make an assumption on what the user wanted*/
-    rnic_ptr->qp_index[index].attributes->disable_mpa_markers = qp_attrs->disable_mpa_markers;
-    rnic_ptr->qp_index[index].attributes->disable_mpa_crc     = qp_attrs->disable_mpa_crc;
+    attrs->disable_mpa_markers = qp_attrs->disable_mpa_markers;
+    attrs->disable_mpa_crc     = qp_attrs->disable_mpa_crc;
+
+    rwlock_write(&rnic_ptr->lock);
+
+    /*check to make sure the PD has been allocated*/
+    if(rnic_ptr->pd_index[qp_attrs->prot_d_id].available == TRUE){
+	rwlock_drop(&rnic_ptr->lock);
+	debug(0, "Protection Domain was not allocated properly");
+	goto bad_attr;
+    }
+
+    /*find a free QP id*/
+    if(rnic_ptr->qp_free != -1){
+	index = rnic_ptr->qp_free;
+	rnic_ptr->qp_free = qp_from_handle(rnic_ptr, index)->next_free;
+    }
+    else{
+	index = rnic_ptr->qp_count;
+	if(index == MAX_QP)
+	    goto no_slot;
+	if(index % QP_CHUNK == 0){  /*first slot of a new chunk*/
+	    rnic_ptr->qp_chunk[index / QP_CHUNK] = malloc(QP_CHUNK * sizeof(iwarp_qp_t));
+	    if(rnic_ptr->qp_chunk[index / QP_CHUNK] == NULL)
+		goto no_slot;
+	}
+	++rnic_ptr->qp_count;
+    }
+    *qp_id = index;
+    qp = qp_from_handle(rnic_ptr, index);
+    qp->attributes = attrs;
+
+    /*Finally makr the QP as not being available*/
+    qp->available = FALSE;
+
+    /*Mark the QP as not being connected*/
+    qp->connected = FALSE;
+    qp->socket_fd = -1;
+
+    /*Mark Pre-connection posted recvs as being empty, the queue is made on the first one*/
+    qp->pre_connection_posts = 0;
+    qp->recv_q.queue = NULL;
+    qp->recv_q.size = qp->recv_q.max = 0;
+
+    if(attrs->srq != NULL)
+	attrs->srq->in_use++;
+    rwlock_drop(&rnic_ptr->lock);
 
     return IWARP_OK;
 
+no_slot:
+    rwlock_drop(&rnic_ptr->lock);
+    free(attrs);
+    return IWARP_INSUFFICIENT_RESOURCES;
+
+bad_attr:
+    free(attrs);
+    return IWARP_INVALID_QP_ATTR;
 
 }
 
@@ -167,43 +220,55 @@ destroy the QP - need to free the memory assocaited with the qp's attributes
 */
 {
     iwarp_rnic_t *rnic_ptr = (iwarp_rnic_t *)ptr_from_int64(rnic_hndl);
+    iwarp_qp_t *qp;
+    iwarp_status_t ret = IWARP_OK;
 
     int index = qp_id;
 
-    if(rnic_ptr->qp_index[index].connected == TRUE) /*make sure its not already available*/
-	return IWARP_CONNECTED_QP;
-
-    if(index < 0 || index > MAX_QP) /*make sure the id is in the valid range*/
-	return IWARP_INVALID_QP_ID;
+    rwlock_write(&rnic_ptr->lock);
+    if(index < 0 || index >= rnic_ptr->qp_count) /*make sure the id is in the valid range*/
+	ret = IWARP_INVALID_QP_ID;
+    else if((qp = qp_from_handle(rnic_ptr, index))->connected == TRUE)
+	ret = IWARP_CONNECTED_QP;
+    else if(qp->available == TRUE) /*make sure its not already available*/
+	ret = IWARP_INVALID_QP_ID;
+    else{
+	if(qp->attributes->srq != NULL)
+	    --qp->attributes->srq->in_use;
 
-    if(rnic_ptr->qp_index[index].available == TRUE) /*make sure its not already available*/
-	return IWARP_INVALID_QP_ID;
+	free(qp->attributes); /*free the memory*/
 
-    free(rnic_ptr->qp_index[index].attributes); /*free the memory*/
+	iwarp_recv_queue_free(&qp->recv_q);  /*posted but never connected*/
 
-    rnic_ptr->qp_index[index].available = TRUE; /*Finally mark it as being available*/
+	qp->available = TRUE; /*Finally mark it as being available*/
+	qp->next_free = rnic_ptr->qp_free;
+	rnic_ptr->qp_free = index;
+    }
+    rwlock_drop(&rnic_ptr->lock);
 
-    return IWARP_OK;
+    return ret;
 }
 
-iwarp_status_t iwarp_qp_passive_connect(/*INOUT*/iwarp_rnic_handle_t rnic_hndl,
-				    /*IN*/iwarp_port_t port, iwarp_qp_handle_t qp_id, const char private_data[],
-				    /*OUT*/char *remote_private_data,
-				    /*IN*/int rpd)
+static iwarp_status_t listener_get(iwarp_rnic_handle_t rnic_hndl, iwarp_port_t port,
+				   /*OUT*/iwarp_listener_t **lp)
 /*
-passively wait for connection from remote side
-this is the server in the client server model
+Find the socket listening on port, opening it the first time.  Called with the RNIC locked.
 */
 {
-    //~ int flags = 1;
-    //~ int err;
     iwarp_status_t ret;
     iwarp_rnic_query_attrs_t attrs;
     struct sockaddr_in passive_socket;
     socklen_t passive_s_len = sizeof(passive_socket);
     iwarp_rnic_t *rnic_ptr = (iwarp_rnic_t *)ptr_from_int64(rnic_hndl);
-    int i;
-
+    iwarp_listener_t *l;
+    int i, listen_fd;
+
+    /*one listening socket per port serves every QP passively connected on it*/
+    for(l = rnic_ptr->listeners; l != NULL; l = l->next)
+	if(l->port == port){
+	    *lp = l;
+	    return IWARP_OK;
+	}
 
     ret = iwarp_rnic_query(rnic_hndl, &attrs);
 
@@ -216,37 +281,73 @@ this is the server in the client server model
     /* do not bind on the interface IP; it prevents loopback tests */
     /* memcpy(&passive_socket.sin_addr, attrs.address, attrs.length); */
     passive_socket.sin_port = htons(port);
-    rnic_ptr->qp_index[qp_id].socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (rnic_ptr->qp_index[qp_id].socket_fd < 0)
+    listen_fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0)
 	return IWARP_CAN_NOT_BUILD_SOCKET;
 
-    /*if we want to set socket as reusable probably not important*/
-    //~ err = setsockopt(rnic_ptr->qp_index[qp_id].socket_fd, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof(flags));
-    //~ if(err < 0){
-	    //~ fprintf(stderr,"Warning: Unable to set Socket address to SO_REUSEADDR!\n");
-	    //~ exit(1);
-    //~ }
-
     /* okay to reuse same local port number */
     i = 1;
-    if (setsockopt(rnic_ptr->qp_index[qp_id].socket_fd, SOL_SOCKET,
-      SO_REUSEADDR, &i, sizeof(i)) < 0)
-	return IWARP_CAN_NOT_BIND_SOCKET;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) < 0)
+	goto close_listen;
 
     /*Attempt to bind socket to port*/
-    if (bind(rnic_ptr->qp_index[qp_id].socket_fd, (struct sockaddr *)&passive_socket, passive_s_len) < 0)
-	return IWARP_CAN_NOT_BIND_SOCKET;
+    if (bind(listen_fd, (struct sockaddr *)&passive_socket, passive_s_len) < 0)
+	goto close_listen;
 
-    /*Listen on the socket*/
-    if (listen(rnic_ptr->qp_index[qp_id].socket_fd, 5) < 0)
+    /*Listen on the socket, peers queue here while earlier ones do MPA startup*/
+    if (listen(listen_fd, SOMAXCONN) < 0){
+	close(listen_fd);
 	return IWARP_CAN_NOT_LISTEN_SOCKET;
+    }
+
+    l = malloc(sizeof(*l));
+    if(l == NULL){
+	close(listen_fd);
+	return IWARP_INSUFFICIENT_RESOURCES;
+    }
+    l->port = port;
+    l->fd = listen_fd;
+    l->next = rnic_ptr->listeners;
+    rnic_ptr->listeners = l;
+    *lp = l;
+    return IWARP_OK;
 
-  //~ printf("going to be listening on socket %d on port %d\n", rnic_ptr->qp_index[qp_id].socket_fd, port);
+close_listen:
+    close(listen_fd);
+    return IWARP_CAN_NOT_BIND_SOCKET;
+}
+
+iwarp_status_t iwarp_qp_passive_connect(/*INOUT*/iwarp_rnic_handle_t rnic_hndl,
+				    /*IN*/iwarp_port_t port, iwarp_qp_handle_t qp_id, const char private_data[],
+				    /*OUT*/char *remote_private_data,
+				    /*IN*/int rpd)
+/*
+passively wait for connection from remote side
+this is the server in the client server model
+*/
+{
+    //~ int flags = 1;
+    //~ int err;
+    iwarp_status_t ret;
+    struct sockaddr_in passive_socket;
+    socklen_t passive_s_len;
+    iwarp_rnic_t *rnic_ptr = (iwarp_rnic_t *)ptr_from_int64(rnic_hndl);
+    iwarp_qp_t *qp = qp_from_handle(rnic_ptr, qp_id);
+    iwarp_listener_t *l;
+
+
+    rwlock_write(&rnic_ptr->lock);
+    ret = listener_get(rnic_hndl, port, &l);
+    rwlock_drop(&rnic_ptr->lock);  /*listeners live until the RNIC closes*/
+    if(ret != IWARP_OK)
+	return ret;
+
+  //~ printf("going to be listening on socket %d on port %d\n", l->fd, port);
 
     /*Accept the connection*/
     passive_s_len = sizeof(passive_socket);
-    rnic_ptr->qp_index[qp_id].socket_fd = accept(rnic_ptr->qp_index[qp_id].socket_fd, (struct sockaddr *) &passive_socket, &passive_s_len);
-    if(rnic_ptr->qp_index[qp_id].socket_fd < 0)
+    qp->socket_fd = accept(l->fd, (struct sockaddr *) &passive_socket, &passive_s_len);
+    if(qp->socket_fd < 0)
 	return IWARP_CAN_NOT_ACCEPT_CONNECTION;
 
 
@@ -271,21 +372,21 @@ this is the server in the client server model
 
 
     /*move this code to stubs.c*/
-    //~ ret = rdmap_register_sock(rnic_ptr->qp_index[qp_id].socket_fd, rnic_ptr->qp_index[qp_id].attributes->sq_cq, rnic_ptr->qp_index[qp_id].attributes->rq_cq);
+    //~ ret = rdmap_register_sock(qp_from_handle(rnic_ptr, qp_id)->socket_fd, qp_from_handle(rnic_ptr, qp_id)->attributes->sq_cq, qp_from_handle(rnic_ptr, qp_id)->attributes->rq_cq);
     //~ if(ret != 0)
 	//~ return IWARP_RDMAP_REGISTER_SOCKET_FAILURE;
 
-    //~ ret = rdmap_mpa_use_markers(rnic_ptr->qp_index[qp_id].socket_fd,!rnic_ptr->qp_index[qp_id].attributes->disable_mpa_markers);
+    //~ ret = rdmap_mpa_use_markers(qp_from_handle(rnic_ptr, qp_id)->socket_fd,!qp_from_handle(rnic_ptr, qp_id)->attributes->disable_mpa_markers);
     //~ if(ret != 0)
 	//~ return IWARP_RDMAP_SET_MARKER_FAILURE;
 
-    //~ ret = rdmap_mpa_use_crc(rnic_ptr->qp_index[qp_id].socket_fd, !rnic_ptr->qp_index[qp_id].attributes->disable_mpa_crc);
+    //~ ret = rdmap_mpa_use_crc(qp_from_handle(rnic_ptr, qp_id)->socket_fd, !qp_from_handle(rnic_ptr, qp_id)->attributes->disable_mpa_crc);
     //~ if(ret != 0)
 	//~ return IWARP_RDMAP_SET_CRC_FAILURE;
 
 
     /*!! Now we need to do the CRC and Marker MPA negotiation - we also have the private data to pass on*/
-    //~ ret = rdmap_init_startup(rnic_ptr->qp_index[qp_id].socket_fd, 0, private_data, remote_private_data, rpd);
+    //~ ret = rdmap_init_startup(qp_from_handle(rnic_ptr, qp_id)->socket_fd, 0, private_data, remote_private_data, rpd);
     //~ if(ret != 0)
 	    //~ return IWARP_MPA_INIT_FAILURE;
 
@@ -294,13 +395,15 @@ this is the server in the client server model
 
 
 
-    /*mark the QP as connected*/
-    rnic_ptr->qp_index[qp_id].connected = TRUE;
+    /*mark the QP as connected, posts that see that no longer queue*/
+    rwlock_write(&rnic_ptr->lock);
+    qp->connected = TRUE;
 
     /*dispatch anything that was preposted to the recv workQ*/
-    ret = iwarp_recv_event_dispatcher(rnic_ptr, &rnic_ptr->qp_index[qp_id], &rnic_ptr->recv_q);
+    ret = iwarp_recv_event_dispatcher(rnic_ptr, qp);
+    rwlock_drop(&rnic_ptr->lock);
 
-    //~ printf("pre connection posted requests are %d\n", rnic_ptr->qp_index[qp_id].pre_connection_posts);
+    //~ printf("pre connection posted requests are %d\n", qp->pre_connection_posts);
     //~ printf("just dispatched %d of those\n", num_posted);
 
     if (ret)
@@ -308,7 +411,6 @@ this is the server in the client server model
 
     return IWARP_OK;
 
-
 }
 
 iwarp_status_t iwarp_qp_active_connect(/*INOUT*/iwarp_rnic_handle_t rnic_hndl,
@@ -346,8 +448,8 @@ NOTE: sleep time is in microseconds
     server_address.sin_port = htons(port);
 
     /*Open the socket*/
-    rnic_ptr->qp_index[qp_id].socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-    if (rnic_ptr->qp_index[qp_id].socket_fd < 0)
+    qp_from_handle(rnic_ptr, qp_id)->socket_fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (qp_from_handle(rnic_ptr, qp_id)->socket_fd < 0)
 	return IWARP_CAN_NOT_BUILD_SOCKET;
 
     /*Bind socket to the port*/
@@ -356,13 +458,13 @@ NOTE: sleep time is in microseconds
     local_address.sin_port = htons(0);
 
 
-    if( bind(rnic_ptr->qp_index[qp_id].socket_fd, (struct sockaddr *) &local_address, sizeof(local_address)) < 0)
+    if( bind(qp_from_handle(rnic_ptr, qp_id)->socket_fd, (struct sockaddr *) &local_address, sizeof(local_address)) < 0)
 	return IWARP_CAN_NOT_BIND_SOCKET;
 
     connected = 0;
 
     for(k=0; k<retrys; k++){
-	ret = connect(rnic_ptr->qp_index[qp_id].socket_fd, (struct sockaddr *)&server_address, sizeof(server_address));
+	ret = connect(qp_from_handle(rnic_ptr, qp_id)->socket_fd, (struct sockaddr *)&server_address, sizeof(server_address));
 	if(ret < 0){
 	    //~ printf("did not connect\n");
 
@@ -383,22 +485,22 @@ NOTE: sleep time is in microseconds
 	ret = v_rdmap_register_connection(rnic_ptr, qp_id, private_data, remote_private_data, rpd, IWARP_ACTIVE_CLIENT);
 
 	//~move this code to stubs.c
-	//~ ret = rdmap_register_sock(rnic_ptr->qp_index[qp_id].socket_fd, rnic_ptr->qp_index[qp_id].attributes->sq_cq, rnic_ptr->qp_index[qp_id].attributes->rq_cq);
+	//~ ret = rdmap_register_sock(qp_from_handle(rnic_ptr, qp_id)->socket_fd, qp_from_handle(rnic_ptr, qp_id)->attributes->sq_cq, qp_from_handle(rnic_ptr, qp_id)->attributes->rq_cq);
 	//~ if(ret != 0)
 	    //~ return IWARP_RDMAP_REGISTER_SOCKET_FAILURE;
 
-	//~ ret = rdmap_mpa_use_markers(rnic_ptr->qp_index[qp_id].socket_fd, !rnic_ptr->qp_index[qp_id].attributes->disable_mpa_markers);
+	//~ ret = rdmap_mpa_use_markers(qp_from_handle(rnic_ptr, qp_id)->socket_fd, !qp_from_handle(rnic_ptr, qp_id)->attributes->disable_mpa_markers);
 	//~ if(ret != 0)
 	    //~ return IWARP_RDMAP_SET_MARKER_FAILURE;
 
-	//~ ret = rdmap_mpa_use_crc(rnic_ptr->qp_index[qp_id].socket_fd, !rnic_ptr->qp_index[qp_id].attributes->disable_mpa_crc);
+	//~ ret = rdmap_mpa_use_crc(qp_from_handle(rnic_ptr, qp_id)->socket_fd, !qp_from_handle(rnic_ptr, qp_id)->attributes->disable_mpa_crc);
 	//~ if(ret != 0)
 	    //~ return IWARP_RDMAP_SET_CRC_FAILURE;
 
 
 	/*!! Now we need to do the CRC and Marker MPA negotiation - we also have the private data to pass on*/
 
-	//~ ret = rdmap_init_startup(rnic_ptr->qp_index[qp_id].socket_fd, 1, private_data, remote_private_data, rpd);
+	//~ ret = rdmap_init_startup(qp_from_handle(rnic_ptr, qp_id)->socket_fd, 1, private_data, remote_private_data, rpd);
 	//~ if(ret != 0)
 	    //~ return IWARP_MPA_INIT_FAILURE;
 
@@ -406,13 +508,15 @@ NOTE: sleep time is in microseconds
 
 
 
-	/*mark the QP as connected*/
-	rnic_ptr->qp_index[qp_id].connected = TRUE;
+	/*mark the QP as connected, posts that see that no longer queue*/
+	rwlock_write(&rnic_ptr->lock);
+	qp_from_handle(rnic_ptr, qp_id)->connected = TRUE;
 
 	/*dispatch anything that was preposted to the recv workQ*/
-	ret = iwarp_recv_event_dispatcher(rnic_ptr, &rnic_ptr->qp_index[qp_id], &rnic_ptr->recv_q);
+	ret = iwarp_recv_event_dispatcher(rnic_ptr, qp_from_handle(rnic_ptr, qp_id));
+	rwlock_drop(&rnic_ptr->lock);
 
-	//~ printf("pre connection posted requests are %d\n", rnic_ptr->qp_index[qp_id].pre_connection_posts);
+	//~ printf("pre connection posted requests are %d\n", qp_from_handle(rnic_ptr, qp_id)->pre_connection_posts);
 	//~ printf("just dispatched %d of those\n", num_posted);
 
 	if (ret)
@@ -439,17 +543,19 @@ Close the connection between the two queue pairs and deregister the socket
 
 
     /*Mark the QP as not being connected*/
-    rnic_ptr->qp_index[qp_id].connected = FALSE;
+    qp_from_handle(rnic_ptr, qp_id)->connected = FALSE;
 
     /*Now deregister the socket with RDMAP layer*/
-    //~ ret = rdmap_deregister_sock(rnic_ptr->qp_index[qp_id].socket_fd);
-    ret = v_rdmap_deregister_sock(rnic_ptr, rnic_ptr->qp_index[qp_id].socket_fd);
+    //~ ret = rdmap_deregister_sock(qp_from_handle(rnic_ptr, qp_id)->socket_fd);
+    ret = v_rdmap_deregister_sock(rnic_ptr, qp_from_handle(rnic_ptr, qp_id)->socket_fd);
     if(ret != IWARP_OK)
 	return IWARP_RDMAP_DEREGISTER_SOCKET_FAILURE;
 
+    /*the fd number is free for the next connection*/
+    iwarp_qp_fd_set(rnic_ptr, qp_from_handle(rnic_ptr, qp_id)->socket_fd, -1);
 
     /*Actually close the connection*/
-    err = close(rnic_ptr->qp_index[qp_id].socket_fd);
+    err = close(qp_from_handle(rnic_ptr, qp_id)->socket_fd);
     if(err != 0)
 	return IWARP_CLOSE_SOCKET_ERROR;
 
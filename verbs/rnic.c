@@ -22,6 +22,17 @@ iwarp_status_t iwarp_rnic_open (/*IN*/int index, iwarp_pblmode_t mode, iwarp_con
 /*
 Opens access to the RNIC (we have no real RNIC so this is an abstract RNIC) just do some simple init things
 */
+{
+    return iwarp_rnic_open_ext(index, mode, context, NULL, rnic_hndl);
+}
+
+
+iwarp_status_t iwarp_rnic_open_ext(/*IN*/int index, iwarp_pblmode_t mode, iwarp_context_t context,
+				   /*IN*/const iwarp_rnic_open_attrs_t *open_attrs,
+				   /*OUT*/iwarp_rnic_handle_t* rnic_hndl)
+/*
+Open the RNIC, then start what open_attrs asks for
+*/
 {
     iwarp_rnic_t *rnic;
     int i;
@@ -65,15 +76,18 @@ Opens access to the RNIC (we have no real RNIC so this is an abstract RNIC) just
 
     }
 
-    for(i=0; i<MAX_QP; i++){
-	rnic->qp_index[i].available = TRUE;
+    /*the QP table starts empty, chunks are added by iwarp_qp_create*/
+    for(i=0; i<MAX_QP / QP_CHUNK; i++){
+	rnic->qp_chunk[i] = NULL;
     }
+    rnic->qp_count = 0;
+    rnic->qp_free = -1;
+    rnic->qp_by_fd = NULL;
+    rnic->qp_by_fd_max = 0;
+    rnic->listeners = NULL;
 
-
-
-
-    /* initialize the work request queue */
-    rnic->recv_q.size = 0;
+    rnic->srq_count = 0;
+    rwlock_init(&rnic->lock);
 
 
 
@@ -88,6 +102,27 @@ Opens access to the RNIC (we have no real RNIC so this is an abstract RNIC) just
 
     *rnic_hndl = int64_from_ptr(rnic);
 
+    if(open_attrs != NULL && open_attrs->progress_threads > 0){
+	status = v_progress_start(rnic, open_attrs->progress_threads, open_attrs->progress_cores);
+	if(status != IWARP_OK){
+	    iwarp_rnic_close(*rnic_hndl);
+	    return status;
+	}
+    }
+    if(open_attrs != NULL && open_attrs->crc_threads > 0){
+	status = v_crc_threads_start(rnic, open_attrs->crc_threads);
+	if(status != IWARP_OK){
+	    iwarp_rnic_close(*rnic_hndl);
+	    return status;
+	}
+    }
+    if(open_attrs != NULL && open_attrs->crc_trusted_subnets != NULL){
+	status = v_crc_trust(rnic, open_attrs->crc_trusted_subnets);
+	if(status != IWARP_OK){
+	    iwarp_rnic_close(*rnic_hndl);
+	    return status;
+	}
+    }
 
     return IWARP_OK;
 
@@ -124,8 +159,12 @@ Mainly used to get hostname if we need anything else from the hostent structure
     /*max outstanding WRQs*/
     attrs->max_wrq = MAX_WRQ;
 
-    /*max outstanding shared request queues - NOT SUPPORTED so 0*/
+    /*max shared receive queues, software stack only*/
+#ifdef KERNEL_IWARP
     attrs->max_srq = 0;
+#else
+    attrs->max_srq = MAX_SRQ;
+#endif
 
     /*what the fd we are using is*/
     attrs->fd = rnic_ptr->fd;
@@ -169,14 +208,38 @@ Close the iWARP - do whatever else needs to be done to tell DDP/RDMAP that we ar
 */
 {
     iwarp_rnic_t *rnic_ptr = (iwarp_rnic_t *)ptr_from_int64(rnic_hndl);
+    iwarp_listener_t *l;
+    int i;
 
     v_rnic_close(rnic_ptr);
 
+    while((l = rnic_ptr->listeners) != NULL){
+	rnic_ptr->listeners = l->next;
+	close(l->fd);
+	free(l);
+    }
+
+    for(i=0; i<MAX_QP / QP_CHUNK; i++)
+	free(rnic_ptr->qp_chunk[i]);
+    free(rnic_ptr->qp_by_fd);
+    rwlock_destroy(&rnic_ptr->lock);
+
     free(rnic_ptr);  /*probbly a better thing to do,, prone to seg faults when we start adding and forgetting stuff*/
 
     return IWARP_OK;
 }
 
+iwarp_status_t iwarp_rnic_thread_safe(/*IN*/ iwarp_rnic_handle_t rnic_hndl)
+/*
+From here on the RNIC, and the RDMAP layer below it, take locks: the RNIC's around its tables, and per
+connection, per CQ and per SRQ ones below, so threads working on different QPs do not wait on each other
+*/
+{
+    ignore(rnic_hndl);  /*the switch is process wide, like the RDMAP layer*/
+    lock_enable();
+    return IWARP_OK;
+}
+
 iwarp_status_t iwarp_nsmr_register(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_addr_t addr_t, void *buffer,
 				    /*IN*/uint32_t length, iwarp_prot_id pd, iwarp_stag_key_t stag_key,
 				    /*IN*/iwarp_access_control_t access_flags,
@@ -206,7 +269,7 @@ Assumes the memory has already been allocaetd by the user!
 	return IWARP_STAG_REGISTRATION_FAILURE;
 
     /*mark the pd as being bound to a new memory region*/
-    rnic_ptr->pd_index[pd].in_use++;
+    iwarp_pd_hold(rnic_ptr, pd, 1);
 
     ignore(stag_key); /*Since we are not creating a Spec compliant STag we can ignore the key that was passed in - to bad this is useful for debugging*/
 
@@ -247,13 +310,118 @@ Added verb to deregister a mem region
     if(ret < 0)
 	return IWARP_INVALID_MEM_REGION;
     else {
-	--rnic_ptr->pd_index[pd].in_use;
+	iwarp_pd_hold(rnic_ptr, pd, -1);
 	return IWARP_OK;
     }
 
 }
 
 
+iwarp_status_t iwarp_nsmr_register_vec(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+					/*INOUT*/iwarp_mem_reg_t *regs, uint32_t count)
+/*
+Register a batch of buffers, each with an STag spanning all of it
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_status_t ret;
+
+    if(count == 0)
+	return IWARP_OK;
+    ret = v_mem_register_vec(rnic_ptr, pd, regs, count);
+    if(ret != IWARP_OK)
+	return IWARP_MEMORY_REGISTRATION_FAILURE;
+
+    iwarp_pd_hold(rnic_ptr, pd, count);
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_deregister_mem_vec(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+					 /*IN*/iwarp_mem_reg_t *regs, uint32_t count)
+/*
+Undo iwarp_nsmr_register_vec, the pd is released even if some entry was already gone
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_status_t ret;
+
+    if(count == 0)
+	return IWARP_OK;
+    ret = v_mem_deregister_vec(rnic_ptr, regs, count);
+    iwarp_pd_hold(rnic_ptr, pd, -(int)count);
+    if(ret != IWARP_OK)
+	return IWARP_INVALID_MEM_REGION;
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_mem_cache_limit(/*IN*/iwarp_rnic_handle_t rnic_hndl, size_t bytes)
+/*
+Bound the memory the registration cache keeps registered on behalf of deregistered regions
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    int ret;
+
+    ret = v_mem_cache_limit(rnic_ptr, bytes);
+    if(ret != IWARP_OK)
+	return IWARP_INSUFFICIENT_RESOURCES;
+
+    return IWARP_OK;
+}
+
+iwarp_status_t iwarp_invalidate_mem(/*IN*/iwarp_rnic_handle_t rnic_hndl, void *buffer, uint32_t length)
+/*
+Forget cached registrations of this range, the user is about to unmap it
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    int ret;
+
+    ret = v_mem_invalidate(rnic_ptr, buffer, length);
+    if(ret != IWARP_OK)
+	return IWARP_INVALID_MEM_REGION;
+
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_allocate_mw(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+				 /*OUT*/iwarp_stag_index_t *mw)
+/*
+Allocate a memory window, no memory is exposed until it is bound
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    int ret;
+
+    ret = v_mem_mw_alloc(rnic_ptr, pd, mw);
+    if(ret != IWARP_OK)
+	return IWARP_INSUFFICIENT_RESOURCES;
+
+    iwarp_pd_hold(rnic_ptr, pd, 1);
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_deallocate_mw(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd, iwarp_stag_index_t mw)
+/*
+Free a memory window, same as destroying any other stag
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    int ret;
+
+    ret = v_mem_stag_destroy(rnic_ptr, mw);
+    if(ret < 0)
+	return IWARP_UNABLE_DESTROY_STAG;
+
+    iwarp_pd_hold(rnic_ptr, pd, -1);
+    return IWARP_OK;
+}
+
+
 iwarp_status_t iwarp_create_sgl(/*IN*/iwarp_rnic_handle_t rnic_hndl,
 				/*OUT*/iwarp_sgl_t *sgl)
 /*
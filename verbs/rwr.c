@@ -12,6 +12,59 @@
 #include "verbs.h"
 //~ #include <stdlib.h>
 
+/*
+ * Save a receive posted before the QP connected, the connect dispatches
+ * the lot.  Called with the RNIC locked, which the connect takes too, so
+ * a QP that connected meanwhile gets it directly.
+ */
+static int recv_q_add(iwarp_rnic_t *rnic_ptr, iwarp_qp_t *qp, const iwarp_wr_t *rq_wr)
+{
+    iwarp_wr_q_t *recv_q = &qp->recv_q;
+    iwarp_wr_t *queue;
+    int max;
+    unsigned int i;
+
+    if (qp->connected)
+	return iwarp_recv_event_dispatch_one(rnic_ptr, qp, rq_wr);
+
+    /* add WR to the QP's queue, flushed when connection made */
+    if (unlikely(recv_q->size == (int) qp->attributes->rq_depth))
+	return IWARP_RWQ_FULL;
+
+    if (recv_q->size == recv_q->max) {  /*start small, idle QPs cost little*/
+	max = recv_q->max ? 2 * recv_q->max : 8;
+	if (max > (int) qp->attributes->rq_depth)
+	    max = qp->attributes->rq_depth;
+	queue = realloc(recv_q->queue, max * sizeof(*queue));
+	if (queue == NULL)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	recv_q->queue = queue;
+	recv_q->max = max;
+    }
+
+    /* struct copy */
+    recv_q->queue[recv_q->size] = *rq_wr;
+
+    /*need to copy the SGLs over in case user deletes them*/
+    recv_q->queue[recv_q->size].sgl = malloc(sizeof (iwarp_sgl_t));
+    if (recv_q->queue[recv_q->size].sgl == NULL)
+	return IWARP_INSUFFICIENT_RESOURCES;
+    for(i=0; i<rq_wr->sgl->sge_count; i++){
+	/*copy length of each one*/
+	recv_q->queue[recv_q->size].sgl->sge[i].length = rq_wr->sgl->sge[i].length;
+	/*now stag*/
+	recv_q->queue[recv_q->size].sgl->sge[i].stag = rq_wr->sgl->sge[i].stag;
+	/*last the to*/
+	recv_q->queue[recv_q->size].sgl->sge[i].to = rq_wr->sgl->sge[i].to;
+    }
+    recv_q->queue[recv_q->size].sgl->sge_count = rq_wr->sgl->sge_count;
+
+    ++recv_q->size;
+    /*keep track of how many we post before connecting*/
+    ++qp->pre_connection_posts;
+    return IWARP_OK;
+}
+
 /*
  * Put a receive work request onto the receive queue.
  */
@@ -19,49 +72,35 @@ iwarp_status_t iwarp_qp_post_rq(/*IN*/iwarp_rnic_handle_t rnic_hndl,
   iwarp_qp_handle_t qp_hndl, iwarp_wr_t *rq_wr)
 {
     iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
-
+    iwarp_qp_t *qp = qp_from_handle(rnic_ptr, qp_hndl);
     int ret;
-    unsigned int i;
     //~ cqe_t cq_evt;
 
+    if (unlikely(qp->attributes->srq != NULL))
+	return IWARP_QP_USES_SRQ;  /*post with iwarp_srq_post_recv*/
+    if (unlikely(rq_wr->sgl->sge_count > qp->attributes->recv_sgl_max))
+	return IWARP_UNSUPPORTED_WR_COUNT;
+
     /*only if connected do we dispatch the queue*/
-    if (rnic_ptr->qp_index[qp_hndl].connected) {
-	ret = iwarp_recv_event_dispatch_one(rnic_ptr, &rnic_ptr->qp_index[qp_hndl], rq_wr);
+    if (likely(qp->connected)) {
+	ret = iwarp_recv_event_dispatch_one(rnic_ptr, qp, rq_wr);
 	if (ret)
 	    return ret;
     } else {
-	/* add WR to the queue, flushed when connection made */
-	if (unlikely(rnic_ptr->recv_q.size == MAX_WRQ))
-	    return IWARP_RWQ_FULL;
-
-	/* struct copy */
-	rnic_ptr->recv_q.queue[rnic_ptr->recv_q.size] = *rq_wr;
-
-	/*need to copy the SGLs over in case user deletes them*/
-	rnic_ptr->recv_q.queue[rnic_ptr->recv_q.size].sgl = malloc(sizeof (iwarp_sgl_t));
-	for(i=0; i<rq_wr->sgl->sge_count; i++){
-	    /*copy length of each one*/
-	    rnic_ptr->recv_q.queue[rnic_ptr->recv_q.size].sgl->sge[i].length = rq_wr->sgl->sge[i].length;
-	    /*now stag*/
-	    rnic_ptr->recv_q.queue[rnic_ptr->recv_q.size].sgl->sge[i].stag = rq_wr->sgl->sge[i].stag;
-	    /*last the to*/
-	    rnic_ptr->recv_q.queue[rnic_ptr->recv_q.size].sgl->sge[i].to = rq_wr->sgl->sge[i].to;
-	}
-	rnic_ptr->recv_q.queue[rnic_ptr->recv_q.size].sgl->sge_count = rq_wr->sgl->sge_count;
-
-	++rnic_ptr->recv_q.size;
-	/*keep track of how many we post before connecting*/
-	++rnic_ptr->qp_index[qp_hndl].pre_connection_posts;
-	ret = IWARP_OK;
+	rwlock_write(&rnic_ptr->lock);  /*else a connect could miss this one*/
+	ret = recv_q_add(rnic_ptr, qp, rq_wr);
+	rwlock_drop(&rnic_ptr->lock);
+	if (ret)
+	    return ret;
     }
 
      if (rq_wr->cq_type == UNSIGNALED) {  /*TODO: Test what happens when is unsignaled and before connection made if no connection
 	 and its unsignaled there will be noting to pull off cq*/
-	//~ ret = v_throw_away_cqe(rnic_ptr, rnic_ptr->qp_index[qp_hndl].attributes->rq_cq);
+	//~ ret = v_throw_away_cqe(rnic_ptr, qp_from_handle(rnic_ptr, qp_hndl)->attributes->rq_cq);
 	//~ if(ret != IWARP_OK)
 	    //~ return IWARP_RWQ_INTERNAL_ERROR;
 
-	//~ ret = cq_consume(rnic_ptr->qp_index[qp_hndl].attributes->rq_cq, &cq_evt);  /*pop off a cq entry just throw it away*/
+	//~ ret = cq_consume(qp_from_handle(rnic_ptr, qp_hndl)->attributes->rq_cq, &cq_evt);  /*pop off a cq entry just throw it away*/
 	//~ if (ret)
 	    //~ return IWARP_RWQ_INTERNAL_ERROR;
 	return IWARP_UNSUPORTED_COMPL_TYPE;
@@ -71,3 +110,33 @@ iwarp_status_t iwarp_qp_post_rq(/*IN*/iwarp_rnic_handle_t rnic_hndl,
     return ret;
 }
 
+/*
+ * Post an array of receives, with one trip to the kernel in kernel mode.
+ */
+iwarp_status_t iwarp_qp_post_rq_list(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_qp_handle_t qp_hndl,
+				     /*IN*/iwarp_wr_t *rq_wr, uint32_t count,
+				     /*OUT*/uint32_t *posted)
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_qp_t *qp = qp_from_handle(rnic_ptr, qp_hndl);
+    int batched = qp->connected;  /*else they only go on the QP's recv_q*/
+    uint32_t i;
+    int ret = IWARP_OK, err = IWARP_OK;
+
+    *posted = 0;
+    if (batched) {
+	ret = v_batch_begin(rnic_ptr, qp->socket_fd);
+	if (ret)
+	    return ret;
+    }
+    for (i=0; i<count; i++) {
+	ret = iwarp_qp_post_rq(rnic_hndl, qp_hndl, &rq_wr[i]);
+	if (ret)
+	    break;
+	++*posted;
+    }
+    if (batched)
+	err = v_batch_end(rnic_ptr, qp->socket_fd, posted);
+
+    return ret ? ret : err;
+}
@@ -0,0 +1,129 @@
+/*
+* Shared receive queues
+*
+*Many QPs can take their receives from one queue, so a server with a great
+*many connections posts for the traffic it expects rather than for every
+*connection.  Completions name the QP the message arrived on.  Only the
+*software stack has them, the kernel interface keeps receives per socket.
+*
+*Copyright (C) 2005 OSC iWarp Team
+*Distributed under the GNU Public License Version 2 or later (SEE LICENSE)
+*
+*
+*/
+#include "verbs.h"
+#include <stdlib.h>
+
+
+iwarp_status_t iwarp_srq_create(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+				/*IN*/uint32_t max_wr, uint32_t sgl_max,
+				/*IN*/iwarp_srq_limit_hndlr_t limit_hndlr, void *context,
+				/*OUT*/iwarp_srq_handle_t *srq_hndl)
+/*
+Create a shared receive queue of max_wr entries in protection domain pd
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_srq_t *srq;
+    iwarp_status_t ret;
+
+    if(pd < 0 || pd >= MAX_PROT_DOMAIN || rnic_ptr->pd_index[pd].available == TRUE)
+	return IWARP_INVALID_PD_ID;
+    if(max_wr == 0 || max_wr > MAX_SRQ_DEPTH || sgl_max > MAX_R_SGL)
+	return IWARP_INSUFFICIENT_RESOURCES;
+    rwlock_write(&rnic_ptr->lock);
+    if(rnic_ptr->srq_count == MAX_SRQ){
+	rwlock_drop(&rnic_ptr->lock);
+	return IWARP_INSUFFICIENT_RESOURCES;
+    }
+    rnic_ptr->srq_count++;  /*taken back below on failure*/
+    rwlock_drop(&rnic_ptr->lock);
+
+    srq = malloc(sizeof(*srq));
+    if(srq == NULL){
+	ret = IWARP_INSUFFICIENT_RESOURCES;
+	goto uncount;
+    }
+    srq->pd = pd;
+    srq->max_wr = max_wr;
+    srq->sgl_max = sgl_max;
+    srq->in_use = 0;
+    srq->limit_hndlr = limit_hndlr;
+    srq->context = context;
+
+    ret = v_srq_create(rnic_ptr, srq);
+    if(ret != IWARP_OK){
+	free(srq);
+	goto uncount;
+    }
+    iwarp_pd_hold(rnic_ptr, pd, 1);
+
+    *srq_hndl = srq;
+    return IWARP_OK;
+
+uncount:
+    rwlock_write(&rnic_ptr->lock);
+    --rnic_ptr->srq_count;
+    rwlock_drop(&rnic_ptr->lock);
+    return ret;
+}
+
+
+iwarp_status_t iwarp_srq_destroy(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_srq_handle_t srq_hndl)
+/*
+Destroy the queue, receives still posted are dropped without completions
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_status_t ret;
+
+    rwlock_read(&rnic_ptr->lock);  /*in_use is changed under the write lock*/
+    ret = srq_hndl->in_use ? IWARP_SRQ_INUSE : IWARP_OK;
+    rwlock_drop(&rnic_ptr->lock);
+    if(ret != IWARP_OK)
+	return ret;
+
+    ret = v_srq_destroy(rnic_ptr, srq_hndl);
+    if(ret != IWARP_OK)
+	return ret;
+    iwarp_pd_hold(rnic_ptr, srq_hndl->pd, -1);
+    rwlock_write(&rnic_ptr->lock);
+    --rnic_ptr->srq_count;
+    rwlock_drop(&rnic_ptr->lock);
+    free(srq_hndl);
+    return IWARP_OK;
+}
+
+
+iwarp_status_t iwarp_srq_post_recv(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_srq_handle_t srq_hndl,
+				   /*IN*/iwarp_wr_t *rq_wr)
+/*
+Post a receive, it does not wait for any QP to connect
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+
+    if(rq_wr->wr_type != IWARP_WR_TYPE_RECV)
+	return IWARP_UNKNOWN_WR_TYPE;
+    if(rq_wr->sgl->sge_count > srq_hndl->sgl_max)
+	return IWARP_UNSUPPORTED_WR_COUNT;
+
+    return v_srq_post_recv(rnic_ptr, srq_hndl, rq_wr->sgl, rq_wr->wr_id);
+}
+
+
+iwarp_status_t iwarp_srq_arm(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_srq_handle_t srq_hndl,
+			     /*IN*/uint32_t limit)
+/*
+Set the low watermark, the handler fires once and the queue must be armed again
+*/
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+
+    if(limit > srq_hndl->max_wr)
+	return IWARP_INVALID_MODIFIER;
+    if(limit && srq_hndl->limit_hndlr == NULL)
+	return IWARP_INVALID_MODIFIER;
+
+    return v_srq_arm(rnic_ptr, srq_hndl, limit);
+}
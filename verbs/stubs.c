@@ -14,8 +14,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <sched.h>
 
 #include "verbs.h"
 #include "stubs.h"
@@ -28,6 +31,86 @@ int KERNEL_MODE = 1;
 int KERNEL_MODE = 0;
 #endif
 
+#ifndef KERNEL_IWARP
+static int v_sgl_iov(const iwarp_sgl_t *sgl, struct iovec *iov)
+/*
+The tagged offset of a local sge is its virtual address here, so an sgl maps
+straight onto an iovec for the software stack
+*/
+{
+    uint32_t i;
+
+    for(i=0; i<sgl->sge_count; i++){
+	iov[i].iov_base = ptr_from_int64(sgl->sge[i].to);
+	iov[i].iov_len = sgl->sge[i].length;
+    }
+    return sgl->sge_count;
+}
+#endif
+
+#ifdef KERNEL_IWARP
+#define V_BATCH_MAX 256  /*commands per doorbell*/
+#define V_BATCH_BUF (V_BATCH_MAX * 128)
+
+struct v_batch {  /*commands gathered for one IWARP_BATCH write*/
+    int active;
+    uint32_t count;
+    uint32_t used;  /*bytes of buf*/
+    uint32_t done;  /*carried out by earlier doorbells of this batch*/
+    char buf[V_BATCH_BUF];
+};
+
+static int v_batch_flush(iwarp_rnic_t *rnic_ptr)
+/*
+Ring the doorbell, everything gathered goes to the kernel in one write
+*/
+{
+    struct v_batch *b = rnic_ptr->batch;
+    struct user_batch req_buf;
+    uint32_t done = 0;
+    int ret;
+
+    if(b->count == 0)
+	return 0;
+    req_buf.cmd = IWARP_BATCH;
+    req_buf.count = b->count;
+    req_buf.len = b->used;
+    req_buf.buf = b->buf;
+    req_buf.done = &done;
+    ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+    b->done += done;
+    b->count = 0;
+    b->used = 0;
+    if(ret != sizeof(req_buf))
+	return -1;
+    return 0;
+}
+
+static int v_write(iwarp_rnic_t *rnic_ptr, const void *req, size_t len)
+/*
+Hand a command to the kernel, or add it to the open batch.  Returns len
+like write() would.
+*/
+{
+    struct v_batch *b = rnic_ptr->batch;
+    struct user_batch_hdr *bh;
+
+    if(b == NULL || !b->active)
+	return write(rnic_ptr->fd, req, len);
+    if(b->count == V_BATCH_MAX || b->used + user_batch_reclen(len) > V_BATCH_BUF){
+	if(v_batch_flush(rnic_ptr) != 0)
+	    return -1;
+    }
+    bh = (struct user_batch_hdr *)(b->buf + b->used);
+    bh->len = len;
+    bh->pad = 0;
+    memcpy(bh + 1, req, len);
+    b->used += user_batch_reclen(len);
+    b->count++;
+    return len;
+}
+#endif
+
 iwarp_status_t v_RNIC_open(int index, iwarp_rnic_t *rnic)
 /*
 Open the RNIC, doesn't really do anything in user mode
@@ -36,6 +119,7 @@ TODO: get rid of const string below, set it somewher else or pass it in as an ar
 {
 
     ignore(index);
+    rnic->batch = NULL;
     #ifdef KERNEL_IWARP
 	static const char *kiwarp_dev = "/dev/kiwarp";
 	int fd;
@@ -64,6 +148,7 @@ Close the RNIC device from the users perspective
 
 
     #ifdef KERNEL_IWARP
+	free(rnic_ptr->batch);
 	ret = close(rnic_ptr->fd);
 
 	if(ret != 0)
@@ -73,6 +158,9 @@ Close the RNIC device from the users perspective
 
     #else
 	ignore(rnic_ptr);
+	if(progress_stop() != 0)  /*the threads poll what is torn down below*/
+	    debug(0, "a progress thread had failed");
+	crc32c_threads_stop();
 	v_mem_fini();
 	ret = v_rdmap_fin();
 	if(ret != 0)
@@ -86,6 +174,59 @@ Close the RNIC device from the users perspective
 
 
 
+}
+
+iwarp_status_t v_progress_start(iwarp_rnic_t *rnic_ptr, int nthreads, const int *cores)
+/*
+Start the background progress threads, the kernel needs none
+*/
+{
+    ignore(rnic_ptr);
+    #ifdef KERNEL_IWARP
+	ignore(nthreads);
+	ignore(cores);
+	return IWARP_PROGRESS_UNSUPPORTED;
+    #else
+	if(progress_start(nthreads, cores) != 0)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_crc_threads_start(iwarp_rnic_t *rnic_ptr, int nthreads)
+/*
+Start the threads helping with large CRCs, the kernel computes its own
+*/
+{
+    ignore(rnic_ptr);
+    #ifdef KERNEL_IWARP
+	ignore(nthreads);
+	return IWARP_CRC_THREADS_UNSUPPORTED;
+    #else
+	if(crc32c_threads_start(nthreads) != 0)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_crc_trust(iwarp_rnic_t *rnic_ptr, const char *const *subnets)
+/*
+Subnets where QPs with mpa_crc_auto go without CRC, the kernel has no such policy
+*/
+{
+    ignore(rnic_ptr);
+    #ifdef KERNEL_IWARP
+	ignore(subnets);
+	return IWARP_CRC_TRUST_UNSUPPORTED;
+    #else
+	for(; *subnets != NULL; subnets++){
+	    if(rdmap_crc_trust(*subnets) != 0){
+		debug(0, "Bad trusted subnet %s", *subnets);
+		return IWARP_INVALID_SUBNET;
+	    }
+	}
+	return IWARP_OK;
+    #endif
 }
 
 iwarp_status_t v_mem_init()
@@ -251,6 +392,158 @@ Deregister the memory from the memory module
     #endif
 }
 
+iwarp_status_t v_mem_register_vec(iwarp_rnic_t *rnic_ptr, iwarp_prot_id pd, iwarp_mem_reg_t *regs, uint32_t count)
+/*
+Register a batch and create its STags, one write to the kernel for all of it
+*/
+{
+    uint32_t i;
+    int ret;
+    #ifdef KERNEL_IWARP
+	struct user_mem_reg_vec req_buf;
+	struct user_mem_reg_ent *ents;
+
+	ents = malloc(count * sizeof(*ents));
+	if(ents == NULL)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	for(i=0; i<count; i++){
+	    ents[i].address = regs[i].buffer;
+	    ents[i].len = regs[i].length;
+	    ents[i].rw = regs[i].access_flags;
+	}
+	req_buf.cmd = IWARP_MEM_REG_VEC;
+	req_buf.count = count;
+	req_buf.prot_domain = pd;
+	req_buf.ents = ents;
+	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	if(ret == sizeof(req_buf)){
+	    for(i=0; i<count; i++){
+		regs[i].mem_region = ents[i].md;
+		regs[i].stag_index = ents[i].stag;
+	    }
+	}
+	free(ents);
+	if(ret != sizeof(req_buf))
+	    return -1;  /*TODO: verbs error code*/
+	return IWARP_OK;
+    #else
+	mem_reg_t *v;
+
+	ignore(rnic_ptr);
+	v = malloc(count * sizeof(*v));
+	if(v == NULL)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	for(i=0; i<count; i++){
+	    v[i].addr = regs[i].buffer;
+	    v[i].len = regs[i].length;
+	    v[i].rw = (stag_acc_t) regs[i].access_flags;
+	}
+	ret = mem_register_vec(0, v, count, pd);
+	if(ret == 0){
+	    for(i=0; i<count; i++){
+		regs[i].mem_region = v[i].md;
+		regs[i].stag_index = v[i].stag;
+	    }
+	}
+	free(v);
+	if(ret < 0)
+	    return -1;  /*TODO: verbs error code*/
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_mem_deregister_vec(iwarp_rnic_t *rnic_ptr, iwarp_mem_reg_t *regs, uint32_t count)
+/*
+Destroy the STags and deregister the regions of a batch
+*/
+{
+    uint32_t i;
+    int ret;
+    #ifdef KERNEL_IWARP
+	struct user_mem_dereg_vec req_buf;
+	struct user_mem_reg_ent *ents;
+
+	ents = malloc(count * sizeof(*ents));
+	if(ents == NULL)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	for(i=0; i<count; i++){
+	    ents[i].md = regs[i].mem_region;
+	    ents[i].stag = regs[i].stag_index;
+	}
+	req_buf.cmd = IWARP_MEM_DEREG_VEC;
+	req_buf.count = count;
+	req_buf.ents = ents;
+	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	free(ents);
+	if(ret != sizeof(req_buf))
+	    return -1;  /*TODO: verbs error code*/
+	return IWARP_OK;
+    #else
+	mem_reg_t *v;
+
+	ignore(rnic_ptr);
+	v = malloc(count * sizeof(*v));
+	if(v == NULL)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	for(i=0; i<count; i++){
+	    v[i].md = regs[i].mem_region;
+	    v[i].stag = regs[i].stag_index;
+	}
+	ret = mem_deregister_vec(v, count);
+	free(v);
+	if(ret < 0)
+	    return -1;  /*TODO: verbs error code*/
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_mem_cache_limit(iwarp_rnic_t *rnic_ptr, size_t bytes)
+/*
+Set how much deregistered memory the registration cache may hold on to
+*/
+{
+    #ifdef KERNEL_IWARP
+	int ret;
+	struct user_mem_cache_limit req_buf;
+	req_buf.cmd = IWARP_MEM_CACHE_LIMIT;
+	req_buf.limit = bytes;
+	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	if(ret != sizeof(req_buf))
+	    return -1;  /*TODO: verbs error code*/
+	else
+	    return IWARP_OK;
+
+    #else
+	ignore(rnic_ptr);
+	mem_cache_set_limit(bytes);
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_mem_invalidate(iwarp_rnic_t *rnic_ptr, void *buffer, uint32_t length)
+/*
+Drop any cached registration of the given range
+*/
+{
+    #ifdef KERNEL_IWARP
+	int ret;
+	struct user_mem_invalidate req_buf;
+	req_buf.cmd = IWARP_MEM_INVALIDATE;
+	req_buf.address = buffer;
+	req_buf.len = length;
+	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	if(ret != sizeof(req_buf))
+	    return -1;  /*TODO: verbs error code*/
+	else
+	    return IWARP_OK;
+
+    #else
+	ignore(rnic_ptr);
+	mem_invalidate(buffer, length);
+	return IWARP_OK;
+    #endif
+}
+
 iwarp_status_t v_rnic_advance(iwarp_rnic_t *rnic_ptr)
 /*
 Advance the RNIC
@@ -272,6 +565,8 @@ Advance the RNIC
 
     #else
 	ignore(rnic_ptr);
+	if(progress_running())  /*the threads do it*/
+	    return progress_error();
 	return rdmap_poll();
     #endif
 }
@@ -395,6 +690,9 @@ TODO: This has not been tested AT ALL YET
 	    case OP_RECV:
 		wc->wr_type = IWARP_WR_TYPE_RECV;
 	    break;
+	    case OP_BIND_MW:
+		wc->wr_type = IWARP_WR_TYPE_BIND_MW;
+	    break;
 	    default:
 		return IWARP_UNKNOWN_WR_TYPE;
 	}
@@ -422,22 +720,21 @@ TODO: This has not been tested AT ALL YET
 	wc->bytes_recvd = kwc.msg_len;  /*how much data we really got*/
 	//~ printf("got %d bytes sent\n", kwc.msg_len);
 
-	/*How do we find out about invalidate STag,, do we really care?*/
-	//~ wc->stag_invalidate =
-	//~ iwarp_stag_index_t stag;  /*the stag that was invalidated*/
+	/*set when the peer used SEND with Invalidate on one of our windows*/
+	wc->stag_invalidate = (kwc.inv_stag != 0);
+	wc->stag = kwc.inv_stag;
 
 	return IWARP_OK;
 
     #else
 
-	ignore(rnic_ptr);
 	cqe_t cq_evt;
 	int i = 0;
 	int ret = 0;
 
 
 	for(;; ){
-	    ret = rdmap_poll();
+	    ret = progress_running() ? progress_error() : rdmap_poll();
 	    if(ret != 0)
 		return IWARP_RDMAP_POLL_FAILURE;
 
@@ -448,6 +745,8 @@ TODO: This has not been tested AT ALL YET
 	    /*otherwise keep on going*/
 	    if(time_out > 0) /*don't call usleep unless we want to sleep, otherwise even with 0 it still delays*/
 		usleep(time_out);
+	    else if(progress_running())  /*leave the cpu to the threads filling the cq*/
+		sched_yield();
 
 	    if(retrys != IWARP_INFINITY){
 		i++;
@@ -473,6 +772,16 @@ TODO: This has not been tested AT ALL YET
 	    case OP_RECV:
 		 wc->wr_type = IWARP_WR_TYPE_RECV;
 	    break;
+	    case OP_BIND_MW:
+		wc->wr_type = IWARP_WR_TYPE_BIND_MW;
+	    break;
+	    case OP_RECV_IMM:
+		wc->wr_type = IWARP_WR_TYPE_RECV_IMM;
+		wc->imm_data = cq_evt.imm;
+	    break;
+	    case OP_ATOMIC:
+		wc->wr_type = IWARP_WR_TYPE_ATOMIC;
+	    break;
 	    default:
 		return IWARP_UNKNOWN_WR_TYPE;
 	}
@@ -490,14 +799,14 @@ TODO: This has not been tested AT ALL YET
 
 	wc->wr_id = cq_evt.id;  /*work request ID*/
 
-	/*how do we get the QP that this was associated with - more importantly WHY would we need to do this?*/
-	//~ wc->qp_hndl =
+	/*QPs can share a CQ and an SRQ, the completion names the socket*/
+	wc->qp_hndl = iwarp_qp_from_fd(rnic_ptr, cq_evt.sk);
 
 	wc->bytes_recvd = cq_evt.msg_len;  /*how much data we really got*/
 
-	/*How do we find out about invalidate STag,, do we really care?*/
-	//~ wc->stag_invalidate =
-	//~ iwarp_stag_index_t stag;  /*the stag that was invalidated*/
+	/*set when the peer used SEND with Invalidate on one of our windows*/
+	wc->stag_invalidate = (cq_evt.inv_stag != 0);
+	wc->stag = cq_evt.inv_stag;
 
 	return IWARP_OK;
     #endif
@@ -517,7 +826,7 @@ iwarp_status_t v_poll_block_qp(iwarp_rnic_t *rnic_ptr,
 
     /*set up the kernel buffer*/
     req_buf.cmd = IWARP_POLL_BLOCK;
-    req_buf.fd = rnic_ptr->qp_index[qp_id].socket_fd;
+    req_buf.fd = qp_from_handle(rnic_ptr, qp_id)->socket_fd;
     req_buf.cq_handle = cq_hndl;
     req_buf.wc = &kwc;
 
@@ -539,6 +848,9 @@ iwarp_status_t v_poll_block_qp(iwarp_rnic_t *rnic_ptr,
 	case OP_RECV:
 	    wc->wr_type = IWARP_WR_TYPE_RECV;
 	    break;
+	case OP_BIND_MW:
+	    wc->wr_type = IWARP_WR_TYPE_BIND_MW;
+	    break;
 	default:
 	    return IWARP_UNKNOWN_WR_TYPE;
     }
@@ -557,6 +869,8 @@ iwarp_status_t v_poll_block_qp(iwarp_rnic_t *rnic_ptr,
     wc->wr_id = kwc.id;
 
     wc->bytes_recvd = kwc.msg_len;
+    wc->stag_invalidate = (kwc.inv_stag != 0);
+    wc->stag = kwc.inv_stag;
     return IWARP_OK;
 #else
     error("%s: not implemented for userspace iwarp", __func__);
@@ -573,8 +887,14 @@ iwarp_status_t v_rdmap_register_connection(iwarp_rnic_t *rnic_ptr, iwarp_qp_hand
 Register the socket as well as set markers and crc settings in RDMAP
 */
 {
+    iwarp_qp_t *qp = qp_from_handle(rnic_ptr, qp_id);
     int ret;
 
+    /*completions only name the socket*/
+    ret = iwarp_qp_fd_set(rnic_ptr, qp->socket_fd, qp_id);
+    if(ret != IWARP_OK)
+	return ret;
+
     #ifdef KERNEL_IWARP
 	struct user_register_sock req_buf;
 	struct user_sock_attrs req_buf2;
@@ -587,10 +907,11 @@ Register the socket as well as set markers and crc settings in RDMAP
 
 	/*register the socket*/
 	req_buf.cmd = IWARP_REGISTER_SOCK;
-	req_buf.fd = rnic_ptr->qp_index[qp_id].socket_fd;
-	req_buf.scq_handle = rnic_ptr->qp_index[qp_id].attributes->sq_cq;
-	req_buf.rcq_handle = rnic_ptr->qp_index[qp_id].attributes->rq_cq;
-	//~ printf("Telling the Kernel %d for socket\n", rnic_ptr->qp_index[qp_id].socket_fd);
+	req_buf.fd = qp->socket_fd;
+	req_buf.scq_handle = qp->attributes->sq_cq;
+	req_buf.rcq_handle = qp->attributes->rq_cq;
+	req_buf.prot_domain = qp->attributes->prot_d_id;
+	//~ printf("Telling the Kernel %d for socket\n", qp->socket_fd);
 	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
 	if(ret != sizeof(req_buf))
 	    return -1;  /*TODO: verbs error code*/
@@ -598,9 +919,9 @@ Register the socket as well as set markers and crc settings in RDMAP
 
 	/*now to set up socket options*/
 	req_buf2.cmd = IWARP_SET_SOCK_ATTRS;
-	req_buf2.fd = req_buf.fd = rnic_ptr->qp_index[qp_id].socket_fd;;
-	req_buf2.use_crc = !rnic_ptr->qp_index[qp_id].attributes->disable_mpa_crc;
-	req_buf2.use_mrkr = !rnic_ptr->qp_index[qp_id].attributes->disable_mpa_markers;
+	req_buf2.fd = req_buf.fd = qp->socket_fd;
+	req_buf2.use_crc = !qp->attributes->disable_mpa_crc;
+	req_buf2.use_mrkr = !qp->attributes->disable_mpa_markers;
 	ret = write(rnic_ptr->fd, &req_buf2, sizeof(req_buf2));
 	if(ret != sizeof(req_buf2))
 	    return -1;  /*TODO: verbs error code*/
@@ -608,7 +929,7 @@ Register the socket as well as set markers and crc settings in RDMAP
 	/*tell kernel to do handshake negotiation for markers and crc*/
 
 	req_buf3.cmd = IWARP_INIT_STARTUP;
-	req_buf3.fd = rnic_ptr->qp_index[qp_id].socket_fd;
+	req_buf3.fd = qp->socket_fd;
 	req_buf3.is_initiator = type;
 	req_buf3.pd_in = temp;
 	req_buf3.len_in = local_pd_len;
@@ -622,23 +943,67 @@ Register the socket as well as set markers and crc settings in RDMAP
 
     #else
 
-	//~ printf("getting ready to do rdmap register sock on %d cqs are %p and %p \n", rnic_ptr->qp_index[qp_id].socket_fd,  rnic_ptr->qp_index[qp_id].attributes->sq_cq, rnic_ptr->qp_index[qp_id].attributes->rq_cq);
+	//~ printf("getting ready to do rdmap register sock on %d cqs are %p and %p \n", qp->socket_fd,  qp->attributes->sq_cq, qp->attributes->rq_cq);
+
+	ret = rdmap_register_sock(qp->socket_fd, qp->attributes->sq_cq, qp->attributes->rq_cq);
+	if(ret != 0)
+	    return IWARP_RDMAP_REGISTER_SOCKET_FAILURE;
 
-	ret = rdmap_register_sock(rnic_ptr->qp_index[qp_id].socket_fd, rnic_ptr->qp_index[qp_id].attributes->sq_cq, rnic_ptr->qp_index[qp_id].attributes->rq_cq);
+	/*the peer reaches only stags of the QP's PD*/
+	ret = rdmap_set_prot_domain(qp->socket_fd, qp->attributes->prot_d_id);
 	if(ret != 0)
 	    return IWARP_RDMAP_REGISTER_SOCKET_FAILURE;
 
+	/*before startup, the peer may send as soon as it is done*/
+	if(qp->attributes->srq != NULL){
+	    ret = rdmap_set_srq(qp->socket_fd, qp->attributes->srq->srq);
+	    if(ret != 0)
+		return IWARP_RDMAP_REGISTER_SOCKET_FAILURE;
+	}
+
 	//~ printf("back from register sock\n");
 
-	ret = rdmap_mpa_use_markers(rnic_ptr->qp_index[qp_id].socket_fd, !rnic_ptr->qp_index[qp_id].attributes->disable_mpa_markers);
+	ret = rdmap_mpa_use_markers(qp->socket_fd, !qp->attributes->disable_mpa_markers);
 	if(ret != 0)
 	    return IWARP_RDMAP_SET_MARKER_FAILURE;
 
-	ret = rdmap_mpa_use_crc(rnic_ptr->qp_index[qp_id].socket_fd, !rnic_ptr->qp_index[qp_id].attributes->disable_mpa_crc);
+	ret = rdmap_mpa_use_crc(qp->socket_fd, qp->attributes->mpa_crc_auto ? RDMAP_CRC_AUTO
+							: !qp->attributes->disable_mpa_crc);
+	if(ret != 0)
+	    return IWARP_RDMAP_SET_CRC_FAILURE;
+
+	ret = rdmap_mpa_defer_crc(qp->socket_fd, qp->attributes->defer_crc_check);
 	if(ret != 0)
 	    return IWARP_RDMAP_SET_CRC_FAILURE;
 
-	ret = rdmap_init_startup(rnic_ptr->qp_index[qp_id].socket_fd, type, private_data, remote_private_data, rpd);
+	ret = rdmap_set_read_depths(qp->socket_fd, qp->attributes->ird ? qp->attributes->ird : 1,
+				    qp->attributes->ord ? qp->attributes->ord : 1);
+	if(ret != 0)
+	    return IWARP_INVALID_QP_ATTR;
+
+	ret = rdmap_set_read_chunk(qp->socket_fd, qp->attributes->rdma_read_chunk);
+	if(ret != 0)
+	    return IWARP_INVALID_QP_ATTR;
+
+	ret = rdmap_set_affinity(qp->socket_fd, qp->attributes->progress_affinity - 1);
+	if(ret != 0)
+	    return IWARP_INVALID_QP_ATTR;
+
+	/*RFC 7306 extensions, the peer may agree to fewer*/
+	ret = rdmap_set_extensions(qp->socket_fd,
+				   (qp->attributes->imm_data_enable ? RDMAP_EXT_IMM : 0)
+				   | (qp->attributes->atomics_enable ? RDMAP_EXT_ATOMIC : 0));
+	if(ret != 0)
+	    return IWARP_INVALID_QP_ATTR;
+
+	/*progress threads poll the socket once startup is done, the receives posted so far must be there by then*/
+	rwlock_write(&rnic_ptr->lock);
+	ret = iwarp_recv_event_dispatcher(rnic_ptr, qp);
+	rwlock_drop(&rnic_ptr->lock);
+	if(ret != 0)
+	    return IWARP_RECV_DISPATCHING_FAILURE;
+
+	ret = rdmap_init_startup(qp->socket_fd, type, private_data, remote_private_data, rpd);
 	if(ret != 0)
 	    return IWARP_MPA_INIT_FAILURE;
 
@@ -649,31 +1014,60 @@ Register the socket as well as set markers and crc settings in RDMAP
 
 }
 
-iwarp_status_t v_throw_away_cqe(iwarp_rnic_t *rnic_ptr, iwarp_cq_handle_t cq_hndl)
+iwarp_status_t v_batch_begin(iwarp_rnic_t *rnic_ptr, int socket_fd)
 /*
-Throw away a completion queue event because user wants an unsignaled completion
+Start gathering posts on a socket, they go out together at v_batch_end.  In
+kernel mode that is one write for all of them, in user mode their FPDUs
+are written to the socket in large pieces.
 */
 {
-
     #ifdef KERNEL_IWARP
-	iwarp_work_completion_t wc;
-
-	return v_poll_cq(rnic_ptr, cq_hndl, 1, 0, &wc);
-
-
+	ignore(socket_fd);
+	if(rnic_ptr->batch == NULL){
+	    rnic_ptr->batch = malloc(sizeof(*rnic_ptr->batch));
+	    if(rnic_ptr->batch == NULL)
+		return IWARP_INSUFFICIENT_RESOURCES;
+	}
+	rnic_ptr->batch->active = 1;
+	rnic_ptr->batch->count = 0;
+	rnic_ptr->batch->used = 0;
+	rnic_ptr->batch->done = 0;
+	return IWARP_OK;
 
     #else
-    int ret = 0;
-    cqe_t cq_evt;
-    ret = cq_consume(cq_hndl, &cq_evt);  /*pop off a cq entry just throw it away*/
-    if (ret)
-	return IWARP_RWQ_INTERNAL_ERROR;
+	ignore(rnic_ptr);
+	if(rdmap_cork(socket_fd) != 0)
+	    return IWARP_NO_CONNECTION;
+	return IWARP_OK;
+    #endif
+}
 
-    return IWARP_OK;
-    ignore(rnic_ptr);
+iwarp_status_t v_batch_end(iwarp_rnic_t *rnic_ptr, int socket_fd, uint32_t *done)
+/*
+Send everything gathered since v_batch_begin.  On failure *done is lowered
+to the number of posts that were carried out; in user mode all of them
+were, and they complete in error.
+*/
+{
+    #ifdef KERNEL_IWARP
+	int ret;
+	ignore(socket_fd);
+	ret = v_batch_flush(rnic_ptr);
+	rnic_ptr->batch->active = 0;
+	if(ret != 0){
+	    if(rnic_ptr->batch->done < *done)
+		*done = rnic_ptr->batch->done;
+	    return IWARP_RDMAP_POST_SEND_FAILURE;
+	}
+	return IWARP_OK;
 
+    #else
+	ignore(rnic_ptr);
+	ignore(done);
+	if(rdmap_uncork(socket_fd) != 0)
+	    return IWARP_RDMAP_POST_SEND_FAILURE;
+	return IWARP_OK;
     #endif
-
 }
 
 iwarp_status_t v_rdmap_post_recv(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag)
@@ -692,7 +1086,7 @@ Post a recv
 	req_buf.buf = buffer;
 	req_buf.len = length;
 
-	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	ret = v_write(rnic_ptr, &req_buf, sizeof(req_buf));
 
 
 
@@ -716,9 +1110,121 @@ Post a recv
 }
 
 
-iwarp_status_t v_rdmap_post_send(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag)
+#ifndef KERNEL_IWARP
+static void v_srq_limit(rdmap_srq_t *s, void *arg)
 /*
-Post a recv
+rdmap calls back with the verbs srq as its argument
+*/
+{
+    iwarp_srq_t *srq = arg;
+
+    ignore(s);
+    srq->limit_hndlr(srq, srq->context);
+}
+#endif
+
+iwarp_status_t v_srq_create(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq)
+/*
+Create the rdmap side of a shared receive queue, the kernel has none
+*/
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(srq);
+	return IWARP_SRQ_UNSUPPORTED;
+
+    #else
+	ignore(rnic_ptr);
+	srq->srq = rdmap_srq_create(srq->max_wr, srq->limit_hndlr ? v_srq_limit : NULL, srq);
+	if(srq->srq == NULL)
+	    return IWARP_INSUFFICIENT_RESOURCES;
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_srq_destroy(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq)
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(srq);
+	return IWARP_SRQ_UNSUPPORTED;
+
+    #else
+	ignore(rnic_ptr);
+	if(rdmap_srq_destroy(srq->srq) < 0)
+	    return IWARP_SRQ_INUSE;
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_srq_post_recv(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id)
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(srq);
+	ignore(sgl);
+	ignore(wr_id);
+	return IWARP_SRQ_UNSUPPORTED;
+
+    #else
+	struct iovec iov[MAX_SGE];
+	int ret;
+
+	ignore(rnic_ptr);
+	if(rdmap_srq_posted(srq->srq) >= srq->max_wr)  /*rdmap rounds its ring up*/
+	    return IWARP_RWQ_FULL;
+	ret = rdmap_srq_post_recv_vec(srq->srq, iov, v_sgl_iov(sgl, iov), wr_id);
+	if(ret)
+	    return IWARP_RDMAP_POST_RECV_FAILURE;
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_srq_arm(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq, uint32_t limit)
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(srq);
+	ignore(limit);
+	return IWARP_SRQ_UNSUPPORTED;
+
+    #else
+	ignore(rnic_ptr);
+	if(rdmap_srq_arm(srq->srq, limit) < 0)
+	    return IWARP_INVALID_MODIFIER;
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_rdmap_post_recv_vec(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id)
+/*
+Post a receive that scatters over several sges, software stack only
+*/
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(socket_fd);
+	ignore(sgl);
+	ignore(wr_id);
+	return IWARP_UNSUPPORTED_WR_COUNT;
+
+    #else
+    struct iovec iov[MAX_SGE];
+    int ret;
+
+    ret = rdmap_post_recv_vec(socket_fd, iov, v_sgl_iov(sgl, iov), wr_id);
+    if (ret)
+	return IWARP_RDMAP_POST_RECV_FAILURE;
+    ignore(rnic_ptr);
+    return IWARP_OK;
+    #endif
+}
+
+
+iwarp_status_t v_rdmap_post_send(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag,
+				 iwarp_wr_cq_t cq_type)
+/*
+Post a send
 */
 {
     #ifdef KERNEL_IWARP
@@ -731,8 +1237,10 @@ Post a recv
 	//~ req_buf.post_type = IWARP_POST_SEND;
 	req_buf.buf = buffer;
 	req_buf.len = length;
+	req_buf.inv_stag = 0;
+	req_buf.flags = cq_type == UNSIGNALED ? IWARP_WR_UNSIGNALED : 0;
 
-	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	ret = v_write(rnic_ptr, &req_buf, sizeof(req_buf));
 	if(ret != sizeof(req_buf))
 	    return -1;  /*TODO: verbs error code*/
 	else
@@ -741,7 +1249,8 @@ Post a recv
     #else
     int ret;
     local_stag = local_stag;  /* unused */
-    ret = rdmap_send(socket_fd, buffer, length, wr_id);
+    ret = rdmap_send(socket_fd, buffer, length, wr_id,
+		     cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
     if (ret)
 	return IWARP_RDMAP_POST_SEND_FAILURE;
     else
@@ -751,9 +1260,195 @@ Post a recv
 
 }
 
+iwarp_status_t v_rdmap_post_send_inline(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id,
+					iwarp_wr_cq_t cq_type)
+/*
+Post a small send whose payload is copied now, it needs no stag.  In kernel
+mode the sges are gathered into the same write as the command.
+*/
+{
+    #ifdef KERNEL_IWARP
+	char req[sizeof(struct user_send) + IWARP_MAX_INLINE];
+	struct user_send *req_buf = (struct user_send *) req;
+	uint32_t i, length = 0;
+	int ret;
+
+	for(i=0; i<sgl->sge_count; i++){
+	    if(length + sgl->sge[i].length > IWARP_MAX_INLINE)
+		return IWARP_INVALID_SQ_OPERATION;
+	    memcpy(req + sizeof(*req_buf) + length, ptr_from_int64(sgl->sge[i].to), sgl->sge[i].length);
+	    length += sgl->sge[i].length;
+	}
+	req_buf->cmd = IWARP_SEND;
+	req_buf->fd = socket_fd;
+	req_buf->id = wr_id;
+	req_buf->buf = NULL;
+	req_buf->len = length;
+	req_buf->local_stag = 0;
+	req_buf->inv_stag = 0;
+	req_buf->flags = IWARP_WR_INLINE;
+	if(cq_type == UNSIGNALED)
+	    req_buf->flags |= IWARP_WR_UNSIGNALED;
+
+	ret = v_write(rnic_ptr, req, sizeof(*req_buf) + length);
+	if(ret != (int)(sizeof(*req_buf) + length))
+	    return -1;  /*TODO: verbs error code*/
+	else
+	    return IWARP_OK;
+
+    #else
+    struct iovec iov[MAX_SGE];
+    int ret;
+    ret = rdmap_send_vec(socket_fd, iov, v_sgl_iov(sgl, iov), wr_id,
+			 RDMAP_INLINE | (cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0));
+    if (ret)
+	return IWARP_RDMAP_POST_SEND_FAILURE;
+    else
+	return IWARP_OK;
+    ignore(rnic_ptr);
+    #endif
+
+}
+
+iwarp_status_t v_rdmap_post_send_vec(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id,
+				      iwarp_stag_index_t inv_stag, iwarp_wr_cq_t cq_type)
+/*
+Post a send gathered from several sges, with an invalidate when inv_stag is
+not 0.  The kernel interface carries one buffer per command, so multiple sges
+are only supported by the software stack.
+*/
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(socket_fd);
+	ignore(sgl);
+	ignore(wr_id);
+	ignore(inv_stag);
+	ignore(cq_type);
+	return IWARP_UNSUPPORTED_WR_COUNT;
+
+    #else
+    struct iovec iov[MAX_SGE];
+    int flags = cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0;
+    int ret;
+
+    if (inv_stag)
+	ret = rdmap_send_inv_vec(socket_fd, iov, v_sgl_iov(sgl, iov), inv_stag, wr_id, flags);
+    else
+	ret = rdmap_send_vec(socket_fd, iov, v_sgl_iov(sgl, iov), wr_id, flags);
+    if (ret)
+	return IWARP_RDMAP_POST_SEND_FAILURE;
+    ignore(rnic_ptr);
+    return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_rdmap_post_send_inv(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id,
+				     iwarp_stag_index_t local_stag, iwarp_stag_index_t inv_stag,
+				     iwarp_wr_cq_t cq_type)
+/*
+Post a send that also invalidates a window stag at the peer
+*/
+{
+    #ifdef KERNEL_IWARP
+	struct user_send req_buf;
+	int ret;
+	req_buf.local_stag = local_stag;
+	req_buf.cmd = IWARP_SEND;
+	req_buf.fd = socket_fd;
+	req_buf.id = wr_id;
+	req_buf.buf = buffer;
+	req_buf.len = length;
+	req_buf.inv_stag = inv_stag;
+	req_buf.flags = cq_type == UNSIGNALED ? IWARP_WR_UNSIGNALED : 0;
+
+	ret = v_write(rnic_ptr, &req_buf, sizeof(req_buf));
+	if(ret != sizeof(req_buf))
+	    return -1;  /*TODO: verbs error code*/
+	else
+	    return IWARP_OK;
+
+    #else
+    int ret;
+    ignore(rnic_ptr);
+    ignore(local_stag);
+    ret = rdmap_send_inv(socket_fd, buffer, length, inv_stag, wr_id,
+			 cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
+    if (ret)
+	return IWARP_RDMAP_POST_SEND_FAILURE;
+    else
+	return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_mem_mw_alloc(iwarp_rnic_t *rnic_ptr, iwarp_prot_id pd, iwarp_stag_index_t *mw)
+/*
+Allocate an unbound memory window
+*/
+{
+    #ifdef KERNEL_IWARP
+	struct user_mw_alloc req_buf;
+	int ret;
+	req_buf.cmd = IWARP_MW_ALLOC;
+	req_buf.prot_domain = pd;
+	req_buf.stag = mw;
+	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	if(ret != sizeof(req_buf))
+	    return -1;  /*TODO: verbs error code*/
+	else
+	    return IWARP_OK;
+
+    #else
+	ignore(rnic_ptr);
+	*mw = mem_mw_alloc(0, pd);
+	if(*mw < 0)
+	    return -1;  /*TODO: verbs error code*/
+	else
+	    return IWARP_OK;
+    #endif
+}
+
+iwarp_status_t v_rdmap_bind_mw(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_mw_bind_t *bind, iwarp_wr_id_t wr_id,
+			       iwarp_wr_cq_t cq_type)
+/*
+Bind a window in send queue order, bind->mw is replaced by the new stag
+*/
+{
+    #ifdef KERNEL_IWARP
+	struct user_mw_bind req_buf;
+	int ret;
+	req_buf.cmd = IWARP_MW_BIND;
+	req_buf.fd = socket_fd;
+	req_buf.id = wr_id;
+	req_buf.mw = bind->mw;
+	req_buf.md = bind->mem_region;
+	req_buf.offset = bind->offset;
+	req_buf.len = bind->length;
+	req_buf.rw = bind->access_flags;
+	req_buf.stag = &bind->mw;
+	req_buf.flags = cq_type == UNSIGNALED ? IWARP_WR_UNSIGNALED : 0;
+	ret = v_write(rnic_ptr, &req_buf, sizeof(req_buf));
+	if(ret != sizeof(req_buf))
+	    return -1;  /*TODO: verbs error code*/
+	else
+	    return IWARP_OK;
+
+    #else
+	stag_t stag;
+	ignore(rnic_ptr);
+	stag = rdmap_bind_mw(socket_fd, bind->mw, bind->mem_region, bind->offset,
+			     bind->offset + bind->length, (stag_acc_t) bind->access_flags, wr_id,
+			     cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
+	if(stag < 0)
+	    return -1;  /*TODO: verbs error code*/
+	bind->mw = stag;
+	return IWARP_OK;
+    #endif
+}
+
 
 iwarp_status_t v_rdmap_rdma_write(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t remote_stag, uint64_t to,  void *buffer, uint32_t len, iwarp_wr_id_t wr_id,
-						    iwarp_stag_index_t local_stag)
+						    iwarp_stag_index_t local_stag, iwarp_wr_cq_t cq_type)
 /*
 Post and RDMA write
 */
@@ -771,8 +1466,9 @@ Post and RDMA write
 	req_buf.len = len;
 	req_buf.sink_stag = remote_stag;
 	req_buf.sink_to = to;
+	req_buf.flags = cq_type == UNSIGNALED ? IWARP_WR_UNSIGNALED : 0;
 
-	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	ret = v_write(rnic_ptr, &req_buf, sizeof(req_buf));
 	if(ret != sizeof(req_buf))
 	    return -1;  /*TODO: verbs error code*/
 	else return IWARP_OK;
@@ -780,7 +1476,8 @@ Post and RDMA write
     #else
 	int err;
 	local_stag = local_stag;  /* unused */
-	err = rdmap_rdma_write(socket_fd, remote_stag, to, buffer, len, wr_id);
+	err = rdmap_rdma_write(socket_fd, remote_stag, to, buffer, len, wr_id,
+			       cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
 	if (err != 0)
 	    return IWARP_RDMAP_RDMA_WRITE_FAILURE;
 	ignore(rnic_ptr);
@@ -792,8 +1489,122 @@ Post and RDMA write
 }
 
 
+iwarp_status_t v_rdmap_rdma_write_vec(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t remote_stag, uint64_t to,
+				       const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type)
+/*
+RDMA write gathered from several local sges into one remote buffer, software
+stack only like v_rdmap_post_send_vec
+*/
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(socket_fd);
+	ignore(remote_stag);
+	ignore(to);
+	ignore(sgl);
+	ignore(wr_id);
+	ignore(cq_type);
+	return IWARP_UNSUPPORTED_WR_COUNT;
+
+    #else
+	struct iovec iov[MAX_SGE];
+	int err;
+
+	err = rdmap_rdma_write_vec(socket_fd, remote_stag, to, iov, v_sgl_iov(sgl, iov), wr_id,
+				   cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
+	if (err != 0)
+	    return IWARP_RDMAP_RDMA_WRITE_FAILURE;
+	ignore(rnic_ptr);
+	return IWARP_OK;
+    #endif
+}
+
+
+iwarp_status_t v_rdmap_rdma_write_imm(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t remote_stag, uint64_t to,
+				       const iwarp_sgl_t *sgl, uint64_t imm_data, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type)
+/*
+RDMA write with immediate data, software stack only, and only if the peer
+agreed to it at connection time
+*/
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(socket_fd);
+	ignore(remote_stag);
+	ignore(to);
+	ignore(sgl);
+	ignore(imm_data);
+	ignore(wr_id);
+	ignore(cq_type);
+	return IWARP_EXT_NOT_NEGOTIATED;
+
+    #else
+	struct iovec iov[MAX_SGE];
+	int err;
+
+	err = rdmap_rdma_write_imm_vec(socket_fd, remote_stag, to, iov, v_sgl_iov(sgl, iov), imm_data, wr_id,
+				       cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
+	if (err != 0){
+	    if (!(rdmap_get_extensions(socket_fd) & RDMAP_EXT_IMM))
+		return IWARP_EXT_NOT_NEGOTIATED;
+	    return IWARP_RDMAP_RDMA_WRITE_FAILURE;
+	}
+	ignore(rnic_ptr);
+	return IWARP_OK;
+    #endif
+}
+
+
+iwarp_status_t v_rdmap_atomic(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_atomic_t *atomic, iwarp_stag_index_t remote_stag,
+			       uint64_t remote_to, uint64_t *orig, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type)
+/*
+Atomic on 8 bytes of the peer's memory, the old value goes to orig.  Like
+write with immediate it needs the software stack and the peer's agreement.
+*/
+{
+    #ifdef KERNEL_IWARP
+	ignore(rnic_ptr);
+	ignore(socket_fd);
+	ignore(atomic);
+	ignore(remote_stag);
+	ignore(remote_to);
+	ignore(orig);
+	ignore(wr_id);
+	ignore(cq_type);
+	return IWARP_EXT_NOT_NEGOTIATED;
+
+    #else
+	int err, aop;
+
+	switch (atomic->op) {
+	case IWARP_ATOMIC_FETCH_ADD:
+	    aop = RDMAP_ATOMIC_FETCH_ADD;
+	    break;
+	case IWARP_ATOMIC_SWAP:
+	    aop = RDMAP_ATOMIC_SWAP;
+	    break;
+	case IWARP_ATOMIC_CMP_SWAP:
+	    aop = RDMAP_ATOMIC_CMP_SWAP;
+	    break;
+	default:
+	    return IWARP_INVALID_MODIFIER;
+	}
+	err = rdmap_atomic(socket_fd, aop, remote_stag, remote_to, atomic->add_swap, atomic->compare, orig, wr_id,
+			   cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
+	if (err != 0){
+	    if (!(rdmap_get_extensions(socket_fd) & RDMAP_EXT_ATOMIC))
+		return IWARP_EXT_NOT_NEGOTIATED;
+	    return IWARP_RDMAP_RDMA_READ_FAILURE;
+	}
+	ignore(rnic_ptr);
+	return IWARP_OK;
+    #endif
+}
+
+
 iwarp_status_t v_rdmap_rdma_read(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t local_stag, uint64_t to, uint32_t len,
-				iwarp_stag_index_t remote_stag, uint64_t remote_to, iwarp_wr_id_t wr_id)
+				iwarp_stag_index_t remote_stag, uint64_t remote_to, iwarp_wr_id_t wr_id,
+				iwarp_wr_cq_t cq_type)
 /*
 RDMA Read
 */
@@ -810,15 +1621,17 @@ RDMA Read
 	req_buf.len = len;
 	req_buf.src_stag = remote_stag;
 	req_buf.src_to = remote_to;
+	req_buf.flags = cq_type == UNSIGNALED ? IWARP_WR_UNSIGNALED : 0;
 
-	ret = write(rnic_ptr->fd, &req_buf, sizeof(req_buf));
+	ret = v_write(rnic_ptr, &req_buf, sizeof(req_buf));
 	if(ret != sizeof(req_buf))
 	    return -1; /*TODO: verbs error code*/
 	else
 	    return IWARP_OK;
     #else
 	int err;
-	err = rdmap_rdma_read(socket_fd, local_stag, to, len, remote_stag, remote_to, wr_id);
+	err = rdmap_rdma_read(socket_fd, local_stag, to, len, remote_stag, remote_to, wr_id,
+			      cq_type == UNSIGNALED ? RDMAP_UNSIGNALED : 0);
 	if (err != 0)
 		    return IWARP_RDMAP_RDMA_READ_FAILURE;
 
@@ -14,6 +14,10 @@ iwarp_status_t v_RNIC_open(int index, iwarp_rnic_t *rnic);
 
 iwarp_status_t v_rnic_close(iwarp_rnic_t *rnic_ptr);
 
+iwarp_status_t v_progress_start(iwarp_rnic_t *rnic_ptr, int nthreads, const int *cores);
+iwarp_status_t v_crc_threads_start(iwarp_rnic_t *rnic_ptr, int nthreads);
+iwarp_status_t v_crc_trust(iwarp_rnic_t *rnic_ptr, const char *const *subnets);
+
 iwarp_status_t v_mem_init(void);
 
 iwarp_status_t v_rdmap_init(void);
@@ -31,6 +35,14 @@ iwarp_status_t v_mem_stag_destroy(iwarp_rnic_t *rnic_ptr, iwarp_stag_index_t sta
 
 iwarp_status_t v_mem_deregister(iwarp_rnic_t *rnic_ptr, iwarp_mem_desc_t mem_region);
 
+iwarp_status_t v_mem_register_vec(iwarp_rnic_t *rnic_ptr, iwarp_prot_id pd, iwarp_mem_reg_t *regs, uint32_t count);
+
+iwarp_status_t v_mem_deregister_vec(iwarp_rnic_t *rnic_ptr, iwarp_mem_reg_t *regs, uint32_t count);
+
+iwarp_status_t v_mem_cache_limit(iwarp_rnic_t *rnic_ptr, size_t bytes);
+
+iwarp_status_t v_mem_invalidate(iwarp_rnic_t *rnic_ptr, void *buffer, uint32_t length);
+
 iwarp_status_t v_rnic_advance(iwarp_rnic_t *rnic_ptr);
 
 iwarp_status_t v_create_cq(iwarp_rnic_t *rnic_ptr, int *num_evts, iwarp_cq_handle_t *cq_hndl);
@@ -46,15 +58,45 @@ iwarp_status_t v_poll_block_qp(iwarp_rnic_t *rnic_ptr,
 iwarp_status_t v_rdmap_register_connection(iwarp_rnic_t *rnic_ptr, iwarp_qp_handle_t qp_id, const char private_data[],
 				           char *remote_private_data, int rpd, iwarp_host_t type);
 
-iwarp_status_t v_throw_away_cqe(iwarp_rnic_t *rnic_ptr, iwarp_cq_handle_t cq_hndl);
+iwarp_status_t v_batch_begin(iwarp_rnic_t *rnic_ptr, int socket_fd);
+
+iwarp_status_t v_batch_end(iwarp_rnic_t *rnic_ptr, int socket_fd, uint32_t *done);
 
 iwarp_status_t v_rdmap_post_recv(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag);
 
-iwarp_status_t v_rdmap_post_send(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag);
+iwarp_status_t v_rdmap_post_send(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag, iwarp_wr_cq_t cq_type);
+
+iwarp_status_t v_srq_create(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq);
+
+iwarp_status_t v_srq_destroy(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq);
+
+iwarp_status_t v_srq_post_recv(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id);
+
+iwarp_status_t v_srq_arm(iwarp_rnic_t *rnic_ptr, iwarp_srq_t *srq, uint32_t limit);
+
+iwarp_status_t v_rdmap_post_recv_vec(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id);
+
+iwarp_status_t v_rdmap_post_send_inline(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id,
+					iwarp_wr_cq_t cq_type);
+
+iwarp_status_t v_rdmap_post_send_vec(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id,
+				      iwarp_stag_index_t inv_stag, iwarp_wr_cq_t cq_type);
+
+iwarp_status_t v_rdmap_post_send_inv(iwarp_rnic_t *rnic_ptr, int socket_fd, void *buffer, uint32_t length, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag, iwarp_stag_index_t inv_stag, iwarp_wr_cq_t cq_type);
+
+iwarp_status_t v_mem_mw_alloc(iwarp_rnic_t *rnic_ptr, iwarp_prot_id pd, iwarp_stag_index_t *mw);
+
+iwarp_status_t v_rdmap_bind_mw(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_mw_bind_t *bind, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type);
+
+iwarp_status_t v_rdmap_rdma_write(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t remote_stag, uint64_t to,  void *buffer, uint32_t len, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag, iwarp_wr_cq_t cq_type);
+
+iwarp_status_t v_rdmap_rdma_write_vec(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t remote_stag, uint64_t to, const iwarp_sgl_t *sgl, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type);
+
+iwarp_status_t v_rdmap_rdma_write_imm(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t remote_stag, uint64_t to, const iwarp_sgl_t *sgl, uint64_t imm_data, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type);
 
-iwarp_status_t v_rdmap_rdma_write(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t remote_stag, uint64_t to,  void *buffer, uint32_t len, iwarp_wr_id_t wr_id, iwarp_stag_index_t local_stag);
+iwarp_status_t v_rdmap_atomic(iwarp_rnic_t *rnic_ptr, int socket_fd, const iwarp_atomic_t *atomic, iwarp_stag_index_t remote_stag, uint64_t remote_to, uint64_t *orig, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type);
 
-iwarp_status_t v_rdmap_rdma_read(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t local_stag, uint64_t to, uint32_t len, iwarp_stag_index_t remote_stag, uint64_t remote_to, iwarp_wr_id_t wr_id);
+iwarp_status_t v_rdmap_rdma_read(iwarp_rnic_t *rnic_ptr, int socket_fd, iwarp_stag_index_t local_stag, uint64_t to, uint32_t len, iwarp_stag_index_t remote_stag, uint64_t remote_to, iwarp_wr_id_t wr_id, iwarp_wr_cq_t cq_type);
 
 iwarp_status_t v_rdmap_deregister_sock(iwarp_rnic_t *rnic_ptr, int socket_fd);
 
@@ -23,26 +23,56 @@ iwarp_status_t iwarp_qp_post_sq(/*IN*/iwarp_rnic_handle_t rnic_hndl,
 
 
     iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_qp_t *qp = qp_from_handle(rnic_ptr, qp_hndl);
 
-    if (unlikely(rnic_ptr->qp_index[qp_hndl].connected != TRUE))
+    if (unlikely(qp->connected != TRUE))
 	return IWARP_NO_CONNECTION;
 
-    ret = iwarp_send_event_dispatch_one(rnic_ptr, &rnic_ptr->qp_index[qp_hndl], sq_wr);
+    ret = iwarp_send_wr_check(qp, sq_wr);
     if (ret)
 	return ret;
 
-    /*if it was signaled then we do nothing, if it was unsignaled then we need to throw away the CQ event*/
+    /*unsignaled requests are passed down as such and never make a CQ event*/
+    ret = iwarp_send_event_dispatch_one(rnic_ptr, qp, sq_wr);
 
+    return ret;
+}
+
+/*
+ * Post an array of sends.  The whole list is checked first so a bad entry
+ * stops it before anything goes out, then the requests are gathered and
+ * sent in one batch.
+ */
+iwarp_status_t iwarp_qp_post_sq_list(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_qp_handle_t qp_hndl,
+				     /*IN*/iwarp_wr_t *sq_wr, uint32_t count,
+				     /*OUT*/uint32_t *posted)
+{
+    iwarp_rnic_t *rnic_ptr = ptr_from_int64(rnic_hndl);
+    iwarp_qp_t *qp = qp_from_handle(rnic_ptr, qp_hndl);
+    uint32_t i;
+    int ret, err;
 
-    if (sq_wr->cq_type == UNSIGNALED) {
-	//~ printf("We have an unsignaled send\n");
-	ret = v_throw_away_cqe(rnic_ptr, rnic_ptr->qp_index[qp_hndl].attributes->sq_cq);
-	if(ret != IWARP_OK)
-	    return IWARP_RWQ_INTERNAL_ERROR;
+    *posted = 0;
+    if (unlikely(qp->connected != TRUE))
+	return IWARP_NO_CONNECTION;
+
+    for (i=0; i<count; i++) {
+	ret = iwarp_send_wr_check(qp, &sq_wr[i]);
+	if (ret)
+	    return ret;
     }
-    //~ else
-	//~ printf("we have a SIGNALED SEND.....");
 
-    return ret;
+    ret = v_batch_begin(rnic_ptr, qp->socket_fd);
+    if (ret)
+	return ret;
+    for (i=0; i<count; i++) {
+	ret = iwarp_send_event_dispatch_one(rnic_ptr, qp, &sq_wr[i]);
+	if (ret)
+	    break;
+	++*posted;
+    }
+    err = v_batch_end(rnic_ptr, qp->socket_fd, posted);
+
+    return ret ? ret : err;
 }
 
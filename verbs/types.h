@@ -46,7 +46,13 @@ typedef enum {
     IWARP_WR_TYPE_SEND,
     IWARP_WR_TYPE_RECV,
     IWARP_WR_TYPE_RDMA_WRITE,
-    IWARP_WR_TYPE_RDMA_READ
+    IWARP_WR_TYPE_RDMA_READ,
+    IWARP_WR_TYPE_BIND_MW,
+    IWARP_WR_TYPE_SEND_INV,
+    IWARP_WR_TYPE_SEND_INLINE,  /*payload copied at post time, sge stag unused*/
+    IWARP_WR_TYPE_RDMA_WRITE_IMM,  /*RFC 7306, consumes a recv at the peer*/
+    IWARP_WR_TYPE_ATOMIC,  /*RFC 7306, the old value lands in the one local sge*/
+    IWARP_WR_TYPE_RECV_IMM  /*completion only, a recv used up by RDMA_WRITE_IMM*/
 } iwarp_wr_work_t;
 
 typedef enum {
@@ -110,6 +116,24 @@ typedef struct {  /*The protection domain */
 /**********/
 typedef int iwarp_qp_handle_t;
 
+/*Shared receive queue, see srq.c*/
+typedef struct IWARP_SRQ_T *iwarp_srq_handle_t;
+
+/*called once from the poll loop when fewer receives than the armed limit remain*/
+typedef void (*iwarp_srq_limit_hndlr_t)(iwarp_srq_handle_t srq_hndl, void *context);
+
+typedef struct IWARP_SRQ_T {
+    iwarp_prot_id pd;
+    uint32_t max_wr;
+    uint32_t sgl_max;
+    int in_use;  /*QPs taking receives from it*/
+    iwarp_srq_limit_hndlr_t limit_hndlr;
+    void *context;
+#ifndef KERNEL_IWARP
+    rdmap_srq_t *srq;
+#endif
+} iwarp_srq_t;
+
 typedef struct { /*All of the QP's properties*/
     iwarp_cq_handle_t sq_cq;
     iwarp_cq_handle_t rq_cq;
@@ -127,15 +151,31 @@ typedef struct { /*All of the QP's properties*/
     iwarp_bool_t zero_stag_enable;
     iwarp_bool_t disable_mpa_markers;
     iwarp_bool_t disable_mpa_crc;
+    uint32_t max_inline_data;  /*largest IWARP_WR_TYPE_SEND_INLINE payload*/
+    iwarp_srq_handle_t srq;  /*take receives from this shared queue, NULL for the QP's own*/
+    iwarp_bool_t imm_data_enable;  /*ask the peer for RDMA write with immediate data*/
+    iwarp_bool_t atomics_enable;  /*ask the peer for atomics*/
+    int progress_affinity;  /*1 + the progress thread to run the connection, 0 to spread them by hash*/
+    iwarp_bool_t defer_crc_check;  /*place incoming data before its CRC is checked, without markers only*/
+    iwarp_bool_t mpa_crc_auto;  /*CRC unless the peer is on this host or a trusted subnet, instead of disable_mpa_crc*/
+    uint32_t rdma_read_chunk;  /*split RDMA reads longer than this into requests of this size, 0 never*/
 
 }iwarp_qp_attrs_t;
 
+typedef struct { /*receives posted before the connection is up, grown as needed*/
+    struct IWARP_WR_T *queue;
+    int size;
+    int max;
+}iwarp_wr_q_t;
+
 typedef struct { /*The QP Structure its self - each QP has its own socket*/
     int socket_fd;
     iwarp_bool_t available;
     iwarp_qp_attrs_t *attributes;
     iwarp_bool_t connected;
     int pre_connection_posts;
+    iwarp_wr_q_t recv_q;  /*dispatched when the connection comes up*/
+    iwarp_qp_handle_t next_free;  /*free list link while available*/
 }iwarp_qp_t;
 
 
@@ -169,23 +209,95 @@ typedef struct {
 
 
 
+/* one buffer of a batch registration */
+typedef struct {
+    void *buffer;
+    uint32_t length;
+    iwarp_access_control_t access_flags;
+    iwarp_mem_desc_t mem_region;  /*OUT*/
+    iwarp_stag_index_t stag_index;  /*OUT: covers the whole buffer*/
+}iwarp_mem_reg_t;
+
+/* memory window bind, carried by an IWARP_WR_TYPE_BIND_MW work request */
+typedef struct {
+    iwarp_stag_index_t mw;  /*IN: window to bind, OUT: new stag to give the peer*/
+    iwarp_mem_desc_t mem_region;  /*registered region the window lands in*/
+    uint32_t offset;  /*start of the window within the region*/
+    uint32_t length;
+    iwarp_access_control_t access_flags;
+}iwarp_mw_bind_t;
+
+/* operands of an IWARP_WR_TYPE_ATOMIC work request on 8 aligned bytes */
+typedef enum {
+    IWARP_ATOMIC_FETCH_ADD,
+    IWARP_ATOMIC_CMP_SWAP,
+    IWARP_ATOMIC_SWAP
+}iwarp_atomic_op_t;
+
 typedef struct {
+    iwarp_atomic_op_t op;
+    uint64_t add_swap;  /*added, or swapped in*/
+    uint64_t compare;  /*CMP_SWAP only*/
+}iwarp_atomic_t;
+
+typedef struct IWARP_WR_T {
     iwarp_wr_id_t wr_id;
     iwarp_sgl_t *sgl;
     iwarp_sgl_t *remote_sgl;
     iwarp_wr_work_t wr_type;
     iwarp_wr_cq_t cq_type;
     iwarp_local_mem_addr_t local_addr;
+    iwarp_stag_index_t inv_stag;  /*remote window to invalidate, SEND_INV only*/
+    iwarp_mw_bind_t *bind;  /*BIND_MW only*/
+    iwarp_atomic_t *atomic;  /*ATOMIC only*/
+    uint64_t imm_data;  /*RDMA_WRITE_IMM only*/
     //~ iwarp_stag_index_t remote_stag;
     //~ iwarp_stag_index_t local_stag;
     //~ iwarp_to_t to;
 }iwarp_wr_t;
 
+
+
+/*******************/
+/*Buffer Pool Stuff*/
+/*******************/
+typedef enum {
+    IWARP_POOL_HUGEPAGE = 1,  /*back arenas with hugepages when possible*/
+    IWARP_POOL_MLOCK = 2      /*keep arenas resident*/
+} iwarp_pool_flags_t;
+
+typedef struct IWARP_ARENA_T {  /*one registered mapping*/
+    struct IWARP_ARENA_T *next;
+    char *base;
+    size_t size;
+    size_t used;  /*carved so far, never shrinks*/
+    int huge;
+    iwarp_mem_desc_t mem_region;
+    iwarp_stag_index_t stag;
+} iwarp_arena_t;
+
+typedef struct IWARP_POOL_FREE_T {  /*overlays a free buffer*/
+    struct IWARP_POOL_FREE_T *next;
+    iwarp_arena_t *arena;
+} iwarp_pool_free_t;
+
 typedef struct {
-    iwarp_wr_t queue[MAX_WRQ];
-    int size;
-}iwarp_wr_q_t;
+    iwarp_prot_id pd;
+    iwarp_access_control_t access_flags;
+    int flags;
+    size_t arena_size;
+    iwarp_arena_t *arenas;  /*newest first, allocation carves from the head*/
+    iwarp_pool_free_t *free_list[POOL_CLASSES];
+} iwarp_pool_t;
+
+typedef iwarp_pool_t *iwarp_pool_handle_t;
 
+typedef struct {  /*what a pool allocation hands back*/
+    void *addr;
+    iwarp_stag_index_t stag;  /*covers the whole arena*/
+    uint64_t to;  /*tagged offset of addr under stag, for an sge*/
+    uint32_t length;  /*rounded up to the size class*/
+} iwarp_pool_buf_t;
 
 
 /**************/
@@ -193,14 +305,34 @@ typedef struct {
 /**************/
 typedef uint64_t iwarp_rnic_handle_t;  /*The RNIC handle we pass around*/
 
+typedef struct IWARP_LISTENER_T { /*passive connects accept on this, one per port*/
+    iwarp_port_t port;
+    int fd;
+    struct IWARP_LISTENER_T *next;
+} iwarp_listener_t;
+
 typedef struct { /*The actual RNIC structure*/
-    iwarp_qp_t qp_index[MAX_QP];
+    iwarp_qp_t *qp_chunk[MAX_QP / QP_CHUNK];  /*QP table, see qp_from_handle*/
+    int qp_count;  /*slots handed out so far, the rest of the chunks are unallocated*/
+    iwarp_qp_handle_t qp_free;  /*head of the destroyed QPs, -1 if none*/
+    iwarp_qp_handle_t *qp_by_fd;  /*connected QP of each socket, -1 if none*/
+    int qp_by_fd_max;
+    iwarp_listener_t *listeners;
     iwarp_prot_domain_t pd_index[MAX_PROT_DOMAIN];
-    iwarp_wr_q_t recv_q;  /* queue to hold posts before connection up */
     int fd; /*just a simple old file descriptor to keep track of what our RNIC is open on,*/
+    struct v_batch *batch;  /*kernel mode posts gathered for one write, see stubs.c*/
+    int srq_count;
+    rwlock_t lock;  /*everything above but fd and batch, see iwarp_rnic_thread_safe*/
 } iwarp_rnic_t;
 
 
+typedef struct { /*options of iwarp_rnic_open_ext, zeroed for the iwarp_rnic_open defaults*/
+    int progress_threads;  /*background threads moving data, 0 for none*/
+    const int *progress_cores;  /*core of each, NULL to leave them unpinned*/
+    int crc_threads;  /*threads helping with the CRCs of large FPDUs, 0 for none*/
+    const char *const *crc_trusted_subnets;  /*"addr/prefix" strings ending in NULL, see mpa_crc_auto*/
+} iwarp_rnic_open_attrs_t;
+
 typedef struct { /*The RNIC's properties*/
     char *vendor_name;
     int version;
@@ -233,6 +365,7 @@ typedef struct {
     uint32_t bytes_recvd;
     iwarp_bool_t stag_invalidate;
     iwarp_stag_index_t stag;
+    uint64_t imm_data;  /*RECV_IMM only*/
 }iwarp_work_completion_t;
 
 #endif
@@ -21,10 +21,13 @@
 	#include "cq.h"
 	#include "mem.h"
 	#include "mpa.h"
+	#include "progress.h"
+	#include "crc32c.h"
 
 #endif
 
 #include "rdmap.h"
+#include "lock.h"
 
 
 
@@ -40,6 +43,7 @@
 #define IWARP_VERBS
 #define ptr_from_int64(p) (void *)(unsigned long)(p)
 #define int64_from_ptr(p) (u_int64_t)(unsigned long)(p)
+#define qp_from_handle(rnic_ptr, h) (&(rnic_ptr)->qp_chunk[(h) / QP_CHUNK][(h) % QP_CHUNK])
 #define ignore(p) (p)=(p)
 
 #define TEST_VAL 4
@@ -57,6 +61,21 @@ passed for it.  Index is always 0 for now.
 iwarp_status_t iwarp_rnic_open(/*IN*/int index, iwarp_pblmode_t mode, iwarp_context_t context,
 			       /*OUT*/iwarp_rnic_handle_t* rnic_hndl);
 
+/*RNIC OPEN EXT
+Same as iwarp_rnic_open, with options.  open_attrs->progress_threads > 0 starts that many threads moving data in the
+background, so transfers and RDMA Read responses go on while the application computes; it then only polls its CQs.
+They are pinned to open_attrs->progress_cores[i] if that is not NULL.  Each thread polls its own share of the
+connections, chosen by hash or by the QP's progress_affinity, and helps the others when it has nothing ready.  This
+implies iwarp_rnic_thread_safe.  open_attrs->crc_threads > 0 starts that many threads that share the CRC of each large
+FPDU with the thread sending or receiving it.  open_attrs->crc_trusted_subnets lists "addr/prefix" subnets whose links are
+trusted not to corrupt data, where QPs with mpa_crc_auto go without CRC.  None of these is for kernel mode, where the
+kernel moves the data: asking for them there fails with IWARP_PROGRESS_UNSUPPORTED, IWARP_CRC_THREADS_UNSUPPORTED or
+IWARP_CRC_TRUST_UNSUPPORTED.
+*/
+iwarp_status_t iwarp_rnic_open_ext(/*IN*/int index, iwarp_pblmode_t mode, iwarp_context_t context,
+				   /*IN*/const iwarp_rnic_open_attrs_t *open_attrs,
+				   /*OUT*/iwarp_rnic_handle_t* rnic_hndl);
+
 /*RNIC QUERY
 Just gets some information about the system.  Not necessary for most applications, called by the connection related verbs to get the host name
 of the machine we are running on.
@@ -69,6 +88,14 @@ Clost the RNIC which means we free any memory still held and terminate any remai
 */
 iwarp_status_t iwarp_rnic_close(/*IN*/ iwarp_rnic_handle_t rnic_hndl);
 
+/*RNIC THREAD SAFE
+Let several threads use the RNIC at once, each posting to its own QPs and polling its own CQs without waiting on the
+others.  Call it before a second thread starts using the RNIC; it cannot be undone.  A QP or CQ shared between threads
+is still safe, only slower.  In kernel mode the posts batched by v_batch_begin are per RNIC, so only one thread at a
+time may batch.
+*/
+iwarp_status_t iwarp_rnic_thread_safe(iwarp_rnic_handle_t rnic_hndl);
+
 /*RDMA ADVANCE
 Since we don't want to export rdmap_poll() to the user we can use this to abstract that call we need to introduce this
 because we don't have a thread to actively read the socket as data comes in.  We call rdmap_poll to see what data is
@@ -130,6 +157,14 @@ iwarp_status_t iwarp_cq_poll_block(iwarp_rnic_handle_t rnic_hndl,
 /***************/
 /*CREATE QUEUE PAIR
 qp_attrs is local data type to verbs consumer - verbs keeps its own qp_attrs for the qp
+With qp_attrs->defer_crc_check incoming data is placed before its CRC is checked, the checks going to the crc_threads if
+there are any; a message still completes only once they pass.  One that fails completes in error, the peer is sent a
+TERMINATE and nothing more is received on the QP.
+With qp_attrs->mpa_crc_auto, disable_mpa_crc is ignored: CRC is asked for at connect unless the peer is this host or in
+one of the RNIC's crc_trusted_subnets.  Either side asking for CRC gets it for both.  In kernel mode disable_mpa_crc
+still decides.
+With qp_attrs->rdma_read_chunk nonzero, an RDMA Read longer than it goes out as requests of at most that many bytes, up
+to ord of them on the wire at once, and still completes as one work request.  Kernel mode does not split reads.
 */
 iwarp_status_t iwarp_qp_create(/*IN*/iwarp_rnic_handle_t rnic_hndl,
 		        /*INOUT*/iwarp_qp_attrs_t *qp_attrs,
@@ -170,6 +205,36 @@ disconnect the queue pair
 iwarp_status_t iwarp_qp_disconnect(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_qp_handle_t qp_id);
 
 
+/*************************/
+/*Shared Receive Queues*/
+/*************************/
+/*CREATE SHARED RECEIVE QUEUE
+QPs created with qp_attrs.srq set take receives from it in arrival order, their completions carry the QP in qp_hndl.
+limit_hndlr may be NULL, otherwise it is called once when an armed limit is crossed
+*/
+iwarp_status_t iwarp_srq_create(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+				/*IN*/uint32_t max_wr, uint32_t sgl_max,
+				/*IN*/iwarp_srq_limit_hndlr_t limit_hndlr, void *context,
+				/*OUT*/iwarp_srq_handle_t *srq_hndl);
+
+/*DESTROY SHARED RECEIVE QUEUE
+Fails while any QP still uses it
+*/
+iwarp_status_t iwarp_srq_destroy(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_srq_handle_t srq_hndl);
+
+/*POST SHARED RECEIVE
+Post a receive for whichever attached QP gets the next message
+*/
+iwarp_status_t iwarp_srq_post_recv(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_srq_handle_t srq_hndl,
+				   /*IN*/iwarp_wr_t *rq_wr);
+
+/*ARM SHARED RECEIVE QUEUE LIMIT
+Call the limit handler once when fewer than limit receives remain posted, 0 disarms.  Re-arm after each event
+*/
+iwarp_status_t iwarp_srq_arm(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_srq_handle_t srq_hndl,
+			     /*IN*/uint32_t limit);
+
+
 /*************************/
 /*Memory Management*/
 /*************************/
@@ -191,6 +256,64 @@ Actaully deregister memory in the mem layer
 */
 iwarp_status_t iwarp_deregister_mem(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd, iwarp_mem_desc_t mem_region);
 
+/*REGISTER NON SHARED MEMORY, BATCHED
+Register count buffers and create an STag over each in one call, a single kernel command in kernel mode.  Either all are registered or none are
+*/
+iwarp_status_t iwarp_nsmr_register_vec(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+					/*INOUT*/iwarp_mem_reg_t *regs, uint32_t count);
+
+/*DEREGISTER MEMORY, BATCHED
+Deallocate the STags and deregister the regions of an iwarp_nsmr_register_vec batch
+*/
+iwarp_status_t iwarp_deregister_mem_vec(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+					 /*IN*/iwarp_mem_reg_t *regs, uint32_t count);
+
+/*SET REGISTRATION CACHE LIMIT
+Keep up to this many bytes registered after deregistration so registering the same buffer again is cheap, 0 disables
+*/
+iwarp_status_t iwarp_mem_cache_limit(/*IN*/iwarp_rnic_handle_t rnic_hndl, size_t bytes);
+
+/*INVALIDATE MEMORY
+Drop cached registrations of a range, must be called before the memory is unmapped or freed back to the OS
+*/
+iwarp_status_t iwarp_invalidate_mem(/*IN*/iwarp_rnic_handle_t rnic_hndl, void *buffer, uint32_t length);
+
+/*ALLOCATE MEMORY WINDOW
+Get an unbound window STag, bind it to part of a registered region by posting an IWARP_WR_TYPE_BIND_MW to the send queue
+*/
+iwarp_status_t iwarp_allocate_mw(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+				 /*OUT*/iwarp_stag_index_t *mw);
+
+/*DEALLOCATE MEMORY WINDOW
+Free a window, bound or not
+*/
+iwarp_status_t iwarp_deallocate_mw(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd, iwarp_stag_index_t mw);
+
+/*CREATE BUFFER POOL
+Arenas of arena_size bytes (0 for one hugepage) are mapped and registered once, flags are iwarp_pool_flags_t
+*/
+iwarp_status_t iwarp_pool_create(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_prot_id pd,
+				 /*IN*/size_t arena_size, iwarp_access_control_t access_flags, int flags,
+				 /*OUT*/iwarp_pool_handle_t *pool_hndl);
+
+/*DESTROY BUFFER POOL
+Deregister and unmap all arenas
+*/
+iwarp_status_t iwarp_pool_destroy(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_pool_handle_t pool_hndl);
+
+/*ALLOCATE POOL BUFFER
+Returns address, STag and tagged offset of an already registered buffer, no registration is done per buffer
+*/
+iwarp_status_t iwarp_pool_alloc(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_pool_handle_t pool_hndl,
+				/*IN*/uint32_t length,
+				/*OUT*/iwarp_pool_buf_t *buf);
+
+/*FREE POOL BUFFER
+Give a buffer back to the pool, it stays registered for reuse
+*/
+iwarp_status_t iwarp_pool_free(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_pool_handle_t pool_hndl,
+			       /*IN*/iwarp_pool_buf_t *buf);
+
 
 /*********************************/
 /*WORK REQUEST PROCESSING*/
@@ -218,6 +341,24 @@ Post a work request to the send queue on behalf of the queue pair
 */
 iwarp_status_t iwarp_qp_post_sq(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_qp_handle_t qp_hndl, iwarp_wr_t *sq_wr);
 
+/*POST RQ LIST
+Post count work requests to the receive queue in one go, *posted says how
+many made it if an error is returned
+*/
+iwarp_status_t iwarp_qp_post_rq_list(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_qp_handle_t qp_hndl,
+				     /*IN*/iwarp_wr_t *rq_wr, uint32_t count,
+				     /*OUT*/uint32_t *posted);
+
+/*POST SQ LIST
+Post count work requests to the send queue in one go.  All are checked
+before any is started, then they go out as one batch.  *posted says how
+many were started if an error is returned.  Their completions come once
+the batch is written, with an error status if writing it failed.
+*/
+iwarp_status_t iwarp_qp_post_sq_list(/*IN*/iwarp_rnic_handle_t rnic_hndl, iwarp_qp_handle_t qp_hndl,
+				     /*IN*/iwarp_wr_t *sq_wr, uint32_t count,
+				     /*OUT*/uint32_t *posted);
+
 /* errno.c */
 const char *iwarp_string_from_errno(iwarp_status_t en);
 
@@ -228,6 +369,14 @@ const char *iwarp_string_from_errno(iwarp_status_t en);
 Dispatch an event off the queue, or a # of events
 */
 int iwarp_recv_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp, const iwarp_wr_t *rq_wr);
-int iwarp_recv_event_dispatcher(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp, iwarp_wr_q_t *work_q);
+int iwarp_recv_event_dispatcher(iwarp_rnic_t *rnic_ptr, iwarp_qp_t *qp);
+void iwarp_recv_queue_free(iwarp_wr_q_t *work_q);
+void iwarp_pd_hold(iwarp_rnic_t *rnic_ptr, iwarp_prot_id pd, int count);
+/*
+Find the QP connected on a socket, from completions that only name the socket
+*/
+iwarp_status_t iwarp_qp_fd_set(iwarp_rnic_t *rnic_ptr, int fd, iwarp_qp_handle_t qp_hndl);
+iwarp_qp_handle_t iwarp_qp_from_fd(iwarp_rnic_t *rnic_ptr, int fd);
 int iwarp_send_event_dispatch_one(iwarp_rnic_t *rnic_ptr, const iwarp_qp_t *qp, const iwarp_wr_t *sq_wr);
+int iwarp_send_wr_check(const iwarp_qp_t *qp, const iwarp_wr_t *sq_wr);
 #endif